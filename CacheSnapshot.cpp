@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "resolv"
+
+#include "CacheSnapshot.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <system_error>
+
+#include <android-base/file.h>
+#include <android-base/format.h>
+#include <android-base/logging.h>
+#include <android-base/unique_fd.h>
+
+namespace android::net {
+
+using base::ErrnoErrorf;
+using base::Errorf;
+using base::unique_fd;
+
+namespace {
+
+constexpr uint32_t kMagic = 0x43534e44;  // "DNSC"
+constexpr uint32_t kVersion = 1;
+constexpr char kSuffix[] = ".snapshot";
+
+struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t signature;
+    uint32_t recordCount;
+    uint32_t reserved;
+};
+
+struct RecordHeader {
+    int64_t expires;
+    uint16_t queryLength;
+    uint16_t answerLength;
+    uint32_t reserved;
+};
+
+constexpr size_t align8(size_t size) {
+    return (size + 7) & ~size_t{7};
+}
+
+}  // namespace
+
+CacheSnapshotWriter::CacheSnapshotWriter(uint64_t signature) : mData(sizeof(Header)) {
+    const Header header = {.magic = kMagic, .version = kVersion, .signature = signature};
+    memcpy(mData.data(), &header, sizeof(header));
+}
+
+void CacheSnapshotWriter::add(const CacheSnapshotRecord& record) {
+    if (record.query.size() > UINT16_MAX || record.answer.size() > UINT16_MAX) return;
+
+    const RecordHeader recordHeader = {
+            .expires = record.expires,
+            .queryLength = static_cast<uint16_t>(record.query.size()),
+            .answerLength = static_cast<uint16_t>(record.answer.size()),
+    };
+    const size_t offset = mData.size();
+    mData.resize(offset + align8(sizeof(recordHeader) + record.query.size() +
+                                 record.answer.size()));
+    uint8_t* p = mData.data() + offset;
+    memcpy(p, &recordHeader, sizeof(recordHeader));
+    p += sizeof(recordHeader);
+    memcpy(p, record.query.data(), record.query.size());
+    memcpy(p + record.query.size(), record.answer.data(), record.answer.size());
+
+    reinterpret_cast<Header*>(mData.data())->recordCount++;
+}
+
+size_t CacheSnapshotWriter::recordCount() const {
+    return reinterpret_cast<const Header*>(mData.data())->recordCount;
+}
+
+base::Result<void> CacheSnapshotWriter::write(const std::string& path) const {
+    // Write to a temporary file first, so that readers never see a partial snapshot.
+    const std::string tmpPath = path + ".tmp";
+    const unique_fd fd(open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+    if (fd == -1) return ErrnoErrorf("failed to create {}", tmpPath);
+    if (!base::WriteFully(fd, mData.data(), mData.size())) {
+        const int savedErrno = errno;
+        unlink(tmpPath.c_str());
+        errno = savedErrno;
+        return ErrnoErrorf("failed to write {}", tmpPath);
+    }
+    // Sync the data before renaming, or a crash could leave an empty snapshot in its place.
+    if (fsync(fd) != 0) {
+        const int savedErrno = errno;
+        unlink(tmpPath.c_str());
+        errno = savedErrno;
+        return ErrnoErrorf("failed to sync {}", tmpPath);
+    }
+    if (rename(tmpPath.c_str(), path.c_str()) != 0) {
+        const int savedErrno = errno;
+        unlink(tmpPath.c_str());
+        errno = savedErrno;
+        return ErrnoErrorf("failed to rename {} to {}", tmpPath, path);
+    }
+    return {};
+}
+
+base::Result<std::unique_ptr<MappedCacheSnapshot>> MappedCacheSnapshot::open(
+        const std::string& path, uint64_t signature) {
+    const unique_fd fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd == -1) return ErrnoErrorf("failed to open {}", path);
+
+    struct stat st;
+    if (fstat(fd.get(), &st) != 0) return ErrnoErrorf("failed to stat {}", path);
+    const size_t size = st.st_size;
+    if (size < sizeof(Header)) return Errorf("{} is too short: {} bytes", path, size);
+
+    void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd.get(), 0);
+    if (data == MAP_FAILED) return ErrnoErrorf("failed to map {}", path);
+    std::unique_ptr<MappedCacheSnapshot> snapshot(new MappedCacheSnapshot(data, size));
+
+    const uint8_t* begin = static_cast<const uint8_t*>(data);
+    const uint8_t* end = begin + size;
+    const Header* header = reinterpret_cast<const Header*>(begin);
+    if (header->magic != kMagic || header->version != kVersion) {
+        return Errorf("{} has an unsupported format: magic {:#x}, version {}", path,
+                      header->magic, header->version);
+    }
+    if (header->signature != signature) {
+        return Errorf("{} is for network {:#x}, not {:#x}", path, header->signature, signature);
+    }
+
+    const uint8_t* p = begin + sizeof(Header);
+    snapshot->mRecords.reserve(header->recordCount);
+    for (uint32_t i = 0; i < header->recordCount; i++) {
+        if (static_cast<size_t>(end - p) < sizeof(RecordHeader)) {
+            return Errorf("{} is truncated at record {}", path, i);
+        }
+        const RecordHeader* recordHeader = reinterpret_cast<const RecordHeader*>(p);
+        const size_t length = sizeof(RecordHeader) + recordHeader->queryLength +
+                              recordHeader->answerLength;
+        if (static_cast<size_t>(end - p) < length) {
+            return Errorf("{} is truncated at record {}", path, i);
+        }
+        const uint8_t* query = p + sizeof(RecordHeader);
+        const uint8_t* answer = query + recordHeader->queryLength;
+        snapshot->mRecords.push_back({
+                .expires = recordHeader->expires,
+                .query = {query, recordHeader->queryLength},
+                .answer = {answer, recordHeader->answerLength},
+        });
+        p += std::min(align8(length), static_cast<size_t>(end - p));
+    }
+    return snapshot;
+}
+
+MappedCacheSnapshot::~MappedCacheSnapshot() {
+    munmap(mData, mSize);
+}
+
+std::string cacheSnapshotPath(const std::string& dir, uint64_t signature) {
+    return fmt::format("{}/{:016x}{}", dir, signature, kSuffix);
+}
+
+void pruneCacheSnapshots(const std::string& dir, size_t maxFiles) {
+    std::error_code ec;
+    std::vector<std::pair<std::filesystem::file_time_type, std::filesystem::path>> snapshots;
+    for (const auto& file : std::filesystem::directory_iterator(dir, ec)) {
+        if (file.path().extension() != kSuffix) continue;
+        snapshots.emplace_back(file.last_write_time(ec), file.path());
+    }
+    if (snapshots.size() <= maxFiles) return;
+
+    // Most recent first.
+    std::sort(snapshots.begin(), snapshots.end(), std::greater<>());
+    for (size_t i = maxFiles; i < snapshots.size(); i++) {
+        LOG(INFO) << "Deleting DNS cache snapshot " << snapshots[i].second;
+        std::filesystem::remove(snapshots[i].second, ec);
+    }
+}
+
+}  // namespace android::net
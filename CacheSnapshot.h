@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+#include <vector>
+
+#include <android-base/result.h>
+
+namespace android::net {
+
+// Snapshots of the entries of a DNS cache, saved to a file so that the cache of a network can
+// be warmed up when the network comes back, or after the resolver restarts.
+//
+// A snapshot file is a header followed by the records, each one aligned on 8 bytes, so that it
+// can be memory-mapped and read in place:
+//   header: magic, version, network signature, number of records
+//   record: expiration time (seconds since the epoch), query length, answer length, query,
+//           answer, padding
+// Integers are in host byte order. A file of another version, or for another network
+// signature, is rejected.
+
+struct CacheSnapshotRecord {
+    int64_t expires;
+    std::span<const uint8_t> query;
+    std::span<const uint8_t> answer;
+};
+
+// Builds a snapshot in memory, so that it can be written without holding the cache lock.
+class CacheSnapshotWriter {
+  public:
+    explicit CacheSnapshotWriter(uint64_t signature);
+
+    void add(const CacheSnapshotRecord& record);
+
+    size_t recordCount() const;
+
+    // Writes the snapshot to |path|, atomically replacing any previous one.
+    base::Result<void> write(const std::string& path) const;
+
+  private:
+    std::vector<uint8_t> mData;
+};
+
+// A snapshot file mapped in memory. The records point into the mapping.
+class MappedCacheSnapshot {
+  public:
+    // Maps |path|, and checks that it is a well-formed snapshot for |signature|.
+    static base::Result<std::unique_ptr<MappedCacheSnapshot>> open(const std::string& path,
+                                                                   uint64_t signature);
+    ~MappedCacheSnapshot();
+
+    MappedCacheSnapshot(const MappedCacheSnapshot&) = delete;
+    MappedCacheSnapshot& operator=(const MappedCacheSnapshot&) = delete;
+
+    const std::vector<CacheSnapshotRecord>& records() const { return mRecords; }
+
+  private:
+    MappedCacheSnapshot(void* data, size_t size) : mData(data), mSize(size) {}
+
+    void* mData;
+    size_t mSize;
+    std::vector<CacheSnapshotRecord> mRecords;
+};
+
+// Returns the path of the snapshot of the network with |signature| in |dir|.
+std::string cacheSnapshotPath(const std::string& dir, uint64_t signature);
+
+// Deletes the least recently written snapshots in |dir| beyond the |maxFiles| most recent ones.
+void pruneCacheSnapshots(const std::string& dir, size_t maxFiles);
+
+}  // namespace android::net
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "CacheSnapshot.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+#include <netdutils/NetNativeTestBase.h>
+
+namespace android::net {
+
+constexpr uint64_t kSignature = 0x0123456789abcdef;
+
+class CacheSnapshotTest : public NetNativeTestBase {
+  protected:
+    std::string path() const { return cacheSnapshotPath(mDir.path, kSignature); }
+
+    TemporaryDir mDir;
+};
+
+TEST_F(CacheSnapshotTest, WriteAndRead) {
+    const std::vector<uint8_t> query1 = {1, 2, 3};
+    const std::vector<uint8_t> answer1 = {4, 5, 6, 7, 8};
+    const std::vector<uint8_t> query2(300, 9);
+    const std::vector<uint8_t> answer2(1000, 10);
+
+    CacheSnapshotWriter writer(kSignature);
+    writer.add({.expires = 1000, .query = query1, .answer = answer1});
+    writer.add({.expires = 2000, .query = query2, .answer = answer2});
+    EXPECT_EQ(2U, writer.recordCount());
+    ASSERT_TRUE(writer.write(path()).ok());
+
+    const auto snapshot = MappedCacheSnapshot::open(path(), kSignature);
+    ASSERT_TRUE(snapshot.ok()) << snapshot.error().message();
+    const std::vector<CacheSnapshotRecord>& records = (*snapshot)->records();
+    ASSERT_EQ(2U, records.size());
+    EXPECT_EQ(1000, records[0].expires);
+    EXPECT_EQ(query1, std::vector<uint8_t>(records[0].query.begin(), records[0].query.end()));
+    EXPECT_EQ(answer1, std::vector<uint8_t>(records[0].answer.begin(), records[0].answer.end()));
+    EXPECT_EQ(2000, records[1].expires);
+    EXPECT_EQ(query2, std::vector<uint8_t>(records[1].query.begin(), records[1].query.end()));
+    EXPECT_EQ(answer2, std::vector<uint8_t>(records[1].answer.begin(), records[1].answer.end()));
+}
+
+TEST_F(CacheSnapshotTest, WrongSignature) {
+    ASSERT_TRUE(CacheSnapshotWriter(kSignature).write(path()).ok());
+    EXPECT_TRUE(MappedCacheSnapshot::open(path(), kSignature).ok());
+    EXPECT_FALSE(MappedCacheSnapshot::open(path(), kSignature + 1).ok());
+}
+
+TEST_F(CacheSnapshotTest, Truncated) {
+    const std::vector<uint8_t> query(100, 1);
+    const std::vector<uint8_t> answer(100, 2);
+    CacheSnapshotWriter writer(kSignature);
+    writer.add({.expires = 1000, .query = query, .answer = answer});
+    ASSERT_TRUE(writer.write(path()).ok());
+
+    struct stat st;
+    ASSERT_EQ(0, stat(path().c_str(), &st));
+    ASSERT_EQ(0, truncate(path().c_str(), st.st_size - 50));
+    EXPECT_FALSE(MappedCacheSnapshot::open(path(), kSignature).ok());
+
+    ASSERT_EQ(0, truncate(path().c_str(), 4));
+    EXPECT_FALSE(MappedCacheSnapshot::open(path(), kSignature).ok());
+}
+
+TEST_F(CacheSnapshotTest, Missing) {
+    EXPECT_FALSE(MappedCacheSnapshot::open(path(), kSignature).ok());
+}
+
+TEST_F(CacheSnapshotTest, Prune) {
+    for (uint64_t signature = 1; signature <= 5; signature++) {
+        ASSERT_TRUE(CacheSnapshotWriter(signature).write(cacheSnapshotPath(mDir.path, signature))
+                            .ok());
+        // Make sure the modification times differ.
+        const timespec times[2] = {{.tv_sec = 0, .tv_nsec = UTIME_OMIT},
+                                   {.tv_sec = static_cast<time_t>(1000 * signature)}};
+        ASSERT_EQ(0, utimensat(AT_FDCWD, cacheSnapshotPath(mDir.path, signature).c_str(), times,
+                               0));
+    }
+
+    pruneCacheSnapshots(mDir.path, 2);
+    for (uint64_t signature = 1; signature <= 5; signature++) {
+        EXPECT_EQ(signature > 3, access(cacheSnapshotPath(mDir.path, signature).c_str(), F_OK) == 0)
+                << signature;
+    }
+}
+
+}  // namespace android::net
@@ -0,0 +1,261 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "resolv"
+
+#include "DnsAsyncEngine.h"
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+#include <android-base/logging.h>
+#include <android-base/thread_annotations.h>
+#include <android-base/unique_fd.h>
+#include <netdutils/ThreadUtil.h>
+
+namespace android::net {
+
+using android::base::unique_fd;
+using std::chrono::steady_clock;
+
+class DnsAsyncEngine::Loop {
+  public:
+    explicit Loop(DnsAsyncEngine* engine) : mEngine(engine) {}
+
+    bool init() {
+        mEpollFd.reset(epoll_create1(EPOLL_CLOEXEC));
+        mEventFd.reset(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+        if (mEpollFd == -1 || mEventFd == -1) {
+            PLOG(ERROR) << "DnsAsyncEngine: failed to create the loop descriptors";
+            return false;
+        }
+        epoll_event event = {.events = EPOLLIN, .data = {.u64 = kEventFdId}};
+        if (epoll_ctl(mEpollFd.get(), EPOLL_CTL_ADD, mEventFd.get(), &event) == -1) {
+            PLOG(ERROR) << "DnsAsyncEngine: failed to watch the eventfd";
+            return false;
+        }
+        return true;
+    }
+
+    void start(std::unique_ptr<Task> task, const std::shared_ptr<Loop>& self) {
+        {
+            std::lock_guard guard(mMutex);
+            task->mLoop = self;
+            task->mId = mNextId++;
+            mNewTasks.push_back(std::move(task));
+        }
+        notify();
+    }
+
+    void wake(uint64_t id) {
+        {
+            std::lock_guard guard(mMutex);
+            mWokenTasks.push_back(id);
+        }
+        notify();
+    }
+
+    void stop() {
+        {
+            std::lock_guard guard(mMutex);
+            mStopping = true;
+        }
+        notify();
+    }
+
+    void run(const std::string& name) {
+        netdutils::setThreadName(name);
+        epoll_event events[kMaxEvents];
+        std::vector<std::unique_ptr<Task>> newTasks;
+        std::vector<uint64_t> wokenTasks;
+        while (true) {
+            const int n = epoll_wait(mEpollFd.get(), events, kMaxEvents, timeoutMs());
+            if (n == -1 && errno != EINTR) {
+                PLOG(ERROR) << "DnsAsyncEngine: epoll_wait failed";
+            }
+            for (int i = 0; i < n; i++) {
+                if (events[i].data.u64 == kEventFdId) {
+                    eventfd_t ignored;
+                    eventfd_read(mEventFd.get(), &ignored);
+                } else {
+                    resume(events[i].data.u64);
+                }
+            }
+            {
+                std::lock_guard guard(mMutex);
+                if (mStopping) break;
+                newTasks.swap(mNewTasks);
+                wokenTasks.swap(mWokenTasks);
+            }
+            // The new tasks first, since they may be woken up before they first run.
+            for (std::unique_ptr<Task>& task : newTasks) {
+                const uint64_t id = task->mId;
+                mTasks.emplace(id, Entry{.task = std::move(task), .timer = mTimers.end()});
+                resume(id);
+            }
+            newTasks.clear();
+            // Then the expired timers, with the woken tasks, so that a task always waiting for a
+            // deadline in the past doesn't keep the loop from waiting for the others.
+            const steady_clock::time_point now = steady_clock::now();
+            for (auto it = mTimers.begin(); it != mTimers.end() && it->first <= now; ++it) {
+                wokenTasks.push_back(it->second);
+            }
+            for (const uint64_t id : wokenTasks) {
+                resume(id);
+            }
+            wokenTasks.clear();
+        }
+        mEngine->mTasks -= mTasks.size();
+        mTasks.clear();
+    }
+
+  private:
+    // The epoll data of the eventfd. Task ids start at 1.
+    static constexpr uint64_t kEventFdId = 0;
+    static constexpr int kMaxEvents = 64;
+
+    using Timers = std::multimap<steady_clock::time_point, uint64_t>;
+
+    struct Entry {
+        std::unique_ptr<Task> task;
+        // The socket and the timer which the task waits for, if any.
+        int fd = -1;
+        Timers::iterator timer;
+    };
+
+    void notify() {
+        if (eventfd_write(mEventFd.get(), 1) == -1) {
+            PLOG(ERROR) << "DnsAsyncEngine: failed to write the eventfd";
+        }
+    }
+
+    int timeoutMs() const {
+        if (mTimers.empty()) return -1;
+        const auto timeout = mTimers.begin()->first - steady_clock::now();
+        if (timeout <= timeout.zero()) return 0;
+        // Round up, or the loop wakes up just before the deadline and spins until it passes.
+        return std::chrono::ceil<std::chrono::milliseconds>(timeout).count();
+    }
+
+    // Resumes the task |id|, unless it's already complete, and waits for what it waits for next.
+    void resume(uint64_t id) {
+        const auto it = mTasks.find(id);
+        if (it == mTasks.end()) return;
+        Entry& entry = it->second;
+        // Stop waiting first, since the task may close or replace its socket.
+        if (entry.fd != -1) {
+            epoll_ctl(mEpollFd.get(), EPOLL_CTL_DEL, entry.fd, nullptr);
+            entry.fd = -1;
+        }
+        if (entry.timer != mTimers.end()) {
+            mTimers.erase(entry.timer);
+            entry.timer = mTimers.end();
+        }
+
+        mEngine->mResumes++;
+        if (!entry.task->resume()) {
+            mTasks.erase(it);
+            mEngine->mTasks--;
+            mEngine->mCompletedTasks++;
+            return;
+        }
+
+        if (const int fd = entry.task->fd(); fd != -1) {
+            epoll_event event = {.events = EPOLLIN, .data = {.u64 = id}};
+            if (epoll_ctl(mEpollFd.get(), EPOLL_CTL_ADD, fd, &event) == 0) {
+                entry.fd = fd;
+            } else {
+                // The task still gets its deadline.
+                PLOG(WARNING) << "DnsAsyncEngine: failed to watch fd " << fd;
+            }
+        }
+        if (const steady_clock::time_point deadline = entry.task->deadline();
+            deadline != steady_clock::time_point::max()) {
+            entry.timer = mTimers.emplace(deadline, id);
+        }
+    }
+
+    DnsAsyncEngine* const mEngine;
+    unique_fd mEpollFd;
+    unique_fd mEventFd;
+
+    std::mutex mMutex;
+    uint64_t mNextId GUARDED_BY(mMutex) = kEventFdId + 1;
+    std::vector<std::unique_ptr<Task>> mNewTasks GUARDED_BY(mMutex);
+    std::vector<uint64_t> mWokenTasks GUARDED_BY(mMutex);
+    bool mStopping GUARDED_BY(mMutex) = false;
+
+    // Only used by the loop thread.
+    std::unordered_map<uint64_t, Entry> mTasks;
+    Timers mTimers;
+};
+
+std::function<void()> DnsAsyncEngine::Task::waker() const {
+    return [loop = mLoop, id = mId] {
+        if (const std::shared_ptr<Loop> l = loop.lock(); l != nullptr) l->wake(id);
+    };
+}
+
+std::unique_ptr<DnsAsyncEngine> DnsAsyncEngine::create(const std::string& name, size_t threads) {
+    if (threads == 0) return nullptr;
+    std::unique_ptr<DnsAsyncEngine> engine(new DnsAsyncEngine());
+    for (size_t i = 0; i < threads; i++) {
+        auto loop = std::make_shared<Loop>(engine.get());
+        if (!loop->init()) return nullptr;
+        engine->mLoops.push_back(std::move(loop));
+    }
+    for (size_t i = 0; i < threads; i++) {
+        engine->mThreads.emplace_back(&Loop::run, engine->mLoops[i].get(),
+                                      name + "_" + std::to_string(i));
+    }
+    return engine;
+}
+
+DnsAsyncEngine::~DnsAsyncEngine() {
+    for (const std::shared_ptr<Loop>& loop : mLoops) {
+        loop->stop();
+    }
+    for (std::thread& thread : mThreads) {
+        thread.join();
+    }
+}
+
+void DnsAsyncEngine::start(std::unique_ptr<Task> task) {
+    const size_t tasks = ++mTasks;
+    size_t peak = mPeakTasks;
+    while (tasks > peak && !mPeakTasks.compare_exchange_weak(peak, tasks)) {
+    }
+    const std::shared_ptr<Loop>& loop = mLoops[mNextLoop++ % mLoops.size()];
+    loop->start(std::move(task), loop);
+}
+
+DnsAsyncEngine::Stats DnsAsyncEngine::getStats() const {
+    return {
+            .threads = mThreads.size(),
+            .tasks = mTasks,
+            .peakTasks = mPeakTasks,
+            .completedTasks = mCompletedTasks,
+            .resumes = mResumes,
+    };
+}
+
+}  // namespace android::net
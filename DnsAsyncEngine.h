@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace android::net {
+
+// Runs many tasks on a few event loop threads, instead of a thread per task.
+//
+// A task is a state machine which never blocks: each loop waits with epoll for the sockets of its
+// tasks to be readable, for their deadlines, or for them to be woken up from other threads, and
+// then resumes them. A task is resumed on the same thread until it completes.
+class DnsAsyncEngine {
+  public:
+    class Loop;
+
+    class Task {
+      public:
+        virtual ~Task() = default;
+
+        // Runs the task as far as it can go without blocking. Returns false once the task is
+        // complete, and the engine destroys it. Otherwise, it's resumed again once fd() is
+        // readable, deadline() has passed or wake() was called, whichever comes first.
+        // The first call happens as soon as the task is started.
+        virtual bool resume() = 0;
+
+        // The socket to wait for, or -1.
+        virtual int fd() const = 0;
+        // When to resume the task anyway, or time_point::max().
+        virtual std::chrono::steady_clock::time_point deadline() const = 0;
+
+      protected:
+        // Returns a function which resumes the task. It can be called from any thread, even once
+        // the task is complete, in which case it does nothing.
+        std::function<void()> waker() const;
+
+      private:
+        friend class DnsAsyncEngine;
+        std::weak_ptr<Loop> mLoop;
+        uint64_t mId = 0;
+    };
+
+    struct Stats {
+        size_t threads;
+        size_t tasks;
+        size_t peakTasks;
+        uint64_t completedTasks;
+        uint64_t resumes;
+    };
+
+    // Starts |threads| loops, with threads named |name|_<index>. Returns nullptr if |threads| is
+    // 0, or if the epoll and eventfd descriptors of the loops can't be created.
+    static std::unique_ptr<DnsAsyncEngine> create(const std::string& name, size_t threads);
+
+    // Stops the loops, and destroys the tasks which are still running.
+    ~DnsAsyncEngine();
+
+    DnsAsyncEngine(const DnsAsyncEngine&) = delete;
+    DnsAsyncEngine& operator=(const DnsAsyncEngine&) = delete;
+
+    // Hands |task| over to one of the loops, which resumes it for the first time.
+    void start(std::unique_ptr<Task> task);
+
+    Stats getStats() const;
+
+  private:
+    DnsAsyncEngine() = default;
+
+    std::vector<std::shared_ptr<Loop>> mLoops;
+    std::vector<std::thread> mThreads;
+    std::atomic<size_t> mNextLoop = 0;
+    std::atomic<size_t> mTasks = 0;
+    std::atomic<size_t> mPeakTasks = 0;
+    std::atomic<uint64_t> mCompletedTasks = 0;
+    std::atomic<uint64_t> mResumes = 0;
+};
+
+}  // namespace android::net
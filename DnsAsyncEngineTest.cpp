@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "DnsAsyncEngine.h"
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <future>
+#include <thread>
+
+#include <android-base/unique_fd.h>
+#include <gtest/gtest.h>
+#include <netdutils/NetNativeTestBase.h>
+
+namespace android::net {
+
+using android::base::unique_fd;
+using std::chrono::steady_clock;
+using namespace std::chrono_literals;
+
+namespace {
+
+// Completes once resumed |n| times, and sets |done|.
+class CountingTask : public DnsAsyncEngine::Task {
+  public:
+    CountingTask(int n, std::promise<std::function<void()>>* waker, std::promise<int>* done)
+        : mRemaining(n), mWaker(waker), mDone(done) {}
+
+    bool resume() override {
+        if (mWaker != nullptr) {
+            mWaker->set_value(waker());
+            mWaker = nullptr;
+        }
+        mResumes++;
+        if (--mRemaining > 0) return true;
+        mDone->set_value(mResumes);
+        return false;
+    }
+    int fd() const override { return -1; }
+    steady_clock::time_point deadline() const override { return steady_clock::time_point::max(); }
+
+  private:
+    int mRemaining;
+    int mResumes = 0;
+    std::promise<std::function<void()>>* mWaker;
+    std::promise<int>* mDone;
+};
+
+}  // namespace
+
+class DnsAsyncEngineTest : public NetNativeTestBase {};
+
+TEST_F(DnsAsyncEngineTest, WakesTasks) {
+    const auto engine = DnsAsyncEngine::create("DnsAsyncTest", 2);
+    ASSERT_NE(nullptr, engine);
+
+    std::promise<std::function<void()>> wakerPromise;
+    std::promise<int> done;
+    engine->start(std::make_unique<CountingTask>(3, &wakerPromise, &done));
+    const std::function<void()> wake = wakerPromise.get_future().get();
+    // Resumed once when started, and then once per wake-up.
+    wake();
+    wake();
+    EXPECT_EQ(3, done.get_future().get());
+
+    // Waking up a completed task does nothing.
+    wake();
+    std::promise<int> done2;
+    engine->start(std::make_unique<CountingTask>(1, nullptr, &done2));
+    EXPECT_EQ(1, done2.get_future().get());
+
+    // The tasks complete once they return.
+    while (engine->getStats().completedTasks < 2) {
+        std::this_thread::yield();
+    }
+    const DnsAsyncEngine::Stats stats = engine->getStats();
+    EXPECT_EQ(2U, stats.threads);
+    EXPECT_EQ(2U, stats.completedTasks);
+    EXPECT_EQ(0U, stats.tasks);
+    EXPECT_LE(1U, stats.peakTasks);
+}
+
+TEST_F(DnsAsyncEngineTest, WaitsForSocketsAndDeadlines) {
+    // Reads from its socket until the peer writes, or gives up at its deadline.
+    class ReadingTask : public DnsAsyncEngine::Task {
+      public:
+        ReadingTask(int fd, steady_clock::time_point deadline, std::promise<char>* done)
+            : mFd(fd), mDeadline(deadline), mDone(done) {}
+
+        bool resume() override {
+            char c;
+            if (read(mFd, &c, 1) == 1) {
+                mDone->set_value(c);
+                return false;
+            }
+            if (steady_clock::now() >= mDeadline) {
+                mDone->set_value('\0');
+                return false;
+            }
+            return true;
+        }
+        int fd() const override { return mFd; }
+        steady_clock::time_point deadline() const override { return mDeadline; }
+
+      private:
+        const int mFd;
+        const steady_clock::time_point mDeadline;
+        std::promise<char>* mDone;
+    };
+
+    const auto engine = DnsAsyncEngine::create("DnsAsyncTest", 1);
+    ASSERT_NE(nullptr, engine);
+    int fds[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds));
+    unique_fd reader(fds[0]), writer(fds[1]);
+    int fds2[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds2));
+    unique_fd silentReader(fds2[0]), silentWriter(fds2[1]);
+
+    std::promise<char> read;
+    std::promise<char> timedOut;
+    const steady_clock::time_point start = steady_clock::now();
+    engine->start(std::make_unique<ReadingTask>(reader.get(), start + 10s, &read));
+    engine->start(std::make_unique<ReadingTask>(silentReader.get(), start + 100ms, &timedOut));
+
+    ASSERT_EQ(1, write(writer.get(), "x", 1));
+    EXPECT_EQ('x', read.get_future().get());
+    EXPECT_EQ('\0', timedOut.get_future().get());
+    EXPECT_LE(100ms, steady_clock::now() - start);
+    EXPECT_GT(10s, steady_clock::now() - start);
+}
+
+TEST_F(DnsAsyncEngineTest, DestroysRunningTasks) {
+    std::promise<std::function<void()>> wakerPromise;
+    std::promise<int> done;
+    std::function<void()> wake;
+    {
+        const auto engine = DnsAsyncEngine::create("DnsAsyncTest", 1);
+        ASSERT_NE(nullptr, engine);
+        engine->start(std::make_unique<CountingTask>(2, &wakerPromise, &done));
+        wake = wakerPromise.get_future().get();
+    }
+    // The task was never woken up, and the waker outlives the engine.
+    wake();
+    EXPECT_EQ(std::future_status::timeout, done.get_future().wait_for(0s));
+}
+
+}  // namespace android::net
@@ -19,6 +19,7 @@
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <dlfcn.h>
+#include <inttypes.h>
 #include <linux/if.h>
 #include <math.h>
 #include <net/if.h>
@@ -32,9 +33,14 @@
 #define LOG_TAG "resolv"
 
 #include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <tuple>
 #include <vector>
 
 #include <android-base/parseint.h>
+#include <android-base/strings.h>
 #include <android/multinetwork.h>  // ResNsendFlags
 #include <cutils/misc.h>           // FIRST_APPLICATION_UID
 #include <cutils/multiuser.h>
@@ -46,12 +52,16 @@
 #include <statslog_resolv.h>
 #include <sysutils/SocketClient.h>
 
+#include "DnsAsyncEngine.h"
 #include "DnsResolver.h"
 #include "Experiments.h"
 #include "NetdPermissions.h"
 #include "OperationLimiter.h"
 #include "PrivateDnsConfiguration.h"
+#include "RequestCoalescer.h"
 #include "ResolverEventReporter.h"
+#include "ThreadPool.h"
+#include "dnsproxyd_protocol/DnsProxydBatch.h"
 #include "dnsproxyd_protocol/DnsProxydProtocol.h"  // NETID_USE_LOCAL_NAMESERVERS
 #include "getaddrinfo.h"
 #include "gethnamaddr.h"
@@ -67,6 +77,7 @@ using aidl::android::net::resolv::aidl::DnsHealthEventParcel;
 using aidl::android::net::resolv::aidl::IDnsResolverUnsolicitedEventListener;
 using android::base::ParseInt;
 using android::base::ParseUint;
+using android::base::Split;
 using std::span;
 
 namespace android {
@@ -91,6 +102,117 @@ void endQueryLimiter(uid_t uid) {
     queryLimiter.finish(uid);
 }
 
+// The default number of threads running the handlers. A queued handler waits for one of them, so
+// the pool is off by default: otherwise, one app or one unresponsive network could hold all the
+// threads and delay every other lookup.
+constexpr int kDefaultHandlerThreads = 0;
+
+// Return the pool running the handlers, or nullptr if each handler runs in its own thread, as
+// set by the handler_threads flag. Flag changes take effect on restart.
+ThreadPool* getHandlerThreadPool() {
+    static ThreadPool* const pool = []() -> ThreadPool* {
+        const Experiments* const experiments = Experiments::getInstance();
+        const int threads = experiments->getFlag("handler_threads", kDefaultHandlerThreads);
+        if (threads <= 0) return nullptr;
+        int queueSize = experiments->getFlag("handler_queue_size", MAX_QUERIES_IN_TOTAL);
+        if (queueSize < 0) {
+            LOG(ERROR) << "Misconfiguration on handler_queue_size " << queueSize;
+            queueSize = MAX_QUERIES_IN_TOTAL;
+        }
+        // Never destroyed: the handlers may still be running at exit.
+        return new ThreadPool("DnsProxyHandler", threads, queueSize);
+    }();
+    return pool;
+}
+
+// The maximum number of async engine loops, which each run many handlers.
+constexpr int kMaxAsyncEngineThreads = 16;
+
+// Return the engine resolving the resnsend queries without blocking a thread each, or nullptr if
+// disabled by the async_engine_threads flag. Flag changes take effect on restart.
+//
+// The engine is off by default: it only covers resnsend, while getaddrinfo and gethostbyname
+// still take a thread each, and it hands the queries it can't send over UDP to the handler
+// threads, which resend them from scratch, see ResNsendAsync.
+DnsAsyncEngine* getAsyncEngine() {
+    static DnsAsyncEngine* const engine = []() -> DnsAsyncEngine* {
+        int threads = Experiments::getInstance()->getFlag("async_engine_threads", 0);
+        if (threads < 0 || threads > kMaxAsyncEngineThreads) {
+            LOG(ERROR) << "Misconfiguration on async_engine_threads " << threads;
+            threads = 0;
+        }
+        // Never destroyed: the tasks may still be running at exit.
+        return DnsAsyncEngine::create("DnsAsync", threads).release();
+    }();
+    return engine;
+}
+
+// The queries answered from the cache on the listener thread, and those handed over to the
+// handlers, see answeredFromCache().
+std::atomic<uint64_t> listenerCacheHits = 0;
+std::atomic<uint64_t> listenerCacheMisses = 0;
+
+// Whether |handler| answered its query from the cache on the listener thread, which spares the
+// cache hits the handler threads. Enabled by the cache_hit_fast_path flag.
+template <typename T>
+bool answeredFromCache(T* handler) {
+    if (!Experiments::getInstance()->getFlag("cache_hit_fast_path", 0)) return false;
+    const bool answered = handler->answerFromCache();
+    (answered ? listenerCacheHits : listenerCacheMisses)++;
+    return answered;
+}
+
+// The getaddrinfo requests which resolve identically: same network context and arguments. The UID
+// is part of it, since the resolution tags its sockets with it and counts its queries against the
+// quota of the UID, so only the requests of the same app are coalesced.
+using GetAddrInfoKey = std::tuple<unsigned, unsigned, unsigned, unsigned, unsigned, uid_t,
+                                  std::string, std::string, int, int, int, int>;
+
+GetAddrInfoKey makeGetAddrInfoKey(const android_net_context& netContext, const std::string& host,
+                                  const std::string& service, const addrinfo* hints) {
+    // Without hints, the client sets all of them to -1, see GetAddrInfoCmd::runCommand().
+    return {netContext.app_netid,
+            netContext.app_mark,
+            netContext.dns_netid,
+            netContext.dns_mark,
+            netContext.flags,
+            netContext.uid,
+            host,
+            service,
+            hints ? hints->ai_flags : -1,
+            hints ? hints->ai_family : -1,
+            hints ? hints->ai_socktype : -1,
+            hints ? hints->ai_protocol : -1};
+}
+
+// The result of a getaddrinfo request, shared by the identical requests coalesced with it.
+struct GetAddrInfoResult {
+    int32_t rv;
+    std::unique_ptr<addrinfo, decltype(&freeaddrinfo)> result;
+    // Reported by the coalesced requests too, so that the metrics count each of them.
+    DnsQueryEvents queryEvents;
+};
+
+using GetAddrInfoCoalescer = RequestCoalescer<GetAddrInfoKey, GetAddrInfoResult>;
+
+GetAddrInfoCoalescer* getGetAddrInfoCoalescer() {
+    // Never destroyed: the handlers may still be running at exit.
+    static GetAddrInfoCoalescer* const coalescer = new GetAddrInfoCoalescer();
+    return coalescer;
+}
+
+// Returns the result of |resolve|, or waits for the identical request in flight and shares its
+// result, in which case |coalesced| is set. Enabled by the getaddrinfo_coalescing flag.
+std::shared_ptr<const GetAddrInfoResult> coalesceGetAddrInfo(
+        const GetAddrInfoKey& key, const std::function<GetAddrInfoResult()>& resolve,
+        bool* coalesced) {
+    if (!Experiments::getInstance()->getFlag("getaddrinfo_coalescing", 0)) {
+        *coalesced = false;
+        return std::make_shared<const GetAddrInfoResult>(resolve());
+    }
+    return getGetAddrInfoCoalescer()->run(key, resolve, coalesced);
+}
+
 void logArguments(int argc, char** argv) {
     if (!WOULD_LOG(VERBOSE)) return;
     for (int i = 0; i < argc; i++) {
@@ -111,15 +233,7 @@ constexpr bool requestingUseLocalNameservers(unsigned flags) {
 }
 
 bool queryingViaTls(unsigned dns_netid) {
-    const auto privateDnsStatus = PrivateDnsConfiguration::getInstance().getStatus(dns_netid);
-    switch (privateDnsStatus.mode) {
-        case PrivateDnsMode::OPPORTUNISTIC:
-            return !privateDnsStatus.validatedServers().empty();
-        case PrivateDnsMode::STRICT:
-            return true;
-        default:
-            return false;
-    }
+    return PrivateDnsConfiguration::getInstance().queryingViaTls(dns_netid);
 }
 
 bool hasPermissionToBypassPrivateDns(uid_t uid) {
@@ -274,9 +388,9 @@ bool parseQuery(span<const uint8_t> msg, uint16_t* query_id, int* rr_type, std::
 // Note: Even if it returns PDM_OFF, it doesn't mean there's no DoT stats in the message
 // because Private DNS mode can change at any time.
 PrivateDnsModes getPrivateDnsModeForMetrics(uint32_t netId) {
-    // If the network `netId` doesn't exist, getStatus() sets the mode to PrivateDnsMode::OFF and
-    // returns it. This is incorrect for the metrics. Consider returning PDM_UNKNOWN in such case.
-    return convertEnumType(PrivateDnsConfiguration::getInstance().getStatus(netId).mode);
+    // If the network `netId` doesn't exist, getMode() returns PrivateDnsMode::OFF. This is
+    // incorrect for the metrics. Consider returning PDM_UNKNOWN in such case.
+    return convertEnumType(PrivateDnsConfiguration::getInstance().getMode(netId));
 }
 
 void initDnsEvent(NetworkDnsEventReported* event, const android_net_context& netContext) {
@@ -313,7 +427,8 @@ void maybeLogQuery(int eventType, const android_net_context& netContext,
         if (query.cache_hit() != CS_FOUND) {
             const int timeTakenMs = event.latency_micros() / 1000;
             DnsQueryLog::Record record(netContext.dns_netid, netContext.uid, netContext.pid,
-                                       query_name, ip_addrs, timeTakenMs);
+                                       query_name, ip_addrs, timeTakenMs,
+                                       resolv_get_network_signature(netContext.dns_netid));
             gDnsResolv->dnsQueryLog().push(std::move(record));
             return;
         }
@@ -728,6 +843,9 @@ DnsProxyListener::DnsProxyListener() : FrameworkListener(SOCKET_NAME) {
     mGetAddrInfoCmd = std::make_unique<GetAddrInfoCmd>();
     registerCmd(mGetAddrInfoCmd.get());
 
+    mGetAddrInfoBatchCmd = std::make_unique<GetAddrInfoBatchCmd>();
+    registerCmd(mGetAddrInfoBatchCmd.get());
+
     mGetHostByAddrCmd = std::make_unique<GetHostByAddrCmd>();
     registerCmd(mGetHostByAddrCmd.get());
 
@@ -744,16 +862,55 @@ DnsProxyListener::DnsProxyListener() : FrameworkListener(SOCKET_NAME) {
 }
 
 void DnsProxyListener::Handler::spawn() {
-    const int rval = netdutils::threadLaunch(this);
+    ThreadPool* const pool = getHandlerThreadPool();
+    const int rval = (pool == nullptr) ? netdutils::threadLaunch(this) : pool->enqueue([this] {
+        std::unique_ptr<Handler> handler(this);
+        netdutils::setThreadName(handler->threadName());
+        handler->run();
+    });
     if (rval == 0) {
         return;
     }
 
+    sendSpawnError(-rval);
+    delete this;
+}
+
+void DnsProxyListener::Handler::sendSpawnError(int err) {
     char* msg = nullptr;
-    asprintf(&msg, "%s (%d)", strerror(-rval), -rval);
+    asprintf(&msg, "%s (%d)", strerror(err), err);
     mClient->sendMsg(ResponseCode::OperationFailed, msg, false);
     free(msg);
-    delete this;
+}
+
+void DnsProxyListener::dump(netdutils::DumpWriter& dw) {
+    dw.println("DnsProxyListener cache hits: %" PRIu64 " answered by the listener, %" PRIu64
+               " handed over",
+               listenerCacheHits.load(), listenerCacheMisses.load());
+    const GetAddrInfoCoalescer::Stats coalescerStats = getGetAddrInfoCoalescer()->getStats();
+    dw.println("DnsProxyListener getaddrinfo: %" PRIu64 " resolved, %" PRIu64
+               " coalesced with an identical request, %zu in flight",
+               coalescerStats.computed, coalescerStats.coalesced, coalescerStats.inFlight);
+
+    if (const ThreadPool* const pool = getHandlerThreadPool(); pool == nullptr) {
+        dw.println("DnsProxyListener handlers: one thread each");
+    } else {
+        const ThreadPool::Stats stats = pool->getStats();
+        dw.println("DnsProxyListener handler threads: %zu of %zu started, %zu idle",
+                   stats.threads, pool->maxThreads(), stats.idleThreads);
+        dw.println("DnsProxyListener handlers: %" PRIu64 " completed, %" PRIu64 " rejected",
+                   stats.completedTasks, stats.rejectedTasks);
+        dw.println("DnsProxyListener handler queue: %zu of %zu, peak %zu", stats.queuedTasks,
+                   pool->maxQueuedTasks(), stats.peakQueuedTasks);
+    }
+
+    const DnsAsyncEngine* const engine = getAsyncEngine();
+    if (engine == nullptr) return;
+    const DnsAsyncEngine::Stats engineStats = engine->getStats();
+    dw.println("DnsProxyListener async engine: %zu threads, %zu tasks, peak %zu",
+               engineStats.threads, engineStats.tasks, engineStats.peakTasks);
+    dw.println("DnsProxyListener async engine: %" PRIu64 " completed, %" PRIu64 " resumes",
+               engineStats.completedTasks, engineStats.resumes);
 }
 
 DnsProxyListener::GetAddrInfoHandler::GetAddrInfoHandler(SocketClient* c, std::string host,
@@ -828,7 +985,7 @@ static bool sendhostent(SocketClient* c, hostent* hp) {
     return success;
 }
 
-static bool sendaddrinfo(SocketClient* c, addrinfo* ai) {
+static bool sendaddrinfo(SocketClient* c, const addrinfo* ai) {
     // struct addrinfo {
     //      int     ai_flags;       /* AI_PASSIVE, AI_CANONNAME, AI_NUMERICHOST */
     //      int     ai_family;      /* PF_xxx */
@@ -911,7 +1068,7 @@ void DnsProxyListener::GetAddrInfoHandler::doDns64Synthesis(int32_t* rv, addrinf
 void DnsProxyListener::GetAddrInfoHandler::run() {
     LOG(INFO) << "GetAddrInfoHandler::run: {" << mNetContext.toString() << "}";
 
-    addrinfo* result = nullptr;
+    std::shared_ptr<const GetAddrInfoResult> result;
     Stopwatch s;
     maybeFixupNetContext(&mNetContext, mClient->getPid());
     const uid_t uid = mClient->getUid();
@@ -926,8 +1083,24 @@ void DnsProxyListener::GetAddrInfoHandler::run() {
         const char* host = mHost.starts_with('^') ? nullptr : mHost.c_str();
         const char* service = mService.starts_with('^') ? nullptr : mService.c_str();
         if (evaluate_domain_name(mNetContext, host)) {
-            rv = resolv_getaddrinfo(host, service, mHints.get(), &mNetContext, &result, &event);
-            doDns64Synthesis(&rv, &result, &event);
+            // The key first, since doDns64Synthesis() may change the hints.
+            const GetAddrInfoKey key = makeGetAddrInfoKey(mNetContext, mHost, mService,
+                                                          mHints.get());
+            bool coalesced;
+            result = coalesceGetAddrInfo(
+                    key,
+                    [&] {
+                        addrinfo* res = nullptr;
+                        int32_t err = resolv_getaddrinfo(host, service, mHints.get(),
+                                                         &mNetContext, &res, &event);
+                        doDns64Synthesis(&err, &res, &event);
+                        return GetAddrInfoResult{err, {res, freeaddrinfo},
+                                                 event.dns_query_events()};
+                    },
+                    &coalesced);
+            // A coalesced request reports the queries of the resolution it shared.
+            if (coalesced) *event.mutable_dns_query_events() = result->queryEvents;
+            rv = result->rv;
         } else {
             rv = EAI_SYSTEM;
         }
@@ -940,24 +1113,40 @@ void DnsProxyListener::GetAddrInfoHandler::run() {
                    << ", max concurrent queries reached";
     }
 
-    const int32_t latencyUs = saturate_cast<int32_t>(s.timeTakenUs());
-    event.set_latency_micros(latencyUs);
-    event.set_event_type(EVENT_GETADDRINFO);
-    event.set_hints_ai_flags((mHints ? mHints->ai_flags : 0));
+    finish(rv, result ? result->result.get() : nullptr, saturate_cast<int32_t>(s.timeTakenUs()),
+           &event, isUidBlocked);
+}
+
+void DnsProxyListener::GetAddrInfoHandler::finish(int32_t rv, const addrinfo* result,
+                                                  int32_t latencyUs,
+                                                  NetworkDnsEventReported* event,
+                                                  bool isUidBlocked) {
+    const uid_t uid = mClient->getUid();
+    event->set_latency_micros(latencyUs);
+    event->set_event_type(EVENT_GETADDRINFO);
+    event->set_hints_ai_flags((mHints ? mHints->ai_flags : 0));
 
     bool success = true;
+    std::unique_lock<std::mutex> batchLock;
+    if (mBatchReplyMutex != nullptr) {
+        batchLock = std::unique_lock(*mBatchReplyMutex);
+        success = sendBE32(mClient, mBatchIndex);
+    }
     if (rv) {
         // getaddrinfo failed
-        success = !mClient->sendBinaryMsg(ResponseCode::DnsProxyOperationFailed, &rv, sizeof(rv));
+        success = success &&
+                  !mClient->sendBinaryMsg(ResponseCode::DnsProxyOperationFailed, &rv, sizeof(rv));
     } else {
-        success = !mClient->sendCode(ResponseCode::DnsProxyQueryResult);
-        addrinfo* ai = result;
+        success = success && !mClient->sendCode(ResponseCode::DnsProxyQueryResult);
+        const addrinfo* ai = result;
         while (ai && success) {
             success = sendBE32(mClient, 1) && sendaddrinfo(mClient, ai);
             ai = ai->ai_next;
         }
         success = success && sendBE32(mClient, 0);
     }
+    // Report without holding up the other replies of the batch.
+    if (batchLock) batchLock.unlock();
 
     if (!success) {
         PLOG(WARNING) << "GetAddrInfoHandler::run: Error writing DNS result to client uid " << uid
@@ -966,15 +1155,38 @@ void DnsProxyListener::GetAddrInfoHandler::run() {
 
     std::vector<std::string> ip_addrs;
     const int total_ip_addr_count = extractGetAddrInfoAnswers(result, &ip_addrs);
-    reportDnsEvent(INetdEventListener::EVENT_GETADDRINFO, mNetContext, latencyUs, rv, event, mHost,
-                   isUidBlocked, ip_addrs, total_ip_addr_count);
-    freeaddrinfo(result);
+    reportDnsEvent(INetdEventListener::EVENT_GETADDRINFO, mNetContext, latencyUs, rv, *event,
+                   mHost, isUidBlocked, ip_addrs, total_ip_addr_count);
 }
 
 std::string DnsProxyListener::GetAddrInfoHandler::threadName() {
     return makeThreadName(mNetContext.dns_netid, mClient->getUid());
 }
 
+void DnsProxyListener::GetAddrInfoHandler::setBatch(std::shared_ptr<std::mutex> replyMutex,
+                                                    uint32_t index) {
+    mBatchReplyMutex = std::move(replyMutex);
+    mBatchIndex = index;
+}
+
+void DnsProxyListener::GetAddrInfoHandler::sendSpawnError(int err) {
+    if (mBatchReplyMutex == nullptr) {
+        Handler::sendSpawnError(err);
+        return;
+    }
+    // The other hostnames of the batch may still be answered: fail this one only, like an
+    // overloaded resolver would.
+    LOG(WARNING) << "GetAddrInfoHandler: batch hostname " << mBatchIndex << " dropped, "
+                 << strerror(err);
+    const int32_t rv = EAI_AGAIN;
+    std::lock_guard guard(*mBatchReplyMutex);
+    if (!sendBE32(mClient, mBatchIndex) ||
+        mClient->sendBinaryMsg(ResponseCode::DnsProxyOperationFailed, &rv, sizeof(rv))) {
+        PLOG(WARNING) << "GetAddrInfoHandler: Error writing DNS result to client uid "
+                      << mClient->getUid() << " pid " << mClient->getPid();
+    }
+}
+
 namespace {
 
 void addIpAddrWithinLimit(std::vector<std::string>* ip_addrs, const sockaddr* addr,
@@ -992,16 +1204,46 @@ void addIpAddrWithinLimit(std::vector<std::string>* ip_addrs, const sockaddr* ad
 
 }  // namespace
 
-DnsProxyListener::GetAddrInfoCmd::GetAddrInfoCmd() : FrameworkCommand("getaddrinfo") {}
-
-int DnsProxyListener::GetAddrInfoCmd::runCommand(SocketClient* cli, int argc, char** argv) {
-    logArguments(argc, argv);
-
+// Parses the arguments of the getaddrinfo and getaddrinfobatch commands following the service,
+// which are the hints and the netId. Returns false if they're invalid.
+static bool parseGetAddrInfoArgs(SocketClient* cli, char** argv, std::unique_ptr<addrinfo>* hints,
+                                 android_net_context* netcontext) {
     int ai_flags = 0;
     int ai_family = 0;
     int ai_socktype = 0;
     int ai_protocol = 0;
     unsigned netId = 0;
+
+    if (!ParseInt(argv[3], &ai_flags) || !ParseInt(argv[4], &ai_family) ||
+        !ParseInt(argv[5], &ai_socktype) || !ParseInt(argv[6], &ai_protocol) ||
+        !ParseUint(argv[7], &netId)) {
+        return false;
+    }
+
+    const bool useLocalNameservers = checkAndClearUseLocalNameserversFlag(&netId);
+    const uid_t uid = cli->getUid();
+
+    gResNetdCallbacks.get_network_context(netId, uid, netcontext);
+
+    if (useLocalNameservers) {
+        netcontext->flags |= NET_CONTEXT_FLAG_USE_LOCAL_NAMESERVERS;
+    }
+
+    if (ai_flags != -1 || ai_family != -1 || ai_socktype != -1 || ai_protocol != -1) {
+        hints->reset((addrinfo*)calloc(1, sizeof(addrinfo)));
+        (*hints)->ai_flags = ai_flags;
+        (*hints)->ai_family = ai_family;
+        (*hints)->ai_socktype = ai_socktype;
+        (*hints)->ai_protocol = ai_protocol;
+    }
+    return true;
+}
+
+DnsProxyListener::GetAddrInfoCmd::GetAddrInfoCmd() : FrameworkCommand("getaddrinfo") {}
+
+int DnsProxyListener::GetAddrInfoCmd::runCommand(SocketClient* cli, int argc, char** argv) {
+    logArguments(argc, argv);
+
     std::string strErr = "GetAddrInfoCmd::runCommand: ";
 
     if (argc != 8) {
@@ -1011,43 +1253,109 @@ int DnsProxyListener::GetAddrInfoCmd::runCommand(SocketClient* cli, int argc, ch
 
     const std::string name = argv[1];
     const std::string service = argv[2];
-    if (!ParseInt(argv[3], &ai_flags))
-        return HandleArgumentError(cli, ResponseCode::CommandParameterError, strErr, argc, argv);
-    if (!ParseInt(argv[4], &ai_family))
-        return HandleArgumentError(cli, ResponseCode::CommandParameterError, strErr, argc, argv);
-    if (!ParseInt(argv[5], &ai_socktype))
-        return HandleArgumentError(cli, ResponseCode::CommandParameterError, strErr, argc, argv);
-    if (!ParseInt(argv[6], &ai_protocol))
-        return HandleArgumentError(cli, ResponseCode::CommandParameterError, strErr, argc, argv);
-    if (!ParseUint(argv[7], &netId))
+    std::unique_ptr<addrinfo> hints;
+    android_net_context netcontext;
+    if (!parseGetAddrInfoArgs(cli, argv, &hints, &netcontext))
         return HandleArgumentError(cli, ResponseCode::CommandParameterError, strErr, argc, argv);
 
-    const bool useLocalNameservers = checkAndClearUseLocalNameserversFlag(&netId);
-    const uid_t uid = cli->getUid();
+    (new GetAddrInfoHandler(cli, name, service, std::move(hints), netcontext))->spawn();
+    return 0;
+}
 
-    android_net_context netcontext;
-    gResNetdCallbacks.get_network_context(netId, uid, &netcontext);
+/*******************************************************
+ *                  GetAddrInfoBatchCmd                *
+ *******************************************************/
+DnsProxyListener::GetAddrInfoBatchCmd::GetAddrInfoBatchCmd()
+    : FrameworkCommand(DNSPROXYD_GETADDRINFO_BATCH_COMMAND) {}
 
-    if (useLocalNameservers) {
-        netcontext.flags |= NET_CONTEXT_FLAG_USE_LOCAL_NAMESERVERS;
+int DnsProxyListener::GetAddrInfoBatchCmd::runCommand(SocketClient* cli, int argc, char** argv) {
+    logArguments(argc, argv);
+
+    std::string strErr = "GetAddrInfoBatchCmd::runCommand: ";
+
+    if (argc != 8) {
+        strErr = strErr + "invalid number of arguments: " + std::to_string(argc);
+        return HandleArgumentError(cli, ResponseCode::CommandParameterError, strErr, 0, NULL);
     }
 
+    const std::vector<std::string> names =
+            Split(argv[1], std::string(1, DNSPROXYD_BATCH_HOSTNAME_SEPARATOR));
+    if (names.size() > DNSPROXYD_BATCH_MAX_HOSTNAMES ||
+        std::any_of(names.begin(), names.end(), [](const auto& name) { return name.empty(); })) {
+        strErr = strErr + "invalid hostnames";
+        return HandleArgumentError(cli, ResponseCode::CommandParameterError, strErr, argc, argv);
+    }
+    const std::string service = argv[2];
     std::unique_ptr<addrinfo> hints;
-    if (ai_flags != -1 || ai_family != -1 || ai_socktype != -1 || ai_protocol != -1) {
-        hints.reset((addrinfo*)calloc(1, sizeof(addrinfo)));
-        hints->ai_flags = ai_flags;
-        hints->ai_family = ai_family;
-        hints->ai_socktype = ai_socktype;
-        hints->ai_protocol = ai_protocol;
+    android_net_context netcontext;
+    if (!parseGetAddrInfoArgs(cli, argv, &hints, &netcontext))
+        return HandleArgumentError(cli, ResponseCode::CommandParameterError, strErr, argc, argv);
+
+    if (cli->sendCode(ResponseCode::DnsProxyQueryResult) || !sendBE32(cli, names.size())) {
+        PLOG(WARNING) << "GetAddrInfoBatchCmd::runCommand: Error writing to client uid "
+                      << cli->getUid() << " pid " << cli->getPid();
+        return 0;
     }
 
-    (new GetAddrInfoHandler(cli, name, service, std::move(hints), netcontext))->spawn();
+    // Each hostname is resolved by its own handler, as if sent in its own getaddrinfo command,
+    // which answers as soon as it's done.
+    const auto replyMutex = std::make_shared<std::mutex>();
+    for (uint32_t i = 0; i < names.size(); i++) {
+        std::unique_ptr<addrinfo> nameHints;
+        if (hints) {
+            nameHints.reset((addrinfo*)calloc(1, sizeof(addrinfo)));
+            *nameHints = *hints;
+        }
+        auto handler = new GetAddrInfoHandler(cli, names[i], service, std::move(nameHints),
+                                              netcontext);
+        handler->setBatch(replyMutex, i);
+        handler->spawn();
+    }
     return 0;
 }
 
 /*******************************************************
  *                  ResNSendCommand                    *
  *******************************************************/
+// Resolves the query of a prepared handler with ResNsendAsync, and hands the handler over to the
+// handler threads if it needs to block. The answer is still written to the client socket by the
+// loop thread.
+class DnsProxyListener::ResNSendTask : public DnsAsyncEngine::Task {
+  public:
+    explicit ResNSendTask(ResNSendHandler* handler) : mHandler(handler) {}
+
+    bool resume() override {
+        if (mSend == nullptr) {
+            mSend = std::make_unique<ResNsendAsync>(mHandler->mNetContext, mHandler->mQuery,
+                                                    mHandler->mFlags, mHandler->mEvent.get(),
+                                                    waker());
+        }
+        switch (mSend->resume()) {
+            case ResNsendAsync::Status::WAITING:
+                return true;
+            case ResNsendAsync::Status::DONE:
+                mHandler->finish(mSend->result(), mSend->rcode(), mSend->answer());
+                break;
+            case ResNsendAsync::Status::BLOCKING:
+                mSend.reset();
+                mHandler.release()->spawn();
+                break;
+        }
+        return false;
+    }
+
+    int fd() const override { return (mSend != nullptr) ? mSend->fd() : -1; }
+
+    std::chrono::steady_clock::time_point deadline() const override {
+        return (mSend != nullptr) ? mSend->deadline()
+                                  : std::chrono::steady_clock::time_point::max();
+    }
+
+  private:
+    std::unique_ptr<ResNSendHandler> mHandler;
+    std::unique_ptr<ResNsendAsync> mSend;
+};
+
 DnsProxyListener::ResNSendCommand::ResNSendCommand() : FrameworkCommand("resnsend") {}
 
 int DnsProxyListener::ResNSendCommand::runCommand(SocketClient* cli, int argc, char** argv) {
@@ -1086,7 +1394,17 @@ int DnsProxyListener::ResNSendCommand::runCommand(SocketClient* cli, int argc, c
         netcontext.flags |= NET_CONTEXT_FLAG_USE_LOCAL_NAMESERVERS;
     }
 
-    (new ResNSendHandler(cli, argv[3], flags, netcontext))->spawn();
+    auto handler = std::make_unique<ResNSendHandler>(cli, argv[3], flags, netcontext);
+    if (answeredFromCache(handler.get())) return 0;
+    // Preparing may call into the system server, which would stall every query on the loop. The
+    // handlers which answerFromCache() didn't prepare, such as those using the local nameservers,
+    // are prepared and resolved on the handler threads instead.
+    DnsAsyncEngine* engine = handler->prepared() ? getAsyncEngine() : nullptr;
+    if (engine != nullptr) {
+        engine->start(std::make_unique<ResNSendTask>(handler.release()));
+    } else {
+        handler.release()->spawn();
+    }
     return 0;
 }
 
@@ -1094,10 +1412,48 @@ DnsProxyListener::ResNSendHandler::ResNSendHandler(SocketClient* c, std::string
                                                    const android_net_context& netcontext)
     : Handler(c), mMsg(std::move(msg)), mFlags(flags), mNetContext(netcontext) {}
 
+DnsProxyListener::ResNSendHandler::~ResNSendHandler() {
+    releaseQueryLimiter();
+}
+
 void DnsProxyListener::ResNSendHandler::run() {
+    if (!mPrepared && !prepare()) return;
+
+    // Send DNS query
+    std::vector<uint8_t> ansBuf(MAXPACKET, 0);
+    int rcode = ns_r_noerror;
+    const int ansLen = resolv_res_nsend(&mNetContext, mQuery, ansBuf, &rcode,
+                                        static_cast<ResNsendFlags>(mFlags), mEvent.get());
+    finish(ansLen, rcode, ansBuf);
+}
+
+bool DnsProxyListener::ResNSendHandler::answerFromCache() {
+    // Checking the permission to use the local nameservers may call into the system server.
+    if (requestingUseLocalNameservers(mNetContext.flags)) return false;
+    // Rejects the blocked UIDs and the queries over the limit before looking at the cache.
+    if (!prepare()) return true;
+
+    // Only a fresh answer: a stale one or one about to expire is refreshed by run().
+    Stopwatch cacheStopwatch;
+    std::vector<uint8_t> ansBuf(MAXPACKET, 0);
+    int ansLen = 0;
+    if (resolv_cache_probe(mNetContext.dns_netid, mQuery, ansBuf, &ansLen, mFlags) !=
+        RESOLV_CACHE_FOUND) {
+        return false;
+    }
+    DnsQueryEvent* dnsQueryEvent = mEvent->mutable_dns_query_events()->add_dns_query_event();
+    dnsQueryEvent->set_latency_micros(saturate_cast<int32_t>(cacheStopwatch.timeTakenUs()));
+    dnsQueryEvent->set_cache_hit(CS_FOUND);
+    dnsQueryEvent->set_type(getQueryType(mQuery));
+    finish(ansLen, reinterpret_cast<const HEADER*>(ansBuf.data())->rcode, ansBuf);
+    return true;
+}
+
+bool DnsProxyListener::ResNSendHandler::prepare() {
     LOG(INFO) << "ResNSendHandler::run: " << mFlags << " / {" << mNetContext.toString() << "}";
 
-    Stopwatch s;
+    mPrepared = true;
+    mStopwatch.getTimeAndResetUs();
     maybeFixupNetContext(&mNetContext, mClient->getPid());
 
     // Decode
@@ -1108,49 +1464,51 @@ void DnsProxyListener::ResNSendHandler::run() {
     if (msgLen == -1) {
         // Decode fail
         sendBE32(mClient, -EILSEQ);
-        return;
+        return false;
     }
+    // Only keep what's needed while the query is in flight.
+    mQuery.assign(msg.begin(), msg.begin() + msgLen);
 
     const uid_t uid = mClient->getUid();
-    int rr_type = 0;
-    std::string rr_name;
-    uint16_t original_query_id = 0;
 
     // TODO: Handle the case which is msg contains more than one query
-    if (!parseQuery(std::span(msg.data(), msgLen), &original_query_id, &rr_type, &rr_name) ||
-        !setQueryId(std::span(msg.data(), msgLen), arc4random_uniform(65536))) {
+    if (!parseQuery(mQuery, &mOriginalQueryId, &mRrType, &mRrName) ||
+        !setQueryId(mQuery, arc4random_uniform(65536))) {
         // If the query couldn't be parsed, block the request.
         LOG(WARNING) << "ResNSendHandler::run: resnsend: from UID " << uid << ", invalid query";
         sendBE32(mClient, -EINVAL);
-        return;
+        return false;
     }
 
-    // Send DNS query
-    std::vector<uint8_t> ansBuf(MAXPACKET, 0);
-    int rcode = ns_r_noerror;
-    int ansLen = -1;
-    NetworkDnsEventReported event;
-    initDnsEvent(&event, mNetContext);
-    const bool isUidBlocked = isUidNetworkingBlocked(mNetContext.uid, mNetContext.dns_netid);
-    if (isUidBlocked) {
+    mEvent = std::make_unique<NetworkDnsEventReported>();
+    initDnsEvent(mEvent.get(), mNetContext);
+    mIsUidBlocked = isUidNetworkingBlocked(mNetContext.uid, mNetContext.dns_netid);
+    if (mIsUidBlocked) {
         LOG(INFO) << "ResNSendHandler::run: network access blocked";
-        ansLen = -ECONNREFUSED;
-    } else if (startQueryLimiter(uid)) {
-        if (evaluate_domain_name(mNetContext, rr_name.c_str())) {
-            ansLen = resolv_res_nsend(&mNetContext, std::span(msg.data(), msgLen), ansBuf, &rcode,
-                                      static_cast<ResNsendFlags>(mFlags), &event);
-        } else {
-            // TODO(b/307048182): It should return -errno.
-            ansLen = -EAI_SYSTEM;
-        }
-        endQueryLimiter(uid);
-    } else {
+        finish(-ECONNREFUSED, ns_r_noerror, {});
+        return false;
+    }
+    if (!startQueryLimiter(uid)) {
         LOG(WARNING) << "ResNSendHandler::run: resnsend: from UID " << uid
                      << ", max concurrent queries reached";
-        ansLen = -EBUSY;
+        finish(-EBUSY, ns_r_noerror, {});
+        return false;
     }
+    mQueryLimited = true;
+    if (!evaluate_domain_name(mNetContext, mRrName.c_str())) {
+        // TODO(b/307048182): It should return -errno.
+        finish(-EAI_SYSTEM, ns_r_noerror, {});
+        return false;
+    }
+    return true;
+}
 
-    const int32_t latencyUs = saturate_cast<int32_t>(s.timeTakenUs());
+void DnsProxyListener::ResNSendHandler::finish(int ansLen, int rcode, span<uint8_t> ans) {
+    releaseQueryLimiter();
+    const uid_t uid = mClient->getUid();
+    NetworkDnsEventReported& event = *mEvent;
+
+    const int32_t latencyUs = saturate_cast<int32_t>(mStopwatch.timeTakenUs());
     event.set_latency_micros(latencyUs);
     event.set_event_type(EVENT_RES_NSEND);
     event.set_res_nsend_flags(static_cast<ResNsendFlags>(mFlags));
@@ -1161,9 +1519,9 @@ void DnsProxyListener::ResNSendHandler::run() {
             PLOG(WARNING) << "ResNSendHandler::run: resnsend: failed to send errno to uid " << uid
                           << " pid " << mClient->getPid();
         }
-        if (rr_type == ns_t_a || rr_type == ns_t_aaaa) {
+        if (mRrType == ns_t_a || mRrType == ns_t_aaaa) {
             reportDnsEvent(INetdEventListener::EVENT_RES_NSEND, mNetContext, latencyUs,
-                           resNSendToAiError(ansLen, rcode), event, rr_name, isUidBlocked);
+                           resNSendToAiError(ansLen, rcode), event, mRrName, mIsUidBlocked);
         }
         return;
     }
@@ -1176,28 +1534,34 @@ void DnsProxyListener::ResNSendHandler::run() {
     }
 
     // Restore query id
-    if (!setQueryId(std::span(ansBuf.data(), ansLen), original_query_id)) {
+    if (!setQueryId(ans.first(ansLen), mOriginalQueryId)) {
         LOG(WARNING) << "ResNSendHandler::run: resnsend: failed to restore query id";
         return;
     }
 
     // Send answer
-    if (!sendLenAndData(mClient, ansLen, ansBuf.data())) {
+    if (!sendLenAndData(mClient, ansLen, ans.data())) {
         PLOG(WARNING) << "ResNSendHandler::run: resnsend: failed to send answer to uid " << uid
                       << " pid " << mClient->getPid();
         return;
     }
 
-    if (rr_type == ns_t_a || rr_type == ns_t_aaaa) {
+    if (mRrType == ns_t_a || mRrType == ns_t_aaaa) {
         std::vector<std::string> ip_addrs;
         const int total_ip_addr_count =
-                extractResNsendAnswers(std::span(ansBuf.data(), ansLen), rr_type, &ip_addrs);
+                extractResNsendAnswers(ans.first(ansLen), mRrType, &ip_addrs);
         reportDnsEvent(INetdEventListener::EVENT_RES_NSEND, mNetContext, latencyUs,
-                       resNSendToAiError(ansLen, rcode), event, rr_name, /*skipStats=*/false,
+                       resNSendToAiError(ansLen, rcode), event, mRrName, /*skipStats=*/false,
                        ip_addrs, total_ip_addr_count);
     }
 }
 
+void DnsProxyListener::ResNSendHandler::releaseQueryLimiter() {
+    if (!mQueryLimited) return;
+    endQueryLimiter(mClient->getUid());
+    mQueryLimited = false;
+}
+
 std::string DnsProxyListener::ResNSendHandler::threadName() {
     return makeThreadName(mNetContext.dns_netid, mClient->getUid());
 }
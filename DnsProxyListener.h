@@ -16,9 +16,15 @@
 
 #pragma once
 
+#include <memory>
+#include <mutex>
+#include <span>
 #include <string>
+#include <vector>
 
 #include <netd_resolv/resolv.h>  // android_net_context
+#include <netdutils/DumpWriter.h>
+#include <netdutils/Stopwatch.h>
 #include <sysutils/FrameworkCommand.h>
 #include <sysutils/FrameworkListener.h>
 
@@ -37,6 +43,9 @@ class DnsProxyListener : public FrameworkListener {
 
     static constexpr const char* SOCKET_NAME = "dnsproxyd";
 
+    // Dump the usage of the threads and of the async engine running the handlers.
+    static void dump(netdutils::DumpWriter& dw);
+
   private:
     class Handler {
       public:
@@ -44,12 +53,14 @@ class DnsProxyListener : public FrameworkListener {
         virtual ~Handler() { mClient->decRef(); }
         void operator=(const Handler&) = delete;
 
-        // Attept to spawn the worker thread, or return an error to the client.
-        // The Handler instance will self-delete in either case.
+        // Attept to queue the handler to the worker threads, or to spawn its own thread, or
+        // return an error to the client. The Handler instance will self-delete in either case.
         void spawn();
 
         virtual void run() = 0;
         virtual std::string threadName() = 0;
+        // Tells the client that the handler could neither be queued nor run, with -|err|.
+        virtual void sendSpawnError(int err);
 
         SocketClient* mClient;  // ref-counted
     };
@@ -72,13 +83,35 @@ class DnsProxyListener : public FrameworkListener {
         void run() override;
         std::string threadName() override;
 
+        // Makes the handler answer the hostname at |index| of a getaddrinfobatch command. The
+        // handlers of the batch share the client socket, so each of them writes its whole reply
+        // under |replyMutex|.
+        void setBatch(std::shared_ptr<std::mutex> replyMutex, uint32_t index);
+        void sendSpawnError(int err) override;
+
       private:
         void doDns64Synthesis(int32_t* rv, addrinfo** res, NetworkDnsEventReported* event);
+        // Sends the result to the client and reports it.
+        void finish(int32_t rv, const addrinfo* result, int32_t latencyUs,
+                    NetworkDnsEventReported* event, bool isUidBlocked);
 
         std::string mHost;
         std::string mService;
         std::unique_ptr<addrinfo> mHints;
         android_net_context mNetContext;
+
+        // Set if answering a getaddrinfobatch command.
+        std::shared_ptr<std::mutex> mBatchReplyMutex;
+        uint32_t mBatchIndex = 0;
+    };
+
+    /* ------ getaddrinfobatch ------*/
+    // Resolves many hostnames with one GetAddrInfoHandler each, see DnsProxydBatch.h.
+    class GetAddrInfoBatchCmd : public FrameworkCommand {
+      public:
+        GetAddrInfoBatchCmd();
+        virtual ~GetAddrInfoBatchCmd() {}
+        int runCommand(SocketClient* c, int argc, char** argv) override;
     };
 
     /* ------ gethostbyname ------*/
@@ -142,19 +175,48 @@ class DnsProxyListener : public FrameworkListener {
         int runCommand(SocketClient* c, int argc, char** argv) override;
     };
 
+    // Runs a ResNSendHandler on the async engine, see the async_engine_threads flag.
+    class ResNSendTask;
+
     class ResNSendHandler : public Handler {
       public:
         ResNSendHandler(SocketClient* c, std::string msg, uint32_t flags,
                         const android_net_context& netcontext);
-        ~ResNSendHandler() override = default;
+        ~ResNSendHandler() override;
 
         void run() override;
         std::string threadName() override;
 
+        // Answers the query on the listener thread if it's rejected, or if it's cached and fresh:
+        // the listener only probes the cache. Returns false if it must run() instead, in which
+        // case it's already prepared.
+        bool answerFromCache();
+        // Whether the query has been decoded and checked, see answerFromCache().
+        bool prepared() const { return mPrepared; }
+
       private:
+        friend class ResNSendTask;
+
+        // Decodes and checks the query. Returns whether it should be resolved, or false if the
+        // client has been answered already.
+        bool prepare();
+        // Sends the result of resolv_res_nsend() to the client.
+        void finish(int ansLen, int rcode, std::span<uint8_t> ans);
+        void releaseQueryLimiter();
+
         std::string mMsg;
         uint32_t mFlags;
         android_net_context mNetContext;
+
+        bool mPrepared = false;
+        netdutils::Stopwatch mStopwatch;
+        std::vector<uint8_t> mQuery;
+        int mRrType = 0;
+        std::string mRrName;
+        uint16_t mOriginalQueryId = 0;
+        std::unique_ptr<NetworkDnsEventReported> mEvent;
+        bool mIsUidBlocked = false;
+        bool mQueryLimited = false;
     };
 
     /* ------ getdnsnetid ------*/
@@ -166,6 +228,7 @@ class DnsProxyListener : public FrameworkListener {
     };
 
     std::unique_ptr<GetAddrInfoCmd> mGetAddrInfoCmd;
+    std::unique_ptr<GetAddrInfoBatchCmd> mGetAddrInfoBatchCmd;
     std::unique_ptr<GetHostByAddrCmd> mGetHostByAddrCmd;
     std::unique_ptr<GetHostByNameCmd> mGetHostByNameCmd;
     std::unique_ptr<ResNSendCommand> mResNSendCommand;
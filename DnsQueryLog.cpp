@@ -17,6 +17,9 @@
 
 #include "DnsQueryLog.h"
 
+#include <algorithm>
+#include <unordered_map>
+
 #include "util.h"
 
 namespace android::net {
@@ -71,4 +74,34 @@ void DnsQueryLog::dump(netdutils::DumpWriter& dw) const {
     }
 }
 
+std::vector<std::string> DnsQueryLog::topHostnames(uint64_t networkSignature, size_t n) const {
+    if (networkSignature == 0) return {};
+
+    // The number of queries and the position of the last one, by hostname.
+    std::unordered_map<std::string, std::pair<int, size_t>> counts;
+    const auto records = mQueue.copy();
+    for (size_t i = 0; i < records.size(); i++) {
+        const Record& record = records[i];
+        if (record.networkSignature != networkSignature || record.hostname.empty()) continue;
+        auto& [count, last] = counts[record.hostname];
+        count++;
+        last = i;
+    }
+
+    std::vector<std::pair<std::pair<int, size_t>, std::string>> ranked;
+    ranked.reserve(counts.size());
+    for (auto& [hostname, count] : counts) {
+        ranked.emplace_back(count, hostname);
+    }
+    n = std::min(n, ranked.size());
+    std::partial_sort(ranked.begin(), ranked.begin() + n, ranked.end(), std::greater<>());
+
+    std::vector<std::string> hostnames;
+    hostnames.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+        hostnames.push_back(std::move(ranked[i].second));
+    }
+    return hostnames;
+}
+
 }  // namespace android::net
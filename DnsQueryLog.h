@@ -33,13 +33,15 @@ class DnsQueryLog {
 
     struct Record {
         Record(uint32_t netId, uid_t uid, pid_t pid, const std::string& hostname,
-               const std::vector<std::string>& addrs, int timeTaken)
+               const std::vector<std::string>& addrs, int timeTaken,
+               uint64_t networkSignature = 0)
             : netId(netId),
               uid(uid),
               pid(pid),
               hostname(hostname),
               addrs(addrs),
-              timeTaken(timeTaken) {}
+              timeTaken(timeTaken),
+              networkSignature(networkSignature) {}
         const uint32_t netId;
         const uid_t uid;
         const pid_t pid;
@@ -47,6 +49,9 @@ class DnsQueryLog {
         const std::string hostname;
         const std::vector<std::string> addrs;
         const int timeTaken;
+        // Identifies the network across netIds, see resolv_get_network_signature(). 0 if the
+        // network wasn't configured.
+        const uint64_t networkSignature;
     };
 
     DnsQueryLog() : DnsQueryLog(getLogSizeFromSysProp()) {}
@@ -57,6 +62,10 @@ class DnsQueryLog {
     void push(Record&& record);
     void dump(netdutils::DumpWriter& dw) const;
 
+    // Return at most |n| hostnames queried on the networks with |networkSignature|, the most
+    // frequently queried first, and the most recently queried first among equals.
+    std::vector<std::string> topHostnames(uint64_t networkSignature, size_t n) const;
+
   private:
     LockedRingBuffer<Record> mQueue;
 
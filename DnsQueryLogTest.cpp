@@ -16,6 +16,7 @@
 
 #include <regex>
 #include <thread>
+#include <tuple>
 
 #include <android-base/strings.h>
 #include <android-base/test_utils.h>
@@ -174,4 +175,38 @@ TEST_F(DnsQueryLogTest, InvalidSizeCustomization) {
     }
 }
 
+TEST_F(DnsQueryLogTest, TopHostnames) {
+    const uint64_t signature = 0x1234;
+    DnsQueryLog queryLog;
+    for (const auto& [netId, hostname, networkSignature] :
+         std::vector<std::tuple<uint32_t, std::string, uint64_t>>{
+                 {30, "a.example.com", signature},
+                 {30, "b.example.com", signature},
+                 {30, "c.example.com", signature},
+                 {30, "b.example.com", signature},
+                 {31, "d.example.com", 0x5678},     // Another network.
+                 {31, "d.example.com", 0x5678},
+                 {32, "", signature},               // Empty hostname.
+                 {32, "", signature},
+                 {32, "a.example.com", signature},  // The same network after a reconnect.
+                 {32, "e.example.com", signature},
+         }) {
+        queryLog.push(DnsQueryLog::Record(netId, 1000, 1000, hostname, serversV4, 10,
+                                          networkSignature));
+    }
+
+    // Most frequently queried first, then most recently queried first.
+    EXPECT_EQ(queryLog.topHostnames(signature, 10),
+              std::vector<std::string>(
+                      {"a.example.com", "b.example.com", "e.example.com", "c.example.com"}));
+    EXPECT_EQ(queryLog.topHostnames(signature, 3),
+              std::vector<std::string>({"a.example.com", "b.example.com", "e.example.com"}));
+    EXPECT_EQ(queryLog.topHostnames(0x5678, 10), std::vector<std::string>({"d.example.com"}));
+    EXPECT_TRUE(queryLog.topHostnames(signature, 0).empty());
+
+    // Networks which aren't configured yet have no signature.
+    queryLog.push(DnsQueryLog::Record(33, 1000, 1000, "f.example.com", serversV4, 10));
+    EXPECT_TRUE(queryLog.topHostnames(0, 10).empty());
+}
+
 }  // namespace android::net
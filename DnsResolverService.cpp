@@ -118,6 +118,7 @@ binder_status_t DnsResolverService::dump(int fd, const char** args, uint32_t num
 
     PrivateDnsConfiguration::getInstance().dump(dw);
     Experiments::getInstance()->dump(dw);
+    DnsProxyListener::dump(dw);
     return STATUS_OK;
 }
 
@@ -48,6 +48,17 @@ class Experiments {
     mutable std::mutex mMutex;
     std::map<std::string_view, int> mFlagsMapInt GUARDED_BY(mMutex);
     static constexpr const char* const kExperimentFlagKeyList[] = {
+            "async_engine_threads",
+            "cache_eviction_policy",
+            "cache_hit_fast_path",
+            "cache_prefetch_min_hits",
+            "cache_prefetch_ttl_percent",
+            "cache_rrsets",
+            "cache_sharing",
+            "cache_snapshot_interval_seconds",
+            "cache_uid_quota_percent",
+            "cache_warm_up_concurrency",
+            "cache_warm_up_names",
             "doh_early_data",
             "doh_idle_timeout_ms",
             "doh_probe_timeout_ms",
@@ -63,13 +74,20 @@ class Experiments {
             "dot_validation_latency_offset_ms",
             "dot_xport_unusable_threshold",
             "fail_fast_on_uid_network_blocking",
+            "getaddrinfo_coalescing",
+            "handler_queue_size",
+            "handler_threads",
             "keep_listening_udp",
+            "max_cache_bytes",
+            "max_cache_bytes_global",
             "max_cache_entries",
             "max_queries_global",
             "mdns_resolution",
             "parallel_lookup_sleep_time",
             "retransmission_time_interval",
             "retry_count",
+            "serve_stale_max_age_seconds",
+            "serve_stale_ttl_seconds",
             "sort_nameservers",
     };
     // This value is used in updateInternal as the default value if any flags can't be found.
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "FrequencySketch.h"
+
+#include <algorithm>
+
+namespace android::net {
+
+namespace {
+
+// Odd multipliers scrambling the key hash differently for each row.
+constexpr uint32_t kSeeds[FrequencySketch::kRows] = {
+        0x9E3779B1U,
+        0x85EBCA77U,
+        0xC2B2AE3DU,
+        0x27D4EB2FU,
+};
+
+}  // namespace
+
+FrequencySketch::FrequencySketch(size_t capacity) {
+    // A power of two no smaller than the capacity, so that rows are indexed by hash bits.
+    mWidth = 2;
+    mShift = 31;
+    while (mWidth < capacity) {
+        mWidth *= 2;
+        mShift--;
+    }
+    mSampleSize = 10 * mWidth;
+    mCounters = std::make_unique<std::atomic<uint8_t>[]>(kRows * mWidth);
+    clear();
+}
+
+size_t FrequencySketch::index(uint32_t hash, int row) const {
+    return row * mWidth + ((hash * kSeeds[row]) >> mShift);
+}
+
+void FrequencySketch::increment(uint32_t hash) {
+    bool added = false;
+    for (int row = 0; row < kRows; row++) {
+        std::atomic<uint8_t>& counter = mCounters[index(hash, row)];
+        const uint8_t count = counter.load(std::memory_order_relaxed);
+        if (count < kMaxFrequency) {
+            counter.store(count + 1, std::memory_order_relaxed);
+            added = true;
+        }
+    }
+    if (added && mAdditions.fetch_add(1, std::memory_order_relaxed) + 1 == mSampleSize) {
+        age();
+    }
+}
+
+uint8_t FrequencySketch::frequency(uint32_t hash) const {
+    uint8_t frequency = kMaxFrequency;
+    for (int row = 0; row < kRows; row++) {
+        frequency = std::min(frequency, mCounters[index(hash, row)].load(std::memory_order_relaxed));
+    }
+    return frequency;
+}
+
+void FrequencySketch::age() {
+    for (size_t i = 0; i < kRows * mWidth; i++) {
+        mCounters[i].store(mCounters[i].load(std::memory_order_relaxed) / 2,
+                           std::memory_order_relaxed);
+    }
+    mAdditions.fetch_sub(mSampleSize / 2, std::memory_order_relaxed);
+}
+
+void FrequencySketch::clear() {
+    for (size_t i = 0; i < kRows * mWidth; i++) {
+        mCounters[i].store(0, std::memory_order_relaxed);
+    }
+    mAdditions.store(0, std::memory_order_relaxed);
+}
+
+}  // namespace android::net
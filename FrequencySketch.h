@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace android::net {
+
+// A count-min sketch estimating how often keys have been seen recently, as used by the
+// TinyLFU cache admission policy.
+//
+// Each key is counted in one counter per row, picked by a different hash of the key, and its
+// estimated frequency is the minimum of these counters. Counters saturate at kMaxFrequency.
+// After 10 increments per counter of a row, all the counters are halved, so that the sketch
+// forgets about keys which aren't popular any more.
+//
+// increment() and frequency() may be called concurrently. The counts are approximate anyway,
+// so concurrent increments of the same counter may be lost.
+class FrequencySketch {
+  public:
+    static constexpr int kRows = 4;
+    static constexpr uint8_t kMaxFrequency = 15;
+
+    // Creates a sketch for a cache holding about |capacity| keys.
+    explicit FrequencySketch(size_t capacity);
+
+    FrequencySketch(const FrequencySketch&) = delete;
+    FrequencySketch& operator=(const FrequencySketch&) = delete;
+
+    // Counts one occurrence of the key hashed to |hash|.
+    void increment(uint32_t hash);
+
+    // Returns the estimated number of recent occurrences of the key hashed to |hash|.
+    uint8_t frequency(uint32_t hash) const;
+
+    // Forgets all the keys.
+    void clear();
+
+    size_t width() const { return mWidth; }
+
+  private:
+    size_t index(uint32_t hash, int row) const;
+    void age();
+
+    size_t mWidth;
+    int mShift;
+    size_t mSampleSize;
+    std::unique_ptr<std::atomic<uint8_t>[]> mCounters;
+    std::atomic<size_t> mAdditions = 0;
+};
+
+}  // namespace android::net
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "FrequencySketch.h"
+
+#include <gtest/gtest.h>
+#include <netdutils/NetNativeTestBase.h>
+
+namespace android::net {
+
+class FrequencySketchTest : public NetNativeTestBase {};
+
+TEST_F(FrequencySketchTest, CountsOccurrences) {
+    FrequencySketch sketch(100);
+    EXPECT_EQ(128U, sketch.width());
+    EXPECT_EQ(0, sketch.frequency(42));
+
+    for (int i = 1; i <= 5; i++) {
+        sketch.increment(42);
+        EXPECT_EQ(i, sketch.frequency(42));
+    }
+    EXPECT_EQ(0, sketch.frequency(43));
+}
+
+TEST_F(FrequencySketchTest, Saturates) {
+    FrequencySketch sketch(100);
+    for (int i = 0; i < 100; i++) {
+        sketch.increment(42);
+    }
+    EXPECT_EQ(FrequencySketch::kMaxFrequency, sketch.frequency(42));
+}
+
+TEST_F(FrequencySketchTest, Ages) {
+    FrequencySketch sketch(16);
+    for (int i = 0; i < FrequencySketch::kMaxFrequency; i++) {
+        sketch.increment(42);
+    }
+    EXPECT_EQ(FrequencySketch::kMaxFrequency, sketch.frequency(42));
+
+    // After about 10 increments per counter of a row, all the counters are halved. Other keys
+    // may share counters with 42, but its counters are saturated, so they are all halved to 7.
+    uint32_t hash = 1000;
+    while (sketch.frequency(42) == FrequencySketch::kMaxFrequency &&
+           hash < 1000 + 20 * sketch.width()) {
+        sketch.increment(hash++);
+    }
+    EXPECT_EQ(7, sketch.frequency(42));
+}
+
+TEST_F(FrequencySketchTest, Clear) {
+    FrequencySketch sketch(100);
+    sketch.increment(42);
+    sketch.clear();
+    EXPECT_EQ(0, sketch.frequency(42));
+}
+
+}  // namespace android::net
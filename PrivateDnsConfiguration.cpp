@@ -197,6 +197,34 @@ PrivateDnsStatus PrivateDnsConfiguration::getStatus(unsigned netId) const {
     return getStatusLocked(netId);
 }
 
+PrivateDnsMode PrivateDnsConfiguration::getMode(unsigned netId) const {
+    std::lock_guard guard(mPrivateDnsLock);
+    const auto mode = mPrivateDnsModes.find(netId);
+    return (mode == mPrivateDnsModes.end()) ? PrivateDnsMode::OFF : mode->second;
+}
+
+bool PrivateDnsConfiguration::queryingViaTls(unsigned netId) const {
+    std::lock_guard guard(mPrivateDnsLock);
+    const auto mode = mPrivateDnsModes.find(netId);
+    if (mode == mPrivateDnsModes.end()) return false;
+    switch (mode->second) {
+        case PrivateDnsMode::STRICT:
+            return true;
+        case PrivateDnsMode::OPPORTUNISTIC: {
+            const auto netPair = mDotTracker.find(netId);
+            if (netPair == mDotTracker.end()) return false;
+            for (const auto& [_, server] : netPair->second) {
+                if (server.active() && server.validationState() == Validation::success) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        default:
+            return false;
+    }
+}
+
 PrivateDnsStatus PrivateDnsConfiguration::getStatusLocked(unsigned netId) const {
     PrivateDnsStatus status{
             .mode = PrivateDnsMode::OFF,
@@ -109,6 +109,12 @@ class PrivateDnsConfiguration {
     void initDoh() EXCLUDES(mPrivateDnsLock);
 
     PrivateDnsStatus getStatus(unsigned netId) const EXCLUDES(mPrivateDnsLock);
+
+    // Like getStatus().mode, without copying the servers.
+    PrivateDnsMode getMode(unsigned netId) const EXCLUDES(mPrivateDnsLock);
+    // Whether the queries on |netId| go over DNS-over-TLS: in strict mode, or in opportunistic
+    // mode once a DoT server is validated. Also without copying the servers.
+    bool queryingViaTls(unsigned netId) const EXCLUDES(mPrivateDnsLock);
     NetworkDnsServerSupportReported getStatusForMetrics(unsigned netId) const
             EXCLUDES(mPrivateDnsLock);
 
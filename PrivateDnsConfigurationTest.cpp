@@ -119,6 +119,11 @@ class PrivateDnsConfigurationTest : public NetNativeTestBase {
     bool checkPrivateDnsStatus(PrivateDnsMode mode) {
         const PrivateDnsStatus status = mPdc.getStatus(kNetId);
         if (status.mode != mode) return false;
+        if (mPdc.getMode(kNetId) != mode) return false;
+        const bool viaTls = (mode == PrivateDnsMode::STRICT) ||
+                            (mode == PrivateDnsMode::OPPORTUNISTIC &&
+                             !status.validatedServers().empty());
+        if (mPdc.queryingViaTls(kNetId) != viaTls) return false;
 
         std::map<std::string, Validation> serverStateMap;
         for (const auto& [server, validation] : status.dotServersMap) {
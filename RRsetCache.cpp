@@ -0,0 +1,223 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "resolv"
+
+#include "RRsetCache.h"
+
+#include <arpa/nameser.h>
+#include <ctype.h>
+#include <netinet/in.h>
+#include <string.h>
+
+#include <algorithm>
+#include <iterator>
+#include <utility>
+
+#include "res_comp.h"
+
+namespace android::net {
+
+namespace {
+
+// The RDATA of A and AAAA records has no domain name, so it can be copied as is. The target
+// of CNAME records is expanded.
+bool isCachedType(uint16_t type) {
+    return type == ns_t_cname || type == ns_t_a || type == ns_t_aaaa;
+}
+
+// Writes the owner name, type, class and TTL of a record at |p|. Returns the position of its
+// RDATA length, or nullptr if the record doesn't fit before |end|.
+uint8_t* putRecordHeader(uint8_t* p, const uint8_t* end, const std::string& name, uint16_t type,
+                         uint32_t ttl, uint8_t** dnptrs, uint8_t** lastdnptr) {
+    const int n = dn_comp(name.c_str(), p, end - p, dnptrs, lastdnptr);
+    if (n < 0 || end - p - n < RRFIXEDSZ) return nullptr;
+    p += n;
+    ns_put16(type, p);
+    ns_put16(ns_c_in, p + INT16SZ);
+    ns_put32(ttl, p + 2 * INT16SZ);
+    return p + 2 * INT16SZ + INT32SZ;
+}
+
+}  // namespace
+
+RRsetCache::RRsetCache(size_t maxRRsets) : mMaxRRsets(maxRRsets) {}
+
+void RRsetCache::add(std::span<const uint8_t> answer, time_t now) {
+    ns_msg handle;
+    ns_rr rr;
+    if (ns_initparse(answer.data(), answer.size(), &handle) < 0 ||
+        ns_msg_getflag(handle, ns_f_rcode) != ns_r_noerror || ns_msg_getflag(handle, ns_f_tc) ||
+        ns_msg_count(handle, ns_s_qd) != 1 || ns_parserr(&handle, ns_s_qd, 0, &rr) < 0 ||
+        ns_rr_class(rr) != ns_c_in) {
+        return;
+    }
+    const uint16_t qtype = ns_rr_type(rr);
+    std::string name = ns_rr_name(rr);
+
+    // Group the records of the answer section into RRsets.
+    std::unordered_map<std::string, RRset> rrsets;
+    for (int i = 0; i < ns_msg_count(handle, ns_s_an); i++) {
+        if (ns_parserr(&handle, ns_s_an, i, &rr) < 0) return;
+        const uint16_t type = ns_rr_type(rr);
+        if (ns_rr_class(rr) != ns_c_in || !isCachedType(type)) continue;
+
+        const time_t expires = now + ns_rr_ttl(rr);
+        auto [it, inserted] = rrsets.try_emplace(key(ns_rr_name(rr), type), RRset{});
+        RRset& rrset = it->second;
+        rrset.expires = inserted ? expires : std::min(rrset.expires, expires);
+        if (type == ns_t_cname) {
+            char target[NS_MAXDNAME];
+            if (dn_expand(ns_msg_base(handle), ns_msg_end(handle), ns_rr_rdata(rr), target,
+                          sizeof(target)) < 0) {
+                return;
+            }
+            rrset.target = target;
+        } else {
+            rrset.rdata.emplace_back(ns_rr_rdata(rr), ns_rr_rdata(rr) + ns_rr_rdlen(rr));
+        }
+    }
+
+    // Only keep the RRsets of the CNAME chain from the question.
+    for (int i = 0; i <= kMaxCnameChain; i++) {
+        if (qtype != ns_t_cname) {
+            if (auto it = rrsets.find(key(name, qtype)); it != rrsets.end()) {
+                if (it->second.expires > now) insert(it->first, std::move(it->second));
+                return;
+            }
+        }
+        auto it = rrsets.find(key(name, ns_t_cname));
+        if (it == rrsets.end()) return;
+        name = it->second.target;
+        if (it->second.expires > now) insert(it->first, std::move(it->second));
+    }
+}
+
+size_t RRsetCache::synthesize(std::span<const uint8_t> query, std::span<uint8_t> answer,
+                              time_t now) {
+    ns_msg handle;
+    ns_rr rr;
+    if (ns_initparse(query.data(), query.size(), &handle) < 0 ||
+        ns_msg_getflag(handle, ns_f_opcode) != ns_o_query || ns_msg_count(handle, ns_s_qd) != 1 ||
+        ns_parserr(&handle, ns_s_qd, 0, &rr) < 0 || ns_rr_class(rr) != ns_c_in) {
+        return 0;
+    }
+    const uint16_t qtype = ns_rr_type(rr);
+    if (qtype != ns_t_a && qtype != ns_t_aaaa) return 0;
+    const std::string qname = ns_rr_name(rr);
+
+    // Synthesized answers can't carry the signatures asked for by the DO bit.
+    for (int i = 0; i < ns_msg_count(handle, ns_s_ar); i++) {
+        if (ns_parserr(&handle, ns_s_ar, i, &rr) < 0) return 0;
+        if (ns_rr_type(rr) == ns_t_opt && (ns_rr_ttl(rr) & NS_OPT_DNSSEC_OK)) return 0;
+    }
+
+    // The CNAME RRsets with their owner names, then the RRset of the query type.
+    std::vector<std::pair<std::string, const RRset*>> cnames;
+    std::string name = qname;
+    const RRset* rrset = nullptr;
+    for (int i = 0; i <= kMaxCnameChain; i++) {
+        rrset = find(name, qtype, now);
+        if (rrset != nullptr) break;
+        const RRset* cname = find(name, ns_t_cname, now);
+        if (cname == nullptr) return 0;
+        cnames.emplace_back(name, cname);
+        name = cname->target;
+    }
+    if (rrset == nullptr) return 0;
+
+    if (answer.size() < HFIXEDSZ) return 0;
+    uint8_t* const begin = answer.data();
+    const uint8_t* const end = begin + answer.size();
+    const HEADER* qhp = reinterpret_cast<const HEADER*>(query.data());
+    HEADER* hp = reinterpret_cast<HEADER*>(begin);
+    memset(hp, 0, HFIXEDSZ);
+    hp->id = qhp->id;
+    hp->qr = 1;
+    hp->opcode = ns_o_query;
+    hp->rd = qhp->rd;
+    hp->ra = 1;
+    hp->rcode = ns_r_noerror;
+    hp->qdcount = htons(1);
+    hp->ancount = htons(cnames.size() + rrset->rdata.size());
+
+    uint8_t* dnptrs[20] = {begin, nullptr};
+    uint8_t** lastdnptr = dnptrs + std::size(dnptrs);
+    uint8_t* p = begin + HFIXEDSZ;
+    const int n = dn_comp(qname.c_str(), p, end - p, dnptrs, lastdnptr);
+    if (n < 0 || end - p - n < QFIXEDSZ) return 0;
+    p += n;
+    ns_put16(qtype, p);
+    ns_put16(ns_c_in, p + INT16SZ);
+    p += QFIXEDSZ;
+
+    for (const auto& [owner, cname] : cnames) {
+        uint8_t* rdlength =
+                putRecordHeader(p, end, owner, ns_t_cname, cname->expires - now, dnptrs, lastdnptr);
+        if (rdlength == nullptr) return 0;
+        p = rdlength + INT16SZ;
+        const int n = dn_comp(cname->target.c_str(), p, end - p, dnptrs, lastdnptr);
+        if (n < 0) return 0;
+        ns_put16(n, rdlength);
+        p += n;
+    }
+    for (const std::vector<uint8_t>& rdata : rrset->rdata) {
+        uint8_t* rdlength =
+                putRecordHeader(p, end, name, qtype, rrset->expires - now, dnptrs, lastdnptr);
+        if (rdlength == nullptr ||
+            end - rdlength - INT16SZ < static_cast<ptrdiff_t>(rdata.size())) {
+            return 0;
+        }
+        ns_put16(rdata.size(), rdlength);
+        p = std::copy(rdata.begin(), rdata.end(), rdlength + INT16SZ);
+    }
+    return p - begin;
+}
+
+std::string RRsetCache::key(std::string_view name, uint16_t type) {
+    std::string key = std::to_string(type) + "/";
+    std::transform(name.begin(), name.end(), std::back_inserter(key),
+                   [](unsigned char c) { return tolower(c); });
+    return key;
+}
+
+const RRsetCache::RRset* RRsetCache::find(std::string_view name, uint16_t type, time_t now) {
+    const auto it = mRRsets.find(key(name, type));
+    if (it == mRRsets.end()) return nullptr;
+    if (now >= it->second.expires) {
+        mLru.erase(it->second.lru);
+        mRRsets.erase(it);
+        return nullptr;
+    }
+    mLru.splice(mLru.begin(), mLru, it->second.lru);
+    return &it->second;
+}
+
+void RRsetCache::insert(std::string key, RRset rrset) {
+    if (auto it = mRRsets.find(key); it != mRRsets.end()) {
+        mLru.erase(it->second.lru);
+        mRRsets.erase(it);
+    }
+    mLru.push_front(key);
+    rrset.lru = mLru.begin();
+    mRRsets.emplace(std::move(key), std::move(rrset));
+    while (mRRsets.size() > mMaxRRsets) {
+        mRRsets.erase(mLru.back());
+        mLru.pop_back();
+    }
+}
+
+}  // namespace android::net
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <time.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace android::net {
+
+// A cache of the RRsets found in DNS answers, from which answers to queries that were never
+// asked can be synthesized. For example, once www.example.com, a CNAME of example.cdn.net, has
+// been resolved, the A records of example.cdn.net answer the queries for the other names which
+// are CNAMEs of it.
+//
+// Only the CNAME, A and AAAA RRsets of class IN on the CNAME chain from the question of an
+// answer are cached, so that an answer can't plant records for unrelated names. Each RRset
+// expires with its own TTL, and the least recently used ones are evicted first.
+//
+// This class is not thread-safe.
+class RRsetCache {
+  public:
+    // The maximum number of CNAME records followed from the question.
+    static constexpr int kMaxCnameChain = 8;
+
+    // Creates a cache holding up to |maxRRsets| RRsets.
+    explicit RRsetCache(size_t maxRRsets);
+
+    RRsetCache(const RRsetCache&) = delete;
+    RRsetCache& operator=(const RRsetCache&) = delete;
+
+    // Caches the RRsets of the CNAME chain answering the question of |answer|, a NOERROR
+    // response received at |now|.
+    void add(std::span<const uint8_t> answer, time_t now);
+
+    // Synthesizes an answer to |query| into |answer| from the RRsets cached at |now|, following
+    // the CNAME chain from its question. Returns the length of the answer, or 0 if an RRset of
+    // the chain is missing or the answer doesn't fit. Only A and AAAA queries are answered.
+    size_t synthesize(std::span<const uint8_t> query, std::span<uint8_t> answer, time_t now);
+
+    size_t size() const { return mRRsets.size(); }
+
+  private:
+    struct RRset {
+        time_t expires;
+        // The target of a CNAME RRset, which has only one record.
+        std::string target;
+        // The RDATA of the records of other RRsets.
+        std::vector<std::vector<uint8_t>> rdata;
+        // Position in mLru.
+        std::list<std::string>::iterator lru;
+    };
+
+    // Returns the key of the RRset of |type| owned by |name|, in presentation format.
+    static std::string key(std::string_view name, uint16_t type);
+
+    // Returns the RRset of |type| owned by |name|, or nullptr if it isn't cached or expired.
+    const RRset* find(std::string_view name, uint16_t type, time_t now);
+
+    void insert(std::string key, RRset rrset);
+
+    const size_t mMaxRRsets;
+    std::unordered_map<std::string, RRset> mRRsets;
+    // The keys of mRRsets, most recently used first.
+    std::list<std::string> mLru;
+};
+
+}  // namespace android::net
@@ -0,0 +1,230 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "RRsetCache.h"
+
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+
+#include <string>
+#include <vector>
+
+#include <gmock/gmock-matchers.h>
+#include <gtest/gtest.h>
+#include <netdutils/NetNativeTestBase.h>
+
+#include "res_comp.h"
+#include "res_debug.h"
+#include "tests/dns_responder/dns_responder.h"
+
+using testing::ElementsAre;
+
+namespace android::net {
+
+namespace {
+
+constexpr time_t kNow = 1000;
+
+test::DNSRecord makeRecord(const std::string& name, ns_type type, const std::string& rdata,
+                           unsigned ttl) {
+    test::DNSRecord record{.name = {.name = name}, .rtype = type, .rclass = ns_c_in, .ttl = ttl};
+    EXPECT_TRUE(test::DNSResponder::fillRdata(rdata, record));
+    return record;
+}
+
+std::vector<uint8_t> makeQuery(const std::string& name, ns_type type, bool dnssecOk = false) {
+    test::DNSHeader header{
+            .id = 0x1234,
+            .rd = true,
+            .questions = {{.qname = {.name = name}, .qtype = type, .qclass = ns_c_in}},
+    };
+    if (dnssecOk) {
+        header.additionals.push_back({.rtype = ns_t_opt, .rclass = 4096, .ttl = NS_OPT_DNSSEC_OK});
+    }
+    std::vector<uint8_t> query;
+    EXPECT_TRUE(header.write(&query));
+    return query;
+}
+
+std::vector<uint8_t> makeAnswer(const std::string& name, ns_type type,
+                                std::vector<test::DNSRecord> records,
+                                ns_rcode rcode = ns_r_noerror) {
+    test::DNSHeader header{
+            .id = 0x1234,
+            .ra = true,
+            .rcode = rcode,
+            .qr = true,
+            .rd = true,
+            .questions = {{.qname = {.name = name}, .qtype = type, .qclass = ns_c_in}},
+            .answers = std::move(records),
+    };
+    std::vector<uint8_t> answer;
+    EXPECT_TRUE(header.write(&answer));
+    return answer;
+}
+
+// Returns the records of the answer section of |answer|, as "name type ttl rdata".
+std::vector<std::string> answerRecords(std::span<const uint8_t> answer) {
+    ns_msg handle;
+    if (ns_initparse(answer.data(), answer.size(), &handle) < 0) {
+        ADD_FAILURE() << "Malformed answer";
+        return {};
+    }
+    std::vector<std::string> records;
+    for (int i = 0; i < ns_msg_count(handle, ns_s_an); i++) {
+        ns_rr rr;
+        EXPECT_EQ(0, ns_parserr(&handle, ns_s_an, i, &rr));
+        char rdata[NS_MAXDNAME] = {};
+        if (ns_rr_type(rr) == ns_t_cname) {
+            dn_expand(ns_msg_base(handle), ns_msg_end(handle), ns_rr_rdata(rr), rdata,
+                      sizeof(rdata));
+        } else {
+            inet_ntop(ns_rr_type(rr) == ns_t_a ? AF_INET : AF_INET6, ns_rr_rdata(rr), rdata,
+                      sizeof(rdata));
+        }
+        records.push_back(std::string(ns_rr_name(rr)) + " " + p_type(ns_rr_type(rr)) + " " +
+                          std::to_string(ns_rr_ttl(rr)) + " " + rdata);
+    }
+    return records;
+}
+
+}  // namespace
+
+class RRsetCacheTest : public NetNativeTestBase {};
+
+TEST_F(RRsetCacheTest, SynthesizesCnameChain) {
+    RRsetCache cache(100);
+    cache.add(makeAnswer("www.example.com.", ns_t_a,
+                         {makeRecord("www.example.com.", ns_t_cname, "cdn.example.net.", 300),
+                          makeRecord("cdn.example.net.", ns_t_a, "192.0.2.1", 60),
+                          makeRecord("cdn.example.net.", ns_t_a, "192.0.2.2", 30)}),
+              kNow);
+    cache.add(makeAnswer("alias.example.org.", ns_t_aaaa,
+                         {makeRecord("alias.example.org.", ns_t_cname, "cdn.example.net.", 100),
+                          makeRecord("cdn.example.net.", ns_t_aaaa, "2001:db8::1", 100)}),
+              kNow);
+    EXPECT_EQ(4U, cache.size());
+
+    // The A query of alias.example.org was never answered, but its CNAME and the A RRset of
+    // the target were. Each RRset has its own TTL, the lowest of its records.
+    std::vector<uint8_t> answer(NS_PACKETSZ);
+    size_t len = cache.synthesize(makeQuery("Alias.Example.org.", ns_t_a), answer, kNow + 10);
+    ASSERT_GT(len, 0U);
+    answer.resize(len);
+    EXPECT_THAT(answerRecords(answer), ElementsAre("Alias.Example.org CNAME 90 cdn.example.net",
+                                                   "cdn.example.net A 20 192.0.2.1",
+                                                   "cdn.example.net A 20 192.0.2.2"));
+
+    ns_msg handle;
+    ns_rr question;
+    ASSERT_EQ(0, ns_initparse(answer.data(), answer.size(), &handle));
+    EXPECT_EQ(0x1234, ns_msg_id(handle));
+    EXPECT_EQ(1, ns_msg_getflag(handle, ns_f_qr));
+    EXPECT_EQ(1, ns_msg_getflag(handle, ns_f_rd));
+    EXPECT_EQ(ns_r_noerror, ns_msg_getflag(handle, ns_f_rcode));
+    ASSERT_EQ(1, ns_msg_count(handle, ns_s_qd));
+    ASSERT_EQ(0, ns_parserr(&handle, ns_s_qd, 0, &question));
+    EXPECT_STREQ("Alias.Example.org", ns_rr_name(question));
+    EXPECT_EQ(ns_t_a, ns_rr_type(question));
+
+    // The target itself.
+    answer.resize(NS_PACKETSZ);
+    len = cache.synthesize(makeQuery("cdn.example.net.", ns_t_aaaa), answer, kNow + 10);
+    ASSERT_GT(len, 0U);
+    answer.resize(len);
+    EXPECT_THAT(answerRecords(answer), ElementsAre("cdn.example.net AAAA 90 2001:db8::1"));
+
+    // The chain is incomplete.
+    answer.resize(NS_PACKETSZ);
+    EXPECT_EQ(0U, cache.synthesize(makeQuery("www.example.com.", ns_t_mx), answer, kNow));
+    EXPECT_EQ(0U, cache.synthesize(makeQuery("other.example.com.", ns_t_a), answer, kNow));
+}
+
+TEST_F(RRsetCacheTest, ExpiresRRsetsSeparately) {
+    RRsetCache cache(100);
+    cache.add(makeAnswer("www.example.com.", ns_t_a,
+                         {makeRecord("www.example.com.", ns_t_cname, "cdn.example.net.", 300),
+                          makeRecord("cdn.example.net.", ns_t_a, "192.0.2.1", 10)}),
+              kNow);
+    cache.add(makeAnswer("www.example.com.", ns_t_aaaa,
+                         {makeRecord("www.example.com.", ns_t_cname, "cdn.example.net.", 300),
+                          makeRecord("cdn.example.net.", ns_t_aaaa, "2001:db8::1", 300)}),
+              kNow);
+
+    std::vector<uint8_t> answer(NS_PACKETSZ);
+    EXPECT_GT(cache.synthesize(makeQuery("www.example.com.", ns_t_a), answer, kNow + 9), 0U);
+    EXPECT_EQ(0U, cache.synthesize(makeQuery("www.example.com.", ns_t_a), answer, kNow + 10));
+    EXPECT_GT(cache.synthesize(makeQuery("www.example.com.", ns_t_aaaa), answer, kNow + 10), 0U);
+    EXPECT_EQ(2U, cache.size());
+}
+
+TEST_F(RRsetCacheTest, OnlyCachesTheCnameChain) {
+    RRsetCache cache(100);
+    // Records unrelated to the question.
+    cache.add(makeAnswer("www.example.com.", ns_t_a,
+                         {makeRecord("www.example.com.", ns_t_a, "192.0.2.1", 300),
+                          makeRecord("bank.example.net.", ns_t_a, "192.0.2.66", 300)}),
+              kNow);
+    // Errors and records with a zero TTL.
+    cache.add(makeAnswer("nx.example.com.", ns_t_a,
+                         {makeRecord("nx.example.com.", ns_t_a, "192.0.2.2", 300)}, ns_r_nxdomain),
+              kNow);
+    cache.add(makeAnswer("zero.example.com.", ns_t_a,
+                         {makeRecord("zero.example.com.", ns_t_a, "192.0.2.3", 0)}),
+              kNow);
+    EXPECT_EQ(1U, cache.size());
+
+    std::vector<uint8_t> answer(NS_PACKETSZ);
+    EXPECT_GT(cache.synthesize(makeQuery("www.example.com.", ns_t_a), answer, kNow), 0U);
+    EXPECT_EQ(0U, cache.synthesize(makeQuery("bank.example.net.", ns_t_a), answer, kNow));
+    EXPECT_EQ(0U, cache.synthesize(makeQuery("nx.example.com.", ns_t_a), answer, kNow));
+    EXPECT_EQ(0U, cache.synthesize(makeQuery("zero.example.com.", ns_t_a), answer, kNow));
+}
+
+TEST_F(RRsetCacheTest, DoesNotSynthesize) {
+    RRsetCache cache(100);
+    cache.add(makeAnswer("www.example.com.", ns_t_a,
+                         {makeRecord("www.example.com.", ns_t_a, "192.0.2.1", 300)}),
+              kNow);
+
+    // DNSSEC records are requested.
+    std::vector<uint8_t> answer(NS_PACKETSZ);
+    EXPECT_EQ(0U, cache.synthesize(makeQuery("www.example.com.", ns_t_a, /*dnssecOk=*/true),
+                                   answer, kNow));
+
+    // The answer doesn't fit.
+    answer.resize(HFIXEDSZ + 20);
+    EXPECT_EQ(0U, cache.synthesize(makeQuery("www.example.com.", ns_t_a), answer, kNow));
+}
+
+TEST_F(RRsetCacheTest, EvictsLeastRecentlyUsed) {
+    RRsetCache cache(2);
+    for (const char* name : {"a.example.com.", "b.example.com."}) {
+        cache.add(makeAnswer(name, ns_t_a, {makeRecord(name, ns_t_a, "192.0.2.1", 300)}), kNow);
+    }
+    std::vector<uint8_t> answer(NS_PACKETSZ);
+    EXPECT_GT(cache.synthesize(makeQuery("a.example.com.", ns_t_a), answer, kNow), 0U);
+
+    cache.add(makeAnswer("c.example.com.", ns_t_a,
+                         {makeRecord("c.example.com.", ns_t_a, "192.0.2.1", 300)}),
+              kNow);
+    EXPECT_EQ(2U, cache.size());
+    EXPECT_GT(cache.synthesize(makeQuery("a.example.com.", ns_t_a), answer, kNow), 0U);
+    EXPECT_EQ(0U, cache.synthesize(makeQuery("b.example.com.", ns_t_a), answer, kNow));
+    EXPECT_GT(cache.synthesize(makeQuery("c.example.com.", ns_t_a), answer, kNow), 0U);
+}
+
+}  // namespace android::net
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include <android-base/thread_annotations.h>
+
+namespace android::net {
+
+// Coalesces the identical requests in flight: the first caller of run() for a key computes the
+// result, and the callers asking for the same key in the meantime wait for it and share it.
+// Once computed, the result isn't kept: the next request for the key computes it again.
+//
+// This class is thread-safe.
+template <typename Key, typename Result>
+class RequestCoalescer {
+  public:
+    struct Stats {
+        // The requests which computed their result, and those which waited for another one.
+        uint64_t computed;
+        uint64_t coalesced;
+        // The keys being computed.
+        size_t inFlight;
+    };
+
+    // Returns the result of |compute|, or of the identical request in flight, in which case
+    // |compute| isn't called, and |coalesced| is set if not null.
+    std::shared_ptr<const Result> run(const Key& key, const std::function<Result()>& compute,
+                                      bool* coalesced = nullptr) EXCLUDES(mMutex) {
+        std::unique_lock lock(mMutex);
+        if (const auto it = mInFlight.find(key); it != mInFlight.end()) {
+            const std::shared_ptr<Request> request = it->second;
+            mCoalesced++;
+            request->cv.wait(lock, [&request] { return request->result != nullptr; });
+            if (coalesced != nullptr) *coalesced = true;
+            return request->result;
+        }
+        const auto request = std::make_shared<Request>();
+        mInFlight.emplace(key, request);
+        mComputed++;
+        lock.unlock();
+
+        auto result = std::make_shared<const Result>(compute());
+
+        lock.lock();
+        request->result = result;
+        mInFlight.erase(key);
+        lock.unlock();
+        request->cv.notify_all();
+        if (coalesced != nullptr) *coalesced = false;
+        return result;
+    }
+
+    Stats getStats() const EXCLUDES(mMutex) {
+        std::lock_guard guard(mMutex);
+        return {.computed = mComputed, .coalesced = mCoalesced, .inFlight = mInFlight.size()};
+    }
+
+  private:
+    struct Request {
+        std::condition_variable cv;
+        // Set once computed.
+        std::shared_ptr<const Result> result;
+    };
+
+    mutable std::mutex mMutex;
+    std::map<Key, std::shared_ptr<Request>> mInFlight GUARDED_BY(mMutex);
+    uint64_t mComputed GUARDED_BY(mMutex) = 0;
+    uint64_t mCoalesced GUARDED_BY(mMutex) = 0;
+};
+
+}  // namespace android::net
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "RequestCoalescer.h"
+
+#include <atomic>
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <netdutils/NetNativeTestBase.h>
+
+namespace android::net {
+
+class RequestCoalescerTest : public NetNativeTestBase {};
+
+TEST_F(RequestCoalescerTest, CoalescesIdenticalRequests) {
+    constexpr int kWaiters = 8;
+    RequestCoalescer<std::string, int> coalescer;
+    std::atomic<int> computations = 0;
+    std::promise<void> release;
+    std::shared_future<void> released = release.get_future().share();
+    const auto compute = [&] {
+        computations++;
+        released.wait();
+        return 42;
+    };
+
+    std::vector<std::future<std::pair<std::shared_ptr<const int>, bool>>> results;
+    for (int i = 0; i < kWaiters + 1; i++) {
+        results.push_back(std::async(std::launch::async, [&] {
+            bool coalesced = false;
+            std::shared_ptr<const int> result = coalescer.run("example.com", compute, &coalesced);
+            return std::make_pair(result, coalesced);
+        }));
+    }
+    // Another key isn't coalesced with them.
+    EXPECT_EQ(7, *coalescer.run("other.example.com", [] { return 7; }));
+
+    while (coalescer.getStats().coalesced < kWaiters) {
+        std::this_thread::yield();
+    }
+    EXPECT_EQ(1U, coalescer.getStats().inFlight);
+    release.set_value();
+
+    std::shared_ptr<const int> first;
+    int coalesced = 0;
+    for (auto& f : results) {
+        const auto [result, wasCoalesced] = f.get();
+        if (first == nullptr) first = result;
+        // All the requests share the same result.
+        EXPECT_EQ(first, result);
+        EXPECT_EQ(42, *result);
+        coalesced += wasCoalesced;
+    }
+    EXPECT_EQ(kWaiters, coalesced);
+    EXPECT_EQ(1, computations);
+
+    const auto stats = coalescer.getStats();
+    EXPECT_EQ(2U, stats.computed);
+    EXPECT_EQ(uint64_t{kWaiters}, stats.coalesced);
+    EXPECT_EQ(0U, stats.inFlight);
+}
+
+TEST_F(RequestCoalescerTest, DoesNotKeepResults) {
+    RequestCoalescer<int, int> coalescer;
+    int computations = 0;
+    const auto compute = [&computations] { return ++computations; };
+
+    bool coalesced = true;
+    EXPECT_EQ(1, *coalescer.run(1, compute, &coalesced));
+    EXPECT_FALSE(coalesced);
+    EXPECT_EQ(2, *coalescer.run(1, compute, &coalesced));
+    EXPECT_FALSE(coalesced);
+    EXPECT_EQ(2U, coalescer.getStats().computed);
+    EXPECT_EQ(0U, coalescer.getStats().coalesced);
+}
+
+}  // namespace android::net
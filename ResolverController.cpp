@@ -18,21 +18,26 @@
 
 #include "ResolverController.h"
 
+#include <algorithm>
 #include <set>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <aidl/android/net/IDnsResolver.h>
 #include <android-base/logging.h>
 #include <android-base/strings.h>
+#include <netdutils/ThreadUtil.h>
 #include <statslog_resolv.h>
 
 #include "Dns64Configuration.h"
 #include "DnsResolver.h"
 #include "DnsTlsDispatcher.h"
+#include "Experiments.h"
 #include "PrivateDnsConfiguration.h"
 #include "ResolverEventReporter.h"
 #include "ResolverStats.h"
+#include "getaddrinfo.h"
 #include "resolv_cache.h"
 #include "stats.h"
 #include "util.h"
@@ -47,6 +52,7 @@ using android::net::ResolverStats;
 namespace android {
 
 using netdutils::DumpWriter;
+using netdutils::setThreadName;
 
 namespace net {
 
@@ -156,6 +162,12 @@ int getDnsInfo(unsigned netId, std::vector<std::string>* servers, std::vector<st
     return 0;
 }
 
+// The upper bound of the number of hostnames resolved by the cache warm-up, and the default and
+// upper bound of the number of them resolved concurrently.
+constexpr int kCacheWarmUpMaxNames = 100;
+constexpr int kCacheWarmUpDefaultConcurrency = 2;
+constexpr int kCacheWarmUpMaxConcurrency = 8;
+
 }  // namespace
 
 ResolverController::ResolverController()
@@ -176,6 +188,13 @@ void ResolverController::destroyNetworkCache(unsigned netId) {
     android::net::stats::stats_write(android::net::stats::NETWORK_DNS_SERVER_SUPPORT_REPORTED,
                                      event.network_type(), event.private_dns_modes(), bytesField);
 
+    {
+        std::lock_guard guard(mCacheWarmUpsMutex);
+        if (const auto it = mCacheWarmUps.find(netId); it != mCacheWarmUps.end()) {
+            it->second->cancelled = true;
+            mCacheWarmUps.erase(it);
+        }
+    }
     resolv_delete_cache_for_net(netId);
     mDns64Configuration->stopPrefixDiscovery(netId);
     privateDnsConfiguration.clear(netId);
@@ -231,7 +250,63 @@ int ResolverController::setResolverConfiguration(const ResolverParamsParcel& res
         }
     }
 
-    return resolv_set_nameservers(resolverParams);
+    // Warm up the cache when the network is configured for the first time, e.g. when it's
+    // reconnected.
+    const bool configured = resolv_get_network_signature(resolverParams.netId) != 0;
+    const int ret = resolv_set_nameservers(resolverParams);
+    if (ret == 0 && !configured) {
+        warmUpCache(resolverParams.netId);
+    }
+    return ret;
+}
+
+void ResolverController::warmUpCache(unsigned netId) {
+    const Experiments* const experiments = Experiments::getInstance();
+    const int maxNames = experiments->getFlag("cache_warm_up_names", 0);
+    if (maxNames <= 0) return;
+    int concurrency =
+            experiments->getFlag("cache_warm_up_concurrency", kCacheWarmUpDefaultConcurrency);
+    if (concurrency < 1 || concurrency > kCacheWarmUpMaxConcurrency) {
+        LOG(ERROR) << "Misconfiguration on cache_warm_up_concurrency " << concurrency;
+        concurrency = kCacheWarmUpDefaultConcurrency;
+    }
+
+    // The DNS query log only has the hostnames which missed the cache, which are the ones
+    // worth warming up.
+    auto warmUp = std::make_shared<CacheWarmUp>();
+    warmUp->hostnames = gDnsResolv->dnsQueryLog().topHostnames(
+            resolv_get_network_signature(netId), std::min(maxNames, kCacheWarmUpMaxNames));
+    if (warmUp->hostnames.empty()) return;
+
+    // Expect to get the mark with system permission. The entries are accounted to the
+    // resolver, so that the warm-up hits can be counted.
+    gResNetdCallbacks.get_network_context(netId, 0 /* uid */, &warmUp->netcontext);
+    warmUp->netcontext.uid = CACHE_WARM_UP_UID;
+    {
+        std::lock_guard guard(mCacheWarmUpsMutex);
+        mCacheWarmUps[netId] = warmUp;
+    }
+    LOG(INFO) << __func__ << ": netId = " << netId << ", resolving " << warmUp->hostnames.size()
+              << " hostnames, " << concurrency << " at a time";
+
+    const size_t threads = std::min<size_t>(concurrency, warmUp->hostnames.size());
+    for (size_t i = 0; i < threads; i++) {
+        std::thread warm_up_thread([warmUp, netId] {
+            setThreadName(fmt::format("CacheWarmUp_{}", netId));
+            for (size_t next = warmUp->next++;
+                 next < warmUp->hostnames.size() && !warmUp->cancelled; next = warmUp->next++) {
+                const addrinfo hints = {.ai_family = AF_UNSPEC};
+                addrinfo* result = nullptr;
+                NetworkDnsEventReported event;
+                if (resolv_getaddrinfo(warmUp->hostnames[next].c_str(), nullptr, &hints,
+                                       &warmUp->netcontext, &result, &event) == 0) {
+                    warmUp->resolved++;
+                }
+                freeaddrinfo(result);
+            }
+        });
+        warm_up_thread.detach();
+    }
 }
 
 int ResolverController::getResolverInfo(int32_t netId, std::vector<std::string>* servers,
@@ -361,6 +436,13 @@ void ResolverController::dump(DumpWriter& dw, unsigned netId) {
             dw.decIndent();
         }
         dw.println("Concurrent DNS query timeout: %d", wait_for_pending_req_timeout_count);
+        {
+            std::lock_guard guard(mCacheWarmUpsMutex);
+            if (const auto it = mCacheWarmUps.find(netId); it != mCacheWarmUps.end()) {
+                dw.println("Cache warm-up: %d of %zu hostnames resolved",
+                           it->second->resolved.load(), it->second->hostnames.size());
+            }
+        }
         resolv_netconfig_dump(dw, netId);
     }
     dw.decIndent();
@@ -17,10 +17,17 @@
 #ifndef _RESOLVER_CONTROLLER_H_
 #define _RESOLVER_CONTROLLER_H_
 
+#include <atomic>
 #include <list>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <set>
+#include <string>
 #include <vector>
 
+#include <android-base/thread_annotations.h>
+
 #include <aidl/android/net/ResolverParamsParcel.h>
 #include "Dns64Configuration.h"
 #include "netd_resolv/resolv.h"
@@ -66,7 +73,25 @@ class ResolverController {
     void dump(netdutils::DumpWriter& dw, unsigned netId);
 
   private:
+    // The hostnames resolved in the background to warm up the cache of a network, see
+    // warmUpCache().
+    struct CacheWarmUp {
+        std::vector<std::string> hostnames;
+        android_net_context netcontext;
+        // The index of the next hostname to resolve.
+        std::atomic<size_t> next = 0;
+        std::atomic<int> resolved = 0;
+        std::atomic<bool> cancelled = false;
+    };
+
+    // Resolve the hostnames most frequently queried the last time the network was connected,
+    // so that the first lookups of the apps hit the cache. Disabled unless the
+    // cache_warm_up_names flag is set.
+    void warmUpCache(unsigned netId);
+
     std::shared_ptr<Dns64Configuration> mDns64Configuration;
+    std::mutex mCacheWarmUpsMutex;
+    std::map<unsigned, std::shared_ptr<CacheWarmUp>> mCacheWarmUps GUARDED_BY(mCacheWarmUpsMutex);
 };
 }  // namespace net
 }  // namespace android
@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SlabAllocator.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <new>
+
+namespace android::net {
+
+int SlabAllocator::sizeClassIndex(size_t size) {
+    const auto it = std::lower_bound(kSizeClasses.begin(), kSizeClasses.end(), size);
+    if (it == kSizeClasses.end()) return -1;
+    return it - kSizeClasses.begin();
+}
+
+void* SlabAllocator::allocate(size_t size) {
+    const int index = sizeClassIndex(size);
+    if (index < 0) {
+        void* ptr = malloc(sizeof(LargeBlock) + size);
+        if (ptr == nullptr) return nullptr;
+        LargeBlock* large = static_cast<LargeBlock*>(ptr);
+        large->prev = nullptr;
+        large->next = mLargeBlocks;
+        if (mLargeBlocks != nullptr) mLargeBlocks->prev = large;
+        mLargeBlocks = large;
+        mLargeBytes += sizeof(LargeBlock) + size;
+        mBytesInUse += size;
+        return large + 1;
+    }
+
+    Slab* slab = mSlabsWithFreeBlocks[index];
+    if (slab == nullptr) {
+        slab = takeEmptySlab(index);
+        if (slab == nullptr) return nullptr;
+        linkSlabWithFreeBlocks(slab);
+    }
+
+    const size_t classSize = kSizeClasses[index];
+    void* block;
+    if (slab->freeList != nullptr) {
+        block = slab->freeList;
+        slab->freeList = slab->freeList->next;
+    } else {
+        block = slab->cursor;
+        slab->cursor += classSize;
+    }
+    slab->blocksInUse++;
+    const std::byte* const slabEnd = slab->memory.get() + kSlabSize;
+    if (slab->freeList == nullptr && static_cast<size_t>(slabEnd - slab->cursor) < classSize) {
+        unlinkSlabWithFreeBlocks(slab);
+    }
+    mBytesInUse += classSize;
+    return block;
+}
+
+void SlabAllocator::deallocate(void* block, size_t size) {
+    if (block == nullptr) return;
+
+    const int index = sizeClassIndex(size);
+    if (index < 0) {
+        LargeBlock* large = static_cast<LargeBlock*>(block) - 1;
+        if (large->prev != nullptr) {
+            large->prev->next = large->next;
+        } else {
+            mLargeBlocks = large->next;
+        }
+        if (large->next != nullptr) large->next->prev = large->prev;
+        mLargeBytes -= sizeof(LargeBlock) + size;
+        mBytesInUse -= size;
+        free(large);
+        return;
+    }
+
+    // The slab of the block is the last one starting at or before it.
+    auto it = mSlabs.upper_bound(static_cast<const std::byte*>(block));
+    --it;
+    Slab* slab = &it->second;
+    FreeBlock* freeBlock = static_cast<FreeBlock*>(block);
+    freeBlock->next = slab->freeList;
+    slab->freeList = freeBlock;
+    slab->blocksInUse--;
+    mBytesInUse -= kSizeClasses[index];
+
+    if (slab->blocksInUse == 0) {
+        if (slab->hasFreeBlocks) unlinkSlabWithFreeBlocks(slab);
+        releaseSlab(it);
+    } else if (!slab->hasFreeBlocks) {
+        linkSlabWithFreeBlocks(slab);
+    }
+}
+
+SlabAllocator::Slab* SlabAllocator::takeEmptySlab(int index) {
+    Slab* slab = mSpareSlab;
+    if (slab != nullptr) {
+        mSpareSlab = nullptr;
+    } else {
+        std::unique_ptr<std::byte[]> memory(new (std::nothrow) std::byte[kSlabSize]);
+        if (memory == nullptr) return nullptr;
+        const std::byte* const address = memory.get();
+        slab = &mSlabs[address];
+        slab->memory = std::move(memory);
+    }
+    slab->sizeClass = index;
+    slab->freeList = nullptr;
+    slab->cursor = slab->memory.get();
+    return slab;
+}
+
+void SlabAllocator::releaseSlab(std::map<const std::byte*, Slab>::iterator slab) {
+    if (mSpareSlab == nullptr) {
+        slab->second.sizeClass = -1;
+        mSpareSlab = &slab->second;
+        return;
+    }
+    mSlabs.erase(slab);
+}
+
+void SlabAllocator::linkSlabWithFreeBlocks(Slab* slab) {
+    Slab*& head = mSlabsWithFreeBlocks[slab->sizeClass];
+    slab->prev = nullptr;
+    slab->next = head;
+    if (head != nullptr) head->prev = slab;
+    head = slab;
+    slab->hasFreeBlocks = true;
+}
+
+void SlabAllocator::unlinkSlabWithFreeBlocks(Slab* slab) {
+    if (slab->prev != nullptr) {
+        slab->prev->next = slab->next;
+    } else {
+        mSlabsWithFreeBlocks[slab->sizeClass] = slab->next;
+    }
+    if (slab->next != nullptr) slab->next->prev = slab->prev;
+    slab->prev = slab->next = nullptr;
+    slab->hasFreeBlocks = false;
+}
+
+void SlabAllocator::clear() {
+    while (mLargeBlocks != nullptr) {
+        LargeBlock* next = mLargeBlocks->next;
+        free(mLargeBlocks);
+        mLargeBlocks = next;
+    }
+    mLargeBytes = 0;
+
+    mSlabs.clear();
+    mSlabsWithFreeBlocks.fill(nullptr);
+    mSpareSlab = nullptr;
+    mBytesInUse = 0;
+}
+
+}  // namespace android::net
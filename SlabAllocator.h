@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <map>
+#include <memory>
+
+namespace android::net {
+
+// A size-classed allocator for variable-sized blocks sharing the same lifetime owner, e.g. the
+// entries of a DNS cache.
+//
+// Blocks are rounded up to a size class and carved out of fixed-size slabs, each of them
+// holding blocks of a single class. Freed blocks are kept on the free list of their slab and
+// reused by later allocations of the same class, so a churning owner doesn't fragment the
+// process heap. A slab whose blocks are all free goes back to the heap, except for one kept
+// aside for the next slab of any class, so the footprint follows the blocks in use rather than
+// the peak of each class. clear() releases everything in O(number of slabs). Blocks bigger than
+// the largest size class are allocated from the heap directly.
+//
+// This class is not thread-safe.
+class SlabAllocator {
+  public:
+    // The size of the slabs blocks are carved out of.
+    static constexpr size_t kSlabSize = 16 * 1024;
+    // The sizes blocks are rounded up to. Each one is a multiple of alignof(std::max_align_t).
+    static constexpr std::array<size_t, 12> kSizeClasses = {
+            64, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096,
+    };
+
+    SlabAllocator() = default;
+    ~SlabAllocator() { clear(); }
+
+    SlabAllocator(const SlabAllocator&) = delete;
+    SlabAllocator& operator=(const SlabAllocator&) = delete;
+
+    // Returns a block of at least |size| bytes, aligned for any object type, or nullptr if
+    // out of memory.
+    void* allocate(size_t size);
+
+    // Returns |block| to the allocator. |size| must be the size it was allocated with.
+    void deallocate(void* block, size_t size);
+
+    // Releases all the blocks at once. This does not run any destructor, so the objects
+    // constructed in the blocks must be trivially destructible or already destroyed.
+    void clear();
+
+    // The number of bytes handed out and not deallocated yet, rounded up to the size classes.
+    size_t bytesInUse() const { return mBytesInUse; }
+
+    // The number of bytes taken from the heap, including the free blocks and unused slab space.
+    size_t bytesAllocated() const { return mSlabs.size() * kSlabSize + mLargeBytes; }
+
+  private:
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    struct Slab {
+        std::unique_ptr<std::byte[]> memory;
+        // The size class of the blocks, or -1 if the slab is empty and unassigned.
+        int sizeClass = -1;
+        // The freed blocks, and the part of the slab never handed out.
+        FreeBlock* freeList = nullptr;
+        std::byte* cursor = nullptr;
+        size_t blocksInUse = 0;
+        // Links in the list of the slabs of the size class with free blocks.
+        bool hasFreeBlocks = false;
+        Slab* prev = nullptr;
+        Slab* next = nullptr;
+    };
+
+    // Header of the blocks bigger than the largest size class, which are kept on a doubly
+    // linked list so that clear() can release them.
+    struct alignas(std::max_align_t) LargeBlock {
+        LargeBlock* prev;
+        LargeBlock* next;
+    };
+
+    // Returns the index of the smallest size class fitting |size|, or -1 if there is none.
+    static int sizeClassIndex(size_t size);
+
+    // Returns an empty slab for the size class |index|, or nullptr if out of memory.
+    Slab* takeEmptySlab(int index);
+    // Gives back |slab|, whose blocks are all free.
+    void releaseSlab(std::map<const std::byte*, Slab>::iterator slab);
+    void linkSlabWithFreeBlocks(Slab* slab);
+    void unlinkSlabWithFreeBlocks(Slab* slab);
+
+    // The slabs, by address, to find the slab of a block.
+    std::map<const std::byte*, Slab> mSlabs;
+    // The slabs of each size class with free blocks, which allocations are served from.
+    std::array<Slab*, kSizeClasses.size()> mSlabsWithFreeBlocks{};
+    // An empty slab kept for the next slab needed by any size class, or nullptr.
+    Slab* mSpareSlab = nullptr;
+
+    LargeBlock* mLargeBlocks = nullptr;
+    size_t mLargeBytes = 0;
+    size_t mBytesInUse = 0;
+};
+
+}  // namespace android::net
@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SlabAllocator.h"
+
+#include <string.h>
+
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <netdutils/NetNativeTestBase.h>
+
+namespace android::net {
+
+class SlabAllocatorTest : public NetNativeTestBase {};
+
+TEST_F(SlabAllocatorTest, RoundsUpToSizeClass) {
+    SlabAllocator allocator;
+    EXPECT_EQ(0U, allocator.bytesInUse());
+    EXPECT_EQ(0U, allocator.bytesAllocated());
+
+    void* block = allocator.allocate(100);
+    ASSERT_NE(nullptr, block);
+    EXPECT_EQ(0U, reinterpret_cast<uintptr_t>(block) % alignof(std::max_align_t));
+    EXPECT_EQ(128U, allocator.bytesInUse());
+    EXPECT_EQ(SlabAllocator::kSlabSize, allocator.bytesAllocated());
+
+    allocator.deallocate(block, 100);
+    EXPECT_EQ(0U, allocator.bytesInUse());
+    EXPECT_EQ(SlabAllocator::kSlabSize, allocator.bytesAllocated());
+}
+
+TEST_F(SlabAllocatorTest, ReusesFreedBlocks) {
+    SlabAllocator allocator;
+    void* block1 = allocator.allocate(300);
+    void* block2 = allocator.allocate(300);
+    ASSERT_NE(nullptr, block1);
+    ASSERT_NE(nullptr, block2);
+    EXPECT_NE(block1, block2);
+
+    // A freed block is reused for any size in the same size class...
+    allocator.deallocate(block1, 300);
+    EXPECT_EQ(block1, allocator.allocate(260));
+
+    // ...but not for a different size class.
+    allocator.deallocate(block2, 300);
+    EXPECT_NE(block2, allocator.allocate(100));
+    EXPECT_EQ(block2, allocator.allocate(384));
+}
+
+TEST_F(SlabAllocatorTest, BlocksDontOverlap) {
+    SlabAllocator allocator;
+    std::vector<std::pair<uint8_t*, size_t>> blocks;
+
+    // Spans several slabs, with sizes from all the size classes.
+    for (size_t i = 0; i < 200; i++) {
+        const size_t size = 1 + (i * 97) % SlabAllocator::kSizeClasses.back();
+        uint8_t* block = static_cast<uint8_t*>(allocator.allocate(size));
+        ASSERT_NE(nullptr, block);
+        memset(block, static_cast<int>(i), size);
+        blocks.emplace_back(block, size);
+    }
+    EXPECT_GT(allocator.bytesAllocated(), SlabAllocator::kSlabSize);
+
+    for (size_t i = 0; i < blocks.size(); i++) {
+        const auto& [block, size] = blocks[i];
+        for (size_t j = 0; j < size; j++) {
+            ASSERT_EQ(static_cast<uint8_t>(i), block[j]) << "block " << i << " offset " << j;
+        }
+    }
+}
+
+TEST_F(SlabAllocatorTest, ReleasesEmptySlabs) {
+    SlabAllocator allocator;
+    constexpr size_t kSize = 1000;
+    constexpr size_t kBlocksPerSlab = SlabAllocator::kSlabSize / 1024;
+    std::vector<void*> blocks;
+    for (size_t i = 0; i < 4 * kBlocksPerSlab; i++) {
+        blocks.push_back(allocator.allocate(kSize));
+        ASSERT_NE(nullptr, blocks.back());
+    }
+    EXPECT_EQ(4 * SlabAllocator::kSlabSize, allocator.bytesAllocated());
+
+    // The slabs go back to the heap once empty, except for one kept aside.
+    for (void* block : blocks) {
+        allocator.deallocate(block, kSize);
+    }
+    EXPECT_EQ(0U, allocator.bytesInUse());
+    EXPECT_EQ(SlabAllocator::kSlabSize, allocator.bytesAllocated());
+
+    // The slab kept aside is reused by another size class.
+    void* block = allocator.allocate(100);
+    ASSERT_NE(nullptr, block);
+    EXPECT_EQ(SlabAllocator::kSlabSize, allocator.bytesAllocated());
+
+    // A slab is kept as long as one of its blocks is in use.
+    blocks.clear();
+    for (size_t i = 0; i < 2 * kBlocksPerSlab; i++) {
+        blocks.push_back(allocator.allocate(kSize));
+        ASSERT_NE(nullptr, blocks.back());
+    }
+    EXPECT_EQ(3 * SlabAllocator::kSlabSize, allocator.bytesAllocated());
+    for (size_t i = 1; i < blocks.size(); i++) {
+        allocator.deallocate(blocks[i], kSize);
+    }
+    EXPECT_EQ(3 * SlabAllocator::kSlabSize, allocator.bytesAllocated());
+    allocator.deallocate(block, 100);
+    EXPECT_EQ(2 * SlabAllocator::kSlabSize, allocator.bytesAllocated());
+    EXPECT_NE(nullptr, allocator.allocate(kSize));
+    EXPECT_EQ(2 * SlabAllocator::kSlabSize, allocator.bytesAllocated());
+}
+
+TEST_F(SlabAllocatorTest, LargeBlocks) {
+    SlabAllocator allocator;
+    constexpr size_t kLargeSize = SlabAllocator::kSizeClasses.back() + 1;
+
+    void* block1 = allocator.allocate(kLargeSize);
+    void* block2 = allocator.allocate(2 * kLargeSize);
+    ASSERT_NE(nullptr, block1);
+    ASSERT_NE(nullptr, block2);
+    memset(block1, 0, kLargeSize);
+    memset(block2, 0, 2 * kLargeSize);
+    EXPECT_EQ(3 * kLargeSize, allocator.bytesInUse());
+    EXPECT_GE(allocator.bytesAllocated(), 3 * kLargeSize);
+
+    allocator.deallocate(block1, kLargeSize);
+    EXPECT_EQ(2 * kLargeSize, allocator.bytesInUse());
+
+    // block2 is released by clear().
+    allocator.clear();
+    EXPECT_EQ(0U, allocator.bytesInUse());
+    EXPECT_EQ(0U, allocator.bytesAllocated());
+}
+
+TEST_F(SlabAllocatorTest, Clear) {
+    SlabAllocator allocator;
+    for (int i = 0; i < 100; i++) {
+        ASSERT_NE(nullptr, allocator.allocate(1000));
+    }
+    EXPECT_EQ(100U * 1024, allocator.bytesInUse());
+
+    allocator.clear();
+    EXPECT_EQ(0U, allocator.bytesInUse());
+    EXPECT_EQ(0U, allocator.bytesAllocated());
+
+    // The allocator is still usable.
+    EXPECT_NE(nullptr, allocator.allocate(1000));
+    EXPECT_EQ(1024U, allocator.bytesInUse());
+}
+
+}  // namespace android::net
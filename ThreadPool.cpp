@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ThreadPool.h"
+
+#include <errno.h>
+
+#include <algorithm>
+#include <utility>
+
+#include <netdutils/ThreadUtil.h>
+
+namespace android::net {
+
+ThreadPool::ThreadPool(std::string name, size_t maxThreads, size_t maxQueuedTasks)
+    : mName(std::move(name)), mMaxThreads(maxThreads), mMaxQueuedTasks(maxQueuedTasks) {}
+
+ThreadPool::~ThreadPool() {
+    std::vector<std::thread> threads;
+    {
+        std::lock_guard guard(mMutex);
+        mStopping = true;
+        threads.swap(mThreads);
+    }
+    mCv.notify_all();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+int ThreadPool::enqueue(Task task) {
+    {
+        std::lock_guard guard(mMutex);
+        // Each idle thread takes one of the queued tasks.
+        if (mTasks.size() >= mIdleThreads) {
+            if (mThreads.size() < mMaxThreads) {
+                mThreads.emplace_back(&ThreadPool::loop, this);
+                mIdleThreads++;
+            } else if (mTasks.size() - mIdleThreads >= mMaxQueuedTasks) {
+                mRejectedTasks++;
+                return -EAGAIN;
+            }
+        }
+        mTasks.push_back(std::move(task));
+        mPeakQueuedTasks = std::max(mPeakQueuedTasks, mTasks.size());
+    }
+    mCv.notify_one();
+    return 0;
+}
+
+ThreadPool::Stats ThreadPool::getStats() const {
+    std::lock_guard guard(mMutex);
+    return {
+            .threads = mThreads.size(),
+            .idleThreads = mIdleThreads,
+            .queuedTasks = mTasks.size(),
+            .peakQueuedTasks = mPeakQueuedTasks,
+            .completedTasks = mCompletedTasks,
+            .rejectedTasks = mRejectedTasks,
+    };
+}
+
+void ThreadPool::loop() {
+    netdutils::setThreadName(mName);
+    std::unique_lock lock(mMutex);
+    while (true) {
+        mCv.wait(lock, [this]() REQUIRES(mMutex) { return !mTasks.empty() || mStopping; });
+        if (mTasks.empty()) return;
+
+        Task task = std::move(mTasks.front());
+        mTasks.pop_front();
+        mIdleThreads--;
+        lock.unlock();
+        task();
+        // Release the resources of the task before taking another one, and undo its renaming.
+        task = nullptr;
+        netdutils::setThreadName(mName);
+        lock.lock();
+        mIdleThreads++;
+        mCompletedTasks++;
+    }
+}
+
+}  // namespace android::net
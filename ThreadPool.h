@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/thread_annotations.h>
+
+namespace android::net {
+
+// A pool of at most |maxThreads| threads running the tasks of a bounded queue, oldest first.
+//
+// The threads are started on demand, when a task is queued and none of them is idle, and then
+// wait for more tasks until the pool is destroyed. Tasks which can't be started right away
+// wait in the queue, which holds at most |maxQueuedTasks| of them.
+class ThreadPool {
+  public:
+    using Task = std::function<void()>;
+
+    struct Stats {
+        size_t threads;
+        size_t idleThreads;
+        size_t queuedTasks;
+        size_t peakQueuedTasks;
+        uint64_t completedTasks;
+        uint64_t rejectedTasks;
+    };
+
+    // The threads are named |name|. A task may rename its thread while it runs.
+    ThreadPool(std::string name, size_t maxThreads, size_t maxQueuedTasks);
+
+    // Waits for the queued tasks to complete.
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Queues |task|, to be run by one of the threads. Returns 0, or -EAGAIN if the queue is full.
+    int enqueue(Task task);
+
+    Stats getStats() const;
+
+    size_t maxThreads() const { return mMaxThreads; }
+    size_t maxQueuedTasks() const { return mMaxQueuedTasks; }
+
+  private:
+    void loop();
+
+    const std::string mName;
+    const size_t mMaxThreads;
+    const size_t mMaxQueuedTasks;
+
+    mutable std::mutex mMutex;
+    std::condition_variable mCv;
+    std::vector<std::thread> mThreads GUARDED_BY(mMutex);
+    // The threads which aren't running a task, including those about to take a queued task.
+    size_t mIdleThreads GUARDED_BY(mMutex) = 0;
+    std::deque<Task> mTasks GUARDED_BY(mMutex);
+    size_t mPeakQueuedTasks GUARDED_BY(mMutex) = 0;
+    uint64_t mCompletedTasks GUARDED_BY(mMutex) = 0;
+    uint64_t mRejectedTasks GUARDED_BY(mMutex) = 0;
+    bool mStopping GUARDED_BY(mMutex) = false;
+};
+
+}  // namespace android::net
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ThreadPool.h"
+
+#include <errno.h>
+
+#include <atomic>
+#include <future>
+#include <set>
+
+#include <gtest/gtest.h>
+#include <netdutils/NetNativeTestBase.h>
+
+namespace android::net {
+
+class ThreadPoolTest : public NetNativeTestBase {};
+
+TEST_F(ThreadPoolTest, RunsTasks) {
+    std::atomic<int> sum = 0;
+    std::mutex mutex;
+    std::set<std::thread::id> threadIds;
+    {
+        ThreadPool pool("ThreadPoolTest", 4, 1000);
+        for (int i = 1; i <= 1000; i++) {
+            ASSERT_EQ(0, pool.enqueue([&, i] {
+                sum += i;
+                std::lock_guard guard(mutex);
+                threadIds.insert(std::this_thread::get_id());
+            }));
+        }
+        // The destructor waits for the queued tasks.
+    }
+    EXPECT_EQ(500500, sum);
+    EXPECT_GE(4U, threadIds.size());
+}
+
+TEST_F(ThreadPoolTest, ReusesIdleThreads) {
+    ThreadPool pool("ThreadPoolTest", 4, 0);
+    for (int i = 0; i < 10; i++) {
+        std::promise<void> done;
+        ASSERT_EQ(0, pool.enqueue([&done] { done.set_value(); }));
+        done.get_future().wait();
+        // Let the thread go back to idle.
+        while (pool.getStats().idleThreads == 0) {
+            std::this_thread::yield();
+        }
+    }
+    const ThreadPool::Stats stats = pool.getStats();
+    EXPECT_EQ(1U, stats.threads);
+    EXPECT_EQ(10U, stats.completedTasks);
+}
+
+TEST_F(ThreadPoolTest, BoundsTheQueue) {
+    std::promise<void> unblock;
+    std::shared_future<void> unblocked = unblock.get_future().share();
+    std::atomic<int> completed = 0;
+    const auto blockingTask = [&] {
+        unblocked.wait();
+        completed++;
+    };
+    {
+        ThreadPool pool("ThreadPoolTest", 2, 3);
+        // Two tasks are running, three are queued.
+        for (int i = 0; i < 5; i++) {
+            EXPECT_EQ(0, pool.enqueue(blockingTask));
+        }
+        EXPECT_EQ(-EAGAIN, pool.enqueue(blockingTask));
+        EXPECT_EQ(-EAGAIN, pool.enqueue(blockingTask));
+
+        ThreadPool::Stats stats = pool.getStats();
+        EXPECT_EQ(2U, stats.threads);
+        EXPECT_EQ(2U, stats.rejectedTasks);
+        EXPECT_LE(3U, stats.peakQueuedTasks);
+
+        unblock.set_value();
+    }
+    EXPECT_EQ(5, completed);
+}
+
+}  // namespace android::net
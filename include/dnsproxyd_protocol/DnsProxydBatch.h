@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#pragma once
+
+/*
+ * The getaddrinfobatch command resolves many hostnames with a single request, as if each of them
+ * was sent in its own getaddrinfo command with the same other arguments:
+ *
+ *   getaddrinfobatch <hostnames> <service> <flags> <family> <socktype> <protocol> <netId>
+ *
+ * where <hostnames> are joined by DNSPROXYD_BATCH_HOSTNAME_SEPARATOR. The hostnames are resolved
+ * concurrently, and the reply is streamed back as each of them completes:
+ *
+ *   - the DnsProxyQueryResult code, followed by the big-endian 32-bit number of hostnames;
+ *   - then for each hostname, in completion order, its big-endian 32-bit index in <hostnames>,
+ *     followed by the same reply as to the getaddrinfo command for it.
+ *
+ * A malformed command is answered by a CommandParameterError message instead. The whole command,
+ * including its terminating null, must fit in DNSPROXYD_MAX_COMMAND_SIZE bytes.
+ */
+#define DNSPROXYD_GETADDRINFO_BATCH_COMMAND "getaddrinfobatch"
+#define DNSPROXYD_BATCH_HOSTNAME_SEPARATOR ','
+#define DNSPROXYD_BATCH_MAX_HOSTNAMES 64
+
+/*
+ * The size of the command buffer of the listener, see CMD_BUF_SIZE in FrameworkListener.cpp.
+ */
+#define DNSPROXYD_MAX_COMMAND_SIZE 1024
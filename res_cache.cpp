@@ -30,16 +30,30 @@
 
 #include "resolv_cache.h"
 
+#include <inttypes.h>
+#include <limits.h>
 #include <resolv.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
 #include <mutex>
 #include <set>
+#include <shared_mutex>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include <arpa/inet.h>
@@ -55,11 +69,18 @@
 #include <android-base/strings.h>
 #include <android-base/thread_annotations.h>
 #include <android/multinetwork.h>  // ResNsendFlags
+#include <netdutils/Stopwatch.h>
+#include <netdutils/ThreadUtil.h>
 
 #include <server_configurable_flags/get_flags.h>
 
+#include "CacheSnapshot.h"
 #include "DnsStats.h"
 #include "Experiments.h"
+#include "FrequencySketch.h"
+#include "RRsetCache.h"
+#include "SlabAllocator.h"
+#include "ThreadPool.h"
 #include "res_comp.h"
 #include "res_debug.h"
 #include "resolv_private.h"
@@ -68,14 +89,22 @@
 using aidl::android::net::IDnsResolver;
 using aidl::android::net::ResolverOptionsParcel;
 using aidl::android::net::ResolverParamsParcel;
+using android::net::CacheSnapshotRecord;
+using android::net::CacheSnapshotWriter;
 using android::net::DnsQueryEvent;
 using android::net::DnsStats;
 using android::net::Experiments;
+using android::net::FrequencySketch;
+using android::net::MappedCacheSnapshot;
 using android::net::PROTO_TCP;
 using android::net::PROTO_UDP;
 using android::net::Protocol;
+using android::net::RRsetCache;
+using android::net::SlabAllocator;
+using android::net::ThreadPool;
 using android::netdutils::DumpWriter;
 using android::netdutils::IPSockAddr;
+using android::netdutils::Stopwatch;
 using std::span;
 
 /* This code implements a small and *simple* DNS resolver cache.
@@ -90,8 +119,15 @@ using std::span;
  *  - it takes raw DNS query packet data as input, and returns raw DNS
  *    answer packet data as output
  *
- *    (this means that two similar queries that encode the DNS name
- *     differently will be treated distinctly).
+ *    queries are looked up by a canonical key, see _dnsPacket_makeKey():
+ *    the ID and the TC bit are ignored, the domain names are lower-cased,
+ *    and the AD bit and an EDNS0 OPT record without options but padding are
+ *    left out, so that queries asked with and without EDNS0 share their
+ *    entries. the DO bit is kept, as a bare OPT record. a cached answer is
+ *    adapted to the options of each query it is served to.
+ *
+ *    (this means that two queries which differ otherwise, e.g. in their
+ *     EDNS0 options, will be treated distinctly).
  *
  *    the smallest TTL value among the answer records are used as the time
  *    to keep an answer in the cache.
@@ -157,6 +193,100 @@ using std::span;
 const int MAX_ENTRIES_DEFAULT = 64 * 2 * 5;
 const int MAX_ENTRIES_LOWER_BOUND = 1;
 const int MAX_ENTRIES_UPPER_BOUND = 100 * 1000;
+
+/* Byte budgets. Besides having at most max_cache_entries entries, the cache of
+ * a network may use at most max_cache_bytes, and the caches of all networks
+ * together at most max_cache_bytes_global. The size of an entry is that of its
+ * query and answer plus its bookkeeping, see entry_block_size(). Networks with
+ * small answers can thus hold more entries than networks with large ones.
+ */
+const int MAX_CACHE_BYTES_DEFAULT = 1024 * 1024;
+const int MAX_CACHE_BYTES_LOWER_BOUND = 4 * 1024;
+const int MAX_CACHE_BYTES_UPPER_BOUND = 64 * 1024 * 1024;
+const int MAX_CACHE_BYTES_GLOBAL_DEFAULT = 8 * 1024 * 1024;
+const int MAX_CACHE_BYTES_GLOBAL_UPPER_BOUND = 512 * 1024 * 1024;
+
+/* Eviction policies, selected by the cache_eviction_policy flag.
+ *
+ * CACHE_EVICTION_LRU evicts the least recently used entry, with a second
+ * chance for the entries hit since they were last considered.
+ *
+ * CACHE_EVICTION_W_TINYLFU keeps new entries in a small LRU window of
+ * CACHE_WINDOW_PERCENT of the cache. Entries leaving the window only make it
+ * to the main cache if their key was looked up more often recently than the
+ * key of the entry they would evict, so that scans of one-off names don't
+ * flush the popular ones.
+ */
+const int CACHE_EVICTION_LRU = 0;
+const int CACHE_EVICTION_W_TINYLFU = 1;
+const int CACHE_WINDOW_PERCENT = 1;
+
+/* Serve-stale (RFC 8767) limits. Expired entries are only served if the
+ * serve_stale_max_age_seconds flag is set, and for at most that long after
+ * their expiration. Stale answers get a TTL of at most serve_stale_ttl_seconds.
+ */
+const int SERVE_STALE_MAX_AGE_UPPER_BOUND = 7 * 24 * 3600;
+const int SERVE_STALE_TTL_DEFAULT = 30;
+const int SERVE_STALE_TTL_UPPER_BOUND = 3600;
+
+/* Prefetch limits. Entries hit at least cache_prefetch_min_hits times are
+ * refreshed in the background once they are within cache_prefetch_ttl_percent
+ * of their TTL from expiring. Prefetch is disabled if the percentage is 0.
+ */
+const int PREFETCH_TTL_PERCENT_UPPER_BOUND = 50;
+const int PREFETCH_MIN_HITS_DEFAULT = 3;
+const int PREFETCH_MIN_HITS_UPPER_BOUND = 255;
+
+/* Per-UID quotas. Each entry is accounted to the UID of the app whose query
+ * added it. If the cache_uid_quota_percent flag is set, the entries of a UID
+ * may take at most that percentage of the cache: past it, the oldest of them
+ * make room for its new ones, so that an app looking up many one-off names
+ * doesn't evict the entries of the others. The dump lists the UIDs with the
+ * most entries, up to UID_DUMP_MAX_UIDS of them.
+ */
+const int UID_QUOTA_PERCENT_UPPER_BOUND = 100;
+const size_t UID_DUMP_MAX_UIDS = 10;
+
+/* Minimum time between two background refreshes of the same entry, whether
+ * it is served stale or prefetched. This is the "failure recheck timer" of
+ * RFC 8767.
+ */
+constexpr int REFRESH_RETRY_INTERVAL = 30;
+
+/* Cache snapshots, see CacheSnapshot.h. If the cache_snapshot_interval_seconds
+ * flag is set, the cache of each network is saved that often, and when the
+ * network is deleted, to a file named after the network signature. It is loaded
+ * back when a network with the same signature is configured. Only the
+ * CACHE_SNAPSHOT_MAX_FILES most recent snapshots are kept. The snapshots are
+ * saved and loaded one at a time by a background thread, which queues at most
+ * CACHE_SNAPSHOT_MAX_QUEUED of them, and loads CACHE_SNAPSHOT_LOAD_BATCH entries
+ * each time it takes the cache lock.
+ */
+const int CACHE_SNAPSHOT_INTERVAL_UPPER_BOUND = 24 * 3600;
+const size_t CACHE_SNAPSHOT_MAX_FILES = 16;
+const size_t CACHE_SNAPSHOT_MAX_QUEUED = 64;
+const size_t CACHE_SNAPSHOT_LOAD_BATCH = 256;
+constexpr char CACHE_SNAPSHOT_DIR[] = "/data/misc/apexdata/com.android.resolv";
+
+/* Period after loading a snapshot during which the cache hits are counted, to
+ * measure how much the snapshot helps.
+ */
+constexpr int CACHE_SNAPSHOT_WARM_START_PERIOD = 60;
+
+/* Number of one-second buckets of the expiry wheel, see _cache_remove_expired().
+ */
+constexpr int EXPIRY_WHEEL_SLOTS = 256;
+
+/* Number of hash table slots the reclaimer visits, or of steps of a resize,
+ * each time it takes the cache lock, see _cache_reclaim_some() and
+ * _cache_rehash_some(). The reclaimer thread sleeps CACHE_RECLAIM_PAUSE_US
+ * between two batches. Tables of up to CACHE_RECLAIM_INLINE_SLOTS slots are
+ * cleared by the flush or resized at once, which is quicker than waking the
+ * reclaimer up.
+ */
+constexpr size_t CACHE_RECLAIM_BATCH = 1024;
+constexpr int CACHE_RECLAIM_PAUSE_US = 1000;
+constexpr size_t CACHE_RECLAIM_INLINE_SLOTS = 4096;
 constexpr int DNSEVENT_SUBSAMPLING_MAP_DEFAULT_KEY = -1;
 
 static time_t _time_now(void) {
@@ -271,45 +401,12 @@ static uint8_t res_tolower(uint8_t c) {
     return (c >= 'A' && c <= 'Z') ? (c | 0x20) : c;
 }
 
-static int res_memcasecmp(const unsigned char *s1, const unsigned char *s2, size_t len) {
-    for (size_t i = 0; i < len; i++) {
-        int ch1 = *s1++;
-        int ch2 = *s2++;
-        int d = res_tolower(ch1) - res_tolower(ch2);
-        if (d != 0) {
-            return d;
-        }
-    }
-    return 0;
-}
-
 static void _dnsPacket_init(DnsPacket* packet, const uint8_t* buff, int bufflen) {
     packet->base = buff;
     packet->end = buff + bufflen;
     packet->cursor = buff;
 }
 
-static void _dnsPacket_rewind(DnsPacket* packet) {
-    packet->cursor = packet->base;
-}
-
-static void _dnsPacket_skip(DnsPacket* packet, int count) {
-    const uint8_t* p = packet->cursor + count;
-
-    if (p > packet->end) p = packet->end;
-
-    packet->cursor = p;
-}
-
-static int _dnsPacket_readInt16(DnsPacket* packet) {
-    const uint8_t* p = packet->cursor;
-
-    if (p + 2 > packet->end) return -1;
-
-    packet->cursor = p + 2;
-    return (p[0] << 8) | p[1];
-}
-
 /** QUERY CHECKING **/
 
 /* check bytes in a dns packet. returns 1 on success, 0 on failure.
@@ -443,275 +540,267 @@ static int _dnsPacket_checkQuery(DnsPacket* packet) {
     return 1;
 }
 
-/** QUERY HASHING SUPPORT
+/** QUERY KEYS
  **
  ** THE FOLLOWING CODE ASSUMES THAT THE INPUT PACKET HAS ALREADY
  ** BEEN SUCCESFULLY CHECKED.
  **/
 
-/* use 32-bit FNV hash function */
-#define FNV_MULT 16777619U
-#define FNV_BASIS 2166136261U
-
-static unsigned _dnsPacket_hashBytes(DnsPacket* packet, int numBytes, unsigned hash) {
-    const uint8_t* p = packet->cursor;
-    const uint8_t* end = packet->end;
-
-    while (numBytes > 0 && p < end) {
-        hash = hash * FNV_MULT ^ *p++;
-        numBytes--;
-    }
-    packet->cursor = p;
-    return hash;
-}
-
-static unsigned _dnsPacket_hashQName(DnsPacket* packet, unsigned hash) {
-    const uint8_t* p = packet->cursor;
-    const uint8_t* end = packet->end;
-
-    for (;;) {
-        if (p >= end) { /* should not happen */
-            LOG(INFO) << __func__ << ": INTERNAL_ERROR: read-overflow";
-            break;
-        }
+/* Maximum size of the canonical key of a query, see _dnsPacket_makeKey().
+ * This fits any question with an EDNS0 OPT record padded to a multiple of
+ * 128 bytes. Queries with larger keys, e.g. with large EDNS0 options, are
+ * not cached.
+ */
+constexpr size_t MAX_KEY_SIZE = 1024;
 
-        int c = *p++;
+/* the options of a query which are left out of its key, but for the DO bit, since they only change
+ * which records the answer carries, see _dnsPacket_makeKey(). the same options describe the records
+ * found in a cached answer, so that the answer can be adapted to each query it is served to, see
+ * cache_copy_answer().
+ */
+constexpr uint8_t DNS_OPTION_EDNS = 1; /* an EDNS0 OPT record */
+constexpr uint8_t DNS_OPTION_DO = 2;   /* the DO bit of the OPT record, or DNSSEC records */
+constexpr uint8_t DNS_OPTION_AD = 4;   /* the AD bit */
 
-        if (c == 0) break;
+/* the OPT record standing for the DO bit in a key: root name, TYPE OPT, no
+ * payload size, only the DO flag and no RDATA.
+ */
+constexpr uint8_t KEY_DO_OPT_RECORD[] = {0, 0, ns_t_opt, 0, 0, 0, 0, 0x80, 0, 0, 0};
 
-        if (c >= 64) {
-            LOG(INFO) << __func__ << ": INTERNAL_ERROR: malformed domain";
-            break;
-        }
-        if (p + c >= end) {
-            LOG(INFO) << __func__ << ": INTERNAL_ERROR: simple label read-overflow";
-            break;
-        }
+/* copy the domain name at the cursor to 'key', lower-cased, and skip it.
+ * returns the length of the name, or 0 if it is malformed or longer than
+ * 'keysize'.
+ */
+static size_t _dnsPacket_copyName(DnsPacket* packet, uint8_t* key, size_t keysize) {
+    const uint8_t* name = packet->cursor;
+    if (!_dnsPacket_checkQName(packet)) return 0;
 
-        while (c > 0) {
-            uint8_t ch = *p++;
-            ch = res_tolower(ch);
-            hash = hash * FNV_MULT ^ ch;
-            c--;
-        }
+    const size_t len = packet->cursor - name;
+    if (len > keysize) return 0;
+    /* label lengths are below 64, so lower-casing leaves them alone, and
+     * the whole name can be converted in one simple loop */
+    for (size_t i = 0; i < len; i++) {
+        key[i] = res_tolower(name[i]);
     }
-    packet->cursor = p;
-    return hash;
+    return len;
 }
 
-static unsigned _dnsPacket_hashQR(DnsPacket* packet, unsigned hash) {
-    hash = _dnsPacket_hashQName(packet, hash);
-    hash = _dnsPacket_hashBytes(packet, 4, hash); /* TYPE and CLASS */
-    return hash;
-}
-
-static unsigned _dnsPacket_hashRR(DnsPacket* packet, unsigned hash) {
-    int rdlength;
-    hash = _dnsPacket_hashQR(packet, hash);
-    hash = _dnsPacket_hashBytes(packet, 4, hash); /* TTL */
-    rdlength = _dnsPacket_readInt16(packet);
-    hash = _dnsPacket_hashBytes(packet, rdlength, hash); /* RDATA */
-    return hash;
+/* return the options of an additional record if it is an EDNS0 OPT record
+ * which may be left out of the key, or 0 otherwise. 'name' is its owner name
+ * and 'fields' its TYPE, CLASS, TTL, RDLENGTH and RDATA, of 'len' bytes.
+ *
+ * the UDP payload size doesn't matter since answers are not truncated on
+ * their way out of the cache, and neither does padding. records with other
+ * EDNS0 options, e.g. a client subnet, or flags are kept in the key.
+ */
+static uint8_t _dnsPacket_getOptOptions(const uint8_t* name, size_t namelen,
+                                        const uint8_t* fields, size_t len) {
+    /* root name, TYPE OPT, extended RCODE and version 0, no flag but DO */
+    if (namelen != 1 || name[0] != 0 || fields[0] != 0 || fields[1] != ns_t_opt ||
+        fields[4] != 0 || fields[5] != 0 || (fields[6] & 0x7f) != 0 || fields[7] != 0) {
+        return 0;
+    }
+    for (size_t i = 10; i < len;) {
+        if (i + 4 > len) return 0;
+        const int code = (fields[i] << 8) | fields[i + 1];
+        if (code != NS_OPT_PADDING) return 0;
+        i += 4 + ((fields[i + 2] << 8) | fields[i + 3]);
+        if (i > len) return 0;
+    }
+    return (fields[6] & 0x80) ? DNS_OPTION_EDNS | DNS_OPTION_DO : DNS_OPTION_EDNS;
 }
 
-static unsigned _dnsPacket_hashQuery(DnsPacket* packet) {
-    unsigned hash = FNV_BASIS;
-    int count, arcount;
-    _dnsPacket_rewind(packet);
-
-    /* ignore the ID */
-    _dnsPacket_skip(packet, 2);
-
-    /* we ignore the TC bit for reasons explained in
-     * _dnsPacket_checkQuery().
-     *
-     * however we hash the RD bit to differentiate
-     * between answers for recursive and non-recursive
-     * queries.
-     */
-    hash = hash * FNV_MULT ^ (packet->base[2] & 1);
-
-    /* mark the first header byte as processed */
-    _dnsPacket_skip(packet, 1);
-
-    /* process the second header byte */
-    hash = _dnsPacket_hashBytes(packet, 1, hash);
+/* build the canonical key of a query packet checked by _dnsPacket_checkQuery() into 'key', which
+ * has room for MAX_KEY_SIZE bytes, and store the options left out of it into 'options'. returns
+ * the length of the key, or 0 if it doesn't fit or the additional records are malformed.
+ *
+ * the key is the query up to the end of its last additional record, with the ID and the TC bit
+ * cleared, and the domain names lower-cased. the AD bit and an EDNS0 OPT record without options
+ * but padding are left out as well: they don't change the answer, only which records it carries,
+ * so queries asked with and without EDNS0 share their entries. the DO bit is kept though, in a
+ * bare OPT record, since an answer cached without the DNSSEC records can't be served to a query
+ * asking for them.
+ *
+ * two queries are equivalent iff their keys are the same bytes, so the cache hashes and compares
+ * keys with plain byte operations. a key is a valid query itself.
+ */
+static size_t _dnsPacket_makeKey(DnsPacket* packet, uint8_t* key, uint8_t* options) {
+    const uint8_t* p = packet->base;
+    uint8_t* out = key;
+    const uint8_t* const end = key + MAX_KEY_SIZE;
 
-    /* read QDCOUNT */
-    count = _dnsPacket_readInt16(packet);
+    memcpy(out, p, DNS_HEADER_SIZE);
+    out[0] = out[1] = 0; /* ID */
+    out[2] &= 1;         /* only RD may be set besides TC */
+    out[3] &= ~0x20;     /* AD */
+    out += DNS_HEADER_SIZE;
+    *options = (p[3] & 0x20) ? DNS_OPTION_AD : 0;
 
     /* assume: ANcount and NScount are 0 */
-    _dnsPacket_skip(packet, 4);
-
-    /* read ARCOUNT */
-    arcount = _dnsPacket_readInt16(packet);
-
-    /* hash QDCOUNT QRs */
-    for (; count > 0; count--) hash = _dnsPacket_hashQR(packet, hash);
-
-    /* hash ARCOUNT RRs */
-    for (; arcount > 0; arcount--) hash = _dnsPacket_hashRR(packet, hash);
-
-    return hash;
-}
-
-/** QUERY COMPARISON
- **
- ** THE FOLLOWING CODE ASSUMES THAT THE INPUT PACKETS HAVE ALREADY
- ** BEEN SUCCESSFULLY CHECKED.
- **/
-
-static int _dnsPacket_isEqualDomainName(DnsPacket* pack1, DnsPacket* pack2) {
-    const uint8_t* p1 = pack1->cursor;
-    const uint8_t* end1 = pack1->end;
-    const uint8_t* p2 = pack2->cursor;
-    const uint8_t* end2 = pack2->end;
+    const int qdcount = (p[4] << 8) | p[5];
+    const int arcount = (p[10] << 8) | p[11];
+    int keyArcount = 0;
+    packet->cursor = p + DNS_HEADER_SIZE;
 
-    for (;;) {
-        if (p1 >= end1 || p2 >= end2) {
-            LOG(INFO) << __func__ << ": INTERNAL_ERROR: read-overflow";
-            break;
-        }
-        int c1 = *p1++;
-        int c2 = *p2++;
-        if (c1 != c2) break;
+    for (int i = 0; i < qdcount + arcount; i++) {
+        const size_t namelen = _dnsPacket_copyName(packet, out, end - out);
+        if (namelen == 0) return 0;
 
-        if (c1 == 0) {
-            pack1->cursor = p1;
-            pack2->cursor = p2;
-            return 1;
-        }
-        if (c1 >= 64) {
-            LOG(INFO) << __func__ << ": INTERNAL_ERROR: malformed domain";
-            break;
+        /* TYPE and CLASS, and TTL, RDLENGTH and RDATA for additional RRs */
+        const uint8_t* const fields = packet->cursor;
+        size_t len = 4;
+        if (i >= qdcount) {
+            if (fields + 10 > packet->end) return 0;
+            len = 10 + ((fields[8] << 8) | fields[9]);
         }
-        if ((p1 + c1 > end1) || (p2 + c1 > end2)) {
-            LOG(INFO) << __func__ << ": INTERNAL_ERROR: simple label read-overflow";
-            break;
+        if (fields + len > packet->end) return 0;
+        packet->cursor += len;
+        if (i >= qdcount) {
+            if (const uint8_t opt = _dnsPacket_getOptOptions(out, namelen, fields, len)) {
+                *options |= opt;
+                if (!(opt & DNS_OPTION_DO)) continue;
+                if (out + sizeof(KEY_DO_OPT_RECORD) > end) return 0;
+                out = std::copy(std::begin(KEY_DO_OPT_RECORD), std::end(KEY_DO_OPT_RECORD), out);
+                keyArcount++;
+                continue;
+            }
+            keyArcount++;
         }
-        if (res_memcasecmp(p1, p2, c1) != 0) break;
-        p1 += c1;
-        p2 += c1;
-        /* we rely on the bound checks at the start of the loop */
+        if (out + namelen + len > end) return 0;
+        memcpy(out + namelen, fields, len);
+        out += namelen + len;
     }
-    /* not the same, or one is malformed */
-    LOG(INFO) << __func__ << ": different DN";
-    return 0;
-}
-
-static int _dnsPacket_isEqualBytes(DnsPacket* pack1, DnsPacket* pack2, int numBytes) {
-    const uint8_t* p1 = pack1->cursor;
-    const uint8_t* p2 = pack2->cursor;
-
-    if (p1 + numBytes > pack1->end || p2 + numBytes > pack2->end) return 0;
-
-    if (memcmp(p1, p2, numBytes) != 0) return 0;
-
-    pack1->cursor += numBytes;
-    pack2->cursor += numBytes;
-    return 1;
-}
-
-static int _dnsPacket_isEqualQR(DnsPacket* pack1, DnsPacket* pack2) {
-    /* compare domain name encoding + TYPE + CLASS */
-    if (!_dnsPacket_isEqualDomainName(pack1, pack2) ||
-        !_dnsPacket_isEqualBytes(pack1, pack2, 2 + 2))
-        return 0;
-
-    return 1;
-}
-
-static int _dnsPacket_isEqualRR(DnsPacket* pack1, DnsPacket* pack2) {
-    int rdlength1, rdlength2;
-    /* compare query + TTL */
-    if (!_dnsPacket_isEqualQR(pack1, pack2) || !_dnsPacket_isEqualBytes(pack1, pack2, 4)) return 0;
-
-    /* compare RDATA */
-    rdlength1 = _dnsPacket_readInt16(pack1);
-    rdlength2 = _dnsPacket_readInt16(pack2);
-    if (rdlength1 != rdlength2 || !_dnsPacket_isEqualBytes(pack1, pack2, rdlength1)) return 0;
-
-    return 1;
+    key[10] = keyArcount >> 8;
+    key[11] = keyArcount & 0xff;
+    return out - key;
 }
 
-static int _dnsPacket_isEqualQuery(DnsPacket* pack1, DnsPacket* pack2) {
-    int count1, count2, arcount1, arcount2;
-
-    /* compare the headers, ignore most fields */
-    _dnsPacket_rewind(pack1);
-    _dnsPacket_rewind(pack2);
+/* hash a canonical key. the key is consumed 8 bytes at a time, which is
+ * several times faster than the byte-wise FNV loop for the typical keys
+ * of 30 to 300 bytes, and the result is finalized so that all its bits
+ * are well mixed.
+ */
+static unsigned _cache_hashKey(const uint8_t* key, size_t len) {
+    constexpr uint64_t MULT = 0x9e3779b97f4a7c15ULL;
+    uint64_t hash = len * MULT;
+    uint64_t word;
 
-    /* compare RD, ignore TC, see comment in _dnsPacket_checkQuery */
-    if ((pack1->base[2] & 1) != (pack2->base[2] & 1)) {
-        LOG(INFO) << __func__ << ": different RD";
-        return 0;
+    for (; len >= 8; key += 8, len -= 8) {
+        memcpy(&word, key, 8);
+        hash = (std::rotl(hash, 5) ^ word) * MULT;
     }
-
-    if (pack1->base[3] != pack2->base[3]) {
-        LOG(INFO) << __func__ << ": different CD or AD";
-        return 0;
+    if (len > 0) {
+        word = 0;
+        memcpy(&word, key, len);
+        hash = (std::rotl(hash, 5) ^ word) * MULT;
     }
 
-    /* mark ID and header bytes as compared */
-    _dnsPacket_skip(pack1, 4);
-    _dnsPacket_skip(pack2, 4);
+    /* murmur3 finalizer */
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return static_cast<unsigned>(hash);
+}
 
-    /* compare QDCOUNT */
-    count1 = _dnsPacket_readInt16(pack1);
-    count2 = _dnsPacket_readInt16(pack2);
-    if (count1 != count2 || count1 < 0) {
-        LOG(INFO) << __func__ << ": different QDCOUNT";
-        return 0;
-    }
+/* cache entry. mru_next and mru_prev are part of the global MRU list.
+ * expiry_next and expiry_pprev are part of a bucket of the expiry wheel.
+ *
+ * the fields are ordered to avoid padding.
+ */
+struct Entry {
+    struct Entry* mru_prev = nullptr;
+    struct Entry* mru_next = nullptr;
+
+    // The entries of the same UID, in the order they were added, see _cache_uid_add().
+    struct Entry* uid_older = nullptr;
+    struct Entry* uid_newer = nullptr;
+
+    struct Entry* expiry_next = nullptr;
+    struct Entry** expiry_pprev = nullptr;
+
+    const uint8_t* query = nullptr; /* canonical key, see _dnsPacket_makeKey() */
+    const uint8_t* answer = nullptr;
+    time_t expires = 0; /* time_t when the entry isn't valid any more */
+
+    // If this entry was prefetched, the expiration time of the entry it replaced, until the
+    // first hit past that time, which would have been a cache miss without the prefetch.
+    std::atomic<time_t> replaced_expires = 0;
+
+    unsigned int hash = 0; /* hash value */
+    int querylen = 0;
+    int answerlen = 0;
+    int id = 0;  /* for debugging purpose */
+    int ttl = 0; /* initial TTL of the entry */
+    uint32_t generation = 0; /* flush generation of the cache it was added in */
+    uint8_t dns_options = 0; /* options of the query, or records of the answer */
+    uid_t uid = NET_CONTEXT_INVALID_UID; /* UID of the app whose query added the entry */
+
+    // The age (time elapsed since the expiration, negative before it) from which a hit may
+    // request a background refresh of this entry. NO_REFRESH_REQUESTED until the first one.
+    static constexpr int NO_REFRESH_REQUESTED = INT_MIN;
+    std::atomic<int> next_refresh_age = NO_REFRESH_REQUESTED;
+
+    // Number of hits, saturating at PREFETCH_MIN_HITS_UPPER_BOUND.
+    std::atomic<uint16_t> hits = 0;
+
+    // Set by cache hits, which only hold the cache lock in shared mode and thus can't move the
+    // entry in the MRU list. Cleared when the entry gets a second chance at eviction time.
+    std::atomic<bool> referenced = false;
+
+    // Whether the entry is in the admission window of the W-TinyLFU policy, or in the main
+    // MRU list.
+    bool in_window = false;
+};
 
-    /* assume: ANcount and NScount are 0 */
-    _dnsPacket_skip(pack1, 4);
-    _dnsPacket_skip(pack2, 4);
-
-    /* compare ARCOUNT */
-    arcount1 = _dnsPacket_readInt16(pack1);
-    arcount2 = _dnsPacket_readInt16(pack2);
-    if (arcount1 != arcount2 || arcount1 < 0) {
-        LOG(INFO) << __func__ << ": different ARCOUNT";
-        return 0;
-    }
+/* node of the reverse index, which maps the addresses found in the A and
+ * AAAA records of the cached answers to their entries. an entry has one
+ * node per address record. nodes are allocated from the cache allocator.
+ */
+struct ReverseIndexNode {
+    struct ReverseIndexNode* next;
+    Entry* entry;
+    uint8_t addrlen;
+    uint8_t addr[sizeof(in6_addr)];
+};
 
-    /* compare the QDCOUNT QRs */
-    for (; count1 > 0; count1--) {
-        if (!_dnsPacket_isEqualQR(pack1, pack2)) {
-            LOG(INFO) << __func__ << ": different QR";
-            return 0;
-        }
-    }
+/* Open addressing hash table of the entries, with linear probing. A null slot
+ * is empty, and hashes[i] is the hash of slots[i]. The number of slots is a
+ * power of two, and an entry's probe sequence starts at the slot given by the
+ * top bits of its hash, see _cache_home_slot(). The hashes are stored next to
+ * the entry pointers, so that probing only dereferences the entries whose hash
+ * matches the key.
+ *
+ * The reverse index is a chained hash table indexing the entries by the
+ * addresses in their answers, see resolv_gethostbyaddr_from_cache(). It has as
+ * many buckets as there are slots, so that both are resized together.
+ */
+struct HashTable {
+    std::vector<Entry*> slots;
+    std::vector<unsigned> hashes;
+    int shift = 31;
+    std::vector<ReverseIndexNode*> reverse_index;
+};
 
-    /* compare the ARCOUNT RRs */
-    for (; arcount1 > 0; arcount1--) {
-        if (!_dnsPacket_isEqualRR(pack1, pack2)) {
-            LOG(INFO) << __func__ << ": different additional RR";
-            return 0;
-        }
+/* Return the number of slots of a table holding up to 'max_entries' entries.
+ * The load factor is kept below 1/2, so that probe sequences stay short, and
+ * there is always an empty slot to terminate them even with the stale entries
+ * of a flush.
+ */
+static size_t _table_capacity(int max_entries) {
+    size_t capacity = 2;
+    while (capacity <= 2 * static_cast<size_t>(max_entries)) {
+        capacity *= 2;
     }
-    return 1;
+    return capacity;
 }
 
-/* cache entry. for simplicity, 'hash' and 'hlink' are inlined in this
- * structure though they are conceptually part of the hash table.
- *
- * similarly, mru_next and mru_prev are part of the global MRU list
- */
-struct Entry {
-    unsigned int hash;   /* hash value */
-    struct Entry* hlink; /* next in collision chain */
-    struct Entry* mru_prev;
-    struct Entry* mru_next;
-
-    const uint8_t* query;
-    int querylen;
-    const uint8_t* answer;
-    int answerlen;
-    time_t expires; /* time_t when the entry isn't valid any more */
-    int id;         /* for debugging purpose */
-};
+static void _table_init(HashTable* table, int max_entries) {
+    const size_t capacity = _table_capacity(max_entries);
+    table->slots.assign(capacity, nullptr);
+    table->hashes.assign(capacity, 0);
+    table->shift = 32 - std::countr_zero(capacity);
+    table->reverse_index.assign(capacity, nullptr);
+}
 
 /*
  * Find the TTL for a negative DNS result.  This is defined as the minimum
@@ -760,6 +849,147 @@ static uint32_t answer_getNegativeTTL(ns_msg handle) {
     return result;
 }
 
+/*
+ * Lower the TTL of all the resource records in the answer to at
+ * most 'max_ttl', except for the OPT pseudo-record.
+ */
+static void answer_capTTL(span<uint8_t> answer, uint32_t max_ttl) {
+    ns_msg handle;
+    if (ns_initparse(answer.data(), answer.size(), &handle) < 0) return;
+
+    for (const ns_sect section : {ns_s_an, ns_s_ns, ns_s_ar}) {
+        for (int n = 0; n < ns_msg_count(handle, section); n++) {
+            ns_rr rr;
+            if (ns_parserr(&handle, section, n, &rr) != 0) return;
+            if (ns_rr_type(rr) == ns_t_opt || ns_rr_ttl(rr) <= max_ttl) continue;
+            // The TTL precedes RDLENGTH and RDATA.
+            uint8_t* ttl = const_cast<uint8_t*>(ns_rr_rdata(rr)) - NS_INT16SZ - NS_INT32SZ;
+            ns_put32(max_ttl, ttl);
+        }
+    }
+}
+
+static bool is_dnssec_type(int type) {
+    return type == ns_t_rrsig || type == ns_t_nsec || type == ns_t_nsec3;
+}
+
+/*
+ * Return the options describing the records of the answer: DNS_OPTION_EDNS
+ * if it has an OPT record, DNS_OPTION_DO if it has DNSSEC records, and
+ * DNS_OPTION_AD if the AD bit is set.
+ */
+static uint8_t answer_getOptions(span<const uint8_t> answer) {
+    ns_msg handle;
+    if (ns_initparse(answer.data(), answer.size(), &handle) < 0) return 0;
+
+    uint8_t options = ns_msg_getflag(handle, ns_f_ad) ? DNS_OPTION_AD : 0;
+    for (const ns_sect section : {ns_s_an, ns_s_ns, ns_s_ar}) {
+        for (int n = 0; n < ns_msg_count(handle, section); n++) {
+            ns_rr rr;
+            if (ns_parserr(&handle, section, n, &rr) != 0) return options;
+            if (ns_rr_type(rr) == ns_t_opt) options |= DNS_OPTION_EDNS;
+            if (is_dnssec_type(ns_rr_type(rr))) options |= DNS_OPTION_DO;
+        }
+    }
+    return options;
+}
+
+/*
+ * Copy the answer into 'out', leaving out the OPT record if 'strip' has
+ * DNS_OPTION_EDNS, and the DNSSEC records if it has DNS_OPTION_DO. The
+ * records that follow move, so the names are compressed again, including
+ * those in the RDATA of the types where RFC 3597 allows compression.
+ *
+ * Return the length of the copy, or 0 if it fails.
+ */
+static size_t answer_stripRecords(span<const uint8_t> answer, span<uint8_t> out, uint8_t strip) {
+    ns_msg handle;
+    if (ns_initparse(answer.data(), answer.size(), &handle) < 0 || out.size() < HFIXEDSZ) {
+        return 0;
+    }
+    memcpy(out.data(), answer.data(), HFIXEDSZ);
+
+    uint8_t* dnptrs[20] = {out.data(), nullptr};
+    uint8_t** const lastdnptr = dnptrs + std::size(dnptrs);
+    uint8_t* p = out.data() + HFIXEDSZ;
+    const uint8_t* const end = out.data() + out.size();
+    const auto putName = [&](const char* name) {
+        const int n = dn_comp(name, p, end - p, dnptrs, lastdnptr);
+        if (n < 0) return false;
+        p += n;
+        return true;
+    };
+    const auto putBytes = [&](const uint8_t* bytes, size_t len) {
+        if (static_cast<size_t>(end - p) < len) return false;
+        p = std::copy(bytes, bytes + len, p);
+        return true;
+    };
+
+    for (const ns_sect section : {ns_s_qd, ns_s_an, ns_s_ns, ns_s_ar}) {
+        int count = 0;
+        for (int n = 0; n < ns_msg_count(handle, section); n++) {
+            ns_rr rr;
+            if (ns_parserr(&handle, section, n, &rr) != 0) return 0;
+            const int type = ns_rr_type(rr);
+            if (((strip & DNS_OPTION_EDNS) && type == ns_t_opt) ||
+                ((strip & DNS_OPTION_DO) && is_dnssec_type(type))) {
+                continue;
+            }
+            count++;
+
+            uint8_t fields[RRFIXEDSZ];
+            ns_put16(type, fields);
+            ns_put16(ns_rr_class(rr), fields + INT16SZ);
+            if (!putName(ns_rr_name(rr))) return 0;
+            if (section == ns_s_qd) {
+                if (!putBytes(fields, QFIXEDSZ)) return 0;
+                continue;
+            }
+            ns_put32(ns_rr_ttl(rr), fields + 2 * INT16SZ);
+            if (!putBytes(fields, RRFIXEDSZ)) return 0;
+            uint8_t* const rdlength = p - INT16SZ;
+
+            size_t prefix = 0;
+            int names = 0;
+            switch (type) {
+                case ns_t_ns:
+                case ns_t_md:
+                case ns_t_mf:
+                case ns_t_cname:
+                case ns_t_mb:
+                case ns_t_mg:
+                case ns_t_mr:
+                case ns_t_ptr:
+                    names = 1;
+                    break;
+                case ns_t_mx:
+                    prefix = INT16SZ;
+                    names = 1;
+                    break;
+                case ns_t_soa:
+                case ns_t_minfo:
+                    names = 2;
+                    break;
+            }
+            const uint8_t* rdata = ns_rr_rdata(rr);
+            const uint8_t* const rdend = rdata + ns_rr_rdlen(rr);
+            uint8_t* const rdstart = p;
+            if (static_cast<size_t>(rdend - rdata) < prefix || !putBytes(rdata, prefix)) return 0;
+            rdata += prefix;
+            for (int i = 0; i < names; i++) {
+                char name[NS_MAXDNAME];
+                const int n = dn_expand(ns_msg_base(handle), rdend, rdata, name, sizeof(name));
+                if (n < 0 || !putName(name)) return 0;
+                rdata += n;
+            }
+            if (!putBytes(rdata, rdend - rdata)) return 0;
+            ns_put16(p - rdstart, rdlength);
+        }
+        ns_put16(count, out.data() + 4 + 2 * section);
+    }
+    return p - out.data();
+}
+
 /*
  * Parse the answer records and find the appropriate
  * smallest TTL among the records.  This might be from
@@ -806,10 +1036,19 @@ static uint32_t answer_getTTL(span<const uint8_t> answer) {
     return result;
 }
 
-static void entry_free(Entry* e) {
+// The cache flushes entries by releasing the memory of its allocator at once.
+static_assert(std::is_trivially_destructible_v<Entry>);
+
+static size_t entry_block_size(const Entry* e) {
+    return sizeof(*e) + e->querylen + e->answerlen;
+}
+
+static void entry_free(SlabAllocator& allocator, Entry* e) {
     /* everything is allocated in a single memory block */
     if (e) {
-        free(e);
+        const size_t size = entry_block_size(e);
+        e->~Entry();
+        allocator.deallocate(e, size);
     }
 }
 
@@ -828,39 +1067,37 @@ static void entry_mru_add(Entry* e, Entry* list) {
     first->mru_prev = e;
 }
 
-/* compute the hash of a given entry, this is a hash of most
- * data in the query (key) */
-static unsigned entry_hash(const Entry* e) {
-    DnsPacket pack[1];
-
-    _dnsPacket_init(pack, e->query, e->querylen);
-    return _dnsPacket_hashQuery(pack);
-}
-
 /* initialize an Entry as a search key, this also checks the input query packet
- * returns 1 on success, or 0 in case of unsupported/malformed data */
-static int entry_init_key(Entry* e, span<const uint8_t> query) {
+ * returns 1 on success, or 0 in case of unsupported/malformed data.
+ * the canonical key of the query is built into 'keybuf', which must have room
+ * for MAX_KEY_SIZE bytes and outlive the search key */
+static int entry_init_key(Entry* e, span<const uint8_t> query, uint8_t* keybuf) {
     DnsPacket pack[1];
 
-    memset(e, 0, sizeof(*e));
-
-    e->query = query.data();
-    e->querylen = query.size();
-    e->hash = entry_hash(e);
+    _dnsPacket_init(pack, query.data(), query.size());
+    if (!_dnsPacket_checkQuery(pack)) return 0;
 
-    _dnsPacket_init(pack, e->query, e->querylen);
-
-    return _dnsPacket_checkQuery(pack);
+    const size_t keylen = _dnsPacket_makeKey(pack, keybuf, &e->dns_options);
+    if (keylen == 0) {
+        LOG(INFO) << __func__ << ": query too large";
+        return 0;
+    }
+    e->query = keybuf;
+    e->querylen = keylen;
+    e->hash = _cache_hashKey(keybuf, keylen);
+    return 1;
 }
 
 /* allocate a new entry as a cache node */
-static Entry* entry_alloc(const Entry* init, span<const uint8_t> answer) {
+static Entry* entry_alloc(SlabAllocator& allocator, const Entry* init,
+                          span<const uint8_t> answer) {
     Entry* e;
     int size;
 
     size = sizeof(*e) + init->querylen + answer.size();
-    e = (Entry*) calloc(size, 1);
-    if (e == NULL) return e;
+    void* block = allocator.allocate(size);
+    if (block == NULL) return NULL;
+    e = new (block) Entry;
 
     e->hash = init->hash;
     e->query = (const uint8_t*) (e + 1);
@@ -872,33 +1109,23 @@ static Entry* entry_alloc(const Entry* init, span<const uint8_t> answer) {
     e->answerlen = answer.size();
 
     memcpy((char*)e->answer, answer.data(), e->answerlen);
+    e->dns_options = answer_getOptions(answer);
 
     return e;
 }
 
 static int entry_equals(const Entry* e1, const Entry* e2) {
-    DnsPacket pack1[1], pack2[1];
-
-    if (e1->querylen != e2->querylen) {
-        return 0;
-    }
-    _dnsPacket_init(pack1, e1->query, e1->querylen);
-    _dnsPacket_init(pack2, e2->query, e2->querylen);
-
-    return _dnsPacket_isEqualQuery(pack1, pack2);
+    return e1->querylen == e2->querylen && memcmp(e1->query, e2->query, e1->querylen) == 0;
 }
 
-/* We use a simple hash table with external collision lists
- * for simplicity, the hash-table fields 'hash' and 'hlink' are
- * inlined in the Entry structure.
- */
-
-/* Maximum time for a thread to wait for an pending request */
-constexpr int PENDING_REQUEST_TIMEOUT = 20;
-
-// lock protecting everything in NetConfig.
+// lock protecting sNetConfigMap. It's only held while looking up, creating or deleting a
+// NetConfig; the NetConfig and its Cache are protected by their own locks.
+// Lock ordering: cache_mutex may be acquired while holding a NetConfig or Cache lock, but never
+// the other way around.
 static std::mutex cache_mutex;
-static std::condition_variable cv;
+
+// Total size of the entries of all the caches, see MAX_CACHE_BYTES_GLOBAL_DEFAULT.
+static std::atomic<size_t> sCacheBytes = 0;
 
 namespace {
 
@@ -946,64 +1173,255 @@ std::unordered_map<int, uint32_t> resolv_get_dns_event_subsampling_map(bool isMd
 }  // namespace
 
 // Note that Cache is not thread-safe per se, access to its members must be protected
-// by an external mutex.
+// by |mutex|.
 //
 // TODO: move all cache manipulation code here and make data members private.
 struct Cache {
-    Cache() : max_cache_entries(get_max_cache_entries_from_flag()) {
-        entries.resize(max_cache_entries);
+    Cache()
+        : max_cache_bytes(get_flag_in_range("max_cache_bytes", MAX_CACHE_BYTES_DEFAULT,
+                                            MAX_CACHE_BYTES_LOWER_BOUND,
+                                            MAX_CACHE_BYTES_UPPER_BOUND)),
+          max_cache_bytes_global(get_flag_in_range(
+                  "max_cache_bytes_global", MAX_CACHE_BYTES_GLOBAL_DEFAULT,
+                  MAX_CACHE_BYTES_LOWER_BOUND, MAX_CACHE_BYTES_GLOBAL_UPPER_BOUND)),
+          serve_stale_max_age(get_flag_in_range("serve_stale_max_age_seconds", 0, 0,
+                                                SERVE_STALE_MAX_AGE_UPPER_BOUND)),
+          serve_stale_ttl(get_flag_in_range("serve_stale_ttl_seconds", SERVE_STALE_TTL_DEFAULT, 1,
+                                            SERVE_STALE_TTL_UPPER_BOUND)),
+          prefetch_ttl_percent(get_flag_in_range("cache_prefetch_ttl_percent", 0, 0,
+                                                 PREFETCH_TTL_PERCENT_UPPER_BOUND)),
+          prefetch_min_hits(get_flag_in_range("cache_prefetch_min_hits", PREFETCH_MIN_HITS_DEFAULT,
+                                              1, PREFETCH_MIN_HITS_UPPER_BOUND)),
+          uid_quota_percent(get_flag_in_range("cache_uid_quota_percent", 0, 0,
+                                              UID_QUOTA_PERCENT_UPPER_BOUND)),
+          snapshot_interval(get_flag_in_range("cache_snapshot_interval_seconds", 0, 0,
+                                              CACHE_SNAPSHOT_INTERVAL_UPPER_BOUND)),
+          next_snapshot(_time_now() + snapshot_interval),
+          max_cache_entries(get_max_cache_entries_from_flag()),
+          flag_max_cache_entries(max_cache_entries) {
+        _table_init(&table, max_cache_entries);
         mru_list.mru_prev = mru_list.mru_next = &mru_list;
+        window_list.mru_prev = window_list.mru_next = &window_list;
+
+        if (get_flag_in_range("cache_eviction_policy", CACHE_EVICTION_LRU, CACHE_EVICTION_LRU,
+                              CACHE_EVICTION_W_TINYLFU) == CACHE_EVICTION_W_TINYLFU) {
+            sketch = std::make_unique<FrequencySketch>(max_cache_entries);
+        }
+        if (get_flag_in_range("cache_rrsets", 0, 0, 1) == 1) {
+            rrsets = std::make_unique<RRsetCache>(max_cache_entries);
+        }
+    }
+    ~Cache() {
+        // Entries are trivially destructible, so they are dropped with the allocators.
+        flushPendingRequests();
+        sCacheBytes -= bytes;
     }
-    ~Cache() { flush(); }
 
+    // Removes all the entries. Large tables are flushed in O(1), by starting a new generation:
+    // the entries of the previous ones are never matched again, but stay in the hash table and
+    // the reverse index, with their memory in a retired allocator, until _cache_reclaim_some()
+    // removes them.
     void flush() {
-        for (int nn = 0; nn < max_cache_entries; nn++) {
-            Entry** pnode = (Entry**)&entries[nn];
-
-            while (*pnode) {
-                Entry* node = *pnode;
-                *pnode = node->hlink;
-                entry_free(node);
-            }
+        if (num_entries > 0) {
+            generation++;
+            stale_entries += num_entries;
+            retired_allocators.push_back(std::move(allocator));
+            allocator = std::make_unique<SlabAllocator>();
+        }
+        if (rrsets != nullptr && rrsets->size() > 0) {
+            retired_rrsets.push_back(
+                    std::exchange(rrsets, std::make_unique<RRsetCache>(max_cache_entries)));
         }
+        expiry_wheel.fill(nullptr);
 
         flushPendingRequests();
 
         mru_list.mru_next = mru_list.mru_prev = &mru_list;
+        window_list.mru_next = window_list.mru_prev = &window_list;
         num_entries = 0;
+        sCacheBytes -= bytes;
+        bytes = 0;
+        window_entries = 0;
+        uid_entries.clear();
         last_id = 0;
+        if (sketch != nullptr) sketch->clear();
+
+        // The stale entries and a full set of live ones must never fill the table. If the
+        // stale entries of a previous flush are still there, drop them all now, which is
+        // simple since there is no live entry left.
+        // An ongoing resize is completed by dropping the old table as well.
+        if (table.slots.size() <= CACHE_RECLAIM_INLINE_SLOTS ||
+            stale_entries + max_cache_entries >= static_cast<int>(table.slots.size())) {
+            std::fill(table.slots.begin(), table.slots.end(), nullptr);
+            std::fill(table.reverse_index.begin(), table.reverse_index.end(), nullptr);
+            old_table = HashTable();
+            stale_entries = 0;
+            retired_allocators.clear();
+            retired_rrsets.clear();
+        }
 
         LOG(INFO) << "DNS cache flushed";
     }
 
     void flushPendingRequests() {
-        pending_req_info* ri = pending_requests.next;
-        while (ri) {
-            pending_req_info* tmp = ri;
-            ri = ri->next;
-            free(tmp);
+        for (const auto& [hash, request] : pending_requests) {
+            request->complete();
         }
-
-        pending_requests.next = nullptr;
-        cv.notify_all();
+        pending_requests.clear();
     }
 
     int get_max_cache_entries() { return max_cache_entries; }
+    // Sets the maximum number of entries. The hash table is resized, and the excess entries
+    // evicted, by _cache_rehash_some().
+    void set_max_cache_entries(int entries) {
+        if (entries == max_cache_entries) return;
+        max_cache_entries = entries;
+        resize_sketch();
+    }
+    // Follows the max_cache_entries flag if it changed since the cache was created or last
+    // followed it, overriding the size set by resolv_resize_cache_for_net(). Returns whether the
+    // maximum number of entries changed.
+    bool follow_max_cache_entries_flag() {
+        const int entries = get_max_cache_entries_from_flag();
+        if (entries == flag_max_cache_entries) return false;
+        flag_max_cache_entries = entries;
+        if (entries == max_cache_entries) return false;
+        max_cache_entries = entries;
+        resize_sketch();
+        return true;
+    }
+    // Replaces the sketch by one sized for the maximum number of entries, since a sketch too small
+    // for the cache saturates and can't tell the popular keys apart any more. The counts start
+    // over: they can't be carried to counters of another width.
+    void resize_sketch() {
+        if (sketch != nullptr) sketch = std::make_unique<FrequencySketch>(max_cache_entries);
+    }
+    int get_window_max_entries() {
+        return std::max(1, max_cache_entries * CACHE_WINDOW_PERCENT / 100);
+    }
+    int get_uid_quota() { return std::max(1, max_cache_entries * uid_quota_percent / 100); }
+
+    // Lock protecting everything in this Cache. Cache hits only take it in shared mode.
+    std::shared_mutex mutex;
 
     int num_entries = 0;
+    // Total size of the entries. Only modified with |mutex| held exclusively, but read
+    // without it when looking for the largest cache.
+    std::atomic<size_t> bytes = 0;
+
+    // Byte budgets of this cache and of all the caches, see MAX_CACHE_BYTES_DEFAULT.
+    const size_t max_cache_bytes;
+    const size_t max_cache_bytes_global;
 
     // TODO: convert to std::list
     Entry mru_list;
     int last_id = 0;
-    std::vector<Entry> entries;
 
-    // TODO: convert to std::vector
-    struct pending_req_info {
-        unsigned int hash;
-        struct pending_req_info* next;
-    } pending_requests{};
+    // W-TinyLFU state. The sketch counts the lookups of each key, and is null if the eviction
+    // policy is LRU. In that case, the window is unused.
+    std::unique_ptr<FrequencySketch> sketch;
+    Entry window_list;
+    int window_entries = 0;
+
+    // Owns the memory of the entries of the current generation.
+    std::unique_ptr<SlabAllocator> allocator = std::make_unique<SlabAllocator>();
+
+    // Flush state, see flush(). The entries of older generations are stale: there are
+    // stale_entries of them left in the hash table, and their memory is in the retired
+    // allocators. The reclaimer sweeps the table from reclaim_cursor, in a pass started at
+    // reclaim_generation, and runs in the background while reclaiming is set.
+    uint32_t generation = 0;
+    int stale_entries = 0;
+    std::vector<std::unique_ptr<SlabAllocator>> retired_allocators;
+    std::vector<std::unique_ptr<RRsetCache>> retired_rrsets;
+    size_t reclaim_cursor = 0;
+    uint32_t reclaim_generation = 0;
+    bool reclaiming = false;
+
+    // The hash table and the reverse index. While the cache is being resized, the entries are
+    // moved from old_table to table a slot at a time from rehash_cursor, and looked up in both,
+    // see _cache_rehash_some(). Otherwise, old_table has no slots.
+    HashTable table;
+    HashTable old_table;
+    size_t rehash_cursor = 0;
+
+    // Hashed timing wheel indexing the entries by the time they may be removed, see
+    // _cache_remove_expired(). Entries removable at time t are in bucket t % EXPIRY_WHEEL_SLOTS,
+    // and the buckets of the times before expiry_cursor have been swept already.
+    std::array<Entry*, EXPIRY_WHEEL_SLOTS> expiry_wheel{};
+    time_t expiry_cursor = 0;
+
+    // A query which missed the cache and is being resolved. The lookups of the same query
+    // made in the meantime wait for it to complete, see resolv_cache_lookup().
+    struct PendingRequest {
+        // Notified when the request is completed or dropped. Waiters hold the cache lock.
+        std::condition_variable_any cv;
+        bool done = false;
+        // Called instead for the lookups which don't wait, see resolv_cache_lookup_async().
+        std::vector<std::function<void()>> callbacks;
+
+        void complete() {
+            done = true;
+            cv.notify_all();
+            for (const auto& callback : callbacks) callback();
+        }
+    };
+    // The pending requests by query hash. Waiters share the ownership of their request, so
+    // that it outlives its removal from the map.
+    std::unordered_map<unsigned int, std::shared_ptr<PendingRequest>> pending_requests;
+
+    // Serve-stale settings. Expired entries are not served if serve_stale_max_age is 0.
+    const int serve_stale_max_age;
+    const int serve_stale_ttl;
+
+    // Prefetch settings and counters. Entries are not prefetched if prefetch_ttl_percent is 0.
+    const int prefetch_ttl_percent;
+    const int prefetch_min_hits;
+    std::atomic<uint64_t> prefetches = 0;
+    std::atomic<uint64_t> prefetch_avoided_misses = 0;
+
+    // The RRsets of the answers, from which the answers to missing queries are synthesized, see
+    // resolv_cache_lookup(). Null if disabled.
+    std::unique_ptr<RRsetCache> rrsets;
+    std::atomic<uint64_t> rrset_synthesized_answers = 0;
+
+    // The entries of each UID, oldest first, and the number of them. UIDs without entries are
+    // removed. The quota is disabled if uid_quota_percent is 0.
+    struct UidEntries {
+        Entry* oldest = nullptr;
+        Entry* newest = nullptr;
+        int count = 0;
+    };
+    std::unordered_map<uid_t, UidEntries> uid_entries;
+    const int uid_quota_percent;
+    std::atomic<uint64_t> uid_quota_evictions = 0;
+
+    // Snapshot settings and state. Snapshots are disabled if snapshot_interval is 0. The
+    // signature identifies the network across netIds and restarts, and is 0 until the
+    // network is configured.
+    const int snapshot_interval;
+    std::atomic<uint64_t> signature = 0;
+    time_t next_snapshot;
+    // Statistics of the last snapshot load, and lookups and hits in the warm start period.
+    std::atomic<time_t> snapshot_loaded_at = 0;
+    std::atomic<int> snapshot_loaded_entries = 0;
+    std::atomic<int64_t> snapshot_load_us = 0;
+    std::atomic<uint64_t> warm_start_lookups = 0;
+    std::atomic<uint64_t> warm_start_hits = 0;
+    // Hits on the entries added by the cache warm-up, see CACHE_WARM_UP_UID.
+    std::atomic<uint64_t> warm_up_hits = 0;
 
   private:
+    static int get_flag_in_range(std::string_view flag, int default_value, int lower_bound,
+                                 int upper_bound) {
+        int value = android::net::Experiments::getInstance()->getFlag(flag, default_value);
+        if (value < lower_bound || value > upper_bound) {
+            LOG(ERROR) << "Misconfiguration on " << flag << " " << value;
+            value = default_value;
+        }
+        return value;
+    }
+
     int get_max_cache_entries_from_flag() {
         int entries = android::net::Experiments::getInstance()->getFlag("max_cache_entries",
                                                                         MAX_ENTRIES_DEFAULT);
@@ -1016,12 +1434,15 @@ struct Cache {
         return entries;
     }
 
-    const int max_cache_entries;
+    // Read without the lock by resolv_get_max_cache_entries() and the dump.
+    std::atomic<int> max_cache_entries;
+    // The value of the max_cache_entries flag last followed.
+    int flag_max_cache_entries;
 };
 
 struct NetConfig {
     explicit NetConfig(unsigned netId) : netid(netId) {
-        cache = std::make_unique<Cache>();
+        cache = std::make_shared<Cache>();
         dns_event_subsampling_map = resolv_get_dns_event_subsampling_map(false);
         mdns_event_subsampling_map = resolv_get_dns_event_subsampling_map(true);
     }
@@ -1044,14 +1465,21 @@ struct NetConfig {
         return 0;
     }
     const unsigned netid;
-    std::unique_ptr<Cache> cache;
+    // Lock protecting everything in this NetConfig except |cache| and |cache_fingerprint|, and
+    // the atomic counters.
+    std::mutex mutex;
+    // The cache of this network. It's replaced when the network starts or stops sharing its
+    // cache, see resolv_set_nameservers(). The Cache has its own lock.
+    std::shared_ptr<Cache> cache GUARDED_BY(cache_mutex);
+    // The resolver fingerprint under which |cache| is shared, or 0 if it isn't shared.
+    uint64_t cache_fingerprint GUARDED_BY(cache_mutex) = 0;
     std::vector<std::string> nameservers;
     std::vector<IPSockAddr> nameserverSockAddrs;
     int revision_id = 0;  // # times the nameservers have been replaced
     res_params params{};
     res_stats nsstats[MAXNS]{};
     std::vector<std::string> search_domains;
-    int wait_for_pending_req_timeout_count = 0;
+    std::atomic<int> wait_for_pending_req_timeout_count = 0;
     // Map format: ReturnCode:rate_denom
     std::unordered_map<int, uint32_t> dns_event_subsampling_map;
     std::unordered_map<int, uint32_t> mdns_event_subsampling_map;
@@ -1068,55 +1496,38 @@ struct NetConfig {
     std::vector<int32_t> transportTypes;
     bool metered = false;
     std::vector<std::string> interfaceNames;
+    // See netconfig_signature_locked().
+    uint64_t signature = 0;
 };
 
 /* gets cache associated with a network, or NULL if none exists */
-static Cache* find_named_cache_locked(unsigned netid) REQUIRES(cache_mutex);
-
-// Return true - if there is a pending request in |cache| matching |key|.
-// Return false - if no pending request is found matching the key. Optionally
-//                link a new one if parameter append_if_not_found is true.
-static bool cache_has_pending_request_locked(Cache* cache, const Entry* key,
-                                             bool append_if_not_found) {
-    if (!cache || !key) return false;
-
-    Cache::pending_req_info* ri = cache->pending_requests.next;
-    Cache::pending_req_info* prev = &cache->pending_requests;
-    while (ri) {
-        if (ri->hash == key->hash) {
-            return true;
-        }
-        prev = ri;
-        ri = ri->next;
-    }
+static std::shared_ptr<Cache> find_named_cache(unsigned netid) EXCLUDES(cache_mutex);
 
-    if (append_if_not_found) {
-        ri = (Cache::pending_req_info*)calloc(1, sizeof(Cache::pending_req_info));
-        if (ri) {
-            ri->hash = key->hash;
-            prev->next = ri;
-        }
+// Evicts entries from the largest caches until all the caches use at most |max_bytes|.
+static void cache_enforce_global_budget(size_t max_bytes) EXCLUDES(cache_mutex);
+
+// Return the pending request in |cache| matching |key|, if any. Otherwise, register a new
+// one for the caller to complete and return nullptr.
+static std::shared_ptr<Cache::PendingRequest> cache_get_pending_request_locked(
+        Cache* cache, const Entry* key) {
+    auto [it, inserted] = cache->pending_requests.try_emplace(key->hash);
+    if (inserted) {
+        it->second = std::make_shared<Cache::PendingRequest>();
+        return nullptr;
     }
-    return false;
+    return it->second;
 }
 
-// Notify all threads that the cache entry |key| has become available
+// Notify the threads waiting for the pending request matching |key| that the cache entry
+// has become available, or won't.
 static void cache_notify_waiting_tid_locked(struct Cache* cache, const Entry* key) {
     if (!cache || !key) return;
 
-    Cache::pending_req_info* ri = cache->pending_requests.next;
-    Cache::pending_req_info* prev = &cache->pending_requests;
-    while (ri) {
-        if (ri->hash == key->hash) {
-            // remove item from list and destroy
-            prev->next = ri->next;
-            free(ri);
-            cv.notify_all();
-            return;
-        }
-        prev = ri;
-        ri = ri->next;
-    }
+    const auto it = cache->pending_requests.find(key->hash);
+    if (it == cache->pending_requests.end()) return;
+
+    it->second->complete();
+    cache->pending_requests.erase(it);
 }
 
 void _resolv_cache_query_failed(unsigned netid, span<const uint8_t> query, uint32_t flags) {
@@ -1125,19 +1536,20 @@ void _resolv_cache_query_failed(unsigned netid, span<const uint8_t> query, uint3
         return;
     }
     Entry key[1];
+    uint8_t keybuf[MAX_KEY_SIZE];
 
-    if (!entry_init_key(key, query)) return;
-
-    std::lock_guard guard(cache_mutex);
+    if (!entry_init_key(key, query, keybuf)) return;
 
-    Cache* cache = find_named_cache_locked(netid);
+    const auto cache = find_named_cache(netid);
+    if (cache == nullptr) return;
 
-    if (cache) {
-        cache_notify_waiting_tid_locked(cache, key);
-    }
+    std::lock_guard guard(cache->mutex);
+    cache_notify_waiting_tid_locked(cache.get(), key);
 }
 
 static void cache_dump_mru_locked(Cache* cache) {
+    if (!WOULD_LOG(DEBUG)) return;
+
     std::string buf = fmt::format("MRU LIST ({:2d}): ", cache->num_entries);
     for (Entry* e = cache->mru_list.mru_next; e != &cache->mru_list; e = e->mru_next) {
         fmt::format_to(std::back_inserter(buf), " {}", e->id);
@@ -1146,53 +1558,214 @@ static void cache_dump_mru_locked(Cache* cache) {
     LOG(DEBUG) << __func__ << ": " << buf;
 }
 
-/* This function tries to find a key within the hash table
- * In case of success, it will return a *pointer* to the hashed key.
- * In case of failure, it will return a *pointer* to NULL
+// Return the first slot of the probe sequence of |hash|. All the bits of the hashes are well
+// mixed, see _cache_hashKey(), so the top ones are used as they are.
+static size_t _cache_home_slot(const HashTable& table, unsigned hash) {
+    return hash >> table.shift;
+}
+
+static Entry** _table_lookup_p(HashTable& table, Entry* key, uint32_t generation) {
+    const size_t mask = table.slots.size() - 1;
+    size_t index = _cache_home_slot(table, key->hash);
+
+    while (table.slots[index] != NULL) {
+        if (table.hashes[index] == key->hash && table.slots[index]->generation == generation &&
+            entry_equals(table.slots[index], key)) {
+            break;
+        }
+        index = (index + 1) & mask;
+    }
+    return &table.slots[index];
+}
+
+/* This function tries to find a key within the hash tables.
+ * In case of success, it will return a *pointer* to the slot of the entry.
+ * In case of failure, it will return a *pointer* to an empty slot.
  *
  * So, the caller must check '*result' to check for success/failure.
  *
  * The main idea is that the result can later be used directly in
- * calls to resolv_cache_add or _resolv_cache_remove as the 'lookup'
- * parameter. This makes the code simpler and avoids re-searching
- * for the key position in the htable.
+ * calls to _cache_add_p or _cache_remove_p as the 'lookup' parameter.
+ * This makes the code simpler and avoids re-searching for the key
+ * position in the table.
  *
- * The result of a lookup_p is only valid until you alter the hash
- * table.
+ * While the cache is being resized, the entries not moved yet are found in the
+ * old table, but a failed lookup always returns an empty slot of the new one.
+ *
+ * The result of a lookup_p is only valid until you alter the hash tables.
  */
 static Entry** _cache_lookup_p(Cache* cache, Entry* key) {
-    int index = key->hash % cache->get_max_cache_entries();
-    Entry** pnode = (Entry**) &cache->entries[index];
-
-    while (*pnode != NULL) {
-        Entry* node = *pnode;
-
-        if (node == NULL) break;
-
-        if (node->hash == key->hash && entry_equals(node, key)) break;
-
-        pnode = &node->hlink;
+    Entry** lookup = _table_lookup_p(cache->table, key, cache->generation);
+    if (*lookup == NULL && !cache->old_table.slots.empty()) {
+        Entry** old_lookup = _table_lookup_p(cache->old_table, key, cache->generation);
+        if (*old_lookup != NULL) return old_lookup;
     }
-    return pnode;
+    return lookup;
 }
 
-/* Add a new entry to the hash table. 'lookup' must be the
- * result of an immediate previous failed _lookup_p() call
- * (i.e. with *lookup == NULL), and 'e' is the pointer to the
- * newly created entry
+/* Return the table holding the slot 'lookup'.
  */
-static void _cache_add_p(Cache* cache, Entry** lookup, Entry* e) {
-    *lookup = e;
-    e->id = ++cache->last_id;
-    entry_mru_add(e, &cache->mru_list);
-    cache->num_entries += 1;
+static HashTable& _cache_table_of(Cache* cache, Entry** lookup) {
+    const std::vector<Entry*>& old_slots = cache->old_table.slots;
+    if (!old_slots.empty() && !std::less<>()(lookup, old_slots.data()) &&
+        std::less<>()(lookup, old_slots.data() + old_slots.size())) {
+        return cache->old_table;
+    }
+    return cache->table;
+}
 
-    LOG(DEBUG) << __func__ << ": entry " << e->id << " added (count=" << cache->num_entries << ")";
+static ReverseIndexNode** _table_reverse_bucket(HashTable& table, const uint8_t* addr,
+                                                size_t addrlen) {
+    return &table.reverse_index[_cache_home_slot(table, _cache_hashKey(addr, addrlen))];
+}
+
+/* Calls fn(rdata, rdlen) for each A and AAAA record in the answer of 'e'.
+ */
+template <typename Fn>
+static void entry_for_each_address(const Entry* e, Fn fn) {
+    ns_msg handle;
+    if (ns_initparse(e->answer, e->answerlen, &handle) < 0) return;
+
+    for (int n = 0; n < ns_msg_count(handle, ns_s_an); n++) {
+        ns_rr rr;
+        if (ns_parserr(&handle, ns_s_an, n, &rr)) continue;
+        if ((ns_rr_type(rr) == ns_t_a && ns_rr_rdlen(rr) == sizeof(in_addr)) ||
+            (ns_rr_type(rr) == ns_t_aaaa && ns_rr_rdlen(rr) == sizeof(in6_addr))) {
+            fn(ns_rr_rdata(rr), ns_rr_rdlen(rr));
+        }
+    }
+}
+
+static void _cache_reverse_index_add(Cache* cache, Entry* e) {
+    entry_for_each_address(e, [cache, e](const uint8_t* addr, size_t addrlen) {
+        void* block = cache->allocator->allocate(sizeof(ReverseIndexNode));
+        if (block == NULL) return;
+        ReverseIndexNode* node = new (block) ReverseIndexNode;
+        ReverseIndexNode** bucket = _table_reverse_bucket(cache->table, addr, addrlen);
+        node->next = *bucket;
+        node->entry = e;
+        node->addrlen = addrlen;
+        memcpy(node->addr, addr, addrlen);
+        *bucket = node;
+    });
+}
+
+static void _cache_reverse_index_remove(Cache* cache, Entry* e) {
+    entry_for_each_address(e, [cache, e](const uint8_t* addr, size_t addrlen) {
+        // The node is in the old table if the cache is being resized and its bucket hasn't
+        // been moved yet.
+        for (HashTable* table : {&cache->old_table, &cache->table}) {
+            if (table->slots.empty()) continue;
+            for (ReverseIndexNode** pnode = _table_reverse_bucket(*table, addr, addrlen);
+                 *pnode != NULL; pnode = &(*pnode)->next) {
+                ReverseIndexNode* node = *pnode;
+                if (node->entry == e && node->addrlen == addrlen &&
+                    memcmp(node->addr, addr, addrlen) == 0) {
+                    *pnode = node->next;
+                    cache->allocator->deallocate(node, sizeof(ReverseIndexNode));
+                    return;
+                }
+            }
+        }
+    });
+}
+
+/* Return the time from which 'e' may be removed from the cache, which is
+ * when it stops being servable as a stale answer.
+ */
+static time_t _cache_removal_time(const Cache* cache, const Entry* e) {
+    return e->expires + cache->serve_stale_max_age;
+}
+
+static void _cache_expiry_add(Cache* cache, Entry* e) {
+    Entry** bucket = &cache->expiry_wheel[_cache_removal_time(cache, e) % EXPIRY_WHEEL_SLOTS];
+    e->expiry_next = *bucket;
+    e->expiry_pprev = bucket;
+    if (*bucket != NULL) (*bucket)->expiry_pprev = &e->expiry_next;
+    *bucket = e;
+}
+
+static void _cache_expiry_remove(Entry* e) {
+    *e->expiry_pprev = e->expiry_next;
+    if (e->expiry_next != NULL) e->expiry_next->expiry_pprev = e->expiry_pprev;
+}
+
+static void _cache_uid_add(Cache* cache, Entry* e) {
+    Cache::UidEntries& entries = cache->uid_entries[e->uid];
+    e->uid_older = entries.newest;
+    e->uid_newer = NULL;
+    if (entries.newest != NULL) {
+        entries.newest->uid_newer = e;
+    } else {
+        entries.oldest = e;
+    }
+    entries.newest = e;
+    entries.count += 1;
+}
+
+static void _cache_uid_remove(Cache* cache, Entry* e) {
+    const auto it = cache->uid_entries.find(e->uid);
+    if (it == cache->uid_entries.end()) return; /* should not happen */
+    Cache::UidEntries& entries = it->second;
+    if (--entries.count == 0) {
+        cache->uid_entries.erase(it);
+        return;
+    }
+    (e->uid_newer != NULL ? e->uid_newer->uid_older : entries.newest) = e->uid_older;
+    (e->uid_older != NULL ? e->uid_older->uid_newer : entries.oldest) = e->uid_newer;
+}
+
+/* Add a new entry to the hash table. 'lookup' must be the
+ * result of an immediate previous failed _lookup_p() call
+ * (i.e. with *lookup == NULL), and 'e' is the pointer to the
+ * newly created entry
+ */
+static void _cache_add_p(Cache* cache, Entry** lookup, Entry* e) {
+    cache->table.hashes[lookup - cache->table.slots.data()] = e->hash;
+    *lookup = e;
+    e->id = ++cache->last_id;
+    e->generation = cache->generation;
+    if (cache->sketch != nullptr) {
+        e->in_window = true;
+        entry_mru_add(e, &cache->window_list);
+        cache->window_entries += 1;
+    } else {
+        entry_mru_add(e, &cache->mru_list);
+    }
+    _cache_reverse_index_add(cache, e);
+    _cache_expiry_add(cache, e);
+    _cache_uid_add(cache, e);
+    cache->num_entries += 1;
+    cache->bytes += entry_block_size(e);
+    sCacheBytes += entry_block_size(e);
+
+    LOG(DEBUG) << __func__ << ": entry " << e->id << " added (count=" << cache->num_entries << ")";
+}
+
+/* Empty the slot 'hole' of the hash table. The following entries of its
+ * probe sequence are shifted back when possible, so that no tombstones are
+ * needed. This invalidates the results of previous lookups.
+ */
+static void _cache_remove_slot(HashTable& table, size_t hole) {
+    const size_t mask = table.slots.size() - 1;
+    for (size_t next = (hole + 1) & mask; table.slots[next] != NULL; next = (next + 1) & mask) {
+        // The entry in |next| may only move to |hole| if its home slot isn't in (hole, next].
+        const size_t home = _cache_home_slot(table, table.hashes[next]);
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            table.slots[hole] = table.slots[next];
+            table.hashes[hole] = table.hashes[next];
+            hole = next;
+        }
+    }
+    table.slots[hole] = NULL;
 }
 
 /* Remove an existing entry from the hash table,
  * 'lookup' must be the result of an immediate previous
  * and succesful _lookup_p() call.
+ *
+ * This invalidates the results of previous lookups, see
+ * _cache_remove_slot().
  */
 static void _cache_remove_p(Cache* cache, Entry** lookup) {
     Entry* e = *lookup;
@@ -1201,53 +1774,400 @@ static void _cache_remove_p(Cache* cache, Entry** lookup) {
                << ")";
 
     entry_mru_remove(e);
-    *lookup = e->hlink;
-    entry_free(e);
+    if (e->in_window) cache->window_entries -= 1;
+    _cache_reverse_index_remove(cache, e);
+    _cache_expiry_remove(e);
+    _cache_uid_remove(cache, e);
+    cache->bytes -= entry_block_size(e);
+    sCacheBytes -= entry_block_size(e);
+    entry_free(*cache->allocator, e);
     cache->num_entries -= 1;
+
+    HashTable& table = _cache_table_of(cache, lookup);
+    _cache_remove_slot(table, lookup - table.slots.data());
 }
 
-/* Remove the oldest entry from the hash table.
+/* Remove the stale entries left by Cache::flush() from the hash table and the
+ * reverse index, visiting at most 'budget' slots and buckets. Returns true once
+ * a whole pass found no stale entry left, at which point the retired allocators
+ * may be released.
+ *
+ * A pass starts over when the cache is flushed again. Removing any entry may
+ * shift stale ones back into the slots already visited, so passes are repeated
+ * until none is left. Reverse index nodes don't move, so one pass is enough for
+ * them. While the cache is being resized, the stale entries of the old table are
+ * dropped by _cache_rehash_some() instead, and a pass starts over once it is done.
  */
-static void _cache_remove_oldest(Cache* cache) {
+static bool _cache_reclaim_some(Cache* cache, size_t budget) {
+    if (cache->reclaim_generation != cache->generation) {
+        cache->reclaim_generation = cache->generation;
+        cache->reclaim_cursor = 0;
+    }
+    HashTable& table = cache->table;
+    const size_t capacity = table.slots.size();
+    for (; budget > 0 && cache->reclaim_cursor < capacity; budget--, cache->reclaim_cursor++) {
+        const size_t index = cache->reclaim_cursor;
+        for (ReverseIndexNode** pnode = &table.reverse_index[index]; *pnode != NULL;) {
+            if ((*pnode)->entry->generation != cache->generation) {
+                *pnode = (*pnode)->next;
+            } else {
+                pnode = &(*pnode)->next;
+            }
+        }
+        // Removing a stale entry may shift another one into its slot.
+        while (table.slots[index] != NULL && table.slots[index]->generation != cache->generation) {
+            _cache_remove_slot(table, index);
+            cache->stale_entries -= 1;
+        }
+    }
+    if (cache->reclaim_cursor < capacity) return false;
+    if (cache->stale_entries > 0) {
+        cache->reclaim_cursor = 0;
+        return false;
+    }
+    return true;
+}
+
+/* Return the oldest entry of the main MRU list, or NULL if it is empty.
+ *
+ * Cache hits don't reorder the MRU list, they only mark the entry as referenced.
+ * Referenced entries found at the tail of the list get a second chance: they are
+ * moved back to the head of the list with their mark cleared. Since every mark is
+ * cleared at most once per call, this terminates after one pass over the list.
+ */
+static Entry* _cache_find_oldest(Cache* cache) {
     Entry* oldest = cache->mru_list.mru_prev;
-    Entry** lookup = _cache_lookup_p(cache, oldest);
+    while (oldest != &cache->mru_list &&
+           oldest->referenced.exchange(false, std::memory_order_relaxed)) {
+        entry_mru_remove(oldest);
+        entry_mru_add(oldest, &cache->mru_list);
+        oldest = cache->mru_list.mru_prev;
+    }
+    return (oldest != &cache->mru_list) ? oldest : NULL;
+}
+
+static void _cache_evict(Cache* cache, Entry* e) {
+    Entry** lookup = _cache_lookup_p(cache, e);
 
     if (*lookup == NULL) { /* should not happen */
-        LOG(INFO) << __func__ << ": OLDEST NOT IN HTABLE ?";
+        LOG(INFO) << __func__ << ": EVICTED ENTRY NOT IN HTABLE ?";
         return;
     }
-    LOG(DEBUG) << __func__ << ": Cache full - removing oldest";
-    res_pquery(std::span(oldest->query, oldest->querylen));
+    LOG(DEBUG) << __func__ << ": Cache full - removing entry " << e->id;
+    res_pquery(std::span(e->query, e->querylen));
     _cache_remove_p(cache, lookup);
 }
 
-/* Remove all expired entries from the hash table.
+/* Remove the oldest entry from the hash table, taken from the W-TinyLFU
+ * window if the main list is empty.
+ */
+static void _cache_remove_oldest(Cache* cache) {
+    if (Entry* oldest = _cache_find_oldest(cache); oldest != NULL) {
+        _cache_evict(cache, oldest);
+    } else if (cache->window_entries > 0) {
+        _cache_evict(cache, cache->window_list.mru_prev);
+    }
+}
+
+/* Return whether the hash table of 'cache' must be resized, or excess entries
+ * evicted, to follow its maximum number of entries.
+ */
+static bool _cache_needs_rehash(Cache* cache) {
+    const int max_entries = cache->get_max_cache_entries();
+    return !cache->old_table.slots.empty() || cache->num_entries > max_entries ||
+           cache->table.slots.size() != _table_capacity(max_entries);
+}
+
+/* Resize the hash table and the reverse index of 'cache' for its maximum number
+ * of entries, in at most 'budget' steps, each of which evicts an entry or moves
+ * a slot and a bucket. Returns true once the table has the right size.
+ *
+ * The excess entries are evicted first, so that the new table is never more
+ * than half full. The entries are then moved to it from the old table slot by
+ * slot, lookups searching both tables meanwhile, and the stale entries of a
+ * flush are dropped rather than moved. All the slots of the old table before
+ * rehash_cursor stay empty, since removing an entry only shifts the following
+ * ones of its probe sequence back.
+ */
+static bool _cache_rehash_some(Cache* cache, size_t budget) {
+    const int max_entries = cache->get_max_cache_entries();
+    for (; budget > 0 && cache->num_entries > max_entries; budget--) {
+        _cache_remove_oldest(cache);
+    }
+    HashTable& old_table = cache->old_table;
+    if (old_table.slots.empty()) {
+        if (cache->num_entries > max_entries) return false;
+        if (cache->table.slots.size() == _table_capacity(max_entries)) return true;
+        old_table = std::move(cache->table);
+        _table_init(&cache->table, max_entries);
+        cache->rehash_cursor = 0;
+        cache->reclaim_cursor = 0;
+    }
+
+    HashTable& table = cache->table;
+    const size_t mask = table.slots.size() - 1;
+    const size_t capacity = old_table.slots.size();
+    for (; budget > 0 && cache->rehash_cursor < capacity; budget--, cache->rehash_cursor++) {
+        const size_t index = cache->rehash_cursor;
+        for (ReverseIndexNode* node = old_table.reverse_index[index]; node != NULL;) {
+            ReverseIndexNode* next = node->next;
+            if (node->entry->generation == cache->generation) {
+                ReverseIndexNode** bucket = _table_reverse_bucket(table, node->addr, node->addrlen);
+                node->next = *bucket;
+                *bucket = node;
+            }
+            node = next;
+        }
+        old_table.reverse_index[index] = NULL;
+        // Removing the entry may shift another one into its slot.
+        while (Entry* e = old_table.slots[index]) {
+            const unsigned hash = old_table.hashes[index];
+            _cache_remove_slot(old_table, index);
+            if (e->generation != cache->generation) {
+                cache->stale_entries -= 1;
+                continue;
+            }
+            size_t free_slot = _cache_home_slot(table, hash);
+            while (table.slots[free_slot] != NULL) {
+                free_slot = (free_slot + 1) & mask;
+            }
+            table.slots[free_slot] = e;
+            table.hashes[free_slot] = hash;
+        }
+    }
+    if (cache->rehash_cursor < capacity) return false;
+
+    old_table = HashTable();
+    // The maximum may have changed again meanwhile.
+    return !_cache_needs_rehash(cache);
+}
+
+/* Remove the oldest entries of 'uid' while it has reached its quota, so that
+ * its new entry doesn't evict the entries of other UIDs.
+ */
+static void _cache_make_room_uid(Cache* cache, uid_t uid) {
+    if (cache->uid_quota_percent == 0) return;
+    const int quota = cache->get_uid_quota();
+    for (;;) {
+        const auto it = cache->uid_entries.find(uid);
+        if (it == cache->uid_entries.end() || it->second.count < quota) return;
+        _cache_evict(cache, it->second.oldest);
+        cache->uid_quota_evictions++;
+    }
+}
+
+/* Remove the oldest entries until an entry of 'size' bytes fits in the byte
+ * budget of the cache. Returns false if it can't, i.e. the entry is larger
+ * than the budget.
+ */
+static bool _cache_make_room_bytes(Cache* cache, size_t size) {
+    if (size > cache->max_cache_bytes) return false;
+    while (cache->bytes + size > cache->max_cache_bytes && cache->num_entries > 0) {
+        _cache_remove_oldest(cache);
+    }
+    return true;
+}
+
+/* Make room in the window, and in the cache if it is full, for a new entry
+ * with the W-TinyLFU policy.
+ *
+ * If the window is full, its oldest entry moves to the main list. If the
+ * cache is full too, it competes with the oldest entry of the main list: the
+ * one whose key was looked up less often recently is evicted.
+ */
+static void _cache_make_room_tinylfu(Cache* cache) {
+    const bool full = cache->num_entries >= cache->get_max_cache_entries();
+    if (cache->window_entries < cache->get_window_max_entries()) {
+        if (full) _cache_remove_oldest(cache);
+        return;
+    }
+
+    Entry* candidate = cache->window_list.mru_prev;
+    entry_mru_remove(candidate);
+    candidate->in_window = false;
+    cache->window_entries -= 1;
+
+    Entry* victim = full ? _cache_find_oldest(cache) : NULL;
+    entry_mru_add(candidate, &cache->mru_list);
+    if (!full) return;
+
+    if (victim == NULL ||
+        cache->sketch->frequency(candidate->hash) <= cache->sketch->frequency(victim->hash)) {
+        victim = candidate;
+    }
+    _cache_evict(cache, victim);
+}
+
+/* Remove the entries which have expired, and can't be served stale either,
+ * since the last call.
+ *
+ * Only the buckets of the expiry wheel for the seconds elapsed since then
+ * are swept, so the cost is proportional to the number of removed entries,
+ * plus the entries removable more than EXPIRY_WHEEL_SLOTS seconds later
+ * which share these buckets and are skipped.
  */
 static void _cache_remove_expired(Cache* cache) {
-    Entry* e;
-    time_t now = _time_now();
-
-    for (e = cache->mru_list.mru_next; e != &cache->mru_list;) {
-        // Entry is old, remove
-        if (now >= e->expires) {
-            Entry** lookup = _cache_lookup_p(cache, e);
-            if (*lookup == NULL) { /* should not happen */
-                LOG(INFO) << __func__ << ": ENTRY NOT IN HTABLE ?";
-                return;
+    const time_t now = _time_now();
+
+    if (now - cache->expiry_cursor >= EXPIRY_WHEEL_SLOTS) {
+        cache->expiry_cursor = now - EXPIRY_WHEEL_SLOTS + 1;
+    }
+    for (; cache->expiry_cursor <= now; cache->expiry_cursor++) {
+        Entry* e = cache->expiry_wheel[cache->expiry_cursor % EXPIRY_WHEEL_SLOTS];
+        while (e != NULL) {
+            Entry* next = e->expiry_next;
+            if (now >= _cache_removal_time(cache, e)) {
+                Entry** lookup = _cache_lookup_p(cache, e);
+                if (*lookup == NULL) { /* should not happen */
+                    LOG(INFO) << __func__ << ": ENTRY NOT IN HTABLE ?";
+                    return;
+                }
+                _cache_remove_p(cache, lookup);
             }
-            e = e->mru_next;
-            _cache_remove_p(cache, lookup);
-        } else {
-            e = e->mru_next;
+            e = next;
         }
     }
 }
 
+// Copy the answer of |e| to |answer|, adapted to the query with |options|: the records and
+// the AD bit that the query wouldn't have been answered with are left out. This only requires
+// the cache lock in shared mode: rather than moving |e| to the top of the MRU list, it marks it
+// as referenced so that _cache_remove_oldest() gives it a second chance.
+static ResolvCacheStatus cache_copy_answer(Entry* e, uint8_t options, span<uint8_t> answer,
+                                           int* answerlen) {
+    *answerlen = e->answerlen;
+    if (e->answerlen > static_cast<ptrdiff_t>(answer.size())) {
+        /* NOTE: we return UNSUPPORTED if the answer buffer is too short */
+        LOG(INFO) << __func__ << ": ANSWER TOO LONG";
+        return RESOLV_CACHE_UNSUPPORTED;
+    }
+
+    const uint8_t strip = e->dns_options & ~options & (DNS_OPTION_EDNS | DNS_OPTION_DO);
+    size_t len = 0;
+    if (strip != 0) len = answer_stripRecords(span(e->answer, e->answerlen), answer, strip);
+    if (len > 0) {
+        *answerlen = len;
+    } else {
+        memcpy(answer.data(), e->answer, e->answerlen);
+    }
+    if ((e->dns_options & DNS_OPTION_AD) && !(options & (DNS_OPTION_AD | DNS_OPTION_DO))) {
+        reinterpret_cast<HEADER*>(answer.data())->ad = 0;
+    }
+
+    // Avoid dirtying the cache line if the entry has been referenced already.
+    if (!e->referenced.load(std::memory_order_relaxed)) {
+        e->referenced.store(true, std::memory_order_relaxed);
+    }
+    if (e->hits.load(std::memory_order_relaxed) < PREFETCH_MIN_HITS_UPPER_BOUND) {
+        e->hits.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    LOG(INFO) << __func__ << ": FOUND IN CACHE entry=" << e;
+    return RESOLV_CACHE_FOUND;
+}
+
+// Return true if a background refresh of |e| has been requested.
+static bool entry_refresh_requested(const Entry* e) {
+    return e->next_refresh_age.load(std::memory_order_relaxed) != Entry::NO_REFRESH_REQUESTED;
+}
+
+// Try to claim the background refresh of |e|. Return true if the caller should refresh it,
+// which only one caller gets per REFRESH_RETRY_INTERVAL.
+static bool entry_request_refresh(Entry* e, time_t now) {
+    const int age = now - e->expires;
+    int next_refresh_age = e->next_refresh_age.load(std::memory_order_relaxed);
+    return age >= next_refresh_age &&
+           e->next_refresh_age.compare_exchange_strong(
+                   next_refresh_age, age + REFRESH_RETRY_INTERVAL, std::memory_order_relaxed);
+}
+
+// Return true if |cache| is in the warm start period of a snapshot load.
+static bool cache_in_warm_start(const Cache* cache, time_t now) {
+    const time_t loaded_at = cache->snapshot_loaded_at.load(std::memory_order_relaxed);
+    return loaded_at != 0 && now < loaded_at + CACHE_SNAPSHOT_WARM_START_PERIOD;
+}
+
+// Copy the answer of the fresh entry |e| to |answer|, adapted to the query with |options|.
+// Return RESOLV_CACHE_FOUND_REFRESH if the caller should prefetch it.
+static ResolvCacheStatus cache_copy_fresh_answer(Cache* cache, Entry* e, uint8_t options,
+                                                 time_t now, span<uint8_t> answer,
+                                                 int* answerlen) {
+    const ResolvCacheStatus status = cache_copy_answer(e, options, answer, answerlen);
+    if (status != RESOLV_CACHE_FOUND) return status;
+    if (cache_in_warm_start(cache, now)) cache->warm_start_hits++;
+    if (e->uid == CACHE_WARM_UP_UID) cache->warm_up_hits++;
+
+    time_t replaced_expires = e->replaced_expires.load(std::memory_order_relaxed);
+    if (replaced_expires != 0 && now >= replaced_expires &&
+        e->replaced_expires.compare_exchange_strong(replaced_expires, 0,
+                                                    std::memory_order_relaxed)) {
+        cache->prefetch_avoided_misses++;
+    }
+
+    if (cache->prefetch_ttl_percent > 0 &&
+        e->hits.load(std::memory_order_relaxed) >= cache->prefetch_min_hits &&
+        (e->expires - now) * 100 <= static_cast<time_t>(e->ttl) * cache->prefetch_ttl_percent &&
+        entry_request_refresh(e, now)) {
+        LOG(INFO) << __func__ << ": PREFETCHING ENTRY " << e;
+        cache->prefetches++;
+        return RESOLV_CACHE_FOUND_REFRESH;
+    }
+    return RESOLV_CACHE_FOUND;
+}
+
+// Return true if |e|, which has expired, may still be served as a stale answer.
+static bool cache_is_servable_stale(const Cache* cache, const Entry* e, time_t now) {
+    return now - e->expires < cache->serve_stale_max_age;
+}
+
+// Copy the answer of the stale entry |e| to |answer|, adapted to the query with |options|, and
+// cap its TTLs. Return RESOLV_CACHE_FOUND_REFRESH if the caller should refresh it.
+static ResolvCacheStatus cache_copy_stale_answer(Cache* cache, Entry* e, uint8_t options,
+                                                 time_t now, span<uint8_t> answer,
+                                                 int* answerlen) {
+    const ResolvCacheStatus status = cache_copy_answer(e, options, answer, answerlen);
+    if (status != RESOLV_CACHE_FOUND) return status;
+    if (cache_in_warm_start(cache, now)) cache->warm_start_hits++;
+    if (e->uid == CACHE_WARM_UP_UID) cache->warm_up_hits++;
+
+    answer_capTTL(answer.first(*answerlen), cache->serve_stale_ttl);
+
+    if (entry_request_refresh(e, now)) {
+        LOG(INFO) << __func__ << ": STALE ENTRY " << e << " NEEDS REFRESH";
+        return RESOLV_CACHE_FOUND_REFRESH;
+    }
+    return RESOLV_CACHE_FOUND;
+}
+
 // Get a NetConfig associated with a network, or nullptr if not found.
 static NetConfig* find_netconfig_locked(unsigned netid) REQUIRES(cache_mutex);
 
-ResolvCacheStatus resolv_cache_lookup(unsigned netid, span<const uint8_t> query,
-                                      span<uint8_t> answer, int* answerlen, uint32_t flags) {
+// Same as find_netconfig_locked(), but takes cache_mutex by itself. The returned NetConfig
+// remains valid even if the network is deleted in the meantime.
+static std::shared_ptr<NetConfig> find_netconfig(unsigned netid) EXCLUDES(cache_mutex);
+
+// Copy the answer of the entry of |key| if it's fresh or may be served stale, with the cache lock
+// only held in shared mode. Return RESOLV_CACHE_NOTFOUND otherwise.
+static ResolvCacheStatus cache_lookup_shared(Cache* cache, Entry* key, span<uint8_t> answer,
+                                             int* answerlen) {
+    std::shared_lock sharedLock(cache->mutex);
+    Entry* e = *_cache_lookup_p(cache, key);
+    if (e == NULL) return RESOLV_CACHE_NOTFOUND;
+    const time_t now = _time_now();
+    if (now < e->expires) {
+        return cache_copy_fresh_answer(cache, e, key->dns_options, now, answer, answerlen);
+    }
+    if (cache_is_servable_stale(cache, e, now)) {
+        return cache_copy_stale_answer(cache, e, key->dns_options, now, answer, answerlen);
+    }
+    return RESOLV_CACHE_NOTFOUND;
+}
+
+// Look up |query| like resolv_cache_lookup(), or like resolv_cache_lookup_async() if
+// |on_pending_done| isn't null.
+static ResolvCacheStatus cache_lookup(unsigned netid, span<const uint8_t> query,
+                                      span<uint8_t> answer, int* answerlen, uint32_t flags,
+                                      std::function<void()>* on_pending_done) {
     // Skip cache lookup, return RESOLV_CACHE_NOTFOUND directly so that it is
     // possible to cache the answer of this query.
     // If ANDROID_RESOLV_NO_CACHE_STORE is set, return RESOLV_CACHE_SKIP to skip possible cache
@@ -1258,6 +2178,7 @@ ResolvCacheStatus resolv_cache_lookup(unsigned netid, span<const uint8_t> query,
         return flags & ANDROID_RESOLV_NO_CACHE_STORE ? RESOLV_CACHE_SKIP : RESOLV_CACHE_NOTFOUND;
     }
     Entry key;
+    uint8_t keybuf[MAX_KEY_SIZE];
     Entry** lookup;
     Entry* e;
     time_t now;
@@ -1265,17 +2186,30 @@ ResolvCacheStatus resolv_cache_lookup(unsigned netid, span<const uint8_t> query,
     LOG(DEBUG) << __func__ << ": lookup";
 
     /* we don't cache malformed queries */
-    if (!entry_init_key(&key, query)) {
+    if (!entry_init_key(&key, query, keybuf)) {
         LOG(INFO) << __func__ << ": unsupported query";
         return RESOLV_CACHE_UNSUPPORTED;
     }
     /* lookup cache */
-    std::unique_lock lock(cache_mutex);
-    android::base::ScopedLockAssertion assume_lock(cache_mutex);
-    Cache* cache = find_named_cache_locked(netid);
-    if (cache == nullptr) {
+    const auto cachePtr = find_named_cache(netid);
+    if (cachePtr == nullptr) {
         return RESOLV_CACHE_UNSUPPORTED;
     }
+    Cache* cache = cachePtr.get();
+    if (cache->sketch != nullptr) cache->sketch->increment(key.hash);
+    if (cache->snapshot_loaded_at != 0 && cache_in_warm_start(cache, _time_now())) {
+        cache->warm_start_lookups++;
+    }
+
+    // Fast path for cache hits, which only need the lock in shared mode.
+    if (const ResolvCacheStatus status = cache_lookup_shared(cache, &key, answer, answerlen);
+        status != RESOLV_CACHE_NOTFOUND) {
+        return status;
+    }
+
+    // Slow path: the entry is missing or stale. Registering a pending request or removing the
+    // stale entry requires the exclusive lock, and the cache may have changed in the meantime.
+    std::unique_lock lock(cache->mutex);
 
     /* see the description of _lookup_p to understand this.
      * the function always return a non-NULL pointer.
@@ -1286,28 +2220,34 @@ ResolvCacheStatus resolv_cache_lookup(unsigned netid, span<const uint8_t> query,
     if (e == NULL) {
         LOG(DEBUG) << __func__ << ": NOT IN CACHE";
 
-        if (!cache_has_pending_request_locked(cache, &key, true)) {
+        // The RRsets cached from other answers may be enough to answer the query.
+        if (cache->rrsets != nullptr) {
+            if (const size_t len = cache->rrsets->synthesize(query, answer, _time_now());
+                len > 0) {
+                cache->rrset_synthesized_answers++;
+                *answerlen = len;
+                return RESOLV_CACHE_FOUND;
+            }
+        }
+
+        const auto request = cache_get_pending_request_locked(cache, &key);
+        if (request == nullptr) {
             return RESOLV_CACHE_NOTFOUND;
         }
+        if (on_pending_done != nullptr) {
+            request->callbacks.push_back(std::move(*on_pending_done));
+            return RESOLV_CACHE_PENDING;
+        }
 
         LOG(INFO) << __func__ << ": Waiting for previous request";
         // wait until (1) timeout OR
-        //            (2) cv is notified AND no pending request matching the |key|
-        // (cv notifier should delete pending request before sending notification.)
-        const bool ret = cv.wait_for(lock, std::chrono::seconds(PENDING_REQUEST_TIMEOUT),
-                                [netid, &cache, &key]() REQUIRES(cache_mutex) {
-                                    // Must update cache as it could have been deleted
-                                    cache = find_named_cache_locked(netid);
-                                    return !cache_has_pending_request_locked(cache, &key, false);
-                                });
-        if (!cache) {
-            return RESOLV_CACHE_NOTFOUND;
-        }
+        //            (2) the pending request matching |key| is completed or dropped.
+        // Only the completion of this request wakes us up. If the network is deleted, its
+        // cache is flushed, which drops all the pending requests.
+        const bool ret = request->cv.wait_for(lock, std::chrono::seconds(PENDING_REQUEST_TIMEOUT),
+                                              [&request]() { return request->done; });
         if (ret == false) {
-            NetConfig* info = find_netconfig_locked(netid);
-            if (info != NULL) {
-                info->wait_for_pending_req_timeout_count++;
-            }
+            resolv_cache_pending_request_timed_out(netid);
         }
         lookup = _cache_lookup_p(cache, &key);
         e = *lookup;
@@ -1318,6 +2258,10 @@ ResolvCacheStatus resolv_cache_lookup(unsigned netid, span<const uint8_t> query,
 
     now = _time_now();
 
+    if (now >= e->expires && cache_is_servable_stale(cache, e, now)) {
+        return cache_copy_stale_answer(cache, e, key.dns_options, now, answer, answerlen);
+    }
+
     /* remove stale entries here */
     if (now >= e->expires) {
         LOG(DEBUG) << __func__ << ": NOT IN CACHE (STALE ENTRY " << *lookup << "DISCARDED)";
@@ -1326,49 +2270,354 @@ ResolvCacheStatus resolv_cache_lookup(unsigned netid, span<const uint8_t> query,
         return RESOLV_CACHE_NOTFOUND;
     }
 
-    *answerlen = e->answerlen;
-    if (e->answerlen > static_cast<ptrdiff_t>(answer.size())) {
-        /* NOTE: we return UNSUPPORTED if the answer buffer is too short */
-        LOG(INFO) << __func__ << ": ANSWER TOO LONG";
-        return RESOLV_CACHE_UNSUPPORTED;
+    return cache_copy_fresh_answer(cache, e, key.dns_options, now, answer, answerlen);
+}
+
+ResolvCacheStatus resolv_cache_lookup(unsigned netid, span<const uint8_t> query,
+                                      span<uint8_t> answer, int* answerlen, uint32_t flags) {
+    return cache_lookup(netid, query, answer, answerlen, flags, nullptr);
+}
+
+ResolvCacheStatus resolv_cache_lookup_async(unsigned netid, span<const uint8_t> query,
+                                            span<uint8_t> answer, int* answerlen, uint32_t flags,
+                                            std::function<void()> on_pending_done) {
+    return cache_lookup(netid, query, answer, answerlen, flags, &on_pending_done);
+}
+
+ResolvCacheStatus resolv_cache_probe(unsigned netid, span<const uint8_t> query,
+                                     span<uint8_t> answer, int* answerlen, uint32_t flags) {
+    if (flags & (ANDROID_RESOLV_NO_CACHE_LOOKUP | ANDROID_RESOLV_NO_CACHE_STORE)) {
+        return RESOLV_CACHE_NOTFOUND;
     }
+    Entry key;
+    uint8_t keybuf[MAX_KEY_SIZE];
+    if (!entry_init_key(&key, query, keybuf)) return RESOLV_CACHE_UNSUPPORTED;
+    const auto cachePtr = find_named_cache(netid);
+    if (cachePtr == nullptr) return RESOLV_CACHE_UNSUPPORTED;
+    Cache* cache = cachePtr.get();
+
+    const ResolvCacheStatus status = cache_lookup_shared(cache, &key, answer, answerlen);
+    // A miss is counted by the lookup which follows it.
+    if (status == RESOLV_CACHE_FOUND || status == RESOLV_CACHE_FOUND_REFRESH) {
+        if (cache->sketch != nullptr) cache->sketch->increment(key.hash);
+        if (cache->snapshot_loaded_at != 0 && cache_in_warm_start(cache, _time_now())) {
+            cache->warm_start_lookups++;
+        }
+    }
+    return status;
+}
 
-    memcpy(answer.data(), e->answer, e->answerlen);
+void resolv_cache_pending_request_timed_out(unsigned netid) {
+    if (const auto info = find_netconfig(netid); info != nullptr) {
+        info->wait_for_pending_req_timeout_count++;
+    }
+}
 
-    /* bump up this entry to the top of the MRU list */
-    if (e != cache->mru_list.mru_next) {
-        entry_mru_remove(e);
-        entry_mru_add(e, &cache->mru_list);
+static std::string sCacheSnapshotDir GUARDED_BY(cache_mutex) = CACHE_SNAPSHOT_DIR;
+
+static std::string cache_snapshot_dir() EXCLUDES(cache_mutex) {
+    std::lock_guard guard(cache_mutex);
+    return sCacheSnapshotDir;
+}
+
+void resolv_set_cache_snapshot_dir(const std::string& dir) {
+    std::lock_guard guard(cache_mutex);
+    sCacheSnapshotDir = dir;
+}
+
+// Save the entries of |cache| which haven't expired to the snapshot of the network with
+// |signature|.
+static void cache_save_snapshot(Cache* cache, uint64_t signature) {
+
+    CacheSnapshotWriter writer(signature);
+    {
+        // Hits don't reorder the lists, so they can be walked under the shared lock. Entries
+        // are saved from the least to the most recently used, so that loading them back in
+        // order restores the MRU order.
+        std::shared_lock guard(cache->mutex);
+        const time_t now = _time_now();
+        for (const Entry* list : {&cache->mru_list, &cache->window_list}) {
+            for (const Entry* e = list->mru_prev; e != list; e = e->mru_prev) {
+                if (now >= e->expires) continue;
+                writer.add({.expires = e->expires,
+                            .query = {e->query, static_cast<size_t>(e->querylen)},
+                            .answer = {e->answer, static_cast<size_t>(e->answerlen)}});
+            }
+        }
     }
 
-    LOG(INFO) << __func__ << ": FOUND IN CACHE entry=" << e;
-    return RESOLV_CACHE_FOUND;
+    const std::string dir = cache_snapshot_dir();
+    if (const auto result = writer.write(android::net::cacheSnapshotPath(dir, signature));
+        !result.ok()) {
+        LOG(WARNING) << __func__ << ": " << result.error().message();
+        return;
+    }
+    android::net::pruneCacheSnapshots(dir, CACHE_SNAPSHOT_MAX_FILES);
+    LOG(INFO) << __func__ << ": saved " << writer.recordCount() << " entries";
 }
 
-int resolv_cache_add(unsigned netid, span<const uint8_t> query, span<const uint8_t> answer) {
+// Return the thread saving the snapshots.
+static ThreadPool* cache_snapshot_thread() {
+    // Never destroyed: a snapshot may still be being saved at exit.
+    static ThreadPool* const thread =
+            new ThreadPool("CacheSnapshot", 1, CACHE_SNAPSHOT_MAX_QUEUED);
+    return thread;
+}
+
+// Save |cache| on the snapshot thread, then run |done|. Return false, without running |done|, if
+// snapshots are disabled for |cache| or too many of them are queued already.
+static bool cache_queue_snapshot(const std::shared_ptr<Cache>& cache,
+                                 std::function<void()> done = nullptr) {
+    const uint64_t signature = cache->signature;
+    if (cache->snapshot_interval == 0 || signature == 0) return false;
+
+    const int ret = cache_snapshot_thread()->enqueue([cache, signature, done = std::move(done)]() {
+        cache_save_snapshot(cache.get(), signature);
+        if (done) done();
+    });
+    if (ret != 0) {
+        LOG(WARNING) << __func__ << ": too many snapshots queued";
+        return false;
+    }
+    return true;
+}
+
+// Load the snapshot of the network with |signature| into |cache|, on the snapshot thread. Entries
+// are loaded with their remaining TTL, CACHE_SNAPSHOT_LOAD_BATCH of them each time the lock is
+// taken, so that lookups don't wait long.
+static void cache_load_snapshot(Cache* cache, uint64_t signature) {
+    Stopwatch stopwatch;
+    const auto snapshot = MappedCacheSnapshot::open(
+            android::net::cacheSnapshotPath(cache_snapshot_dir(), signature), signature);
+    if (!snapshot.ok()) {
+        LOG(INFO) << __func__ << ": " << snapshot.error().message();
+        return;
+    }
+
+    // The records go from the least to the most recently used, and are loaded in that order to
+    // restore it. If they don't all fit, skip the least recently used ones.
+    const std::vector<CacheSnapshotRecord>& records = (*snapshot)->records();
+    size_t first = records.size();
+    time_t now;
+    {
+        std::shared_lock guard(cache->mutex);
+        now = _time_now();
+        size_t entries = cache->num_entries;
+        size_t bytes = cache->bytes;
+        for (; first > 0; first--) {
+            const CacheSnapshotRecord& record = records[first - 1];
+            if (record.expires <= now) continue;
+            const size_t size = sizeof(Entry) + record.query.size() + record.answer.size();
+            if (entries >= static_cast<size_t>(cache->get_max_cache_entries()) ||
+                bytes + size > cache->max_cache_bytes) {
+                break;
+            }
+            entries++;
+            bytes += size;
+        }
+    }
+
+    int loaded = 0;
+    bool full = false;
+    for (size_t i = first; i < records.size() && !full;) {
+        std::lock_guard guard(cache->mutex);
+        now = _time_now();
+        for (const size_t end = std::min(i + CACHE_SNAPSHOT_LOAD_BATCH, records.size()); i < end;
+             i++) {
+            const CacheSnapshotRecord& record = records[i];
+            if (cache->num_entries >= cache->get_max_cache_entries() ||
+                cache->bytes + sizeof(Entry) + record.query.size() + record.answer.size() >
+                        cache->max_cache_bytes) {
+                full = true;
+                break;
+            }
+            Entry key;
+            uint8_t keybuf[MAX_KEY_SIZE];
+            if (record.expires <= now || !entry_init_key(&key, record.query, keybuf) ||
+                answer_getTTL(record.answer) == 0) {
+                continue;
+            }
+            Entry** lookup = _cache_lookup_p(cache, &key);
+            if (*lookup != NULL) continue;
+
+            Entry* e = entry_alloc(*cache->allocator, &key, record.answer);
+            if (e == NULL) {
+                full = true;
+                break;
+            }
+            e->expires = record.expires;
+            e->ttl = record.expires - now;
+            answer_capTTL(span((uint8_t*)e->answer, e->answerlen), e->ttl);
+            _cache_add_p(cache, lookup, e);
+            loaded++;
+        }
+    }
+
+    cache->snapshot_loaded_entries = loaded;
+    cache->snapshot_load_us = stopwatch.timeTakenUs();
+    cache->warm_start_lookups = 0;
+    cache->warm_start_hits = 0;
+    cache->snapshot_loaded_at = now;
+    LOG(INFO) << __func__ << ": loaded " << loaded << " entries in "
+              << cache->snapshot_load_us.load() << " us";
+}
+
+// Load the snapshot of the network with |signature| into |cache| in the background, unless the
+// signature of the cache is the same already.
+static void cache_queue_load_snapshot(const std::shared_ptr<Cache>& cache, uint64_t signature) {
+    if (cache->snapshot_interval == 0 || signature == 0 ||
+        cache->signature.exchange(signature) == signature) {
+        return;
+    }
+    // The snapshot thread runs its tasks in order, so if the network was just deleted, its
+    // snapshot is saved before being loaded.
+    const int ret = cache_snapshot_thread()->enqueue(
+            [cache, signature]() { cache_load_snapshot(cache.get(), signature); });
+    if (ret != 0) LOG(WARNING) << __func__ << ": too many snapshots queued";
+}
+
+void resolv_wait_for_cache_snapshots() {
+    std::promise<void> done;
+    if (cache_snapshot_thread()->enqueue([&done]() { done.set_value(); }) == 0) {
+        done.get_future().wait();
+    }
+}
+
+// Save |cache| in the background if its snapshot interval has elapsed.
+static void cache_schedule_snapshot_locked(const std::shared_ptr<Cache>& cache) {
+    if (cache->snapshot_interval == 0) return;
+    const time_t now = _time_now();
+    if (now < cache->next_snapshot) return;
+    cache->next_snapshot = now + cache->snapshot_interval;
+    cache_queue_snapshot(cache);
+}
+
+// The caches whose stale entries are being reclaimed, or which are being resized, in turn by the
+// reclaimer thread. See cache_reclaim_in_background().
+static std::mutex reclaim_mutex;
+static std::condition_variable reclaim_cv;
+static std::deque<std::shared_ptr<Cache>> sReclaimQueue GUARDED_BY(reclaim_mutex);
+static bool sReclaimerStarted GUARDED_BY(reclaim_mutex) = false;
+
+// Run a batch of the reclaim of |cache|. Return true once it's done, after releasing the memory of
+// the stale entries without the lock.
+static bool cache_reclaim_some_in_background(Cache* cache) {
+    std::vector<std::unique_ptr<SlabAllocator>> retired;
+    std::vector<std::unique_ptr<RRsetCache>> retiredRRsets;
+    {
+        std::lock_guard guard(cache->mutex);
+        // Without retired allocators, there are no stale entries to reclaim.
+        const bool done = _cache_rehash_some(cache, CACHE_RECLAIM_BATCH) &&
+                          (cache->retired_allocators.empty() ||
+                           _cache_reclaim_some(cache, CACHE_RECLAIM_BATCH));
+        if (!done) return false;
+        retired.swap(cache->retired_allocators);
+        retiredRRsets.swap(cache->retired_rrsets);
+        cache->reclaiming = false;
+    }
+    return true;
+}
+
+// Take turns reclaiming the queued caches, one batch at a time, pausing between the batches so
+// that lookups and other threads get the cache locks and the CPU.
+static void cache_reclaim_loop() {
+    android::netdutils::setThreadName("CacheReclaim");
+    while (true) {
+        std::shared_ptr<Cache> cache;
+        {
+            std::unique_lock lock(reclaim_mutex);
+            reclaim_cv.wait(lock, []() REQUIRES(reclaim_mutex) { return !sReclaimQueue.empty(); });
+            cache = std::move(sReclaimQueue.front());
+            sReclaimQueue.pop_front();
+        }
+        if (!cache_reclaim_some_in_background(cache.get())) {
+            std::lock_guard guard(reclaim_mutex);
+            sReclaimQueue.push_back(std::move(cache));
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(CACHE_RECLAIM_PAUSE_US));
+    }
+}
+
+// Reclaim the stale entries of |cache| and finish resizing it in the background, a batch of slots
+// each time the lock is taken so that lookups don't wait long.
+static void cache_reclaim_in_background(const std::shared_ptr<Cache>& cache) {
+    {
+        std::lock_guard guard(cache->mutex);
+        const bool idle = cache->retired_allocators.empty() && cache->retired_rrsets.empty() &&
+                          !_cache_needs_rehash(cache.get());
+        if (cache->reclaiming || idle) {
+            return;
+        }
+        cache->reclaiming = true;
+    }
+
+    {
+        std::lock_guard guard(reclaim_mutex);
+        sReclaimQueue.push_back(cache);
+        if (!sReclaimerStarted) {
+            // Never stopped: the thread waits for more caches to reclaim.
+            std::thread(cache_reclaim_loop).detach();
+            sReclaimerStarted = true;
+        }
+    }
+    reclaim_cv.notify_one();
+}
+
+// Resize the hash table of |cache| for its maximum number of entries: small tables at once, larger
+// ones in the background.
+static void cache_resize(const std::shared_ptr<Cache>& cache) {
+    {
+        std::lock_guard guard(cache->mutex);
+        const size_t capacity = _table_capacity(cache->get_max_cache_entries());
+        if (cache->old_table.slots.empty() &&
+            std::max(cache->table.slots.size(), capacity) <= CACHE_RECLAIM_INLINE_SLOTS) {
+            _cache_rehash_some(cache.get(), SIZE_MAX);
+            return;
+        }
+    }
+    cache_reclaim_in_background(cache);
+}
+
+int resolv_cache_add(unsigned netid, span<const uint8_t> query, span<const uint8_t> answer,
+                     uid_t uid) {
     Entry key[1];
     Entry* e;
     Entry** lookup;
     uint32_t ttl;
-    Cache* cache = NULL;
 
     /* don't assume that the query has already been cached
      */
-    if (!entry_init_key(key, query)) {
+    uint8_t keybuf[MAX_KEY_SIZE];
+    if (!entry_init_key(key, query, keybuf)) {
         LOG(INFO) << __func__ << ": passed invalid query?";
         return -EINVAL;
     }
 
-    std::lock_guard guard(cache_mutex);
-
-    cache = find_named_cache_locked(netid);
-    if (cache == nullptr) {
+    const auto cachePtr = find_named_cache(netid);
+    if (cachePtr == nullptr) {
         return -ENONET;
     }
+    Cache* cache = cachePtr.get();
+    std::unique_lock guard(cache->mutex);
+
+    _cache_remove_expired(cache);
+    cache_schedule_snapshot_locked(cachePtr);
 
     lookup = _cache_lookup_p(cache, key);
     e = *lookup;
 
+    // Replace the entry if it is being refreshed in the background, or if it has expired,
+    // e.g. it is served stale or hasn't been looked up since it expired.
+    time_t replaced_expires = 0;
+    if (e != NULL && (_time_now() >= e->expires || entry_refresh_requested(e))) {
+        if (_time_now() < e->expires) {
+            replaced_expires = e->expires;
+        }
+        _cache_remove_p(cache, lookup);
+        lookup = _cache_lookup_p(cache, key);
+        e = *lookup;
+    }
+
     // Should only happen on ANDROID_RESOLV_NO_CACHE_LOOKUP
     if (e != NULL) {
         LOG(INFO) << __func__ << ": ALREADY IN CACHE (" << e << ") ? IGNORING ADD";
@@ -1376,33 +2625,49 @@ int resolv_cache_add(unsigned netid, span<const uint8_t> query, span<const uint8
         return -EEXIST;
     }
 
-    if (cache->num_entries >= cache->get_max_cache_entries()) {
-        _cache_remove_expired(cache);
-        if (cache->num_entries >= cache->get_max_cache_entries()) {
+    // Answers which can't be cached don't evict any entry.
+    ttl = answer_getTTL(answer);
+    if (ttl > 0) {
+        const int num_entries = cache->num_entries;
+        _cache_make_room_uid(cache, uid);
+        if (cache->sketch != nullptr) {
+            _cache_make_room_tinylfu(cache);
+        } else if (cache->num_entries >= cache->get_max_cache_entries()) {
             _cache_remove_oldest(cache);
         }
-        // TODO: It looks useless, remove below code after having test to prove it.
-        lookup = _cache_lookup_p(cache, key);
-        e = *lookup;
-        if (e != NULL) {
-            LOG(INFO) << __func__ << ": ALREADY IN CACHE (" << e << ") ? IGNORING ADD";
-            cache_notify_waiting_tid_locked(cache, key);
-            return -EEXIST;
+        const bool fits =
+                _cache_make_room_bytes(cache, sizeof(Entry) + key->querylen + answer.size());
+        if (cache->num_entries != num_entries) {
+            // Removing an entry may have moved the others around, look up the key again.
+            lookup = _cache_lookup_p(cache, key);
+            e = *lookup;
+            if (e != NULL) {
+                LOG(INFO) << __func__ << ": ALREADY IN CACHE (" << e << ") ? IGNORING ADD";
+                cache_notify_waiting_tid_locked(cache, key);
+                return -EEXIST;
+            }
         }
-    }
 
-    ttl = answer_getTTL(answer);
-    if (ttl > 0) {
-        e = entry_alloc(key, answer);
+        e = fits ? entry_alloc(*cache->allocator, key, answer) : NULL;
         if (e != NULL) {
             e->expires = ttl + _time_now();
+            e->ttl = ttl;
+            e->replaced_expires = replaced_expires;
+            e->uid = uid;
             _cache_add_p(cache, lookup, e);
         }
     }
+    if (cache->rrsets != nullptr) {
+        cache->rrsets->add(answer, _time_now());
+    }
 
     cache_dump_mru_locked(cache);
     cache_notify_waiting_tid_locked(cache, key);
+    guard.unlock();
 
+    if (sCacheBytes > cache->max_cache_bytes_global) {
+        cache_enforce_global_budget(cache->max_cache_bytes_global);
+    }
     return 0;
 }
 
@@ -1419,78 +2684,68 @@ bool resolv_gethostbyaddr_from_cache(unsigned netid, char domain_name[], size_t
         return false;
     }
 
-    Cache* cache = nullptr;
-    Entry* node = nullptr;
-
-    ns_rr rr;
-    ns_msg handle;
-    ns_rr rr_query;
-
-    struct sockaddr_in sa;
-    struct sockaddr_in6 sa6;
-    char* addr_buf = nullptr;
-
-    std::lock_guard guard(cache_mutex);
+    in6_addr addr;
+    const size_t addrlen = (af == AF_INET) ? sizeof(in_addr) : sizeof(in6_addr);
+    if (inet_pton(af, ip_address, &addr) != 1) {
+        LOG(WARNING) << __func__ << ": inet_pton() fail";
+        return false;
+    }
 
-    cache = find_named_cache_locked(netid);
+    const auto cache = find_named_cache(netid);
     if (cache == nullptr) {
         return false;
     }
-
-    for (node = cache->mru_list.mru_next; node != nullptr && node != &cache->mru_list;
-         node = node->mru_next) {
-        if (node->answer == nullptr) {
-            continue;
+    std::shared_lock guard(cache->mutex);
+
+    // If several entries have this address, prefer the most recently added one.
+    const uint8_t* addr_bytes = reinterpret_cast<const uint8_t*>(&addr);
+    Entry* found = nullptr;
+    for (HashTable* table : {&cache->old_table, &cache->table}) {
+        if (table->slots.empty()) continue;
+        for (const ReverseIndexNode* node = *_table_reverse_bucket(*table, addr_bytes, addrlen);
+             node != nullptr; node = node->next) {
+            if (node->entry->generation == cache->generation && node->addrlen == addrlen &&
+                memcmp(node->addr, addr_bytes, addrlen) == 0 &&
+                (found == nullptr || node->entry->id > found->id)) {
+                found = node->entry;
+            }
         }
+    }
+    if (found == nullptr) {
+        return false;
+    }
 
-        memset(&handle, 0, sizeof(handle));
-
-        if (ns_initparse(node->answer, node->answerlen, &handle) < 0) {
+    ns_msg handle;
+    if (ns_initparse(found->answer, found->answerlen, &handle) < 0) {
+        return false;
+    }
+    const int query_count = ns_msg_count(handle, ns_s_qd);
+    for (int i = 0; i < query_count; i++) {
+        ns_rr rr_query;
+        if (ns_parserr(&handle, ns_s_qd, i, &rr_query)) {
             continue;
         }
-
-        for (int n = 0; n < ns_msg_count(handle, ns_s_an); n++) {
-            memset(&rr, 0, sizeof(rr));
-
-            if (ns_parserr(&handle, ns_s_an, n, &rr)) {
-                continue;
-            }
-
-            if (ns_rr_type(rr) == ns_t_a && af == AF_INET) {
-                addr_buf = (char*)&(sa.sin_addr);
-            } else if (ns_rr_type(rr) == ns_t_aaaa && af == AF_INET6) {
-                addr_buf = (char*)&(sa6.sin6_addr);
-            } else {
-                continue;
-            }
-
-            if (inet_pton(af, ip_address, addr_buf) != 1) {
-                LOG(WARNING) << __func__ << ": inet_pton() fail";
-                return false;
-            }
-
-            if (memcmp(ns_rr_rdata(rr), addr_buf, ns_rr_rdlen(rr)) == 0) {
-                int query_count = ns_msg_count(handle, ns_s_qd);
-                for (int i = 0; i < query_count; i++) {
-                    memset(&rr_query, 0, sizeof(rr_query));
-                    if (ns_parserr(&handle, ns_s_qd, i, &rr_query)) {
-                        continue;
-                    }
-                    strlcpy(domain_name, ns_rr_name(rr_query), domain_name_size);
-                    if (domain_name[0] != '\0') {
-                        return true;
-                    }
-                }
-            }
+        strlcpy(domain_name, ns_rr_name(rr_query), domain_name_size);
+        if (domain_name[0] != '\0') {
+            return true;
         }
     }
-
     return false;
 }
 
-static std::unordered_map<unsigned, std::unique_ptr<NetConfig>> sNetConfigMap
+static std::unordered_map<unsigned, std::shared_ptr<NetConfig>> sNetConfigMap
         GUARDED_BY(cache_mutex);
 
+// The caches shared by the networks with the same resolver fingerprint, if the cache_sharing
+// flag is set. See resolv_set_nameservers().
+static std::unordered_map<uint64_t, std::weak_ptr<Cache>> sSharedCaches GUARDED_BY(cache_mutex);
+
+// Returns the number of networks using |cache|.
+static int cache_users_locked(const Cache* cache) REQUIRES(cache_mutex) {
+    return std::count_if(sNetConfigMap.begin(), sNetConfigMap.end(),
+                         [cache](const auto& it) { return it.second->cache.get() == cache; });
+}
+
 // Clears nameservers set for |netconfig| and clears the stats
 static void free_nameservers_locked(NetConfig* netconfig);
 // Order-insensitive comparison for the two set of servers.
@@ -1501,9 +2756,10 @@ static void res_cache_clear_stats_locked(NetConfig* netconfig);
 
 // public API for netd to query if name server is set on specific netid
 bool resolv_has_nameservers(unsigned netid) {
-    std::lock_guard guard(cache_mutex);
-    NetConfig* info = find_netconfig_locked(netid);
-    return (info != nullptr) && (info->nameserverCount() > 0);
+    const auto info = find_netconfig(netid);
+    if (info == nullptr) return false;
+    std::lock_guard guard(info->mutex);
+    return info->nameserverCount() > 0;
 }
 
 int resolv_create_cache_for_net(unsigned netid) {
@@ -1513,27 +2769,82 @@ int resolv_create_cache_for_net(unsigned netid) {
         return -EEXIST;
     }
 
-    sNetConfigMap[netid] = std::make_unique<NetConfig>(netid);
+    sNetConfigMap[netid] = std::make_shared<NetConfig>(netid);
 
     return 0;
 }
 
 void resolv_delete_cache_for_net(unsigned netid) {
-    std::lock_guard guard(cache_mutex);
-    sNetConfigMap.erase(netid);
+    std::shared_ptr<Cache> cache;
+    bool shared;
+    {
+        std::lock_guard guard(cache_mutex);
+        auto it = sNetConfigMap.find(netid);
+        if (it == sNetConfigMap.end()) return;
+        cache = it->second->cache;
+        const uint64_t fingerprint = it->second->cache_fingerprint;
+        sNetConfigMap.erase(it);
+        shared = cache_users_locked(cache.get()) > 0;
+        // The cache is only flushed once saved, which mustn't flush it for a network with the
+        // same resolvers set up in the meantime: that network gets a cache of its own.
+        if (!shared && fingerprint != 0) sSharedCaches.erase(fingerprint);
+    }
+
+    // The other networks sharing the cache keep the entries and the pending requests, which they
+    // may be waiting for too.
+    if (shared) return;
+
+    // Other threads may still hold a reference to the deleted NetConfig. Flush the cache rather
+    // than leaving the entries alive until the last reference is dropped. The threads waiting for
+    // its pending requests are woken up right away, but the entries are only flushed once saved.
+    {
+        std::lock_guard guard(cache->mutex);
+        cache->flushPendingRequests();
+    }
+    const bool queued = cache_queue_snapshot(cache, [cache]() {
+        std::lock_guard guard(cache->mutex);
+        cache->flush();
+    });
+    if (!queued) {
+        std::lock_guard guard(cache->mutex);
+        cache->flush();
+    }
 }
 
 int resolv_flush_cache_for_net(unsigned netid) {
-    std::lock_guard guard(cache_mutex);
-
-    NetConfig* netconfig = find_netconfig_locked(netid);
+    const auto netconfig = find_netconfig(netid);
     if (netconfig == nullptr) {
         return -ENONET;
     }
-    netconfig->cache->flush();
+    // If the cache is shared, this flushes it for all the networks sharing it.
+    if (const auto cache = find_named_cache(netid); cache != nullptr) {
+        {
+            std::lock_guard guard(cache->mutex);
+            cache->flush();
+        }
+        cache_reclaim_in_background(cache);
+    }
 
     // Also clear the NS statistics.
-    res_cache_clear_stats_locked(netconfig);
+    std::lock_guard guard(netconfig->mutex);
+    res_cache_clear_stats_locked(netconfig.get());
+    return 0;
+}
+
+int resolv_resize_cache_for_net(unsigned netid, int max_entries) {
+    if (max_entries < MAX_ENTRIES_LOWER_BOUND || max_entries > MAX_ENTRIES_UPPER_BOUND) {
+        return -EINVAL;
+    }
+    // If the cache is shared, this resizes it for all the networks sharing it.
+    const auto cache = find_named_cache(netid);
+    if (cache == nullptr) {
+        return -ENONET;
+    }
+    {
+        std::lock_guard guard(cache->mutex);
+        cache->set_max_cache_entries(max_entries);
+    }
+    cache_resize(cache);
     return 0;
 }
 
@@ -1547,9 +2858,51 @@ std::vector<unsigned> resolv_list_caches() {
     return result;
 }
 
-static Cache* find_named_cache_locked(unsigned netid) {
+static void cache_enforce_global_budget(size_t max_bytes) {
+    // The caches, largest first, listed once even if shared by several networks. Their sizes may
+    // change meanwhile, which only makes the eviction a bit less even.
+    std::vector<std::pair<size_t, std::shared_ptr<Cache>>> caches;
+    {
+        std::lock_guard guard(cache_mutex);
+        for (const auto& [netid, info] : sNetConfigMap) {
+            if (std::none_of(caches.begin(), caches.end(),
+                             [&info](const auto& it) { return it.second == info->cache; })) {
+                caches.emplace_back(info->cache->bytes, info->cache);
+            }
+        }
+    }
+    std::sort(caches.begin(), caches.end(),
+              [](const auto& a, const auto& b) { return a.first > b.first; });
+
+    // Evict from the largest caches down to the same size, so that the networks end up sharing the
+    // global budget evenly: find how many caches must shrink, and down to which size.
+    const size_t total = sCacheBytes;
+    if (total <= max_bytes) return;
+    const size_t excess = total - max_bytes;
+    size_t largest = 0;
+    size_t largest_bytes = 0;
+    size_t target_bytes = 0;
+    while (largest < caches.size()) {
+        largest_bytes += caches[largest++].first;
+        const size_t next_bytes = largest < caches.size() ? caches[largest].first : 0;
+        if (largest_bytes - largest * next_bytes >= excess) {
+            target_bytes = (largest_bytes - excess) / largest;
+            break;
+        }
+    }
+    for (size_t i = 0; i < largest && sCacheBytes > max_bytes; i++) {
+        Cache* cache = caches[i].second.get();
+        std::lock_guard guard(cache->mutex);
+        while (sCacheBytes > max_bytes && cache->num_entries > 0 && cache->bytes > target_bytes) {
+            _cache_remove_oldest(cache);
+        }
+    }
+}
+
+static std::shared_ptr<Cache> find_named_cache(unsigned netid) {
+    std::lock_guard guard(cache_mutex);
     NetConfig* info = find_netconfig_locked(netid);
-    if (info != nullptr) return info->cache.get();
+    if (info != nullptr) return info->cache;
     return nullptr;
 }
 
@@ -1560,10 +2913,18 @@ static NetConfig* find_netconfig_locked(unsigned netid) {
     return nullptr;
 }
 
-android::net::NetworkType resolv_get_network_types_for_net(unsigned netid) {
+static std::shared_ptr<NetConfig> find_netconfig(unsigned netid) {
     std::lock_guard guard(cache_mutex);
-    NetConfig* netconfig = find_netconfig_locked(netid);
+    if (auto it = sNetConfigMap.find(netid); it != sNetConfigMap.end()) {
+        return it->second;
+    }
+    return nullptr;
+}
+
+android::net::NetworkType resolv_get_network_types_for_net(unsigned netid) {
+    const auto netconfig = find_netconfig(netid);
     if (netconfig == nullptr) return android::net::NT_UNKNOWN;
+    std::lock_guard guard(netconfig->mutex);
     return convert_network_type(netconfig->transportTypes);
 }
 
@@ -1577,9 +2938,9 @@ bool is_mdns_supported_transport_types(const std::vector<int32_t>& transportType
 }
 
 bool is_mdns_supported_network(unsigned netid) {
-    std::lock_guard guard(cache_mutex);
-    NetConfig* netconfig = find_netconfig_locked(netid);
+    const auto netconfig = find_netconfig(netid);
     if (netconfig == nullptr) return false;
+    std::lock_guard guard(netconfig->mutex);
     return is_mdns_supported_transport_types(netconfig->transportTypes);
 }
 
@@ -1629,11 +2990,11 @@ bool isValidServer(const std::string& server) {
 }  // namespace
 
 std::vector<std::string> getCustomizedTableByName(const size_t netid, const char* hostname) {
-    std::lock_guard guard(cache_mutex);
-    NetConfig* netconfig = find_netconfig_locked(netid);
+    const auto netconfig = find_netconfig(netid);
 
     std::vector<std::string> result;
     if (netconfig != nullptr) {
+        std::lock_guard guard(netconfig->mutex);
         const auto& hosts = netconfig->customizedTable.equal_range(hostname);
         for (auto i = hosts.first; i != hosts.second; ++i) {
             result.push_back(i->second);
@@ -1643,11 +3004,86 @@ std::vector<std::string> getCustomizedTableByName(const size_t netid, const char
 }
 
 std::vector<std::string> resolv_get_interface_names(int netid) {
+    const auto netconfig = find_netconfig(netid);
+    if (netconfig == nullptr) return {};
+
+    std::lock_guard guard(netconfig->mutex);
+    return netconfig->interfaceNames;
+}
+
+// Continue the FNV-1a hash |hash| with |strings|. If |sorted| is true, the order of the strings
+// doesn't matter.
+static uint64_t hash_strings(uint64_t hash, std::vector<std::string> strings, bool sorted) {
+    if (sorted) std::sort(strings.begin(), strings.end());
+    for (const std::string& str : strings) {
+        for (const char c : str) {
+            hash = (hash ^ static_cast<uint8_t>(c)) * 0x100000001b3ULL;
+        }
+        hash = (hash ^ '\0') * 0x100000001b3ULL;
+    }
+    return (hash ^ '\n') * 0x100000001b3ULL;
+}
+
+constexpr uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325ULL;
+
+// Return a signature identifying the network of |netconfig| across netIds and resolver
+// restarts, or 0 if its DNS servers aren't known yet.
+static uint64_t netconfig_signature_locked(const NetConfig* netconfig) {
+    if (netconfig->nameservers.empty()) return 0;
+
+    uint64_t signature = hash_strings(FNV_OFFSET_BASIS, netconfig->nameservers, true);
+    signature = hash_strings(signature, netconfig->search_domains, false);
+    signature = hash_strings(signature, netconfig->interfaceNames, false);
+    return signature != 0 ? signature : 1;
+}
+
+// Return the fingerprint of the resolvers configured by |params|: the networks with the same
+// fingerprint get the same answers, and may share their cache. Returns 0 if cache sharing is
+// disabled, or if there are no DNS servers.
+static uint64_t resolver_fingerprint(const std::vector<std::string>& nameservers,
+                                     const ResolverParamsParcel& params) {
+    if (nameservers.empty() || !Experiments::getInstance()->getFlag("cache_sharing", 0)) return 0;
+
+    // Private DNS sends the queries to other servers, which may answer differently.
+    uint64_t fingerprint = hash_strings(FNV_OFFSET_BASIS, nameservers, true);
+    fingerprint = hash_strings(fingerprint, params.tlsServers, true);
+    fingerprint = hash_strings(fingerprint, {params.tlsName}, false);
+    return fingerprint != 0 ? fingerprint : 1;
+}
+
+// Make |netconfig| use the cache shared under |fingerprint|, or a cache of its own if it is 0.
+// A network leaving a shared cache, or changing resolvers while sharing is enabled, gets a new,
+// empty one. Returns the previous cache of the network if it changed, or nullptr.
+static std::shared_ptr<Cache> netconfig_share_cache(NetConfig* netconfig, uint64_t fingerprint)
+        EXCLUDES(cache_mutex) {
     std::lock_guard guard(cache_mutex);
+    if (fingerprint == netconfig->cache_fingerprint) return nullptr;
 
-    NetConfig* netconfig = find_netconfig_locked(netid);
-    if (netconfig != nullptr) return netconfig->interfaceNames;
-    return {};
+    std::shared_ptr<Cache> old_cache = netconfig->cache;
+    const bool old_cache_shared = cache_users_locked(old_cache.get()) > 1;
+    if (netconfig->cache_fingerprint != 0 && !old_cache_shared) {
+        sSharedCaches.erase(netconfig->cache_fingerprint);
+    }
+    std::erase_if(sSharedCaches, [](const auto& it) { return it.second.expired(); });
+
+    std::shared_ptr<Cache> cache;
+    if (fingerprint != 0) {
+        if (auto it = sSharedCaches.find(fingerprint); it != sSharedCaches.end()) {
+            cache = it->second.lock();
+        }
+    }
+    if (cache == nullptr) {
+        // Keep the current cache if no other network uses it, as when sharing is disabled, unless
+        // it holds the answers of other resolvers.
+        const bool reuse = !old_cache_shared && netconfig->cache_fingerprint == 0;
+        cache = reuse ? old_cache : std::make_shared<Cache>();
+        if (fingerprint != 0) sSharedCaches[fingerprint] = cache;
+    }
+    netconfig->cache = cache;
+    netconfig->cache_fingerprint = fingerprint;
+    LOG(INFO) << __func__ << ": netid = " << netconfig->netid << ", fingerprint = " << std::hex
+              << fingerprint << std::dec << ", users = " << cache_users_locked(cache.get());
+    return cache != old_cache ? old_cache : nullptr;
 }
 
 int resolv_set_nameservers(const ResolverParamsParcel& params) {
@@ -1666,11 +3102,10 @@ int resolv_set_nameservers(const ResolverParamsParcel& params) {
         ipSockAddrs.push_back(IPSockAddr::toIPSockAddr(server, 53));
     }
 
-    std::lock_guard guard(cache_mutex);
-    NetConfig* netconfig = find_netconfig_locked(netid);
-
+    const auto netconfig = find_netconfig(netid);
     if (netconfig == nullptr) return -ENONET;
 
+    std::unique_lock lock(netconfig->mutex);
     uint8_t old_max_samples = netconfig->params.max_samples;
 
     memset(&netconfig->params, 0, sizeof(netconfig->params));
@@ -1696,7 +3131,7 @@ int resolv_set_nameservers(const ResolverParamsParcel& params) {
 
     if (!resolv_is_nameservers_equal(netconfig->nameservers, params.servers)) {
         // free current before adding new
-        free_nameservers_locked(netconfig);
+        free_nameservers_locked(netconfig.get());
         netconfig->nameservers = std::move(nameservers);
         for (int i = 0; i < numservers; i++) {
             LOG(INFO) << __func__ << ": netid = " << netid
@@ -1710,7 +3145,7 @@ int resolv_set_nameservers(const ResolverParamsParcel& params) {
             // All other parameters do not affect shared state: Changing these parameters does
             // not invalidate the samples, as they only affect aggregation and the conditions
             // under which servers are considered usable.
-            res_cache_clear_stats_locked(netconfig);
+            res_cache_clear_stats_locked(netconfig.get());
         }
     }
 
@@ -1729,17 +3164,41 @@ int resolv_set_nameservers(const ResolverParamsParcel& params) {
     netconfig->interfaceNames = std::move(params.interfaceNames);
 
     if (params.resolverOptions.has_value()) {
-        return netconfig->setOptions(params.resolverOptions.value());
+        if (const int ret = netconfig->setOptions(params.resolverOptions.value()); ret != 0) {
+            return ret;
+        }
+    }
+
+    // The NetConfig and Cache locks are never held together.
+    const uint64_t signature = netconfig_signature_locked(netconfig.get());
+    netconfig->signature = signature;
+    const uint64_t fingerprint = resolver_fingerprint(netconfig->nameservers, params);
+    lock.unlock();
+
+    if (const auto old_cache = netconfig_share_cache(netconfig.get(), fingerprint);
+        old_cache != nullptr) {
+        // The pending requests of this network will complete in its new cache.
+        std::lock_guard guard(old_cache->mutex);
+        old_cache->flushPendingRequests();
+    }
+    if (const auto cache = find_named_cache(netid); cache != nullptr) {
+        bool resize;
+        {
+            std::lock_guard guard(cache->mutex);
+            resize = cache->follow_max_cache_entries_flag();
+        }
+        if (resize) cache_resize(cache);
+        cache_queue_load_snapshot(cache, signature);
     }
 
     return 0;
 }
 
 int resolv_set_options(unsigned netid, const ResolverOptionsParcel& options) {
-    std::lock_guard guard(cache_mutex);
-    NetConfig* netconfig = find_netconfig_locked(netid);
-
+    const auto netconfig = find_netconfig(netid);
     if (netconfig == nullptr) return -ENONET;
+
+    std::lock_guard guard(netconfig->mutex);
     return netconfig->setOptions(options);
 }
 
@@ -1768,10 +3227,10 @@ void resolv_populate_res_for_net(ResState* statp) {
     }
     LOG(DEBUG) << __func__ << ": netid=" << statp->netid;
 
-    std::lock_guard guard(cache_mutex);
-    NetConfig* info = find_netconfig_locked(statp->netid);
+    const auto info = find_netconfig(statp->netid);
     if (info == nullptr) return;
 
+    std::lock_guard guard(info->mutex);
     const bool sortNameservers = Experiments::getInstance()->getFlag("sort_nameservers", 0);
     statp->sort_nameservers = sortNameservers;
     statp->nsaddrs = sortNameservers ? info->dnsStats.getSortedServers(PROTO_UDP)
@@ -1816,10 +3275,10 @@ int android_net_res_stats_get_info_for_net(unsigned netid, int* nscount,
                                            char domains[MAXDNSRCH][MAXDNSRCHPATH],
                                            res_params* params, struct res_stats stats[MAXNS],
                                            int* wait_for_pending_req_timeout_count) {
-    std::lock_guard guard(cache_mutex);
-    NetConfig* info = find_netconfig_locked(netid);
+    const auto info = find_netconfig(netid);
     if (!info) return -1;
 
+    std::lock_guard guard(info->mutex);
     const int num = info->nameserverCount();
     if (num > MAXNS) {
         LOG(INFO) << __func__ << ": nscount " << num << " > MAXNS " << MAXNS;
@@ -1845,9 +3304,10 @@ int android_net_res_stats_get_info_for_net(unsigned netid, int* nscount,
 }
 
 std::vector<std::string> resolv_cache_dump_subsampling_map(unsigned netid, bool is_mdns) {
-    std::lock_guard guard(cache_mutex);
-    NetConfig* netconfig = find_netconfig_locked(netid);
+    const auto netconfig = find_netconfig(netid);
     if (netconfig == nullptr) return {};
+
+    std::lock_guard guard(netconfig->mutex);
     std::vector<std::string> result;
     const auto& subsampling_map = (!is_mdns) ? netconfig->dns_event_subsampling_map
                                              : netconfig->mdns_event_subsampling_map;
@@ -1867,9 +3327,10 @@ std::vector<std::string> resolv_cache_dump_subsampling_map(unsigned netid, bool
 //
 // Returns the subsampling rate if the event should be sampled, or 0 if it should be discarded.
 uint32_t resolv_cache_get_subsampling_denom(unsigned netid, int return_code, bool is_mdns) {
-    std::lock_guard guard(cache_mutex);
-    NetConfig* netconfig = find_netconfig_locked(netid);
+    const auto netconfig = find_netconfig(netid);
     if (netconfig == nullptr) return 0;  // Don't log anything at all.
+
+    std::lock_guard guard(netconfig->mutex);
     const auto& subsampling_map = (!is_mdns) ? netconfig->dns_event_subsampling_map
                                              : netconfig->mdns_event_subsampling_map;
     auto search_returnCode = subsampling_map.find(return_code);
@@ -1885,13 +3346,13 @@ uint32_t resolv_cache_get_subsampling_denom(unsigned netid, int return_code, boo
 
 int resolv_cache_get_resolver_stats(unsigned netid, res_params* params, res_stats stats[MAXNS],
                                     const std::vector<IPSockAddr>& serverSockAddrs) {
-    std::lock_guard guard(cache_mutex);
-    NetConfig* info = find_netconfig_locked(netid);
+    const auto info = find_netconfig(netid);
     if (!info) {
         LOG(WARNING) << __func__ << ": NetConfig for netid " << netid << " not found";
         return -1;
     }
 
+    std::lock_guard guard(info->mutex);
     for (size_t i = 0; i < serverSockAddrs.size(); i++) {
         for (size_t j = 0; j < info->nameserverSockAddrs.size(); j++) {
             // Should never happen. Just in case because of the fix-sized array |stats|.
@@ -1920,10 +3381,11 @@ void resolv_cache_add_resolver_stats_sample(unsigned netid, int revision_id,
                                             const res_sample& sample, int max_samples) {
     if (max_samples <= 0) return;
 
-    std::lock_guard guard(cache_mutex);
-    NetConfig* info = find_netconfig_locked(netid);
+    const auto info = find_netconfig(netid);
+    if (info == nullptr) return;
 
-    if (info && info->revision_id == revision_id) {
+    std::lock_guard guard(info->mutex);
+    if (info->revision_id == revision_id) {
         const int serverNum = std::min(MAXNS, static_cast<int>(info->nameserverSockAddrs.size()));
         for (int ns = 0; ns < serverNum; ns++) {
             if (serverSockAddr == info->nameserverSockAddrs[ns]) {
@@ -1935,28 +3397,28 @@ void resolv_cache_add_resolver_stats_sample(unsigned netid, int revision_id,
 }
 
 bool has_named_cache(unsigned netid) {
-    std::lock_guard guard(cache_mutex);
-    return find_named_cache_locked(netid) != nullptr;
+    return find_named_cache(netid) != nullptr;
 }
 
 int resolv_cache_get_expiration(unsigned netid, span<const uint8_t> query, time_t* expiration) {
     Entry key;
+    uint8_t keybuf[MAX_KEY_SIZE];
     *expiration = -1;
 
     // A malformed query is not allowed.
-    if (!entry_init_key(&key, query)) {
+    if (!entry_init_key(&key, query, keybuf)) {
         LOG(WARNING) << __func__ << ": unsupported query";
         return -EINVAL;
     }
 
     // lookup cache.
-    Cache* cache;
-    std::lock_guard guard(cache_mutex);
-    if (cache = find_named_cache_locked(netid); cache == nullptr) {
+    const auto cache = find_named_cache(netid);
+    if (cache == nullptr) {
         LOG(WARNING) << __func__ << ": cache not created in the network " << netid;
         return -ENONET;
     }
-    Entry** lookup = _cache_lookup_p(cache, &key);
+    std::lock_guard guard(cache->mutex);
+    Entry** lookup = _cache_lookup_p(cache.get(), &key);
     Entry* e = *lookup;
     if (e == NULL) {
         LOG(WARNING) << __func__ << ": not in cache";
@@ -1974,8 +3436,7 @@ int resolv_cache_get_expiration(unsigned netid, span<const uint8_t> query, time_
 
 int resolv_stats_set_addrs(unsigned netid, Protocol proto, const std::vector<std::string>& addrs,
                            int port) {
-    std::lock_guard guard(cache_mutex);
-    const auto info = find_netconfig_locked(netid);
+    const auto info = find_netconfig(netid);
 
     if (info == nullptr) {
         LOG(WARNING) << __func__ << ": Network " << netid << " not found for "
@@ -1989,6 +3450,7 @@ int resolv_stats_set_addrs(unsigned netid, Protocol proto, const std::vector<std
         sockAddrs.push_back(IPSockAddr::toIPSockAddr(addr, port));
     }
 
+    std::lock_guard guard(info->mutex);
     if (!info->dnsStats.setAddrs(sockAddrs, proto)) {
         LOG(WARNING) << __func__ << ": Failed to set " << Protocol_Name(proto) << " on network "
                      << netid;
@@ -2002,8 +3464,8 @@ bool resolv_stats_add(unsigned netid, const android::netdutils::IPSockAddr& serv
                       const DnsQueryEvent* record) {
     if (record == nullptr) return false;
 
-    std::lock_guard guard(cache_mutex);
-    if (const auto info = find_netconfig_locked(netid); info != nullptr) {
+    if (const auto info = find_netconfig(netid); info != nullptr) {
+        std::lock_guard guard(info->mutex);
         return info->dnsStats.addStats(server, *record);
     }
     return false;
@@ -2107,9 +3569,83 @@ static const char* transport_type_to_str(const std::vector<int32_t>& transportTy
 }
 
 void resolv_netconfig_dump(DumpWriter& dw, unsigned netid) {
-    std::lock_guard guard(cache_mutex);
-    if (const auto info = find_netconfig_locked(netid); info != nullptr) {
+    if (const auto info = find_netconfig(netid); info != nullptr) {
+        std::shared_ptr<Cache> cache;
+        int cacheUsers;
+        {
+            std::lock_guard guard(cache_mutex);
+            cache = info->cache;
+            cacheUsers = cache_users_locked(cache.get());
+        }
+        size_t cacheBytesInUse, cacheBytesAllocated, cacheBytes;
+        int cacheEntries, cacheStaleEntries;
+        size_t cacheRRsets = 0, cacheRehashedSlots = 0, cacheOldSlots = 0;
+        std::vector<std::pair<int, uid_t>> cacheUidEntries;
+        {
+            std::shared_lock guard(cache->mutex);
+            cacheBytesInUse = cache->allocator->bytesInUse();
+            cacheBytesAllocated = cache->allocator->bytesAllocated();
+            cacheBytes = cache->bytes;
+            cacheEntries = cache->num_entries;
+            cacheStaleEntries = cache->stale_entries;
+            if (cache->rrsets != nullptr) cacheRRsets = cache->rrsets->size();
+            cacheOldSlots = cache->old_table.slots.size();
+            if (cacheOldSlots > 0) cacheRehashedSlots = cache->rehash_cursor;
+            cacheUidEntries.reserve(cache->uid_entries.size());
+            for (const auto& [uid, entries] : cache->uid_entries) {
+                cacheUidEntries.emplace_back(entries.count, uid);
+            }
+        }
+        std::lock_guard guard(info->mutex);
         info->dnsStats.dump(dw);
+        dw.println("Cache entries: %d of %d, %zu of %zu bytes (all networks: %zu of %zu bytes)",
+                   cacheEntries, cache->get_max_cache_entries(), cacheBytes,
+                   cache->max_cache_bytes, sCacheBytes.load(), cache->max_cache_bytes_global);
+        if (cacheUsers > 1) {
+            dw.println("Cache shared with %d other networks", cacheUsers - 1);
+        }
+        dw.println("Cache memory: %zu bytes in use, %zu bytes allocated", cacheBytesInUse,
+                   cacheBytesAllocated);
+        if (cacheStaleEntries > 0) {
+            dw.println("Cache flushed entries not reclaimed yet: %d", cacheStaleEntries);
+        }
+        if (cacheOldSlots > 0) {
+            dw.println("Cache resizing: %zu of %zu slots rehashed", cacheRehashedSlots,
+                       cacheOldSlots);
+        }
+        if (cache->uid_quota_percent > 0) {
+            dw.println("Cache UID quota: %d entries, %" PRIu64 " evictions", cache->get_uid_quota(),
+                       cache->uid_quota_evictions.load());
+        }
+        if (!cacheUidEntries.empty()) {
+            const size_t shown = std::min(cacheUidEntries.size(), UID_DUMP_MAX_UIDS);
+            std::partial_sort(cacheUidEntries.begin(), cacheUidEntries.begin() + shown,
+                              cacheUidEntries.end(), std::greater<>());
+            std::vector<std::string> uids;
+            for (size_t i = 0; i < shown; i++) {
+                const auto [count, uid] = cacheUidEntries[i];
+                uids.push_back(uid == NET_CONTEXT_INVALID_UID ? fmt::format("unknown={}", count)
+                                                              : fmt::format("{}={}", uid, count));
+            }
+            dw.println("Cache entries by UID: %s%s", android::base::Join(uids, ", ").c_str(),
+                       shown < cacheUidEntries.size() ? ", ..." : "");
+        }
+        dw.println("Cache prefetches: %" PRIu64 ", avoided misses: %" PRIu64,
+                   cache->prefetches.load(), cache->prefetch_avoided_misses.load());
+        if (cache->rrsets != nullptr) {
+            dw.println("Cache RRsets: %zu, synthesized answers: %" PRIu64, cacheRRsets,
+                       cache->rrset_synthesized_answers.load());
+        }
+        if (cache->snapshot_interval > 0) {
+            dw.println("Cache snapshot: %d entries loaded in %" PRId64 " us, %" PRIu64
+                       " hits out of %" PRIu64 " lookups in the first %d seconds",
+                       cache->snapshot_loaded_entries.load(), cache->snapshot_load_us.load(),
+                       cache->warm_start_hits.load(), cache->warm_start_lookups.load(),
+                       CACHE_SNAPSHOT_WARM_START_PERIOD);
+        }
+        if (const uint64_t warmUpHits = cache->warm_up_hits; warmUpHits > 0) {
+            dw.println("Cache warm-up hits: %" PRIu64, warmUpHits);
+        }
         // TODO: dump info->hosts
         dw.println("TC mode: %s", tc_mode_to_str(info->tc_mode));
         dw.println("TransportType: %s", transport_type_to_str(info->transportTypes));
@@ -2118,26 +3654,33 @@ void resolv_netconfig_dump(DumpWriter& dw, unsigned netid) {
 }
 
 int resolv_get_max_cache_entries(unsigned netid) {
-    std::lock_guard guard(cache_mutex);
-    NetConfig* info = find_netconfig_locked(netid);
-    if (!info) {
+    const auto cache = find_named_cache(netid);
+    if (!cache) {
         LOG(WARNING) << __func__ << ": NetConfig for netid " << netid << " not found";
         return -1;
     }
-    return info->cache->get_max_cache_entries();
+    return cache->get_max_cache_entries();
 }
 
 bool resolv_is_enforceDnsUid_enabled_network(unsigned netid) {
-    std::lock_guard guard(cache_mutex);
-    if (const auto info = find_netconfig_locked(netid); info != nullptr) {
+    if (const auto info = find_netconfig(netid); info != nullptr) {
+        std::lock_guard guard(info->mutex);
         return info->enforceDnsUid;
     }
     return false;
 }
 
+uint64_t resolv_get_network_signature(unsigned netid) {
+    if (const auto info = find_netconfig(netid); info != nullptr) {
+        std::lock_guard guard(info->mutex);
+        return info->signature;
+    }
+    return 0;
+}
+
 bool resolv_is_metered_network(unsigned netid) {
-    std::lock_guard guard(cache_mutex);
-    if (const auto info = find_netconfig_locked(netid); info != nullptr) {
+    if (const auto info = find_netconfig(netid); info != nullptr) {
+        std::lock_guard guard(info->mutex);
         return info->metered;
     }
     return false;
@@ -96,6 +96,7 @@
 #include <time.h>
 #include <unistd.h>
 #include <span>
+#include <vector>
 
 #include <android-base/logging.h>
 #include <android-base/result.h>
@@ -103,16 +104,20 @@
 
 #include <netdutils/Slice.h>
 #include <netdutils/Stopwatch.h>
+#include <netdutils/ThreadUtil.h>
 #include "DnsTlsDispatcher.h"
 #include "DnsTlsTransport.h"
 #include "Experiments.h"
+#include "OperationLimiter.h"
 #include "PrivateDnsConfiguration.h"
+#include "ThreadPool.h"
 #include "netd_resolv/resolv.h"
 #include "private/android_filesystem_config.h"
 
 #include "doh.h"
 #include "res_comp.h"
 #include "res_debug.h"
+#include "res_send.h"
 #include "resolv_cache.h"
 #include "stats.h"
 #include "stats.pb.h"
@@ -146,7 +151,9 @@ using android::net::PROTO_DOH;
 using android::net::PROTO_MDNS;
 using android::net::PROTO_TCP;
 using android::net::PROTO_UDP;
+using android::net::ThreadPool;
 using android::netdutils::IPSockAddr;
+using android::netdutils::OperationLimiter;
 using android::netdutils::Slice;
 using android::netdutils::Stopwatch;
 using std::span;
@@ -427,6 +434,50 @@ static DnsQueryEvent* addDnsQueryEvent(NetworkDnsEventReported* event) {
     return event->mutable_dns_query_events()->add_dns_query_event();
 }
 
+// The background refreshes of the cache entries, which run at most kCacheRefreshThreads at a time.
+// Only kCacheRefreshMaxQueued more of them wait, at most kCacheRefreshMaxPerUid of which for the
+// queries of one UID, so that one app can't fill the queue. A refresh which isn't queued is tried
+// again by the next lookup after REFRESH_RETRY_INTERVAL, see res_cache.cpp.
+constexpr size_t kCacheRefreshThreads = 4;
+constexpr size_t kCacheRefreshMaxQueued = 64;
+constexpr int kCacheRefreshMaxPerUid = 16;
+
+static ThreadPool* cacheRefreshThreads() {
+    // Never destroyed: a refresh may still be running at exit.
+    static ThreadPool* const threads =
+            new ThreadPool("CacheRefresh", kCacheRefreshThreads, kCacheRefreshMaxQueued);
+    return threads;
+}
+
+static OperationLimiter<uid_t>& cacheRefreshLimiter() {
+    // Never destroyed, like the threads running the refreshes.
+    static OperationLimiter<uid_t>* const limiter =
+            new OperationLimiter<uid_t>(kCacheRefreshMaxPerUid);
+    return *limiter;
+}
+
+// Resolves |msg| again in the background, bypassing the cache lookup, so that the answer
+// replaces the cache entry that has just been served, which is stale or about to expire.
+static void refreshCacheEntry(ResState* statp, span<const uint8_t> msg, uint32_t flags) {
+    const uid_t uid = statp->uid;
+    if (!cacheRefreshLimiter().start(uid, kCacheRefreshThreads + kCacheRefreshMaxQueued)) return;
+    const int ret = cacheRefreshThreads()->enqueue(
+            [res = std::make_shared<ResState>(statp->clone()),
+             query = std::vector<uint8_t>(msg.begin(), msg.end()), flags, uid]() {
+                android::netdutils::setThreadName("CacheRefresh_" + std::to_string(res->netid));
+                NetworkDnsEventReported event;
+                res->event = &event;
+                std::vector<uint8_t> ans(MAXPACKET);
+                int rcode;
+                res_nsend(res.get(), query, ans, &rcode, flags | ANDROID_RESOLV_NO_CACHE_LOOKUP);
+                cacheRefreshLimiter().finish(uid);
+            });
+    if (ret != 0) {
+        LOG(WARNING) << __func__ << ": too many cache refreshes queued";
+        cacheRefreshLimiter().finish(uid);
+    }
+}
+
 static bool isNetworkRestricted(int terrno) {
     // It's possible that system was in some network restricted mode, which blocked
     // the operation of sending packet and resulted in EPERM errno.
@@ -436,6 +487,85 @@ static bool isNetworkRestricted(int terrno) {
     return (terrno == EPERM);
 }
 
+// Picks the nameservers to query in plaintext, and how many times to try each of them.
+// Returns the revision of the resolver stats in |params|, or -1.
+static int select_nameservers(ResState* statp, span<const uint8_t> msg, uint32_t flags,
+                              res_params* params, bool usable_servers[MAXNS], int* retryTimes) {
+    res_stats stats[MAXNS]{};
+    int revision_id = resolv_cache_get_resolver_stats(statp->netid, params, stats, statp->nsaddrs);
+    if (revision_id < 0) return revision_id;
+
+    int usableServersCount = android_net_res_stats_get_usable_servers(
+            params, stats, statp->nameserverCount(), usable_servers);
+
+    if (statp->sort_nameservers) {
+        // It's unnecessary to mark a DNS server as unusable since broken servers will be less
+        // likely to be chosen.
+        for (int i = 0; i < statp->nameserverCount(); i++) {
+            usable_servers[i] = true;
+        }
+    }
+
+    // TODO: Let it always choose the first nameserver when sort_nameservers is enabled.
+    if ((flags & ANDROID_RESOLV_NO_RETRY) && usableServersCount > 1) {
+        auto hp = reinterpret_cast<const HEADER*>(msg.data());
+
+        // Select a random server based on the query id
+        int selectedServer = (hp->id % usableServersCount) + 1;
+        res_set_usable_server(selectedServer, statp->nameserverCount(), usable_servers);
+    }
+
+    // Send request, RETRY times, or until successful.
+    *retryTimes = (flags & ANDROID_RESOLV_NO_RETRY) ? 1 : params->retry_count;
+    return revision_id;
+}
+
+// The outcome of a plaintext query sent to one of the nameservers.
+struct QueryAttempt {
+    size_t ns;  // The server which answered, or was queried if none did
+    ::android::net::Protocol protocol;
+    int retryCount;
+    bool recordStats;
+    time_t queryTime;
+    int delay;
+    int32_t latencyUs;
+    int rcode;
+    int terrno;
+};
+
+static void record_query_attempt(ResState* statp, span<const uint8_t> msg,
+                                 ResolvCacheStatus cache_status, int revision_id,
+                                 const res_params& params, const QueryAttempt& attempt) {
+    const IPSockAddr& receivedServerAddr = statp->nsaddrs[attempt.ns];
+    DnsQueryEvent* dnsQueryEvent = addDnsQueryEvent(statp->event);
+    dnsQueryEvent->set_cache_hit(static_cast<CacheStatus>(cache_status));
+    dnsQueryEvent->set_latency_micros(attempt.latencyUs);
+    dnsQueryEvent->set_dns_server_index(attempt.ns);
+    dnsQueryEvent->set_ip_version(ipFamilyToIPVersion(receivedServerAddr.family()));
+    dnsQueryEvent->set_retry_times(attempt.retryCount);
+    dnsQueryEvent->set_rcode(static_cast<NsRcode>(attempt.rcode));
+    dnsQueryEvent->set_protocol(attempt.protocol);
+    dnsQueryEvent->set_type(getQueryType(msg));
+    dnsQueryEvent->set_linux_errno(static_cast<LinuxErrno>(attempt.terrno));
+
+    // Only record stats the first time we try a query. This ensures that
+    // queries that deterministically fail (e.g., a name that always returns
+    // SERVFAIL or times out) do not unduly affect the stats.
+    if (attempt.recordStats) {
+        // (b/151166599): This is a workaround to prevent that DnsResolver calculates the
+        // reliability of DNS servers from being broken when network restricted mode is
+        // enabled.
+        // TODO: Introduce the new server selection instead of skipping stats recording.
+        if (!isNetworkRestricted(attempt.terrno)) {
+            res_sample sample;
+            res_stats_set_sample(&sample, attempt.queryTime, attempt.rcode, attempt.delay);
+            resolv_cache_add_resolver_stats_sample(statp->netid, revision_id, receivedServerAddr,
+                                                   sample, params.max_samples);
+            resolv_stats_add(statp->netid, receivedServerAddr, dnsQueryEvent);
+        }
+    }
+}
+
 int res_nsend(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int* rcode,
               uint32_t flags, std::chrono::milliseconds sleepTimeMs) {
     LOG(DEBUG) << __func__;
@@ -452,13 +582,16 @@ int res_nsend(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int*
     Stopwatch cacheStopwatch;
     ResolvCacheStatus cache_status = resolv_cache_lookup(statp->netid, msg, ans, &anslen, flags);
     const int32_t cacheLatencyUs = saturate_cast<int32_t>(cacheStopwatch.timeTakenUs());
-    if (cache_status == RESOLV_CACHE_FOUND) {
+    if (cache_status == RESOLV_CACHE_FOUND || cache_status == RESOLV_CACHE_FOUND_REFRESH) {
         HEADER* hp = (HEADER*)(void*)ans.data();
         *rcode = hp->rcode;
         DnsQueryEvent* dnsQueryEvent = addDnsQueryEvent(statp->event);
         dnsQueryEvent->set_latency_micros(cacheLatencyUs);
-        dnsQueryEvent->set_cache_hit(static_cast<CacheStatus>(cache_status));
+        dnsQueryEvent->set_cache_hit(CacheStatus::CS_FOUND);
         dnsQueryEvent->set_type(getQueryType(msg));
+        if (cache_status == RESOLV_CACHE_FOUND_REFRESH) {
+            refreshCacheEntry(statp, msg, flags);
+        }
         return anslen;
     } else if (cache_status != RESOLV_CACHE_UNSUPPORTED) {
         // had a cache miss for a known network, so populate the thread private
@@ -491,7 +624,7 @@ int res_nsend(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int*
             res_pquery(ans.first(resplen));
 
             if (cache_status == RESOLV_CACHE_NOTFOUND) {
-                resolv_cache_add(statp->netid, msg, std::span(ans.data(), resplen));
+                resolv_cache_add(statp->netid, msg, std::span(ans.data(), resplen), statp->uid);
             }
             return resplen;
         }
@@ -519,7 +652,7 @@ int res_nsend(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int*
             LOG(DEBUG) << __func__ << ": got answer from Private DNS";
             res_pquery(ans.first(resplen));
             if (cache_status == RESOLV_CACHE_NOTFOUND) {
-                resolv_cache_add(statp->netid, msg, ans.first(resplen));
+                resolv_cache_add(statp->netid, msg, ans.first(resplen), statp->uid);
             }
             return resplen;
         }
@@ -536,9 +669,10 @@ int res_nsend(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int*
         std::this_thread::sleep_for(sleepTimeMs);
     }
 
-    res_stats stats[MAXNS]{};
     res_params params;
-    int revision_id = resolv_cache_get_resolver_stats(statp->netid, &params, stats, statp->nsaddrs);
+    bool usable_servers[MAXNS];
+    int retryTimes;
+    int revision_id = select_nameservers(statp, msg, flags, &params, usable_servers, &retryTimes);
     if (revision_id < 0) {
         LOG(ERROR) << __func__ << ": revision_id < 0";
         // TODO: Remove errno once callers stop using it
@@ -546,29 +680,6 @@ int res_nsend(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int*
         return -ESRCH;
     }
 
-    bool usable_servers[MAXNS];
-    int usableServersCount = android_net_res_stats_get_usable_servers(
-            &params, stats, statp->nameserverCount(), usable_servers);
-
-    if (statp->sort_nameservers) {
-        // It's unnecessary to mark a DNS server as unusable since broken servers will be less
-        // likely to be chosen.
-        for (int i = 0; i < statp->nameserverCount(); i++) {
-            usable_servers[i] = true;
-        }
-    }
-
-    // TODO: Let it always choose the first nameserver when sort_nameservers is enabled.
-    if ((flags & ANDROID_RESOLV_NO_RETRY) && usableServersCount > 1) {
-        auto hp = reinterpret_cast<const HEADER*>(msg.data());
-
-        // Select a random server based on the query id
-        int selectedServer = (hp->id % usableServersCount) + 1;
-        res_set_usable_server(selectedServer, statp->nameserverCount(), usable_servers);
-    }
-
-    // Send request, RETRY times, or until successful.
-    int retryTimes = (flags & ANDROID_RESOLV_NO_RETRY) ? 1 : params.retry_count;
     int useTcp = msg.size() > PACKETSZ;
     int gotsomewhere = 0;
 
@@ -617,40 +728,22 @@ int res_nsend(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int*
                 LOG(INFO) << __func__ << ": used send_dg " << resplen << " terrno: " << terrno;
             }
 
-            const IPSockAddr& receivedServerAddr = statp->nsaddrs[actualNs];
-            DnsQueryEvent* dnsQueryEvent = addDnsQueryEvent(statp->event);
-            dnsQueryEvent->set_cache_hit(static_cast<CacheStatus>(cache_status));
             // When |retryTimes| > 1, we cannot actually know the correct latency value if we
             // received the answer from the previous server. So temporarily set the latency as -1 if
             // that condition happened.
             // TODO: make the latency value accurate.
-            dnsQueryEvent->set_latency_micros(
-                    (actualNs == ns) ? saturate_cast<int32_t>(queryStopwatch.timeTakenUs()) : -1);
-            dnsQueryEvent->set_dns_server_index(actualNs);
-            dnsQueryEvent->set_ip_version(ipFamilyToIPVersion(receivedServerAddr.family()));
-            dnsQueryEvent->set_retry_times(retry_count_for_event);
-            dnsQueryEvent->set_rcode(static_cast<NsRcode>(*rcode));
-            dnsQueryEvent->set_protocol(query_proto);
-            dnsQueryEvent->set_type(getQueryType(msg));
-            dnsQueryEvent->set_linux_errno(static_cast<LinuxErrno>(terrno));
-
-            // Only record stats the first time we try a query. This ensures that
-            // queries that deterministically fail (e.g., a name that always returns
-            // SERVFAIL or times out) do not unduly affect the stats.
-            if (shouldRecordStats) {
-                // (b/151166599): This is a workaround to prevent that DnsResolver calculates the
-                // reliability of DNS servers from being broken when network restricted mode is
-                // enabled.
-                // TODO: Introduce the new server selection instead of skipping stats recording.
-                if (!isNetworkRestricted(terrno)) {
-                    res_sample sample;
-                    res_stats_set_sample(&sample, query_time, *rcode, delay);
-                    resolv_cache_add_resolver_stats_sample(statp->netid, revision_id,
-                                                           receivedServerAddr, sample,
-                                                           params.max_samples);
-                    resolv_stats_add(statp->netid, receivedServerAddr, dnsQueryEvent);
-                }
-            }
+            const int32_t latencyUs =
+                    (actualNs == ns) ? saturate_cast<int32_t>(queryStopwatch.timeTakenUs()) : -1;
+            record_query_attempt(statp, msg, cache_status, revision_id, params,
+                                 {.ns = actualNs,
+                                  .protocol = query_proto,
+                                  .retryCount = retry_count_for_event,
+                                  .recordStats = shouldRecordStats,
+                                  .queryTime = query_time,
+                                  .delay = delay,
+                                  .latencyUs = latencyUs,
+                                  .rcode = *rcode,
+                                  .terrno = terrno});
 
             if (resplen == 0) continue;
             if (fallbackTCP) {
@@ -667,7 +760,7 @@ int res_nsend(ResState* statp, span<const uint8_t> msg, span<uint8_t> ans, int*
             res_pquery(ans.first(resplen));
 
             if (cache_status == RESOLV_CACHE_NOTFOUND) {
-                resolv_cache_add(statp->netid, msg, std::span(ans.data(), resplen));
+                resolv_cache_add(statp->netid, msg, std::span(ans.data(), resplen), statp->uid);
             }
             statp->closeSockets();
             return (resplen);
@@ -1082,28 +1175,31 @@ static int setupUdpSocket(ResState* statp, const sockaddr* sockap, unique_fd* fd
     return 1;
 }
 
-static int send_dg(ResState* statp, res_params* params, span<const uint8_t> msg, span<uint8_t> ans,
-                   int* terrno, size_t* ns, int* v_circuit, int* gotsomewhere, int* rcode) {
+// Sends |msg| to the nameserver |ns| over UDP, opening its socket if needed.
+// return  1 - the query was sent.
+// return  0 - the server can't be reached, try the next one.
+// return -1 - fatal error.
+static int send_dg_query(ResState* statp, span<const uint8_t> msg, int* terrno, size_t ns) {
     // It should never happen, but just in case.
-    if (*ns >= statp->nsaddrs.size()) {
+    if (ns >= statp->nsaddrs.size()) {
         LOG(ERROR) << __func__ << ": Out-of-bound indexing: " << ns;
         *terrno = EINVAL;
         return -1;
     }
 
-    const sockaddr_storage ss = statp->nsaddrs[*ns];
+    const sockaddr_storage ss = statp->nsaddrs[ns];
     const sockaddr* nsap = reinterpret_cast<const sockaddr*>(&ss);
 
-    if (statp->udpsocks[*ns] == -1) {
-        int result = setupUdpSocket(statp, nsap, &statp->udpsocks[*ns], terrno);
+    if (statp->udpsocks[ns] == -1) {
+        int result = setupUdpSocket(statp, nsap, &statp->udpsocks[ns], terrno);
         if (result <= 0) return result;
-        statp->udpsocks_ts[*ns] = evNowTime();
+        statp->udpsocks_ts[ns] = evNowTime();
 
         // Use a "connected" datagram socket to receive an ECONNREFUSED error
         // on the next socket operation when the server responds with an
         // ICMP port-unreachable error. This way we can detect the absence of
         // a nameserver without timing out.
-        if (connect(statp->udpsocks[*ns], nsap, sockaddrSize(nsap)) < 0) {
+        if (connect(statp->udpsocks[ns], nsap, sockaddrSize(nsap)) < 0) {
             *terrno = errno;
             dump_error("connect(dg)", nsap);
             statp->closeSockets();
@@ -1111,13 +1207,93 @@ static int send_dg(ResState* statp, res_params* params, span<const uint8_t> msg,
         }
         LOG(DEBUG) << __func__ << ": new DG socket";
     }
-    if (send(statp->udpsocks[*ns], msg.data(), msg.size(), 0) !=
+    if (send(statp->udpsocks[ns], msg.data(), msg.size(), 0) !=
         static_cast<ptrdiff_t>(msg.size())) {
         *terrno = errno;
         PLOG(DEBUG) << __func__ << ": send: ";
         statp->closeSockets();
         return 0;
     }
+    return 1;
+}
+
+// Receives one datagram from |fd| and checks whether it answers |msg|.
+// return length - a valid answer, or 1 with |*v_circuit| set if it was truncated.
+// return  0     - no answer. |*needRetry| is set if the datagram was ignored, and the server
+//                 may still answer.
+// return -1     - nothing to receive yet, with MSG_DONTWAIT in |recvFlags|.
+static int recv_dg_answer(ResState* statp, int fd, int recvFlags, span<const uint8_t> msg,
+                          span<uint8_t> ans, int* terrno, size_t* ns, int* v_circuit,
+                          int* gotsomewhere, int* rcode, bool* needRetry) {
+    *needRetry = false;
+    sockaddr_storage from;
+    socklen_t fromlen = sizeof(from);
+    int resplen = recvfrom(fd, ans.data(), ans.size(), recvFlags, (sockaddr*)(void*)&from,
+                           &fromlen);
+    if (resplen <= 0) {
+        if ((recvFlags & MSG_DONTWAIT) && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return -1;
+        }
+        *terrno = errno;
+        PLOG(DEBUG) << __func__ << ": recvfrom: ";
+        return 0;
+    }
+    *gotsomewhere = 1;
+    if (resplen < HFIXEDSZ) {
+        // Undersized message.
+        LOG(DEBUG) << __func__ << ": undersized: " << resplen;
+        *terrno = EMSGSIZE;
+        return 0;
+    }
+    if (resplen > static_cast<ptrdiff_t>(ans.size())) {
+        LOG(FATAL) << __func__ << ": invalid resplen (too large): " << resplen;
+    }
+
+    int receivedFromNs = *ns;
+    if (*needRetry = ignoreInvalidAnswer(statp, from, msg, ans, &receivedFromNs); *needRetry) {
+        res_pquery(ans.first(resplen));
+        return 0;
+    }
+
+    HEADER* anhp = (HEADER*)(void*)ans.data();
+    if (anhp->rcode == FORMERR && (statp->netcontext_flags & NET_CONTEXT_FLAG_USE_EDNS)) {
+        //  Do not retry if the server do not understand EDNS0.
+        //  The case has to be captured here, as FORMERR packet do not
+        //  carry query section, hence res_queriesmatch() returns 0.
+        LOG(DEBUG) << __func__ << ": server rejected query with EDNS0:";
+        res_pquery(ans.first(resplen));
+        // record the error
+        statp->flags |= RES_F_EDNS0ERR;
+        *terrno = EREMOTEIO;
+        return 0;
+    }
+
+    if (anhp->rcode == SERVFAIL || anhp->rcode == NOTIMP || anhp->rcode == REFUSED) {
+        LOG(DEBUG) << __func__ << ": server rejected query:";
+        res_pquery(ans.first(resplen));
+        *rcode = anhp->rcode;
+        return 0;
+    }
+    if (anhp->tc) {
+        // To get the rest of answer,
+        // use TCP with same server.
+        LOG(DEBUG) << __func__ << ": truncated answer";
+        *terrno = E2BIG;
+        *v_circuit = 1;
+        return 1;
+    }
+    // All is well, or the error is fatal. Signal that the
+    // next nameserver ought not be tried.
+
+    *rcode = anhp->rcode;
+    *ns = receivedFromNs;
+    *terrno = 0;
+    return resplen;
+}
+
+static int send_dg(ResState* statp, res_params* params, span<const uint8_t> msg, span<uint8_t> ans,
+                   int* terrno, size_t* ns, int* v_circuit, int* gotsomewhere, int* rcode) {
+    if (int result = send_dg_query(statp, msg, terrno, *ns); result <= 0) return result;
 
     timespec timeout = get_timeout(statp, params, *ns);
     timespec start_time = evNowTime();
@@ -1139,68 +1315,9 @@ static int send_dg(ResState* statp, res_params* params, span<const uint8_t> msg,
         }
         bool needRetry = false;
         for (int fd : result.value()) {
-            needRetry = false;
-            sockaddr_storage from;
-            socklen_t fromlen = sizeof(from);
-            int resplen =
-                    recvfrom(fd, ans.data(), ans.size(), 0, (sockaddr*)(void*)&from, &fromlen);
-            if (resplen <= 0) {
-                *terrno = errno;
-                PLOG(DEBUG) << __func__ << ": recvfrom: ";
-                continue;
-            }
-            *gotsomewhere = 1;
-            if (resplen < HFIXEDSZ) {
-                // Undersized message.
-                LOG(DEBUG) << __func__ << ": undersized: " << resplen;
-                *terrno = EMSGSIZE;
-                continue;
-            }
-            if (resplen > static_cast<ptrdiff_t>(ans.size())) {
-                LOG(FATAL) << __func__ << ": invalid resplen (too large): " << resplen;
-            }
-
-            int receivedFromNs = *ns;
-            if (needRetry = ignoreInvalidAnswer(statp, from, msg, ans, &receivedFromNs);
-                needRetry) {
-                res_pquery(ans.first(resplen));
-                continue;
-            }
-
-            HEADER* anhp = (HEADER*)(void*)ans.data();
-            if (anhp->rcode == FORMERR && (statp->netcontext_flags & NET_CONTEXT_FLAG_USE_EDNS)) {
-                //  Do not retry if the server do not understand EDNS0.
-                //  The case has to be captured here, as FORMERR packet do not
-                //  carry query section, hence res_queriesmatch() returns 0.
-                LOG(DEBUG) << __func__ << ": server rejected query with EDNS0:";
-                res_pquery(ans.first(resplen));
-                // record the error
-                statp->flags |= RES_F_EDNS0ERR;
-                *terrno = EREMOTEIO;
-                continue;
-            }
-
-            if (anhp->rcode == SERVFAIL || anhp->rcode == NOTIMP || anhp->rcode == REFUSED) {
-                LOG(DEBUG) << __func__ << ": server rejected query:";
-                res_pquery(ans.first(resplen));
-                *rcode = anhp->rcode;
-                continue;
-            }
-            if (anhp->tc) {
-                // To get the rest of answer,
-                // use TCP with same server.
-                LOG(DEBUG) << __func__ << ": truncated answer";
-                *terrno = E2BIG;
-                *v_circuit = 1;
-                return 1;
-            }
-            // All is well, or the error is fatal. Signal that the
-            // next nameserver ought not be tried.
-
-            *rcode = anhp->rcode;
-            *ns = receivedFromNs;
-            *terrno = 0;
-            return resplen;
+            int resplen = recv_dg_answer(statp, fd, 0, msg, ans, terrno, ns, v_circuit,
+                                         gotsomewhere, rcode, &needRetry);
+            if (resplen > 0) return resplen;
         }
         if (!needRetry) return 0;
     }
@@ -1465,6 +1582,239 @@ int resolv_res_nsend(const android_net_context* netContext, span<const uint8_t>
     return res_nsend(&res, msg, ans, rcode, flags);
 }
 
+// Whether the query can be sent by ResNsendAsync: plaintext DNS over UDP, and nothing else.
+static bool canSendAsync(ResState* statp, span<const uint8_t> msg) {
+    if (isMdnsResolution(statp->flags) || msg.size() > PACKETSZ) return false;
+    if (statp->nameserverCount() == 0) return false;
+    if (Experiments::getInstance()->getFlag("keep_listening_udp", 0)) return false;
+    if (statp->netcontext_flags & NET_CONTEXT_FLAG_USE_LOCAL_NAMESERVERS) return true;
+
+    // Like res_private_dns_send(), which falls back to plaintext right away in these cases.
+    const PrivateDnsStatus privateDnsStatus =
+            PrivateDnsConfiguration::getInstance().getStatus(statp->netid);
+    switch (privateDnsStatus.mode) {
+        case PrivateDnsMode::OFF:
+            return true;
+        case PrivateDnsMode::OPPORTUNISTIC:
+            return !privateDnsStatus.hasValidatedDohServers() &&
+                   privateDnsStatus.validatedServers().empty();
+        default:
+            return false;
+    }
+}
+
+// The buffer which ResNsendAsync receives the answers into. Only the answer which completes the
+// query is copied, so that the queries in flight don't hold MAXPACKET bytes each.
+static span<uint8_t> answerBuffer() {
+    thread_local std::vector<uint8_t> buffer(MAXPACKET);
+    return buffer;
+}
+
+static std::chrono::steady_clock::time_point deadlineAfter(const timespec& timeout) {
+    return std::chrono::steady_clock::now() + std::chrono::seconds(timeout.tv_sec) +
+           std::chrono::nanoseconds(timeout.tv_nsec);
+}
+
+ResNsendAsync::ResNsendAsync(const android_net_context& netContext, span<const uint8_t> msg,
+                             uint32_t flags, NetworkDnsEventReported* event,
+                             std::function<void()> wake)
+    : mRes(std::make_unique<ResState>(&netContext, event)),
+      mMsg(msg.begin(), msg.end()),
+      mFlags(flags),
+      mWake(std::move(wake)) {}
+
+ResNsendAsync::~ResNsendAsync() = default;
+
+int ResNsendAsync::fd() const {
+    return (mState == State::WAIT_ANSWER) ? mRes->udpsocks[mNs].get() : -1;
+}
+
+ResNsendAsync::Status ResNsendAsync::resume() {
+    switch (mState) {
+        case State::START:
+            resolv_populate_res_for_net(mRes.get());
+            if (!canSendAsync(mRes.get(), mMsg)) return Status::BLOCKING;
+            res_pquery(mMsg);
+            return lookupCache();
+        case State::WAIT_PENDING:
+            if (*mPendingDone) return lookupCache();
+            if (std::chrono::steady_clock::now() < mDeadline) return Status::WAITING;
+            resolv_cache_pending_request_timed_out(mRes->netid);
+            return lookupCacheAfterTimeout();
+        case State::WAIT_ANSWER:
+            return receiveAnswer();
+        case State::DONE:
+            break;
+    }
+    return Status::DONE;
+}
+
+ResNsendAsync::Status ResNsendAsync::lookupCache() {
+    const span<uint8_t> ans = answerBuffer();
+    int anslen = 0;
+    Stopwatch cacheStopwatch;
+    mPendingDone = std::make_shared<std::atomic<bool>>(false);
+    mCacheStatus = resolv_cache_lookup_async(
+            mRes->netid, mMsg, ans, &anslen, mFlags,
+            [pendingDone = mPendingDone, wake = mWake] {
+                *pendingDone = true;
+                wake();
+            });
+    const int32_t cacheLatencyUs = saturate_cast<int32_t>(cacheStopwatch.timeTakenUs());
+    if (mCacheStatus == RESOLV_CACHE_PENDING) {
+        mState = State::WAIT_PENDING;
+        mDeadline = std::chrono::steady_clock::now() +
+                    std::chrono::seconds(PENDING_REQUEST_TIMEOUT);
+        return Status::WAITING;
+    }
+    if (mCacheStatus == RESOLV_CACHE_FOUND || mCacheStatus == RESOLV_CACHE_FOUND_REFRESH) {
+        return cacheHit(ans.first(anslen), cacheLatencyUs);
+    }
+    return startQuery();
+}
+
+// Like resolv_cache_lookup() once it gave up waiting for the pending request: look the query up
+// once more without waiting, and resolve it on a miss.
+ResNsendAsync::Status ResNsendAsync::lookupCacheAfterTimeout() {
+    const span<uint8_t> ans = answerBuffer();
+    int anslen = 0;
+    Stopwatch cacheStopwatch;
+    const ResolvCacheStatus status = resolv_cache_probe(mRes->netid, mMsg, ans, &anslen, mFlags);
+    const int32_t cacheLatencyUs = saturate_cast<int32_t>(cacheStopwatch.timeTakenUs());
+    if (status == RESOLV_CACHE_FOUND || status == RESOLV_CACHE_FOUND_REFRESH) {
+        mCacheStatus = status;
+        return cacheHit(ans.first(anslen), cacheLatencyUs);
+    }
+    mCacheStatus = RESOLV_CACHE_NOTFOUND;
+    return startQuery();
+}
+
+ResNsendAsync::Status ResNsendAsync::cacheHit(span<const uint8_t> ans, int32_t cacheLatencyUs) {
+    mRcode = reinterpret_cast<const HEADER*>(ans.data())->rcode;
+    DnsQueryEvent* dnsQueryEvent = addDnsQueryEvent(mRes->event);
+    dnsQueryEvent->set_latency_micros(cacheLatencyUs);
+    dnsQueryEvent->set_cache_hit(CacheStatus::CS_FOUND);
+    dnsQueryEvent->set_type(getQueryType(mMsg));
+    if (mCacheStatus == RESOLV_CACHE_FOUND_REFRESH) {
+        refreshCacheEntry(mRes.get(), mMsg, mFlags);
+    }
+    mAns.assign(ans.begin(), ans.end());
+    return done(ans.size());
+}
+
+// Picks the servers to query, like res_nsend() after a cache miss, and sends the query.
+ResNsendAsync::Status ResNsendAsync::startQuery() {
+    if (!(mRes->netcontext_flags & NET_CONTEXT_FLAG_USE_LOCAL_NAMESERVERS)) {
+        const PrivateDnsStatus privateDnsStatus =
+                PrivateDnsConfiguration::getInstance().getStatus(mRes->netid);
+        mRes->event->set_private_dns_modes(convertEnumType(privateDnsStatus.mode));
+    }
+    mRevisionId = select_nameservers(mRes.get(), mMsg, mFlags, &mParams, mUsableServers,
+                                     &mRetryTimes);
+    if (mRevisionId < 0) {
+        LOG(ERROR) << __func__ << ": revision_id < 0";
+        return done(-ESRCH);
+    }
+    return sendQuery();
+}
+
+// Sends the query to the next usable server, like the plaintext DNS loop of res_nsend().
+ResNsendAsync::Status ResNsendAsync::sendQuery() {
+    for (; mAttempt < mRetryTimes; ++mAttempt, mNs = 0) {
+        for (; mNs < mRes->nsaddrs.size(); ++mNs) {
+            if (!mUsableServers[mNs]) continue;
+
+            mRcode = RCODE_INTERNAL_ERROR;
+            LOG(DEBUG) << __func__ << ": Querying server (# " << mNs + 1
+                       << ") address = " << mRes->nsaddrs[mNs].toString();
+            mQueryTime = time(nullptr);
+            mQueryStopwatch.getTimeAndResetUs();
+            // Use an impossible error code as default value
+            mTerrno = ETIME;
+            const int result = send_dg_query(mRes.get(), mMsg, &mTerrno, mNs);
+            if (result > 0) {
+                mState = State::WAIT_ANSWER;
+                mDeadline = deadlineAfter(get_timeout(mRes.get(), &mParams, mNs));
+                return Status::WAITING;
+            }
+            if (result < 0) return endAttempt(result, mNs);
+            recordAttempt(mNs);
+        }
+    }
+    mRes->closeSockets();
+    _resolv_cache_query_failed(mRes->netid, mMsg, mFlags);
+    return done(mGotSomewhere ? -ETIMEDOUT : -ECONNREFUSED);
+}
+
+ResNsendAsync::Status ResNsendAsync::receiveAnswer() {
+    for (;;) {
+        size_t actualNs = mNs;
+        bool needRetry;
+        const int resplen = recv_dg_answer(mRes.get(), mRes->udpsocks[mNs], MSG_DONTWAIT, mMsg,
+                                           answerBuffer(), &mTerrno, &actualNs, &mUseTcp,
+                                           &mGotSomewhere, &mRcode, &needRetry);
+        if (resplen > 0) return endAttempt(resplen, actualNs);
+        if (resplen < 0) break;
+        if (!needRetry) return endAttempt(0, mNs);
+    }
+    if (std::chrono::steady_clock::now() < mDeadline) return Status::WAITING;
+
+    // Like send_dg(), leave the UDP sockets open, in case the answer is late.
+    LOG(DEBUG) << __func__ << ": timeout";
+    mRcode = RCODE_TIMEOUT;
+    mTerrno = ETIMEDOUT;
+    mGotSomewhere = 1;
+    return endAttempt(0, mNs);
+}
+
+void ResNsendAsync::recordAttempt(size_t actualNs) {
+    const int32_t latencyUs =
+            (actualNs == mNs) ? saturate_cast<int32_t>(mQueryStopwatch.timeTakenUs()) : -1;
+    record_query_attempt(mRes.get(), mMsg, mCacheStatus, mRevisionId, mParams,
+                         {.ns = actualNs,
+                          .protocol = PROTO_UDP,
+                          .retryCount = mAttempt,
+                          .recordStats = (mAttempt == 0),
+                          .queryTime = mQueryTime,
+                          .delay = elapsedTimeInMs(mRes->udpsocks_ts[actualNs]),
+                          .latencyUs = latencyUs,
+                          .rcode = mRcode,
+                          .terrno = mTerrno});
+}
+
+ResNsendAsync::Status ResNsendAsync::endAttempt(int resplen, size_t actualNs) {
+    recordAttempt(actualNs);
+    if (resplen == 0) {
+        ++mNs;
+        return sendQuery();
+    }
+    if (resplen < 0 || mUseTcp) {
+        _resolv_cache_query_failed(mRes->netid, mMsg, mFlags);
+        mRes->closeSockets();
+        if (resplen < 0) return done(-mTerrno);
+        // Truncated: resolv_res_nsend() retries over TCP.
+        mState = State::DONE;
+        return Status::BLOCKING;
+    }
+
+    const span<const uint8_t> ans = answerBuffer().first(resplen);
+    LOG(DEBUG) << __func__ << ": got answer:";
+    res_pquery(ans);
+    if (mCacheStatus == RESOLV_CACHE_NOTFOUND) {
+        resolv_cache_add(mRes->netid, mMsg, ans, mRes->uid);
+    }
+    mRes->closeSockets();
+    mAns.assign(ans.begin(), ans.end());
+    return done(resplen);
+}
+
+ResNsendAsync::Status ResNsendAsync::done(int result) {
+    mResult = result;
+    mState = State::DONE;
+    mDeadline = std::chrono::steady_clock::time_point::max();
+    return Status::DONE;
+}
+
 // Returns the elapsed time in milliseconds since the given time `from`.
 int elapsedTimeInMs(const timespec& from) {
     const timespec now = evNowTime();
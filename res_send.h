@@ -16,12 +16,101 @@
 
 #pragma once
 
+#include <errno.h>
+#include <time.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
 #include <span>
+#include <vector>
+
+#include <netdutils/Stopwatch.h>
 
 #include "netd_resolv/resolv.h"  // struct android_net_context
+#include "params.h"
+#include "resolv_cache.h"
 #include "stats.pb.h"
 
 // Query dns with raw msg
 int resolv_res_nsend(const android_net_context* netContext, std::span<const uint8_t> msg,
                      std::span<uint8_t> ans, int* rcode, uint32_t flags,
                      android::net::NetworkDnsEventReported* event);
+
+struct ResState;
+
+// The plaintext UDP part of resolv_res_nsend(), as a state machine which never blocks, for the
+// callers which multiplex many queries on an event loop.
+//
+// resume() runs the query as far as it can without blocking. While it returns WAITING, it must
+// be called again once fd() is readable, deadline() has passed or |wake| was called, whichever
+// comes first; spurious calls are harmless. |wake| may be called from any thread, even after the
+// query completed.
+//
+// BLOCKING means the query needs what this class doesn't support: private DNS, mDNS, TCP or the
+// keep_listening_udp experiment. The caller should then run resolv_res_nsend() on a thread of
+// its own. Any pending cache request of the query is released before. Nothing else is carried
+// over: after a truncated answer, resolv_res_nsend() starts again with the cache lookup and the
+// UDP query before falling back to TCP.
+class ResNsendAsync {
+  public:
+    enum class Status { WAITING, DONE, BLOCKING };
+
+    ResNsendAsync(const android_net_context& netContext, std::span<const uint8_t> msg,
+                  uint32_t flags, android::net::NetworkDnsEventReported* event,
+                  std::function<void()> wake);
+    ~ResNsendAsync();
+
+    Status resume();
+
+    // The socket to wait for, or -1.
+    int fd() const;
+    std::chrono::steady_clock::time_point deadline() const { return mDeadline; }
+
+    // Once DONE, the length of answer(), or -errno, and the rcode, like resolv_res_nsend().
+    int result() const { return mResult; }
+    int rcode() const { return mRcode; }
+    std::span<uint8_t> answer() { return mAns; }
+
+  private:
+    enum class State { START, WAIT_PENDING, WAIT_ANSWER, DONE };
+
+    Status lookupCache();
+    Status lookupCacheAfterTimeout();
+    Status cacheHit(std::span<const uint8_t> ans, int32_t cacheLatencyUs);
+    Status startQuery();
+    Status sendQuery();
+    Status receiveAnswer();
+    void recordAttempt(size_t actualNs);
+    Status endAttempt(int resplen, size_t actualNs);
+    Status done(int result);
+
+    const std::unique_ptr<ResState> mRes;
+    const std::vector<uint8_t> mMsg;
+    const uint32_t mFlags;
+    const std::function<void()> mWake;
+    // The answer, once DONE.
+    std::vector<uint8_t> mAns;
+
+    State mState = State::START;
+    std::chrono::steady_clock::time_point mDeadline = std::chrono::steady_clock::time_point::max();
+    // Set by the cache when the pending request which the query waits for is done.
+    std::shared_ptr<std::atomic<bool>> mPendingDone;
+    ResolvCacheStatus mCacheStatus = RESOLV_CACHE_UNSUPPORTED;
+
+    res_params mParams;
+    int mRevisionId = -1;
+    bool mUsableServers[MAXNS];
+    int mRetryTimes = 0;
+    int mAttempt = 0;
+    size_t mNs = 0;
+    time_t mQueryTime = 0;
+    android::netdutils::Stopwatch mQueryStopwatch;
+    int mGotSomewhere = 0;
+    int mUseTcp = 0;
+    int mTerrno = ETIME;
+
+    int mResult = -ETIME;
+    int mRcode = 0;
+};
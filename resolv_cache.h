@@ -28,18 +28,22 @@
 
 #pragma once
 
+#include <functional>
 #include <span>
+#include <string>
 #include <unordered_map>
 #include <vector>
 
 #include <aidl/android/net/IDnsResolver.h>
 #include <aidl/android/net/ResolverOptionsParcel.h>
+#include <private/android_filesystem_config.h>  // AID_DNS
 
 #include <netdutils/DumpWriter.h>
 #include <netdutils/InternetAddresses.h>
 #include <stats.pb.h>
 
 #include "ResolverStats.h"
+#include "netd_resolv/resolv.h"
 #include "params.h"
 #include "stats.h"
 
@@ -59,16 +63,46 @@ typedef enum {
                               /* or the answer buffer is too small */
     RESOLV_CACHE_NOTFOUND,    /* the cache doesn't know about this query */
     RESOLV_CACHE_FOUND,       /* the cache found the answer */
-    RESOLV_CACHE_SKIP         /* Don't do anything on cache */
+    RESOLV_CACHE_SKIP,        /* Don't do anything on cache */
+    RESOLV_CACHE_FOUND_REFRESH, /* the cache found the answer, which is stale (RFC 8767) */
+                                /* or about to expire: the caller should refresh it */
+    RESOLV_CACHE_PENDING        /* the query is being resolved by another caller */
 } ResolvCacheStatus;
 
+/* Maximum time for a thread to wait for an pending request */
+constexpr int PENDING_REQUEST_TIMEOUT = 20;
+
 ResolvCacheStatus resolv_cache_lookup(unsigned netid, std::span<const uint8_t> query,
                                       std::span<uint8_t> answer, int* answerlen, uint32_t flags);
 
+// Like resolv_cache_lookup(), but for event loops, which must not block: instead of waiting for
+// the pending request of the same query, return RESOLV_CACHE_PENDING, and call
+// |on_pending_done| once the request completes or is dropped. It's called with the cache lock
+// held, so it must not call into the cache, but only schedule another lookup. If that doesn't
+// happen within PENDING_REQUEST_TIMEOUT seconds, the caller should give up waiting, call
+// resolv_cache_pending_request_timed_out(), and resolve the query without the cache.
+ResolvCacheStatus resolv_cache_lookup_async(unsigned netid, std::span<const uint8_t> query,
+                                            std::span<uint8_t> answer, int* answerlen,
+                                            uint32_t flags, std::function<void()> on_pending_done);
+void resolv_cache_pending_request_timed_out(unsigned netid);
+
+// Like resolv_cache_lookup(), but only returns the answers which are already cached: on a miss,
+// return RESOLV_CACHE_NOTFOUND without waiting for a pending request or registering one, so the
+// caller must not resolve the query itself, but hand it over to resolv_cache_lookup(). The only
+// exception is a caller which gave up waiting for the pending request, as resolv_cache_lookup()
+// does after PENDING_REQUEST_TIMEOUT.
+ResolvCacheStatus resolv_cache_probe(unsigned netid, std::span<const uint8_t> query,
+                                     std::span<uint8_t> answer, int* answerlen, uint32_t flags);
+
 // add a (query,answer) to the cache. If the pair has been in the cache, no new entry will be added
-// in the cache.
+// in the cache. The entry is accounted to |uid|, the app which sent the query, see the
+// cache_uid_quota_percent flag.
 int resolv_cache_add(unsigned netid, std::span<const uint8_t> query,
-                     std::span<const uint8_t> answer);
+                     std::span<const uint8_t> answer, uid_t uid = NET_CONTEXT_INVALID_UID);
+
+// The UID of the queries made by the cache warm-up when a network is configured, see
+// ResolverController. The hits on their entries are counted as warm-up hits.
+constexpr uid_t CACHE_WARM_UP_UID = AID_DNS;
 
 /* Notify the cache a request failed */
 void _resolv_cache_query_failed(unsigned netid, std::span<const uint8_t> query, uint32_t flags);
@@ -94,6 +128,18 @@ void resolv_delete_cache_for_net(unsigned netid);
 // Flushes the cache associated with the given network.
 int resolv_flush_cache_for_net(unsigned netid);
 
+// Resizes the cache associated with the given network to hold at most |max_entries| entries,
+// e.g. to release memory under pressure, until the max_cache_entries flag changes. The hash
+// table is rehashed incrementally, so that lookups are never blocked for long. Returns 0,
+// -EINVAL if |max_entries| is out of bounds, or -ENONET.
+int resolv_resize_cache_for_net(unsigned netid, int max_entries);
+
+// Sets the directory where the cache snapshots are saved. For testing only.
+void resolv_set_cache_snapshot_dir(const std::string& dir);
+
+// Waits until the cache snapshots queued so far are saved or loaded. For testing only.
+void resolv_wait_for_cache_snapshots();
+
 // Get transport types to a given network.
 android::net::NetworkType resolv_get_network_types_for_net(unsigned netid);
 
@@ -148,3 +194,7 @@ bool resolv_is_enforceDnsUid_enabled_network(unsigned netid);
 
 // Return true if the network is metered.
 bool resolv_is_metered_network(unsigned netid);
+
+// Return a signature identifying a network across netIds, e.g. when it's reconnected, or 0 if
+// its DNS servers aren't configured.
+uint64_t resolv_get_network_signature(unsigned netid);
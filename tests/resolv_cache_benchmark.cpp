@@ -0,0 +1,681 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <arpa/nameser.h>
+#include <ctype.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <latch>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/format.h>
+#include <android-base/logging.h>
+#include <android-base/properties.h>
+#include <benchmark/benchmark.h>
+
+#include "Experiments.h"
+#include "resolv_cache.h"
+#include "resolv_private.h"
+#include "tests/dns_responder/dns_responder.h"
+
+namespace {
+
+constexpr unsigned kBaseNetId = 1000;
+constexpr int kNamesPerNetwork = 64;
+
+const std::string kCacheEvictionPolicyFlag(
+        "persist.device_config.netd_native.cache_eviction_policy");
+const std::string kMaxCacheEntriesFlag("persist.device_config.netd_native.max_cache_entries");
+const std::string kMaxCacheBytesFlag("persist.device_config.netd_native.max_cache_bytes");
+
+struct CacheEntry {
+    std::vector<uint8_t> query;
+    std::vector<uint8_t> answer;
+};
+
+// Makes the query that res_nquery() sends on a network with |netcontextFlags|, which add an
+// EDNS0 OPT record for EDNS0 and DNS-over-TLS.
+std::vector<uint8_t> makeQuery(const std::string& qname, int qtype, unsigned netcontextFlags = 0) {
+    uint8_t buf[MAXPACKET] = {};
+    int len = res_nmkquery(QUERY, qname.c_str(), ns_c_in, qtype, {}, buf, netcontextFlags);
+    android_net_context netcontext = {.flags = netcontextFlags};
+    ResState res(&netcontext, nullptr);
+    if (netcontextFlags & (NET_CONTEXT_FLAG_USE_EDNS | NET_CONTEXT_FLAG_USE_DNS_OVER_TLS)) {
+        len = res_nopt(&res, len, buf, MAXPACKET);
+    }
+    return std::vector<uint8_t>(buf, buf + len);
+}
+
+// Makes an answer to |query| with one record per element of |rdata_strs|.
+std::vector<uint8_t> makeAnswer(const std::vector<uint8_t>& query,
+                                const std::vector<std::string>& rdata_strs, unsigned ttl) {
+    test::DNSHeader header;
+    header.read(reinterpret_cast<const char*>(query.data()),
+                reinterpret_cast<const char*>(query.data()) + query.size());
+
+    for (const test::DNSQuestion& question : header.questions) {
+        for (const std::string& rdata_str : rdata_strs) {
+            test::DNSRecord record{
+                    .name = {.name = question.qname.name},
+                    .rtype = question.qtype,
+                    .rclass = question.qclass,
+                    .ttl = ttl,
+            };
+            test::DNSResponder::fillRdata(rdata_str, record);
+            header.answers.push_back(std::move(record));
+        }
+    }
+
+    char answer[MAXPACKET] = {};
+    char* answer_end = header.write(answer, answer + sizeof(answer));
+    return std::vector<uint8_t>(answer, answer_end);
+}
+
+CacheEntry makeCacheEntry(const std::string& qname) {
+    CacheEntry ce;
+    ce.query = makeQuery(qname, ns_t_a);
+    ce.answer = makeAnswer(ce.query, {"192.0.2.1"}, /*ttl=*/3600);
+    return ce;
+}
+
+// Returns a name of at least |length| characters, made of |prefix| and |suffix| with labels of
+// |fill| characters in between.
+std::string makeLongName(const std::string& prefix, const std::string& suffix, size_t length,
+                         char fill = 'a') {
+    std::string name = prefix;
+    while (name.size() + 1 + suffix.size() < length) {
+        const size_t labelLength = std::min<size_t>(63, length - name.size() - suffix.size() - 1);
+        name += std::string(labelLength, fill) + ".";
+    }
+    return name + suffix;
+}
+
+// Creates a cache for |netId| filled with |count| entries, and returns these entries.
+std::vector<CacheEntry> setupNetwork(unsigned netId, int count = kNamesPerNetwork) {
+    resolv_create_cache_for_net(netId);
+    std::vector<CacheEntry> entries;
+    for (int i = 0; i < count; i++) {
+        entries.push_back(makeCacheEntry(fmt::format("host{}.net{}.example.com", i, netId)));
+        resolv_cache_add(netId, entries.back().query, entries.back().answer);
+    }
+    return entries;
+}
+
+}  // namespace
+
+// Cache-hit throughput when several networks are busy at the same time. Each benchmark thread
+// hammers its own network, so the aggregate throughput is expected to scale with the number
+// of threads as long as lookups on different networks don't serialize on a common lock.
+static void BM_CacheHitConcurrentNetworks(benchmark::State& state) {
+    static std::vector<std::vector<CacheEntry>> sEntries;
+    if (state.thread_index() == 0) {
+        sEntries.clear();
+        for (int i = 0; i < state.threads(); i++) {
+            sEntries.push_back(setupNetwork(kBaseNetId + i));
+        }
+    }
+
+    const unsigned netId = kBaseNetId + state.thread_index();
+    std::vector<uint8_t> answer(MAXPACKET);
+    int anslen = 0;
+    int i = 0;
+    for (auto _ : state) {
+        const CacheEntry& ce = sEntries[state.thread_index()][i++ % kNamesPerNetwork];
+        if (resolv_cache_lookup(netId, ce.query, answer, &anslen, 0) != RESOLV_CACHE_FOUND) {
+            state.SkipWithError("Unexpected cache miss");
+            break;
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+
+    if (state.thread_index() == 0) {
+        for (int i = 0; i < state.threads(); i++) {
+            resolv_delete_cache_for_net(kBaseNetId + i);
+        }
+    }
+}
+BENCHMARK(BM_CacheHitConcurrentNetworks)->Threads(1)->Threads(4)->Threads(16)->UseRealTime();
+
+// Cache-hit throughput when all the benchmark threads look up names on the same network, e.g.
+// many apps resolving popular names on the default network. Hits only take the cache lock in
+// shared mode, so they are expected to scale with the number of threads as well.
+static void BM_CacheHitSameNetwork(benchmark::State& state) {
+    static std::vector<CacheEntry> sEntries;
+    if (state.thread_index() == 0) {
+        sEntries = setupNetwork(kBaseNetId);
+    }
+
+    std::vector<uint8_t> answer(MAXPACKET);
+    int anslen = 0;
+    int i = state.thread_index();
+    for (auto _ : state) {
+        const CacheEntry& ce = sEntries[i++ % kNamesPerNetwork];
+        if (resolv_cache_lookup(kBaseNetId, ce.query, answer, &anslen, 0) != RESOLV_CACHE_FOUND) {
+            state.SkipWithError("Unexpected cache miss");
+            break;
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+
+    if (state.thread_index() == 0) {
+        resolv_delete_cache_for_net(kBaseNetId);
+    }
+}
+BENCHMARK(BM_CacheHitSameNetwork)->Threads(1)->Threads(4)->Threads(16)->UseRealTime();
+
+// Cache-hit latency when the cache holds max_cache_entries entries, which is the worst case for
+// the hash table load. Names are looked up in a scattered order to defeat the CPU caches.
+static void BM_CacheLookupFullCache(benchmark::State& state) {
+    resolv_create_cache_for_net(kBaseNetId);
+    const int maxEntries = resolv_get_max_cache_entries(kBaseNetId);
+    resolv_delete_cache_for_net(kBaseNetId);
+    const std::vector<CacheEntry> entries = setupNetwork(kBaseNetId, maxEntries);
+
+    std::vector<uint8_t> answer(MAXPACKET);
+    int anslen = 0;
+    size_t i = 0;
+    for (auto _ : state) {
+        // 7919 is a prime, so this visits all the entries.
+        i = (i + 7919) % entries.size();
+        if (resolv_cache_lookup(kBaseNetId, entries[i].query, answer, &anslen, 0) !=
+            RESOLV_CACHE_FOUND) {
+            state.SkipWithError("Unexpected cache miss");
+            break;
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+
+    resolv_delete_cache_for_net(kBaseNetId);
+}
+BENCHMARK(BM_CacheLookupFullCache);
+
+// Cache-hit latency with names of the length given as argument, looked up with a case different
+// from the one they were cached with, as resolvers randomizing the case of queries (DNS 0x20)
+// do. The cost of building, hashing and comparing the keys grows with the length of the names.
+static void BM_CacheLookupLongNames(benchmark::State& state) {
+    resolv_create_cache_for_net(kBaseNetId);
+    std::vector<CacheEntry> entries;
+    for (int i = 0; i < kNamesPerNetwork; i++) {
+        std::string name = makeLongName(fmt::format("host{}.", i), "example.com", state.range(0));
+        CacheEntry ce = makeCacheEntry(name);
+        resolv_cache_add(kBaseNetId, ce.query, ce.answer);
+        for (size_t j = 0; j < name.size(); j += 2) {
+            name[j] = toupper(name[j]);
+        }
+        ce.query = makeQuery(name, ns_t_a);
+        entries.push_back(std::move(ce));
+    }
+
+    std::vector<uint8_t> answer(MAXPACKET);
+    int anslen = 0;
+    int i = 0;
+    for (auto _ : state) {
+        const CacheEntry& ce = entries[i++ % kNamesPerNetwork];
+        if (resolv_cache_lookup(kBaseNetId, ce.query, answer, &anslen, 0) != RESOLV_CACHE_FOUND) {
+            state.SkipWithError("Unexpected cache miss");
+            break;
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+
+    resolv_delete_cache_for_net(kBaseNetId);
+}
+BENCHMARK(BM_CacheLookupLongNames)->Arg(16)->Arg(64)->Arg(128)->Arg(253);
+
+// Cache-hit latency in a full cache of long names which only differ in their first few
+// characters, e.g. generated subdomains of a CDN. A weak hash makes such keys collide, so that
+// lookups walk long probe sequences, and each key comparison along them scans the common part.
+static void BM_CacheLookupSimilarNames(benchmark::State& state) {
+    resolv_create_cache_for_net(kBaseNetId);
+    const int maxEntries = resolv_get_max_cache_entries(kBaseNetId);
+    std::vector<CacheEntry> entries;
+    for (int i = 0; i < maxEntries; i++) {
+        entries.push_back(makeCacheEntry(makeLongName(fmt::format("{}.", i), "example.com", 250)));
+        resolv_cache_add(kBaseNetId, entries.back().query, entries.back().answer);
+    }
+
+    std::vector<uint8_t> answer(MAXPACKET);
+    int anslen = 0;
+    size_t i = 0;
+    for (auto _ : state) {
+        i = (i + 7919) % entries.size();
+        if (resolv_cache_lookup(kBaseNetId, entries[i].query, answer, &anslen, 0) !=
+            RESOLV_CACHE_FOUND) {
+            state.SkipWithError("Unexpected cache miss");
+            break;
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+
+    resolv_delete_cache_for_net(kBaseNetId);
+}
+BENCHMARK(BM_CacheLookupSimilarNames);
+
+// Cache-add throughput on a full cache, where every add evicts an entry, allocates a new one and
+// releases the evicted one.
+static void BM_CacheAddFullCache(benchmark::State& state) {
+    resolv_create_cache_for_net(kBaseNetId);
+    const int maxEntries = resolv_get_max_cache_entries(kBaseNetId);
+    // Cycling through twice as many names as the cache holds, each name has been evicted by
+    // the time it is added again.
+    // Each name gets its own address, as a shared one would make the reverse index dominate.
+    std::vector<CacheEntry> entries;
+    for (int i = 0; i < 2 * maxEntries; i++) {
+        CacheEntry ce;
+        ce.query = makeQuery(fmt::format("host{}.example.com", i), ns_t_a);
+        ce.answer = makeAnswer(ce.query, {fmt::format("10.0.{}.{}", i / 256, i % 256)},
+                               /*ttl=*/3600);
+        entries.push_back(std::move(ce));
+    }
+
+    size_t i = 0;
+    for (auto _ : state) {
+        const CacheEntry& ce = entries[i++ % entries.size()];
+        if (resolv_cache_add(kBaseNetId, ce.query, ce.answer) != 0) {
+            state.SkipWithError("Failed to add an entry");
+            break;
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+
+    resolv_delete_cache_for_net(kBaseNetId);
+}
+BENCHMARK(BM_CacheAddFullCache);
+
+// Reverse lookups in a full cache where every answer has several A records, as done by
+// gethostbyaddr() for addresses recently resolved by the app.
+static void BM_GetHostByAddrFullCache(benchmark::State& state) {
+    constexpr int kRecordsPerAnswer = 4;
+    resolv_create_cache_for_net(kBaseNetId);
+    const int maxEntries = resolv_get_max_cache_entries(kBaseNetId);
+
+    std::vector<std::string> addrs;
+    for (int i = 0; i < maxEntries; i++) {
+        CacheEntry ce;
+        ce.query = makeQuery(fmt::format("host{}.example.com", i), ns_t_a);
+        std::vector<std::string> rdata;
+        for (int j = 0; j < kRecordsPerAnswer; j++) {
+            rdata.push_back(fmt::format("10.{}.{}.{}", j, i / 256, i % 256));
+        }
+        ce.answer = makeAnswer(ce.query, rdata, /*ttl=*/3600);
+        resolv_cache_add(kBaseNetId, ce.query, ce.answer);
+        addrs.push_back(rdata.back());
+    }
+
+    char domainName[NS_MAXDNAME];
+    size_t i = 0;
+    for (auto _ : state) {
+        i = (i + 7919) % addrs.size();
+        if (!resolv_gethostbyaddr_from_cache(kBaseNetId, domainName, sizeof(domainName),
+                                             addrs[i].c_str(), AF_INET)) {
+            state.SkipWithError("Address not found");
+            break;
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+
+    resolv_delete_cache_for_net(kBaseNetId);
+}
+BENCHMARK(BM_GetHostByAddrFullCache);
+
+// Flushing a cache holding the number of entries given as argument, while other threads look up
+// names in it. The iteration time is the time the flush takes, and lookup_max_us is the worst
+// latency of the concurrent lookups, which wait for the flush, averaged over the iterations.
+// The lookups are paced as the queries of apps are, rather than made in a tight loop which
+// would starve the threads needing the cache lock exclusively.
+static void BM_CacheLookupDuringFlush(benchmark::State& state) {
+    constexpr int kReaders = 2;
+    const int numEntries = state.range(0);
+    const std::string storedMaxEntries = android::base::GetProperty(kMaxCacheEntriesFlag, "");
+    const std::string storedMaxBytes = android::base::GetProperty(kMaxCacheBytesFlag, "");
+    android::base::SetProperty(kMaxCacheEntriesFlag, std::to_string(numEntries));
+    android::base::SetProperty(kMaxCacheBytesFlag, std::to_string(64 * 1024 * 1024));
+    android::net::Experiments::getInstance()->update();
+
+    const std::vector<CacheEntry> entries = setupNetwork(kBaseNetId, numEntries);
+    std::atomic<bool> done = false;
+    std::atomic<int64_t> maxLatencyNs = 0;
+    std::vector<std::thread> readers;
+    for (int r = 0; r < kReaders; r++) {
+        readers.emplace_back([&, r] {
+            std::vector<uint8_t> answer(MAXPACKET);
+            int anslen = 0;
+            for (size_t i = r; !done; i = (i + 7919) % entries.size()) {
+                const CacheEntry& ce = entries[i];
+                const auto start = std::chrono::steady_clock::now();
+                if (resolv_cache_lookup(kBaseNetId, ce.query, answer, &anslen, 0) !=
+                    RESOLV_CACHE_FOUND) {
+                    // Drop the pending request, so that the other readers don't wait for it.
+                    _resolv_cache_query_failed(kBaseNetId, ce.query, 0);
+                }
+                const int64_t latencyNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                  std::chrono::steady_clock::now() - start)
+                                                  .count();
+                int64_t max = maxLatencyNs;
+                while (latencyNs > max && !maxLatencyNs.compare_exchange_weak(max, latencyNs)) {
+                }
+                std::this_thread::sleep_for(std::chrono::microseconds(20));
+            }
+        });
+    }
+
+    int64_t sumMaxLatencyNs = 0;
+    for (auto _ : state) {
+        for (const CacheEntry& ce : entries) {
+            resolv_cache_add(kBaseNetId, ce.query, ce.answer);
+        }
+        maxLatencyNs = 0;
+        const auto start = std::chrono::steady_clock::now();
+        resolv_flush_cache_for_net(kBaseNetId);
+        const auto end = std::chrono::steady_clock::now();
+        state.SetIterationTime(std::chrono::duration<double>(end - start).count());
+        // Let the lookups which waited for the flush complete.
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        sumMaxLatencyNs += maxLatencyNs;
+    }
+    state.counters["lookup_max_us"] = sumMaxLatencyNs / 1000.0 / state.iterations();
+
+    done = true;
+    for (std::thread& reader : readers) {
+        reader.join();
+    }
+    resolv_delete_cache_for_net(kBaseNetId);
+    android::base::SetProperty(kMaxCacheEntriesFlag, storedMaxEntries);
+    android::base::SetProperty(kMaxCacheBytesFlag, storedMaxBytes);
+    android::net::Experiments::getInstance()->update();
+}
+BENCHMARK(BM_CacheLookupDuringFlush)
+        ->Arg(1000)
+        ->Arg(10000)
+        ->Iterations(20)
+        ->UseManualTime();
+
+// Resizing a cache holding the number of entries given as argument to twice that and back, while
+// other threads look up names in it. The iteration time is the time the resize call takes, and
+// lookup_max_us is the worst latency of the concurrent lookups while the entries are moved to the
+// new table in the background, averaged over the iterations. None of the lookups should miss.
+static void BM_CacheLookupDuringResize(benchmark::State& state) {
+    constexpr int kReaders = 2;
+    const int numEntries = state.range(0);
+    const std::string storedMaxEntries = android::base::GetProperty(kMaxCacheEntriesFlag, "");
+    const std::string storedMaxBytes = android::base::GetProperty(kMaxCacheBytesFlag, "");
+    android::base::SetProperty(kMaxCacheEntriesFlag, std::to_string(numEntries));
+    android::base::SetProperty(kMaxCacheBytesFlag, std::to_string(64 * 1024 * 1024));
+    android::net::Experiments::getInstance()->update();
+
+    const std::vector<CacheEntry> entries = setupNetwork(kBaseNetId, numEntries);
+    std::atomic<bool> done = false;
+    std::atomic<int64_t> maxLatencyNs = 0;
+    std::atomic<int> misses = 0;
+    std::vector<std::thread> readers;
+    for (int r = 0; r < kReaders; r++) {
+        readers.emplace_back([&, r] {
+            std::vector<uint8_t> answer(MAXPACKET);
+            int anslen = 0;
+            for (size_t i = r; !done; i = (i + 7919) % entries.size()) {
+                const CacheEntry& ce = entries[i];
+                const auto start = std::chrono::steady_clock::now();
+                if (resolv_cache_lookup(kBaseNetId, ce.query, answer, &anslen, 0) !=
+                    RESOLV_CACHE_FOUND) {
+                    _resolv_cache_query_failed(kBaseNetId, ce.query, 0);
+                    misses++;
+                }
+                const int64_t latencyNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                  std::chrono::steady_clock::now() - start)
+                                                  .count();
+                int64_t max = maxLatencyNs;
+                while (latencyNs > max && !maxLatencyNs.compare_exchange_weak(max, latencyNs)) {
+                }
+                std::this_thread::sleep_for(std::chrono::microseconds(20));
+            }
+        });
+    }
+
+    int64_t sumMaxLatencyNs = 0;
+    int maxEntries = numEntries;
+    for (auto _ : state) {
+        maxEntries = (maxEntries == numEntries) ? 2 * numEntries : numEntries;
+        maxLatencyNs = 0;
+        const auto start = std::chrono::steady_clock::now();
+        resolv_resize_cache_for_net(kBaseNetId, maxEntries);
+        const auto end = std::chrono::steady_clock::now();
+        state.SetIterationTime(std::chrono::duration<double>(end - start).count());
+        // Let the entries be moved to the new table.
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        sumMaxLatencyNs += maxLatencyNs;
+    }
+    state.counters["lookup_max_us"] = sumMaxLatencyNs / 1000.0 / state.iterations();
+    state.counters["lookup_misses"] = misses.load();
+
+    done = true;
+    for (std::thread& reader : readers) {
+        reader.join();
+    }
+    resolv_delete_cache_for_net(kBaseNetId);
+    android::base::SetProperty(kMaxCacheEntriesFlag, storedMaxEntries);
+    android::base::SetProperty(kMaxCacheBytesFlag, storedMaxBytes);
+    android::net::Experiments::getInstance()->update();
+}
+BENCHMARK(BM_CacheLookupDuringResize)
+        ->Arg(1000)
+        ->Arg(10000)
+        ->Iterations(20)
+        ->UseManualTime();
+
+// Thundering herd: many threads look up the same few names while the first lookup of each name
+// is being resolved, so they all wait for it. Measures the time it takes, once the answers are
+// added, for all the waiters to be served. Completing one name should only wake up the threads
+// waiting for that name.
+static void BM_PendingRequestsThunderingHerd(benchmark::State& state) {
+    const int numNames = state.range(0);
+    const int waitersPerName = state.range(1);
+    resolv_create_cache_for_net(kBaseNetId);
+
+    std::vector<CacheEntry> entries;
+    for (int i = 0; i < numNames; i++) {
+        entries.push_back(makeCacheEntry(fmt::format("herd{}.example.com", i)));
+    }
+
+    for (auto _ : state) {
+        resolv_flush_cache_for_net(kBaseNetId);
+        // The first lookup of each name misses the cache, and registers a pending request.
+        std::vector<uint8_t> answer(MAXPACKET);
+        int anslen = 0;
+        for (const CacheEntry& ce : entries) {
+            resolv_cache_lookup(kBaseNetId, ce.query, answer, &anslen, 0);
+        }
+
+        std::latch started(numNames * waitersPerName);
+        std::latch served(numNames * waitersPerName);
+        std::atomic<int> misses = 0;
+        std::vector<std::thread> threads;
+        for (int i = 0; i < numNames * waitersPerName; i++) {
+            threads.emplace_back([&, i] {
+                const CacheEntry& ce = entries[i % numNames];
+                std::vector<uint8_t> answer(MAXPACKET);
+                int anslen = 0;
+                started.count_down();
+                if (resolv_cache_lookup(kBaseNetId, ce.query, answer, &anslen, 0) !=
+                    RESOLV_CACHE_FOUND) {
+                    misses++;
+                }
+                served.count_down();
+            });
+        }
+        // Give the waiters some time to block on their pending request.
+        started.wait();
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+        const auto start = std::chrono::steady_clock::now();
+        for (const CacheEntry& ce : entries) {
+            resolv_cache_add(kBaseNetId, ce.query, ce.answer);
+        }
+        served.wait();
+        const auto end = std::chrono::steady_clock::now();
+        state.SetIterationTime(std::chrono::duration<double>(end - start).count());
+
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        if (misses > 0) {
+            state.SkipWithError("Unexpected cache miss");
+            break;
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * numNames * waitersPerName);
+
+    resolv_delete_cache_for_net(kBaseNetId);
+}
+BENCHMARK(BM_PendingRequestsThunderingHerd)
+        ->Args({1, 256})
+        ->Args({16, 16})
+        ->Args({256, 1})
+        ->UseManualTime();
+
+// Returns the query names of the trace to replay in BM_CacheHitRatio. If the
+// RESOLV_CACHE_TRACE environment variable is set, it is the path of a recorded trace with one
+// query name per line. Otherwise, the trace is synthesized: mostly names drawn from a Zipf
+// distribution, as apps looking up popular names do, interleaved with scans of one-off names,
+// as an app iterating over tracker hostnames does.
+const std::vector<std::string>& getTrace() {
+    static const std::vector<std::string> sTrace = [] {
+        std::vector<std::string> trace;
+        if (const char* path = getenv("RESOLV_CACHE_TRACE"); path != nullptr) {
+            std::ifstream file(path);
+            for (std::string name; std::getline(file, name);) {
+                if (!name.empty()) trace.push_back(name);
+            }
+            return trace;
+        }
+
+        constexpr int kPopularNames = 2000;
+        constexpr int kRounds = 100;
+        constexpr int kPopularQueriesPerRound = 1000;
+        constexpr int kScannedNamesPerRound = 300;
+        std::vector<double> weights;
+        for (int rank = 1; rank <= kPopularNames; rank++) {
+            weights.push_back(1.0 / rank);
+        }
+        std::mt19937 rng(42);
+        std::discrete_distribution<int> zipf(weights.begin(), weights.end());
+        int scanned = 0;
+        for (int round = 0; round < kRounds; round++) {
+            for (int i = 0; i < kPopularQueriesPerRound; i++) {
+                trace.push_back(fmt::format("popular{}.example.com", zipf(rng)));
+            }
+            for (int i = 0; i < kScannedNamesPerRound; i++) {
+                trace.push_back(fmt::format("tracker{}.example.net", scanned++));
+            }
+        }
+        return trace;
+    }();
+    return sTrace;
+}
+
+// Hit ratio of the cache replaying a query trace with the eviction policy given as argument:
+// 0 for LRU, 1 for W-TinyLFU. Each miss is resolved by adding the answer to the cache.
+static void BM_CacheHitRatio(benchmark::State& state) {
+    const std::vector<std::string>& trace = getTrace();
+    std::map<std::string, CacheEntry> entries;
+    for (const std::string& name : trace) {
+        if (!entries.contains(name)) entries.emplace(name, makeCacheEntry(name));
+    }
+
+    const std::string storedPolicy = android::base::GetProperty(kCacheEvictionPolicyFlag, "");
+    android::base::SetProperty(kCacheEvictionPolicyFlag, std::to_string(state.range(0)));
+    android::net::Experiments::getInstance()->update();
+
+    std::vector<uint8_t> answer(MAXPACKET);
+    int anslen = 0;
+    int64_t hits = 0;
+    for (auto _ : state) {
+        resolv_create_cache_for_net(kBaseNetId);
+        for (const std::string& name : trace) {
+            const CacheEntry& ce = entries.at(name);
+            if (resolv_cache_lookup(kBaseNetId, ce.query, answer, &anslen, 0) ==
+                RESOLV_CACHE_FOUND) {
+                hits++;
+            } else {
+                resolv_cache_add(kBaseNetId, ce.query, ce.answer);
+            }
+        }
+        resolv_delete_cache_for_net(kBaseNetId);
+    }
+    state.SetItemsProcessed(state.iterations() * trace.size());
+    state.counters["hit_ratio"] =
+            static_cast<double>(hits) / (state.iterations() * trace.size());
+
+    android::base::SetProperty(kCacheEvictionPolicyFlag, storedPolicy);
+    android::net::Experiments::getInstance()->update();
+}
+BENCHMARK(BM_CacheHitRatio)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+// Hit ratio of the cache replaying the trace of BM_CacheHitRatio, with each query sent in plain
+// text, with EDNS0 or over DNS-over-TLS at random, as when the apps of a network resolve names
+// through different APIs, or opportunistic private DNS falls back to plain text.
+static void BM_CacheHitRatioMixedQueries(benchmark::State& state) {
+    constexpr unsigned kNetcontextFlags[] = {0, NET_CONTEXT_FLAG_USE_EDNS,
+                                             NET_CONTEXT_FLAG_USE_DNS_OVER_TLS};
+    const std::vector<std::string>& trace = getTrace();
+    std::map<std::pair<std::string, unsigned>, CacheEntry> entries;
+    std::vector<const CacheEntry*> queries;
+    std::mt19937 rng(42);
+    for (const std::string& name : trace) {
+        const unsigned flags = kNetcontextFlags[rng() % std::size(kNetcontextFlags)];
+        auto [it, inserted] = entries.try_emplace({name, flags});
+        if (inserted) {
+            it->second.query = makeQuery(name, ns_t_a, flags);
+            it->second.answer = makeAnswer(it->second.query, {"192.0.2.1"}, /*ttl=*/3600);
+        }
+        queries.push_back(&it->second);
+    }
+
+    std::vector<uint8_t> answer(MAXPACKET);
+    int anslen = 0;
+    int64_t hits = 0;
+    for (auto _ : state) {
+        resolv_create_cache_for_net(kBaseNetId);
+        for (const CacheEntry* ce : queries) {
+            if (resolv_cache_lookup(kBaseNetId, ce->query, answer, &anslen, 0) ==
+                RESOLV_CACHE_FOUND) {
+                hits++;
+            } else {
+                resolv_cache_add(kBaseNetId, ce->query, ce->answer);
+            }
+        }
+        resolv_delete_cache_for_net(kBaseNetId);
+    }
+    state.SetItemsProcessed(state.iterations() * queries.size());
+    state.counters["hit_ratio"] =
+            static_cast<double>(hits) / (state.iterations() * queries.size());
+}
+BENCHMARK(BM_CacheHitRatioMixedQueries)->Unit(benchmark::kMillisecond);
+
+int main(int argc, char** argv) {
+    // Conceal the resolver cache logs, which would otherwise dominate the measurements.
+    android::base::SetMinimumLogSeverity(android::base::WARNING);
+    benchmark::Initialize(&argc, argv);
+    benchmark::RunSpecifiedBenchmarks();
+    return 0;
+}
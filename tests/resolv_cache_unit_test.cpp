@@ -23,6 +23,7 @@
 #include <span>
 #include <thread>
 
+#include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android/multinetwork.h>
 #include <arpa/inet.h>
@@ -81,6 +82,19 @@ std::vector<uint8_t> makeQuery(int op, const char* qname, int qclass, int qtype)
     return std::vector<uint8_t>(buf, buf + len);
 }
 
+// Makes the query that res_nquery() sends on a network with |netcontextFlags|, which add an
+// EDNS0 OPT record for EDNS0 and DNS-over-TLS, with the DO and AD bits for the latter.
+std::vector<uint8_t> makeQuery(const char* qname, int qtype, unsigned netcontextFlags) {
+    uint8_t buf[MAXPACKET] = {};
+    int len = res_nmkquery(QUERY, qname, ns_c_in, qtype, {}, buf, netcontextFlags);
+    android_net_context netcontext = {.flags = netcontextFlags};
+    ResState res(&netcontext, nullptr);
+    if (netcontextFlags & (NET_CONTEXT_FLAG_USE_EDNS | NET_CONTEXT_FLAG_USE_DNS_OVER_TLS)) {
+        len = res_nopt(&res, len, buf, MAXPACKET);
+    }
+    return std::vector<uint8_t>(buf, buf + len);
+}
+
 std::vector<uint8_t> makeAnswer(const std::vector<uint8_t>& query, const char* rdata_str,
                                 const unsigned ttl) {
     test::DNSHeader header;
@@ -180,6 +194,14 @@ class ResolvCacheTest : public NetNativeTestBase {
         return true;
     }
 
+    // Returns whether |ce| is in the cache. Unlike cacheLookup(), a miss isn't a failure, but
+    // it registers a pending request, so this must not be called twice for an absent entry.
+    bool isCached(uint32_t netId, const CacheEntry& ce) {
+        int anslen = 0;
+        std::vector<uint8_t> answer(MAXPACKET);
+        return resolv_cache_lookup(netId, ce.query, answer, &anslen, 0) == RESOLV_CACHE_FOUND;
+    }
+
     int cacheCreate(uint32_t netId) {
         return resolv_create_cache_for_net(netId);
     }
@@ -188,8 +210,8 @@ class ResolvCacheTest : public NetNativeTestBase {
         resolv_delete_cache_for_net(netId);
     }
 
-    int cacheAdd(uint32_t netId, const CacheEntry& ce) {
-        return resolv_cache_add(netId, ce.query, ce.answer);
+    int cacheAdd(uint32_t netId, const CacheEntry& ce, uid_t uid = NET_CONTEXT_INVALID_UID) {
+        return resolv_cache_add(netId, ce.query, ce.answer, uid);
     }
 
     int cacheAdd(uint32_t netId, const std::vector<uint8_t>& query,
@@ -398,6 +420,113 @@ TEST_F(ResolvCacheTest, CacheLookup_Types) {
     }
 }
 
+TEST_F(ResolvCacheTest, CacheLookup_EquivalentQueries) {
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    const CacheEntry ce = makeCacheEntry(QUERY, "Cache.Lookup.Example", ns_c_in, ns_t_a, "1.2.3.4");
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+
+    // Names are compared case-insensitively, and the ID, TC and AD bits are ignored.
+    std::vector<uint8_t> query = makeQuery(QUERY, "cache.LOOKUP.example", ns_c_in, ns_t_a);
+    query[0] ^= 0xff;
+    query[2] |= 0x02;
+    query[3] |= 0x20;
+    EXPECT_TRUE(isCached(TEST_NETID, {.query = query}));
+
+    // The RD bit makes a difference.
+    query[2] ^= 0x01;
+    EXPECT_FALSE(isCached(TEST_NETID, {.query = query}));
+}
+
+TEST_F(ResolvCacheTest, CacheLookup_EdnsQueriesShareEntries) {
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    const std::vector<uint8_t> plainQuery = makeQuery("edns.example", ns_t_a, 0);
+    const std::vector<uint8_t> ednsQuery =
+            makeQuery("edns.example", ns_t_a, NET_CONTEXT_FLAG_USE_EDNS);
+    const std::vector<uint8_t> dotQuery =
+            makeQuery("edns.example", ns_t_a, NET_CONTEXT_FLAG_USE_DNS_OVER_TLS);
+
+    // The answer to a DNS-over-TLS query, with the AD bit, an RRSIG and an OPT record.
+    test::DNSHeader header;
+    header.read(reinterpret_cast<const char*>(dotQuery.data()),
+                reinterpret_cast<const char*>(dotQuery.data()) + dotQuery.size());
+    header.qr = true;
+    header.ad = true;
+    header.answers.push_back(
+            {.name = {.name = "edns.example."}, .rtype = ns_t_a, .rclass = ns_c_in, .ttl = 10});
+    ASSERT_TRUE(test::DNSResponder::fillRdata("1.2.3.4", header.answers.back()));
+    header.answers.push_back({.name = {.name = "edns.example."},
+                              .rtype = ns_t_rrsig,
+                              .rclass = ns_c_in,
+                              .ttl = 10,
+                              .rdata = std::vector<char>(40, 'x')});
+    header.additionals = {{.rtype = ns_t_opt, .rclass = 1232, .ttl = NS_OPT_DNSSEC_OK}};
+    std::vector<uint8_t> dotAnswer;
+    ASSERT_TRUE(header.write(&dotAnswer));
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, dotQuery, dotAnswer));
+
+    // The same query gets the answer as is.
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID,
+                            {.query = dotQuery, .answer = dotAnswer}));
+
+    // Queries without the DO bit don't share it, since the answer to a DNSSEC-aware query may
+    // have records they didn't ask for.
+    EXPECT_FALSE(isCached(TEST_NETID, {.query = ednsQuery}));
+
+    // The answer to an EDNS0 query, with the AD bit and an OPT record.
+    test::DNSHeader ednsHeader;
+    ednsHeader.read(reinterpret_cast<const char*>(ednsQuery.data()),
+                    reinterpret_cast<const char*>(ednsQuery.data()) + ednsQuery.size());
+    ednsHeader.qr = true;
+    ednsHeader.ad = true;
+    ednsHeader.answers = {header.answers[0]};
+    ednsHeader.additionals = {{.rtype = ns_t_opt, .rclass = 1232}};
+    std::vector<uint8_t> ednsAnswer;
+    ASSERT_TRUE(ednsHeader.write(&ednsAnswer));
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ednsQuery, ednsAnswer));
+
+    // Queries without the AD bit don't get it, and those without EDNS0 don't get the OPT record
+    // either.
+    for (const auto& [query, arcount] : {std::pair(ednsQuery, 1), std::pair(plainQuery, 0)}) {
+        int anslen = 0;
+        std::vector<uint8_t> answer(MAXPACKET);
+        ASSERT_EQ(RESOLV_CACHE_FOUND, resolv_cache_lookup(TEST_NETID, query, answer, &anslen, 0));
+        ns_msg handle;
+        ns_rr rr;
+        ASSERT_EQ(0, ns_initparse(answer.data(), anslen, &handle));
+        EXPECT_EQ(0, ns_msg_getflag(handle, ns_f_ad));
+        EXPECT_EQ(1, ns_msg_count(handle, ns_s_qd));
+        ASSERT_EQ(1, ns_msg_count(handle, ns_s_an));
+        ASSERT_EQ(0, ns_parserr(&handle, ns_s_an, 0, &rr));
+        EXPECT_EQ(ns_t_a, ns_rr_type(rr));
+        EXPECT_EQ(10U, ns_rr_ttl(rr));
+        ASSERT_EQ(4, ns_rr_rdlen(rr));
+        EXPECT_EQ(0, memcmp(ns_rr_rdata(rr), "\x01\x02\x03\x04", 4));
+        ASSERT_EQ(arcount, ns_msg_count(handle, ns_s_ar));
+        if (arcount > 0) {
+            ASSERT_EQ(0, ns_parserr(&handle, ns_s_ar, 0, &rr));
+            EXPECT_EQ(ns_t_opt, ns_rr_type(rr));
+        }
+    }
+
+    // An answer to a plain query is served as is to EDNS0 queries, but not to DNSSEC-aware ones,
+    // which would miss the DNSSEC records.
+    const CacheEntry ce = makeCacheEntry(QUERY, "plain.example", ns_c_in, ns_t_a, "1.2.3.4");
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID,
+                            {.query = makeQuery("plain.example", ns_t_a, NET_CONTEXT_FLAG_USE_EDNS),
+                             .answer = ce.answer}));
+    EXPECT_FALSE(isCached(TEST_NETID, {.query = makeQuery("plain.example", ns_t_a,
+                                                          NET_CONTEXT_FLAG_USE_DNS_OVER_TLS)}));
+
+    // EDNS0 options which may change the answer, e.g. a client subnet, are part of the key.
+    // The OPT record follows the question, and its RDATA is the padding option.
+    std::vector<uint8_t> subnetQuery = ednsQuery;
+    const size_t optionCode = plainQuery.size() + 1 + RRFIXEDSZ;
+    ASSERT_EQ(NS_OPT_PADDING, ns_get16(&subnetQuery[optionCode]));
+    ns_put16(8, &subnetQuery[optionCode]);
+    EXPECT_FALSE(isCached(TEST_NETID, {.query = subnetQuery}));
+}
+
 TEST_F(ResolvCacheTest, CacheLookup_InvalidArgs) {
     EXPECT_EQ(0, cacheCreate(TEST_NETID));
 
@@ -448,6 +577,140 @@ TEST_F(ResolvCacheTest, CacheLookup_Expired) {
     EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce));
 }
 
+TEST_F(ResolvCacheTest, CacheLookup_ServeStale) {
+    {
+        // The flags are read when the cache is created.
+        ScopedSystemProperties sp1(kServeStaleMaxAgeFlag, "3600");
+        ScopedSystemProperties sp2(kServeStaleTtlFlag, "1");
+        android::net::Experiments::getInstance()->update();
+        EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    }
+    android::net::Experiments::getInstance()->update();
+
+    CacheEntry ce = makeCacheEntry(QUERY, "expired.in.2s", ns_c_in, ns_t_a, "1.2.3.4", 2s);
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+    std::this_thread::sleep_for(2500ms);
+
+    // The first stale hit asks the caller to refresh the entry. The TTLs are capped.
+    int anslen = 0;
+    std::vector<uint8_t> answer(MAXPACKET);
+    EXPECT_EQ(RESOLV_CACHE_FOUND_REFRESH,
+              resolv_cache_lookup(TEST_NETID, ce.query, answer, &anslen, 0));
+    ns_msg handle;
+    ns_rr rr;
+    ASSERT_EQ(0, ns_initparse(answer.data(), anslen, &handle));
+    ASSERT_EQ(0, ns_parserr(&handle, ns_s_an, 0, &rr));
+    EXPECT_EQ(1U, ns_rr_ttl(rr));
+
+    // The refresh is in progress, so the next stale hits don't ask for another one.
+    EXPECT_EQ(RESOLV_CACHE_FOUND, resolv_cache_lookup(TEST_NETID, ce.query, answer, &anslen, 0));
+
+    // The refreshed answer replaces the stale entry.
+    ce = makeCacheEntry(QUERY, "expired.in.2s", ns_c_in, ns_t_a, "1.2.3.5");
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+}
+
+TEST_F(ResolvCacheTest, CacheLookup_ServeStaleMaxAge) {
+    {
+        ScopedSystemProperties sp(kServeStaleMaxAgeFlag, "1");
+        android::net::Experiments::getInstance()->update();
+        EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    }
+    android::net::Experiments::getInstance()->update();
+
+    CacheEntry ce = makeCacheEntry(QUERY, "expired.in.1s", ns_c_in, ns_t_a, "1.2.3.4", 1s);
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+
+    // Entries which have been expired for longer than the max age are not served.
+    std::this_thread::sleep_for(3000ms);
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce));
+}
+
+TEST_F(ResolvCacheTest, CacheLookup_Prefetch) {
+    {
+        ScopedSystemProperties sp1(kCachePrefetchTtlPercentFlag, "50");
+        ScopedSystemProperties sp2(kCachePrefetchMinHitsFlag, "2");
+        android::net::Experiments::getInstance()->update();
+        EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    }
+    android::net::Experiments::getInstance()->update();
+
+    CacheEntry ce = makeCacheEntry(QUERY, "expired.in.4s", ns_c_in, ns_t_a, "1.2.3.4", 4s);
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+
+    // Within the last half of its TTL, the first hit asks the caller to refresh the entry.
+    std::this_thread::sleep_for(2500ms);
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND_REFRESH, TEST_NETID, ce));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+
+    // The refreshed answer replaces the entry although it hasn't expired yet.
+    ce = makeCacheEntry(QUERY, "expired.in.4s", ns_c_in, ns_t_a, "1.2.3.5");
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+
+    // Entries which haven't been hit often enough are not prefetched.
+    ce = makeCacheEntry(QUERY, "not.hot", ns_c_in, ns_t_a, "1.2.3.4", 4s);
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+    std::this_thread::sleep_for(2500ms);
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+}
+
+TEST_F(ResolvCacheTest, CacheLookup_SynthesizedFromRRsets) {
+    {
+        ScopedSystemProperties sp(kCacheRRsetsFlag, "1");
+        android::net::Experiments::getInstance()->update();
+        EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    }
+    android::net::Experiments::getInstance()->update();
+
+    // The AAAA answer of alias.example brings the CNAME to target.example, whose A RRset is in
+    // another answer.
+    const std::vector<uint8_t> aaaaQuery = makeQuery(QUERY, "alias.example", ns_c_in, ns_t_aaaa);
+    test::DNSHeader header;
+    header.read(reinterpret_cast<const char*>(aaaaQuery.data()),
+                reinterpret_cast<const char*>(aaaaQuery.data()) + aaaaQuery.size());
+    header.qr = true;
+    header.answers.push_back({.name = {.name = "alias.example."},
+                              .rtype = ns_t_cname,
+                              .rclass = ns_c_in,
+                              .ttl = 100});
+    ASSERT_TRUE(test::DNSResponder::fillRdata("target.example.", header.answers.back()));
+    header.answers.push_back({.name = {.name = "target.example."},
+                              .rtype = ns_t_aaaa,
+                              .rclass = ns_c_in,
+                              .ttl = 100});
+    ASSERT_TRUE(test::DNSResponder::fillRdata("2001:db8::1", header.answers.back()));
+    std::vector<uint8_t> aaaaAnswer;
+    ASSERT_TRUE(header.write(&aaaaAnswer));
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, aaaaQuery, aaaaAnswer));
+    const CacheEntry ce = makeCacheEntry(QUERY, "target.example", ns_c_in, ns_t_a, "1.2.3.4");
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+
+    // The A query of alias.example was never answered.
+    int anslen = 0;
+    std::vector<uint8_t> answer(MAXPACKET);
+    const std::vector<uint8_t> aQuery = makeQuery(QUERY, "alias.example", ns_c_in, ns_t_a);
+    EXPECT_EQ(RESOLV_CACHE_FOUND, resolv_cache_lookup(TEST_NETID, aQuery, answer, &anslen, 0));
+    ns_msg handle;
+    ns_rr rr;
+    ASSERT_EQ(0, ns_initparse(answer.data(), anslen, &handle));
+    EXPECT_EQ(ns_msg_id(handle), (aQuery[0] << 8) | aQuery[1]);
+    ASSERT_EQ(2, ns_msg_count(handle, ns_s_an));
+    ASSERT_EQ(0, ns_parserr(&handle, ns_s_an, 0, &rr));
+    EXPECT_EQ(ns_t_cname, ns_rr_type(rr));
+    EXPECT_STREQ("alias.example", ns_rr_name(rr));
+    ASSERT_EQ(0, ns_parserr(&handle, ns_s_an, 1, &rr));
+    EXPECT_EQ(ns_t_a, ns_rr_type(rr));
+    EXPECT_STREQ("target.example", ns_rr_name(rr));
+
+    // The RRsets are dropped with the cache.
+    EXPECT_EQ(0, cacheFlush(TEST_NETID));
+    EXPECT_EQ(RESOLV_CACHE_NOTFOUND, resolv_cache_lookup(TEST_NETID, aQuery, answer, &anslen, 0));
+}
+
 TEST_F(ResolvCacheTest, PendingRequest_QueryDeferred) {
     EXPECT_EQ(0, cacheCreate(TEST_NETID));
     EXPECT_EQ(0, cacheCreate(TEST_NETID_2));
@@ -561,6 +824,114 @@ TEST_F(ResolvCacheTest, PendingRequest_CacheDestroyed) {
     }
 }
 
+TEST_F(ResolvCacheTest, PendingRequest_SharedCacheUserDeleted) {
+    {
+        ScopedSystemProperties sp(kCacheSharingFlag, "1");
+        android::net::Experiments::getInstance()->update();
+        EXPECT_EQ(0, cacheCreate(TEST_NETID));
+        EXPECT_EQ(0, cacheCreate(TEST_NETID_2));
+        const SetupParams setup = {.servers = {"127.0.0.1"}, .params = kParams};
+        EXPECT_EQ(0, cacheSetupResolver(TEST_NETID, setup));
+        EXPECT_EQ(0, cacheSetupResolver(TEST_NETID_2, setup));
+    }
+    android::net::Experiments::getInstance()->update();
+
+    CacheEntry ce = makeCacheEntry(QUERY, "query.shared", ns_c_in, ns_t_a, "1.2.3.4");
+    std::atomic_bool done(false);
+
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce));
+
+    std::vector<std::thread> threads(5);
+    for (std::thread& thread : threads) {
+        thread = std::thread([&]() {
+            EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+
+            // Ensure this thread gets stuck in lookups before we wake it.
+            EXPECT_TRUE(done);
+        });
+    }
+
+    // Wait for a while for the threads performing lookups.
+    std::this_thread::sleep_for(100ms);
+
+    // Deleting another network sharing the cache must not cause the threads to wake up.
+    cacheDelete(TEST_NETID_2);
+
+    // Ensure none of the threads has finished the lookups.
+    std::this_thread::sleep_for(100ms);
+
+    // Wake up the threads
+    done = true;
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+TEST_F(ResolvCacheTest, PendingRequest_LookupAsync) {
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+
+    CacheEntry ce = makeCacheEntry(QUERY, "lookup.async", ns_c_in, ns_t_a, "1.2.3.4");
+    std::vector<uint8_t> answer(MAXPACKET);
+    int anslen = 0;
+    int calls = 0;
+    const auto lookupAsync = [&] {
+        return resolv_cache_lookup_async(TEST_NETID, ce.query, answer, &anslen, 0,
+                                         [&calls] { calls++; });
+    };
+
+    // The lookups don't wait for the pending request, but are notified of its completion.
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce));
+    EXPECT_EQ(RESOLV_CACHE_PENDING, lookupAsync());
+    EXPECT_EQ(RESOLV_CACHE_PENDING, lookupAsync());
+    EXPECT_EQ(0, calls);
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+    EXPECT_EQ(2, calls);
+    EXPECT_EQ(RESOLV_CACHE_FOUND, lookupAsync());
+    answer.resize(anslen);
+    EXPECT_EQ(ce.answer, answer);
+
+    // Failed and dropped requests.
+    answer.resize(MAXPACKET);
+    CacheEntry ce2 = makeCacheEntry(QUERY, "lookup.async2", ns_c_in, ns_t_a, "1.2.3.4");
+    EXPECT_EQ(RESOLV_CACHE_NOTFOUND,
+              resolv_cache_lookup(TEST_NETID, ce2.query, answer, &anslen, 0));
+    EXPECT_EQ(RESOLV_CACHE_PENDING,
+              resolv_cache_lookup_async(TEST_NETID, ce2.query, answer, &anslen, 0,
+                                        [&calls] { calls++; }));
+    cacheQueryFailed(TEST_NETID, ce2, 0);
+    EXPECT_EQ(3, calls);
+    EXPECT_EQ(RESOLV_CACHE_NOTFOUND,
+              resolv_cache_lookup(TEST_NETID, ce2.query, answer, &anslen, 0));
+    EXPECT_EQ(RESOLV_CACHE_PENDING,
+              resolv_cache_lookup_async(TEST_NETID, ce2.query, answer, &anslen, 0,
+                                        [&calls] { calls++; }));
+    cacheDelete(TEST_NETID);
+    EXPECT_EQ(4, calls);
+}
+
+TEST_F(ResolvCacheTest, Probe) {
+    std::vector<uint8_t> answer(MAXPACKET);
+    int anslen = 0;
+    CacheEntry ce = makeCacheEntry(QUERY, "cache.probe", ns_c_in, ns_t_a, "1.2.3.4");
+    EXPECT_EQ(RESOLV_CACHE_UNSUPPORTED,
+              resolv_cache_probe(TEST_NETID, ce.query, answer, &anslen, 0));
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+
+    // A miss doesn't register a pending request, so the next lookup doesn't wait.
+    EXPECT_EQ(RESOLV_CACHE_NOTFOUND, resolv_cache_probe(TEST_NETID, ce.query, answer, &anslen, 0));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce));
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+
+    EXPECT_EQ(RESOLV_CACHE_FOUND, resolv_cache_probe(TEST_NETID, ce.query, answer, &anslen, 0));
+    answer.resize(anslen);
+    EXPECT_EQ(ce.answer, answer);
+    answer.resize(MAXPACKET);
+    EXPECT_EQ(RESOLV_CACHE_NOTFOUND, resolv_cache_probe(TEST_NETID, ce.query, answer, &anslen,
+                                                        ANDROID_RESOLV_NO_CACHE_LOOKUP));
+}
+
 TEST_F(ResolvCacheTest, MaxEntries) {
     EXPECT_EQ(0, cacheCreate(TEST_NETID));
     std::vector<CacheEntry> ces;
@@ -588,6 +959,173 @@ TEST_F(ResolvCacheTest, MaxEntries) {
     }
 }
 
+TEST_F(ResolvCacheTest, MaxEntries_TinyLfu) {
+    {
+        ScopedSystemProperties sp(kCacheEvictionPolicyFlag, "1");
+        android::net::Experiments::getInstance()->update();
+        EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    }
+    android::net::Experiments::getInstance()->update();
+    const int max_cache_entries = resolv_get_max_cache_entries(TEST_NETID);
+
+    // Fill half of the cache with popular names.
+    std::vector<CacheEntry> popular;
+    for (int i = 0; i < max_cache_entries / 2; i++) {
+        std::string qname = fmt::format("popular.{:06d}", i);
+        SCOPED_TRACE(qname);
+        CacheEntry ce = makeCacheEntry(QUERY, qname.data(), ns_c_in, ns_t_a, "1.2.3.4");
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce));
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+        popular.emplace_back(ce);
+    }
+
+    // Scan twice as many one-off names as the cache holds.
+    for (int i = 0; i < 2 * max_cache_entries; i++) {
+        std::string qname = fmt::format("scan.{:06d}", i);
+        SCOPED_TRACE(qname);
+        CacheEntry ce = makeCacheEntry(QUERY, qname.data(), ns_c_in, ns_t_a, "1.2.3.4");
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce));
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+    }
+
+    // Unlike with the LRU policy, the scan didn't flush the popular names.
+    for (const CacheEntry& ce : popular) {
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+    }
+}
+
+TEST_F(ResolvCacheTest, MaxBytes) {
+    {
+        ScopedSystemProperties sp(kMaxCacheBytesFlag, "4096");
+        android::net::Experiments::getInstance()->update();
+        EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    }
+    android::net::Experiments::getInstance()->update();
+    const int max_cache_entries = resolv_get_max_cache_entries(TEST_NETID);
+
+    // Answers with long names fill the byte budget way before the entry limit.
+    const std::string target = fmt::format("{0}.{0}.{0}.example.com", std::string(60, 'x'));
+    std::vector<CacheEntry> ces;
+    for (int i = 0; i < 100; i++) {
+        std::string qname = fmt::format("cache.{:06d}", i);
+        SCOPED_TRACE(qname);
+        CacheEntry ce = makeCacheEntry(QUERY, qname.data(), ns_c_in, ns_t_ptr, target.c_str());
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+        ces.emplace_back(ce);
+    }
+
+    std::vector<bool> cached;
+    for (const CacheEntry& ce : ces) {
+        cached.push_back(isCached(TEST_NETID, ce));
+    }
+    const int found = std::count(cached.begin(), cached.end(), true);
+    const size_t size = ces[0].query.size() + ces[0].answer.size();
+    EXPECT_GT(found, 0);
+    EXPECT_LE(found * size, 4096U);
+    EXPECT_LT(found, max_cache_entries);
+    // The oldest entries were evicted.
+    EXPECT_FALSE(cached.front());
+    EXPECT_TRUE(cached.back());
+}
+
+TEST_F(ResolvCacheTest, MaxBytesGlobal) {
+    {
+        ScopedSystemProperties sp(kMaxCacheBytesGlobalFlag, "8192");
+        android::net::Experiments::getInstance()->update();
+        EXPECT_EQ(0, cacheCreate(TEST_NETID));
+        EXPECT_EQ(0, cacheCreate(TEST_NETID_2));
+    }
+    android::net::Experiments::getInstance()->update();
+
+    // Both networks fill the global budget in turn.
+    const std::string target = fmt::format("{0}.{0}.{0}.example.com", std::string(60, 'x'));
+    std::vector<CacheEntry> ces;
+    for (int i = 0; i < 100; i++) {
+        std::string qname = fmt::format("cache.{:06d}", i);
+        SCOPED_TRACE(qname);
+        CacheEntry ce = makeCacheEntry(QUERY, qname.data(), ns_c_in, ns_t_ptr, target.c_str());
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+        ces.emplace_back(ce);
+    }
+    for (const CacheEntry& ce : ces) {
+        EXPECT_EQ(0, cacheAdd(TEST_NETID_2, ce));
+    }
+
+    // The second network took half of the budget from the first one.
+    int found1 = 0, found2 = 0;
+    for (const CacheEntry& ce : ces) {
+        found1 += isCached(TEST_NETID, ce);
+        found2 += isCached(TEST_NETID_2, ce);
+    }
+    EXPECT_GT(found1, 0);
+    EXPECT_GT(found2, 0);
+    EXPECT_LE(std::abs(found1 - found2), 1);
+    EXPECT_LE((found1 + found2) * (ces[0].query.size() + ces[0].answer.size()), 8192U);
+}
+
+TEST_F(ResolvCacheTest, UidQuota) {
+    // Only the cache of TEST_NETID has a quota.
+    {
+        ScopedSystemProperties sp1(kMaxCacheEntriesFlag, "100");
+        ScopedSystemProperties sp2(kCacheUidQuotaPercentFlag, "20");
+        android::net::Experiments::getInstance()->update();
+        EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    }
+    {
+        ScopedSystemProperties sp(kMaxCacheEntriesFlag, "100");
+        android::net::Experiments::getInstance()->update();
+        EXPECT_EQ(0, cacheCreate(TEST_NETID_2));
+    }
+    android::net::Experiments::getInstance()->update();
+    constexpr uid_t kAppUid = 10001;
+    constexpr uid_t kNoisyAppUid = 10002;
+
+    for (const int netId : {TEST_NETID, TEST_NETID_2}) {
+        SCOPED_TRACE(netId);
+        std::vector<CacheEntry> app_ces, noisy_ces;
+        for (int i = 0; i < 20; i++) {
+            const std::string qname = fmt::format("app.{:03d}", i);
+            app_ces.push_back(makeCacheEntry(QUERY, qname.data(), ns_c_in, ns_t_a, "1.2.3.4"));
+            EXPECT_EQ(0, cacheAdd(netId, app_ces.back(), kAppUid));
+        }
+        // Another app looks up many random names.
+        for (int i = 0; i < 200; i++) {
+            const std::string qname = fmt::format("{:03d}.noisy", i);
+            noisy_ces.push_back(makeCacheEntry(QUERY, qname.data(), ns_c_in, ns_t_a, "1.2.3.4"));
+            EXPECT_EQ(0, cacheAdd(netId, noisy_ces.back(), kNoisyAppUid));
+        }
+
+        time_t expiration;
+        if (netId == TEST_NETID) {
+            // The noisy app only evicted its own entries, and kept 20% of the cache.
+            for (const CacheEntry& ce : app_ces) {
+                EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, netId, ce));
+            }
+            for (int i = 0; i < 200; i++) {
+                EXPECT_EQ(i < 180 ? -ENODATA : 0,
+                          resolv_cache_get_expiration(netId, noisy_ces[i].query, &expiration));
+            }
+
+            // An answer which can't be cached doesn't evict any entry.
+            const CacheEntry uncacheable =
+                    makeCacheEntry(QUERY, "uncacheable.noisy", ns_c_in, ns_t_a, "1.2.3.4", 0s);
+            EXPECT_EQ(0, cacheAdd(netId, uncacheable, kNoisyAppUid));
+            EXPECT_EQ(0, resolv_cache_get_expiration(netId, noisy_ces[180].query, &expiration));
+        } else {
+            for (const CacheEntry& ce : app_ces) {
+                EXPECT_EQ(-ENODATA, resolv_cache_get_expiration(netId, ce.query, &expiration));
+            }
+            for (int i = 0; i < 200; i++) {
+                EXPECT_EQ(i < 100 ? -ENODATA : 0,
+                          resolv_cache_get_expiration(netId, noisy_ces[i].query, &expiration));
+            }
+        }
+    }
+}
+
 TEST_F(ResolvCacheTest, CacheFull) {
     EXPECT_EQ(0, cacheCreate(TEST_NETID));
 
@@ -625,6 +1163,34 @@ TEST_F(ResolvCacheTest, CacheFull) {
     EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID, ce1));
 }
 
+TEST_F(ResolvCacheTest, CacheFull_RemoveManyExpiredEntries) {
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    std::vector<CacheEntry> ces;
+
+    // Stuff the resolver cache, with every other entry expiring soon.
+    const int max_cache_entries = resolv_get_max_cache_entries(TEST_NETID);
+    for (int i = 0; i < max_cache_entries; i++) {
+        std::string qname = fmt::format("cache.{:06d}", i);
+        SCOPED_TRACE(qname);
+        CacheEntry ce = makeCacheEntry(QUERY, qname.data(), ns_c_in, ns_t_a, "1.2.3.4",
+                                       (i % 2) ? 50s : 1s);
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+        ces.emplace_back(ce);
+    }
+
+    std::this_thread::sleep_for(1500ms);
+
+    // The cache is full now, so all the expired entries are removed at once. The remaining
+    // entries must still be found afterwards.
+    CacheEntry ce = makeCacheEntry(QUERY, "cache.overfilled", ns_c_in, ns_t_a, "1.2.3.4", 50s);
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+    for (int i = 1; i < max_cache_entries; i += 2) {
+        SCOPED_TRACE(fmt::format("cache.{:06d}", i));
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ces[i]));
+    }
+}
+
 class ResolvCacheParameterizedTest : public ResolvCacheTest,
                                      public testing::WithParamInterface<int> {};
 
@@ -659,6 +1225,129 @@ TEST_F(ResolvCacheTest, ResolverSetup) {
     EXPECT_TRUE(resolv_has_nameservers(TEST_NETID));
 }
 
+TEST_F(ResolvCacheTest, ResolverSetup_LoadsCacheSnapshot) {
+    TemporaryDir snapshotDir;
+    resolv_set_cache_snapshot_dir(snapshotDir.path);
+    {
+        ScopedSystemProperties sp(kCacheSnapshotIntervalFlag, "3600");
+        android::net::Experiments::getInstance()->update();
+        EXPECT_EQ(0, cacheCreate(TEST_NETID));
+        EXPECT_EQ(0, cacheCreate(TEST_NETID_2));
+    }
+    android::net::Experiments::getInstance()->update();
+
+    const SetupParams setup = {
+            .servers = {"127.0.0.1", "::127.0.0.2"},
+            .domains = {"domain1.com"},
+            .params = kParams,
+    };
+    EXPECT_EQ(0, cacheSetupResolver(TEST_NETID, setup));
+    const CacheEntry ce = makeCacheEntry(QUERY, "snapshot", ns_c_in, ns_t_a, "1.2.3.4", 100s);
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+
+    // Deleting the network saves its snapshot, which is loaded in the background by the next
+    // network with the same configuration, whatever its netId.
+    cacheDelete(TEST_NETID);
+    EXPECT_EQ(0, cacheSetupResolver(TEST_NETID_2, setup));
+    resolv_wait_for_cache_snapshots();
+
+    int anslen = 0;
+    std::vector<uint8_t> answer(MAXPACKET);
+    EXPECT_EQ(RESOLV_CACHE_FOUND,
+              resolv_cache_lookup(TEST_NETID_2, ce.query, answer, &anslen, 0));
+    ns_msg handle;
+    ns_rr rr;
+    ASSERT_EQ(0, ns_initparse(answer.data(), anslen, &handle));
+    ASSERT_EQ(0, ns_parserr(&handle, ns_s_an, 0, &rr));
+    EXPECT_LE(ns_rr_ttl(rr), 100U);
+    EXPECT_GE(ns_rr_ttl(rr), 98U);
+}
+
+TEST_F(ResolvCacheTest, ResolverSetup_LoadsMostRecentlyUsedFromSnapshot) {
+    TemporaryDir snapshotDir;
+    resolv_set_cache_snapshot_dir(snapshotDir.path);
+    {
+        ScopedSystemProperties sp(kCacheSnapshotIntervalFlag, "3600");
+        android::net::Experiments::getInstance()->update();
+        EXPECT_EQ(0, cacheCreate(TEST_NETID));
+        EXPECT_EQ(0, cacheCreate(TEST_NETID_2));
+    }
+    android::net::Experiments::getInstance()->update();
+
+    const SetupParams setup = {
+            .servers = {"127.0.0.1", "::127.0.0.2"},
+            .domains = {"domain1.com"},
+            .params = kParams,
+    };
+    EXPECT_EQ(0, cacheSetupResolver(TEST_NETID, setup));
+    std::vector<CacheEntry> entries;
+    for (int i = 0; i < 8; i++) {
+        entries.push_back(makeCacheEntry(QUERY, fmt::format("mru.{}", i).c_str(), ns_c_in, ns_t_a,
+                                         "1.2.3.4", 100s));
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, entries.back()));
+    }
+    cacheDelete(TEST_NETID);
+
+    // Only half of the snapshot fits in the cache: the most recently used entries are loaded.
+    EXPECT_EQ(0, resolv_resize_cache_for_net(TEST_NETID_2, 4));
+    EXPECT_EQ(0, cacheSetupResolver(TEST_NETID_2, setup));
+    resolv_wait_for_cache_snapshots();
+    for (int i = 0; i < 8; i++) {
+        SCOPED_TRACE(i);
+        EXPECT_TRUE(cacheLookup(i < 4 ? RESOLV_CACHE_NOTFOUND : RESOLV_CACHE_FOUND, TEST_NETID_2,
+                                entries[i]));
+    }
+}
+
+TEST_F(ResolvCacheTest, ResolverSetup_SharesCache) {
+    {
+        ScopedSystemProperties sp(kCacheSharingFlag, "1");
+        android::net::Experiments::getInstance()->update();
+        EXPECT_EQ(0, cacheCreate(TEST_NETID));
+        EXPECT_EQ(0, cacheCreate(TEST_NETID_2));
+
+        // Networks with the same servers share their cache, whatever their search domains.
+        SetupParams setup = {
+                .servers = {"127.0.0.1", "::127.0.0.2"},
+                .domains = {"domain1.com"},
+                .params = kParams,
+        };
+        EXPECT_EQ(0, cacheSetupResolver(TEST_NETID, setup));
+        const CacheEntry ce1 = makeCacheEntry(QUERY, "shared.1", ns_c_in, ns_t_a, "1.2.3.4");
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, ce1));
+        setup.domains = {"domain2.com"};
+        EXPECT_EQ(0, cacheSetupResolver(TEST_NETID_2, setup));
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID_2, ce1));
+
+        // Flushing the cache of one network flushes it for both.
+        const CacheEntry ce2 = makeCacheEntry(QUERY, "shared.2", ns_c_in, ns_t_a, "1.2.3.4");
+        EXPECT_EQ(0, cacheAdd(TEST_NETID_2, ce2));
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce2));
+        EXPECT_EQ(0, resolv_flush_cache_for_net(TEST_NETID));
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID_2, ce2));
+        EXPECT_EQ(0, cacheAdd(TEST_NETID_2, ce2));
+
+        // Changing the servers of a network gives it a cache of its own.
+        setup.servers = {"127.0.0.3"};
+        EXPECT_EQ(0, cacheSetupResolver(TEST_NETID_2, setup));
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce2));
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID_2, ce2));
+
+        // Deleting a network sharing its cache keeps the entries for the others.
+        EXPECT_EQ(0, cacheSetupResolver(TEST_NETID_2, {.servers = {"127.0.0.1", "::127.0.0.2"},
+                                                       .params = kParams}));
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID_2, ce2));
+        cacheDelete(TEST_NETID);
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID_2, ce2));
+
+        // The last network using a cache doesn't keep it when its servers change.
+        setup.servers = {"127.0.0.4"};
+        EXPECT_EQ(0, cacheSetupResolver(TEST_NETID_2, setup));
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_NOTFOUND, TEST_NETID_2, ce2));
+    }
+    android::net::Experiments::getInstance()->update();
+}
+
 TEST_F(ResolvCacheTest, ResolverSetup_InvalidNameServers) {
     EXPECT_EQ(0, cacheCreate(TEST_NETID));
     const std::string invalidServers[]{
@@ -791,6 +1480,131 @@ TEST_F(ResolvCacheTest, FlushCache) {
     expectCacheStats("FlushCache: no record in cache stats", TEST_NETID, cacheStats_empty);
 }
 
+TEST_F(ResolvCacheTest, FlushCache_Repeatedly) {
+    // Big enough for the flushed entries to be reclaimed in the background.
+    {
+        ScopedSystemProperties sp(kMaxCacheEntriesFlag, "3000");
+        android::net::Experiments::getInstance()->update();
+        EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    }
+    android::net::Experiments::getInstance()->update();
+    const int max_cache_entries = resolv_get_max_cache_entries(TEST_NETID);
+    ASSERT_EQ(3000, max_cache_entries);
+    std::vector<CacheEntry> ces;
+    for (int i = 0; i < max_cache_entries; i++) {
+        const std::string qname = fmt::format("cache.{:06d}", i);
+        const std::string addr = fmt::format("10.0.{}.{}", i / 256, i % 256);
+        ces.push_back(makeCacheEntry(QUERY, qname.data(), ns_c_in, ns_t_a, addr.data()));
+    }
+
+    // Flush a full cache several times in a row, so that the reclaiming can't keep up.
+    for (int round = 0; round < 5; round++) {
+        SCOPED_TRACE(round);
+        for (const CacheEntry& ce : ces) {
+            EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+        }
+        for (const CacheEntry& ce : ces) {
+            EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+        }
+        char domain_name[NS_MAXDNAME] = {};
+        EXPECT_TRUE(resolv_gethostbyaddr_from_cache(TEST_NETID, domain_name, NS_MAXDNAME,
+                                                    "10.0.0.0", AF_INET));
+        EXPECT_STREQ("cache.000000", domain_name);
+
+        EXPECT_EQ(0, cacheFlush(TEST_NETID));
+        EXPECT_FALSE(isCached(TEST_NETID, ces.front()));
+        EXPECT_FALSE(isCached(TEST_NETID, ces.back()));
+        EXPECT_FALSE(resolv_gethostbyaddr_from_cache(TEST_NETID, domain_name, NS_MAXDNAME,
+                                                     "10.0.0.0", AF_INET));
+    }
+}
+
+TEST_F(ResolvCacheTest, ResizeCache) {
+    // Big enough to be resized in the background, with room for twice as many entries.
+    {
+        ScopedSystemProperties sp1(kMaxCacheEntriesFlag, "3000");
+        ScopedSystemProperties sp2(kMaxCacheBytesFlag, "4194304");
+        android::net::Experiments::getInstance()->update();
+        EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    }
+    android::net::Experiments::getInstance()->update();
+    ASSERT_EQ(3000, resolv_get_max_cache_entries(TEST_NETID));
+    std::vector<CacheEntry> ces;
+    for (int i = 0; i < 6000; i++) {
+        const std::string qname = fmt::format("cache.{:06d}", i);
+        const std::string addr = fmt::format("10.0.{}.{}", i / 256, i % 256);
+        ces.push_back(makeCacheEntry(QUERY, qname.data(), ns_c_in, ns_t_a, addr.data()));
+    }
+    for (int i = 0; i < 3000; i++) {
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, ces[i]));
+    }
+
+    EXPECT_EQ(-EINVAL, resolv_resize_cache_for_net(TEST_NETID, 0));
+    EXPECT_EQ(-ENONET, resolv_resize_cache_for_net(TEST_NETID + 1, 6000));
+
+    // The entries are found while they are moved to the larger table, and the new ones are
+    // added meanwhile.
+    EXPECT_EQ(0, resolv_resize_cache_for_net(TEST_NETID, 6000));
+    EXPECT_EQ(6000, resolv_get_max_cache_entries(TEST_NETID));
+    for (int i = 0; i < 3000; i++) {
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ces[i]));
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, ces[3000 + i]));
+    }
+    char domain_name[NS_MAXDNAME] = {};
+    EXPECT_TRUE(resolv_gethostbyaddr_from_cache(TEST_NETID, domain_name, NS_MAXDNAME, "10.0.0.0",
+                                                AF_INET));
+    EXPECT_STREQ("cache.000000", domain_name);
+    for (const CacheEntry& ce : ces) {
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+    }
+
+    // Shrinking the cache evicts the oldest entries in the background.
+    EXPECT_EQ(0, resolv_resize_cache_for_net(TEST_NETID, 1000));
+    EXPECT_EQ(1000, resolv_get_max_cache_entries(TEST_NETID));
+    time_t expiration;
+    for (int i = 0; i < 1000; i++) {
+        if (resolv_cache_get_expiration(TEST_NETID, ces[4999].query, &expiration) != 0) break;
+        std::this_thread::sleep_for(10ms);
+    }
+    EXPECT_EQ(-ENODATA, resolv_cache_get_expiration(TEST_NETID, ces[4999].query, &expiration));
+    for (int i = 5000; i < 6000; i++) {
+        EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ces[i]));
+    }
+    EXPECT_TRUE(resolv_gethostbyaddr_from_cache(TEST_NETID, domain_name, NS_MAXDNAME,
+                                                "10.0.23.111", AF_INET));
+    EXPECT_STREQ("cache.005999", domain_name);
+    EXPECT_FALSE(resolv_gethostbyaddr_from_cache(TEST_NETID, domain_name, NS_MAXDNAME,
+                                                 "10.0.0.0", AF_INET));
+}
+
+TEST_F(ResolvCacheTest, ResizeCache_FollowsFlag) {
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    const SetupParams setup = {
+            .servers = {"127.0.0.1", "::127.0.0.2"},
+            .domains = {"domain1.com"},
+            .params = kParams,
+    };
+    const int default_max_cache_entries = resolv_get_max_cache_entries(TEST_NETID);
+    const CacheEntry ce = makeCacheEntry(QUERY, "resize", ns_c_in, ns_t_a, "1.2.3.4");
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+
+    // The cache follows the flag when the resolver is set up again, until it is resized.
+    {
+        ScopedSystemProperties sp(kMaxCacheEntriesFlag, "2000");
+        android::net::Experiments::getInstance()->update();
+        EXPECT_EQ(0, cacheSetupResolver(TEST_NETID, setup));
+        EXPECT_EQ(2000, resolv_get_max_cache_entries(TEST_NETID));
+
+        EXPECT_EQ(0, resolv_resize_cache_for_net(TEST_NETID, 500));
+        EXPECT_EQ(0, cacheSetupResolver(TEST_NETID, setup));
+        EXPECT_EQ(500, resolv_get_max_cache_entries(TEST_NETID));
+    }
+    android::net::Experiments::getInstance()->update();
+    EXPECT_EQ(0, cacheSetupResolver(TEST_NETID, setup));
+    EXPECT_EQ(default_max_cache_entries, resolv_get_max_cache_entries(TEST_NETID));
+    EXPECT_TRUE(cacheLookup(RESOLV_CACHE_FOUND, TEST_NETID, ce));
+}
+
 TEST_F(ResolvCacheTest, GetHostByAddrFromCache_InvalidArgs) {
     char domain_name[NS_MAXDNAME] = {};
     const char query_v4[] = "1.2.3.5";
@@ -870,6 +1684,48 @@ TEST_F(ResolvCacheTest, GetHostByAddrFromCache) {
     EXPECT_STREQ(answer, domain_name);
 }
 
+TEST_F(ResolvCacheTest, GetHostByAddrFromCache_RemovedEntries) {
+    char domain_name[NS_MAXDNAME] = {};
+    const char query_v4[] = "1.2.3.5";
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+
+    // The most recently added entry wins.
+    CacheEntry ce1 = makeCacheEntry(QUERY, "first.in.cache", ns_c_in, ns_t_a, query_v4);
+    CacheEntry ce2 = makeCacheEntry(QUERY, "second.in.cache", ns_c_in, ns_t_a, query_v4);
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce1));
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce2));
+    EXPECT_TRUE(resolv_gethostbyaddr_from_cache(TEST_NETID, domain_name, NS_MAXDNAME, query_v4,
+                                                AF_INET));
+    EXPECT_STREQ("second.in.cache", domain_name);
+
+    // Flushed entries are not found.
+    EXPECT_EQ(0, cacheFlush(TEST_NETID));
+    memset(domain_name, 0, NS_MAXDNAME);
+    EXPECT_FALSE(resolv_gethostbyaddr_from_cache(TEST_NETID, domain_name, NS_MAXDNAME, query_v4,
+                                                 AF_INET));
+    EXPECT_STREQ("", domain_name);
+
+    // Evicted entries are not found.
+    EXPECT_EQ(0, cacheAdd(TEST_NETID, ce1));
+    EXPECT_TRUE(resolv_gethostbyaddr_from_cache(TEST_NETID, domain_name, NS_MAXDNAME, query_v4,
+                                                AF_INET));
+    EXPECT_STREQ("first.in.cache", domain_name);
+    const int max_cache_entries = resolv_get_max_cache_entries(TEST_NETID);
+    for (int i = 0; i < max_cache_entries; i++) {
+        std::string qname = fmt::format("cache.{:06d}", i);
+        SCOPED_TRACE(qname);
+        CacheEntry ce = makeCacheEntry(QUERY, qname.data(), ns_c_in, ns_t_a, "1.2.3.4");
+        EXPECT_EQ(0, cacheAdd(TEST_NETID, ce));
+    }
+    memset(domain_name, 0, NS_MAXDNAME);
+    EXPECT_FALSE(resolv_gethostbyaddr_from_cache(TEST_NETID, domain_name, NS_MAXDNAME, query_v4,
+                                                 AF_INET));
+    EXPECT_STREQ("", domain_name);
+    EXPECT_TRUE(resolv_gethostbyaddr_from_cache(TEST_NETID, domain_name, NS_MAXDNAME, "1.2.3.4",
+                                                AF_INET));
+    EXPECT_THAT(domain_name, testing::StartsWith("cache."));
+}
+
 TEST_F(ResolvCacheTest, GetResolverStats) {
     const res_sample sample1 = {.at = time(nullptr), .rtt = 100, .rcode = ns_r_noerror};
     const res_sample sample2 = {.at = time(nullptr), .rtt = 200, .rcode = ns_r_noerror};
@@ -995,6 +1851,33 @@ TEST_F(ResolvCacheTest, IsNetworkMetered) {
     EXPECT_FALSE(resolv_is_metered_network(TEST_NETID + 2));
 }
 
+TEST_F(ResolvCacheTest, NetworkSignature) {
+    const SetupParams setup = {
+            .servers = {"127.0.0.1"},
+            .domains = {"domain1.com"},
+            .params = kParams,
+    };
+    // Networks without DNS servers have no signature.
+    EXPECT_EQ(0, cacheCreate(TEST_NETID));
+    EXPECT_EQ(0U, resolv_get_network_signature(TEST_NETID));
+    EXPECT_EQ(0, cacheSetupResolver(TEST_NETID, setup));
+    const uint64_t signature = resolv_get_network_signature(TEST_NETID);
+    EXPECT_NE(0U, signature);
+
+    // The same network, reconnected with another netId.
+    resolv_delete_cache_for_net(TEST_NETID);
+    EXPECT_EQ(0U, resolv_get_network_signature(TEST_NETID));
+    EXPECT_EQ(0, cacheCreate(TEST_NETID + 1));
+    EXPECT_EQ(0, cacheSetupResolver(TEST_NETID + 1, setup));
+    EXPECT_EQ(signature, resolv_get_network_signature(TEST_NETID + 1));
+
+    // Another network.
+    SetupParams other = setup;
+    other.servers = {"127.0.0.2"};
+    EXPECT_EQ(0, cacheSetupResolver(TEST_NETID + 1, other));
+    EXPECT_NE(signature, resolv_get_network_signature(TEST_NETID + 1));
+}
+
 namespace {
 
 constexpr int EAI_OK = 0;
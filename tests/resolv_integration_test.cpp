@@ -55,6 +55,7 @@
 #include <thread>
 #include <unordered_set>
 
+#include <DnsProxydBatch.h>
 #include <DnsProxydProtocol.h>  // NETID_USE_LOCAL_NAMESERVERS
 #include <aidl/android/net/IDnsResolver.h>
 #include <android/binder_manager.h>
@@ -4442,6 +4443,76 @@ TEST_F(ResolverTest, getDnsNetId) {
     EXPECT_EQ(500, readResponseCode(fd));
 }
 
+TEST_F(ResolverTest, GetAddrInfoBatch) {
+    constexpr char listen_addr[] = "127.0.0.4";
+    constexpr int kNames = 50;
+    std::vector<std::string> batchNames;
+    std::vector<std::string> singleNames;
+    std::vector<DnsRecord> records;
+    for (int i = 0; i < kNames; i++) {
+        batchNames.push_back(fmt::format("b{}.example.com", i));
+        singleNames.push_back(fmt::format("s{}.example.com", i));
+        records.push_back({batchNames.back() + ".", ns_type::ns_t_a, fmt::format("1.2.3.{}", i)});
+        records.push_back({singleNames.back() + ".", ns_type::ns_t_a, fmt::format("1.2.4.{}", i)});
+    }
+    test::DNSResponder dns(listen_addr);
+    StartDns(dns, records);
+    std::vector<std::string> servers = {listen_addr};
+    ASSERT_TRUE(mDnsClient.SetResolversForNetwork(servers));
+
+    const addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_DGRAM};
+    std::vector<int> answers(kNames, 0);
+    const auto checkAnswer = [&](size_t index, int rv, const std::vector<std::string>& addrs) {
+        ASSERT_LT(index, answers.size());
+        answers[index]++;
+        EXPECT_EQ(0, rv) << batchNames[index];
+        EXPECT_THAT(addrs, testing::ElementsAre(fmt::format("1.2.3.{}", index)));
+    };
+
+    // All the hostnames are answered once, through a single connection to dnsproxyd.
+    Stopwatch s;
+    EXPECT_EQ(0, getaddrinfo_batch(batchNames, &hints, TEST_NETID, checkAnswer));
+    const int batchTimeMs = s.timeTakenUs() / 1000;
+    EXPECT_THAT(answers, testing::Each(1));
+    for (const auto& name : batchNames) {
+        EXPECT_EQ(1U, GetNumQueries(dns, name.c_str())) << name;
+    }
+
+    // The same number of uncached hostnames, resolved one after the other, for comparison.
+    s.getTimeAndResetUs();
+    for (int i = 0; i < kNames; i++) {
+        ScopedAddrinfo result = safe_getaddrinfo(singleNames[i].c_str(), nullptr, &hints);
+        EXPECT_EQ(fmt::format("1.2.4.{}", i), ToString(result));
+    }
+    const int singleTimeMs = s.timeTakenUs() / 1000;
+    LOG(INFO) << "Resolved " << kNames << " hostnames in " << batchTimeMs
+              << " ms with one getaddrinfobatch command, " << singleTimeMs
+              << " ms with getaddrinfo() calls";
+
+    // The cached hostnames are answered again, and the failures are reported per hostname.
+    dns.clearQueries();
+    std::vector<int> rvs(3, -1);
+    EXPECT_EQ(0, getaddrinfo_batch({batchNames[0], "nonexistent.example.com", batchNames[1]},
+                                   &hints, TEST_NETID,
+                                   [&](size_t index, int rv, const std::vector<std::string>&) {
+                                       ASSERT_LT(index, rvs.size());
+                                       rvs[index] = rv;
+                                   }));
+    EXPECT_EQ(0, rvs[0]);
+    EXPECT_NE(0, rvs[1]);
+    EXPECT_NE(-1, rvs[1]);
+    EXPECT_EQ(0, rvs[2]);
+    EXPECT_EQ(0U, GetNumQueries(dns, batchNames[0].c_str()));
+    EXPECT_EQ(0U, GetNumQueries(dns, batchNames[1].c_str()));
+
+    // Malformed batches are rejected as a whole.
+    unique_fd fd(dns_open_proxy());
+    ASSERT_TRUE(fd.ok());
+    sendCommand(fd.get(), fmt::format("{} a.example.com,,b.example.com ^ -1 -1 -1 -1 {}",
+                                      DNSPROXYD_GETADDRINFO_BATCH_COMMAND, TEST_NETID));
+    EXPECT_EQ(ResponseCode::CommandParameterError, readResponseCode(fd.get()));
+}
+
 TEST_F(ResolverTest, BlockDnsQueryWithUidRule) {
     SKIP_IF_BPF_NOT_SUPPORTED;
     constexpr char listen_addr1[] = "127.0.0.4";
@@ -18,11 +18,22 @@
 #include "resolv_test_utils.h"
 
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include <android-base/chrono_utils.h>
 #include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
 #include <firewall.h>
+#include <netdutils/ResponseCode.h>
 
+#include "DnsProxydBatch.h"
+
+using android::base::unique_fd;
+using android::netdutils::ResponseCode;
 using android::netdutils::ScopedAddrinfo;
 
 std::string ToString(const hostent* he) {
@@ -159,6 +170,113 @@ ScopedAddrinfo safe_getaddrinfo(const char* node, const char* service,
     return ScopedAddrinfo(result);
 }
 
+namespace {
+
+bool readFully(int fd, void* buf, size_t len) {
+    uint8_t* p = static_cast<uint8_t*>(buf);
+    while (len > 0) {
+        const ssize_t n = TEMP_FAILURE_RETRY(read(fd, p, len));
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool readBE32(int fd, uint32_t* value) {
+    if (!readFully(fd, value, sizeof(*value))) return false;
+    *value = ntohl(*value);
+    return true;
+}
+
+// Reads the 3 digits and the separator of a response code.
+bool readResponseCode(int fd, int* code) {
+    char buf[4];
+    if (!readFully(fd, buf, sizeof(buf))) return false;
+    buf[3] = '\0';
+    return android::base::ParseInt(buf, code);
+}
+
+// Reads the addresses of a successful getaddrinfo reply, following its response code.
+bool readAddrinfos(int fd, std::vector<std::string>* addresses) {
+    uint32_t more;
+    while (readBE32(fd, &more)) {
+        if (more == 0) return true;
+        // ai_flags, ai_family, ai_socktype and ai_protocol.
+        uint32_t fields[4];
+        uint32_t addrLen;
+        sockaddr_storage addr = {};
+        if (!readFully(fd, fields, sizeof(fields)) || !readBE32(fd, &addrLen) ||
+            addrLen > sizeof(addr) || !readFully(fd, &addr, addrLen)) {
+            return false;
+        }
+        uint32_t canonNameLen;
+        if (!readBE32(fd, &canonNameLen)) return false;
+        std::string canonName(canonNameLen, '\0');
+        if (!readFully(fd, canonName.data(), canonNameLen)) return false;
+        addresses->push_back(ToString(&addr));
+    }
+    return false;
+}
+
+}  // namespace
+
+int getaddrinfo_batch(const std::vector<std::string>& names, const addrinfo* hints, unsigned netId,
+                      const GetAddrInfoBatchCallback& onResult) {
+    if (names.empty() || names.size() > DNSPROXYD_BATCH_MAX_HOSTNAMES) return -EINVAL;
+    // The hostnames can't be empty, nor contain the separators of the command.
+    const std::string separators = std::string(" ") + DNSPROXYD_BATCH_HOSTNAME_SEPARATOR;
+    for (const auto& name : names) {
+        if (name.empty() || name.find_first_of(separators) != std::string::npos) return -EINVAL;
+    }
+    const std::string cmd = android::base::StringPrintf(
+            "%s %s ^ %d %d %d %d %u", DNSPROXYD_GETADDRINFO_BATCH_COMMAND,
+            android::base::Join(names, DNSPROXYD_BATCH_HOSTNAME_SEPARATOR).c_str(),
+            hints ? hints->ai_flags : -1, hints ? hints->ai_family : -1,
+            hints ? hints->ai_socktype : -1, hints ? hints->ai_protocol : -1, netId);
+    if (cmd.size() + 1 > DNSPROXYD_MAX_COMMAND_SIZE) return -EMSGSIZE;
+
+    unique_fd fd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    if (fd == -1) return -errno;
+    static const sockaddr_un proxyAddr = {
+            .sun_family = AF_UNIX,
+            .sun_path = "/dev/socket/dnsproxyd",
+    };
+    if (TEMP_FAILURE_RETRY(connect(fd, (const sockaddr*)&proxyAddr, sizeof(proxyAddr))) != 0 ||
+        TEMP_FAILURE_RETRY(write(fd, cmd.c_str(), cmd.size() + 1)) !=
+                static_cast<ssize_t>(cmd.size() + 1)) {
+        return -errno;
+    }
+
+    int code;
+    uint32_t count;
+    if (!readResponseCode(fd, &code)) return -EIO;
+    if (code != ResponseCode::DnsProxyQueryResult) return -EINVAL;
+    if (!readBE32(fd, &count) || count != names.size()) return -EIO;
+
+    // The hostnames are answered in completion order.
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t index;
+        std::vector<std::string> addresses;
+        if (!readBE32(fd, &index) || index >= count || !readResponseCode(fd, &code)) return -EIO;
+        if (code == ResponseCode::DnsProxyQueryResult) {
+            if (!readAddrinfos(fd, &addresses)) return -EIO;
+            onResult(index, 0, addresses);
+        } else if (code == ResponseCode::DnsProxyOperationFailed) {
+            // A binary message: its length, then the host order error of getaddrinfo().
+            uint32_t len;
+            int32_t rv;
+            if (!readBE32(fd, &len) || len != sizeof(rv) || !readFully(fd, &rv, sizeof(rv))) {
+                return -EIO;
+            }
+            onResult(index, rv, addresses);
+        } else {
+            return -EIO;
+        }
+    }
+    return 0;
+}
+
 int WaitChild(pid_t pid) {
     int status;
     const pid_t got_pid = TEMP_FAILURE_RETRY(waitpid(pid, &status, 0));
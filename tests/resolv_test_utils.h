@@ -171,6 +171,13 @@ constexpr char kDotPortString[] = "853";
 
 const std::string kFlagPrefix("persist.device_config.netd_native.");
 
+const std::string kCacheEvictionPolicyFlag(kFlagPrefix + "cache_eviction_policy");
+const std::string kCachePrefetchMinHitsFlag(kFlagPrefix + "cache_prefetch_min_hits");
+const std::string kCachePrefetchTtlPercentFlag(kFlagPrefix + "cache_prefetch_ttl_percent");
+const std::string kCacheRRsetsFlag(kFlagPrefix + "cache_rrsets");
+const std::string kCacheSharingFlag(kFlagPrefix + "cache_sharing");
+const std::string kCacheSnapshotIntervalFlag(kFlagPrefix + "cache_snapshot_interval_seconds");
+const std::string kCacheUidQuotaPercentFlag(kFlagPrefix + "cache_uid_quota_percent");
 const std::string kDohEarlyDataFlag(kFlagPrefix + "doh_early_data");
 const std::string kDohIdleTimeoutFlag(kFlagPrefix + "doh_idle_timeout_ms");
 const std::string kDohProbeTimeoutFlag(kFlagPrefix + "doh_probe_timeout_ms");
@@ -189,9 +196,13 @@ const std::string kDotValidationLatencyOffsetMsFlag(kFlagPrefix +
 const std::string kFailFastOnUidNetworkBlockingFlag(kFlagPrefix +
                                                     "fail_fast_on_uid_network_blocking");
 const std::string kKeepListeningUdpFlag(kFlagPrefix + "keep_listening_udp");
+const std::string kMaxCacheBytesFlag(kFlagPrefix + "max_cache_bytes");
+const std::string kMaxCacheBytesGlobalFlag(kFlagPrefix + "max_cache_bytes_global");
 const std::string kParallelLookupSleepTimeFlag(kFlagPrefix + "parallel_lookup_sleep_time");
 const std::string kRetransIntervalFlag(kFlagPrefix + "retransmission_time_interval");
 const std::string kRetryCountFlag(kFlagPrefix + "retry_count");
+const std::string kServeStaleMaxAgeFlag(kFlagPrefix + "serve_stale_max_age_seconds");
+const std::string kServeStaleTtlFlag(kFlagPrefix + "serve_stale_ttl_seconds");
 const std::string kSortNameserversFlag(kFlagPrefix + "sort_nameservers");
 
 const std::string kPersistNetPrefix("persist.net.");
@@ -431,6 +442,16 @@ bool PollForCondition(const std::function<bool()>& condition,
 android::netdutils::ScopedAddrinfo safe_getaddrinfo(const char* node, const char* service,
                                                     const struct addrinfo* hints);
 
+// Called with the index of a hostname of a batch, its getaddrinfo() error, and its addresses.
+using GetAddrInfoBatchCallback =
+        std::function<void(size_t index, int rv, const std::vector<std::string>& addresses)>;
+
+// Resolves |names| on |netId| with a single getaddrinfobatch command to dnsproxyd, see
+// DnsProxydBatch.h, and calls |onResult| for each of them as soon as it's answered. Returns 0,
+// or a negative errno if the batch couldn't be sent or its reply couldn't be read.
+int getaddrinfo_batch(const std::vector<std::string>& names, const addrinfo* hints, unsigned netId,
+                      const GetAddrInfoBatchCallback& onResult);
+
 void SetMdnsRoute();
 void RemoveMdnsRoute();
 void AllowNetworkInBackground(int uid, bool allow);
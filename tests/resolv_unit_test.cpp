@@ -17,6 +17,7 @@
 #define LOG_TAG "resolv"
 
 #include <aidl/android/net/IDnsResolver.h>
+#include <algorithm>
 #include <android-base/format.h>
 #include <android-base/logging.h>
 #include <arpa/inet.h>
@@ -25,12 +26,16 @@
 #include <netdb.h>
 #include <netdutils/InternetAddresses.h>
 #include <netdutils/NetNativeTestBase.h>
+#include <poll.h>
 #include <resolv_stats_test_utils.h>
+#include <sys/eventfd.h>
 
 #include "dns_responder.h"
 #include "getaddrinfo.h"
 #include "gethnamaddr.h"
+#include "res_send.h"
 #include "resolv_cache.h"
+#include "resolv_private.h"
 #include "stats.pb.h"
 #include "tests/resolv_test_utils.h"
 
@@ -40,6 +45,7 @@ namespace android {
 namespace net {
 
 using aidl::android::net::IDnsResolver;
+using android::base::unique_fd;
 using android::net::NetworkDnsEventReported;
 using android::netdutils::ScopedAddrinfo;
 
@@ -155,6 +161,66 @@ class ResolvGetAddrInfoTest : public TestBase {};
 class GetHostByNameForNetContextTest : public TestBase {};
 class ResolvCommonFunctionTest : public TestBase {};
 
+class ResNsendAsyncTest : public TestBase {
+  protected:
+    std::unique_ptr<ResNsendAsync> MakeResNsendAsync(const std::vector<uint8_t>& query) {
+        // The cache may wake the query up after the test, so the eventfd outlives it.
+        std::shared_ptr<unique_fd> wakeFd = mWakeFd;
+        return std::make_unique<ResNsendAsync>(mNetcontext, query, /*flags=*/0, &mEvent,
+                                               [wakeFd] { eventfd_write(wakeFd->get(), 1); });
+    }
+
+    // Runs |send| like an event loop: resumes it whenever its socket is readable, its deadline
+    // has passed or it was woken up, until it no longer waits.
+    ResNsendAsync::Status Run(ResNsendAsync& send) {
+        ResNsendAsync::Status status = send.resume();
+        while (status == ResNsendAsync::Status::WAITING) {
+            pollfd fds[] = {{.fd = mWakeFd->get(), .events = POLLIN},
+                            {.fd = send.fd(), .events = POLLIN}};
+            // Spurious wake-ups are harmless, so the deadline is checked at least every second.
+            const auto timeout = std::chrono::ceil<std::chrono::milliseconds>(
+                    send.deadline() - std::chrono::steady_clock::now());
+            poll(fds, std::size(fds), std::clamp<int64_t>(timeout.count(), 0, 1000));
+            eventfd_t value;
+            eventfd_read(mWakeFd->get(), &value);
+            status = send.resume();
+        }
+        return status;
+    }
+
+    static std::vector<uint8_t> MakeQuery(const char* name) {
+        uint8_t buf[MAXPACKET] = {};
+        const int len = res_nmkquery(QUERY, name, ns_c_in, ns_t_a, {}, buf, /*netcontext_flags=*/0);
+        return std::vector<uint8_t>(buf, buf + len);
+    }
+
+    std::vector<uint8_t> MakeAnswer(const std::vector<uint8_t>& query, const char* addr) {
+        test::DNSHeader header;
+        header.read(reinterpret_cast<const char*>(query.data()),
+                    reinterpret_cast<const char*>(query.data()) + query.size());
+        header.qr = true;
+        header.answers.push_back(
+                MakeAnswerRecord(header.questions[0].qname.name, ns_c_in, ns_t_a, addr));
+        std::vector<uint8_t> answer;
+        EXPECT_TRUE(header.write(&answer));
+        return answer;
+    }
+
+    // Returns the number of answer records of the answer of |send|.
+    static int GetAnswerCount(ResNsendAsync& send) {
+        ns_msg handle;
+        if (send.result() <= 0 ||
+            ns_initparse(send.answer().data(), send.result(), &handle) != 0) {
+            return -1;
+        }
+        return ns_msg_count(handle, ns_s_an);
+    }
+
+    const std::shared_ptr<unique_fd> mWakeFd =
+            std::make_shared<unique_fd>(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+    NetworkDnsEventReported mEvent;
+};
+
 TEST_F(ResolvGetAddrInfoTest, InvalidParameters) {
     // Both null "netcontext" and null "res" of resolv_getaddrinfo() are not tested
     // here because they are checked by assert() without returning any error number.
@@ -1931,6 +1997,116 @@ TEST_F(ResolvCommonFunctionTest, ConvertTransportsToNetworkType) {
     }
 }
 
+TEST_F(ResNsendAsyncTest, CacheMissAnswered) {
+    test::DNSResponder dns;
+    dns.addMapping(kHelloExampleCom, ns_type::ns_t_a, kHelloExampleComAddrV4);
+    ASSERT_TRUE(dns.startServer());
+    ASSERT_EQ(0, SetResolvers());
+
+    const auto send = MakeResNsendAsync(MakeQuery(kHelloExampleCom));
+    EXPECT_EQ(ResNsendAsync::Status::DONE, Run(*send));
+    EXPECT_EQ(NOERROR, send->rcode());
+    EXPECT_EQ(1, GetAnswerCount(*send));
+    EXPECT_EQ(1U, GetNumQueries(dns, kHelloExampleCom));
+}
+
+TEST_F(ResNsendAsyncTest, CacheHit) {
+    test::DNSResponder dns;
+    dns.addMapping(kHelloExampleCom, ns_type::ns_t_a, kHelloExampleComAddrV4);
+    ASSERT_TRUE(dns.startServer());
+    ASSERT_EQ(0, SetResolvers());
+    const std::vector<uint8_t> query = MakeQuery(kHelloExampleCom);
+    ASSERT_EQ(0, resolv_cache_add(TEST_NETID, query, MakeAnswer(query, kHelloExampleComAddrV4)));
+
+    // The answer comes from the cache right away.
+    const auto send = MakeResNsendAsync(query);
+    EXPECT_EQ(ResNsendAsync::Status::DONE, send->resume());
+    EXPECT_EQ(NOERROR, send->rcode());
+    EXPECT_EQ(1, GetAnswerCount(*send));
+    EXPECT_EQ(0U, GetNumQueries(dns, kHelloExampleCom));
+}
+
+TEST_F(ResNsendAsyncTest, TimeoutRetriesNextServer) {
+    constexpr char kUnresponsiveAddr[] = "127.0.0.4";
+    test::DNSResponder unresponsive(kUnresponsiveAddr);
+    unresponsive.setResponseProbability(0.0);
+    ASSERT_TRUE(unresponsive.startServer());
+    test::DNSResponder dns;
+    dns.addMapping(kHelloExampleCom, ns_type::ns_t_a, kHelloExampleComAddrV4);
+    ASSERT_TRUE(dns.startServer());
+    ASSERT_EQ(0, SetResolvers({kUnresponsiveAddr, test::kDefaultListenAddr}));
+
+    const auto send = MakeResNsendAsync(MakeQuery(kHelloExampleCom));
+    EXPECT_EQ(ResNsendAsync::Status::DONE, Run(*send));
+    EXPECT_EQ(1, GetAnswerCount(*send));
+    EXPECT_EQ(1U, GetNumQueries(unresponsive, kHelloExampleCom));
+    EXPECT_EQ(1U, GetNumQueries(dns, kHelloExampleCom));
+}
+
+TEST_F(ResNsendAsyncTest, PendingRequestDone) {
+    test::DNSResponder dns;
+    dns.addMapping(kHelloExampleCom, ns_type::ns_t_a, kHelloExampleComAddrV4);
+    ASSERT_TRUE(dns.startServer());
+    ASSERT_EQ(0, SetResolvers());
+
+    // Another lookup of the same query is resolving it.
+    const std::vector<uint8_t> query = MakeQuery(kHelloExampleCom);
+    std::vector<uint8_t> buf(MAXPACKET);
+    int anslen = 0;
+    ASSERT_EQ(RESOLV_CACHE_NOTFOUND, resolv_cache_lookup(TEST_NETID, query, buf, &anslen, 0));
+
+    const auto send = MakeResNsendAsync(query);
+    EXPECT_EQ(ResNsendAsync::Status::WAITING, send->resume());
+    EXPECT_EQ(-1, send->fd());
+
+    // Completing the other lookup wakes the query up, which gets the answer from the cache.
+    ASSERT_EQ(0, resolv_cache_add(TEST_NETID, query, MakeAnswer(query, kHelloExampleComAddrV4)));
+    EXPECT_EQ(ResNsendAsync::Status::DONE, Run(*send));
+    EXPECT_EQ(1, GetAnswerCount(*send));
+    EXPECT_EQ(0U, GetNumQueries(dns, kHelloExampleCom));
+}
+
+TEST_F(ResNsendAsyncTest, PendingRequestTimeout) {
+    test::DNSResponder dns;
+    dns.addMapping(kHelloExampleCom, ns_type::ns_t_a, kHelloExampleComAddrV4);
+    ASSERT_TRUE(dns.startServer());
+    ASSERT_EQ(0, SetResolvers());
+
+    // Another lookup of the same query never completes.
+    const std::vector<uint8_t> query = MakeQuery(kHelloExampleCom);
+    std::vector<uint8_t> buf(MAXPACKET);
+    int anslen = 0;
+    ASSERT_EQ(RESOLV_CACHE_NOTFOUND, resolv_cache_lookup(TEST_NETID, query, buf, &anslen, 0));
+
+    // After PENDING_REQUEST_TIMEOUT, the query gives up waiting and resolves the query itself.
+    const auto send = MakeResNsendAsync(query);
+    EXPECT_EQ(ResNsendAsync::Status::DONE, Run(*send));
+    EXPECT_EQ(1, GetAnswerCount(*send));
+    EXPECT_EQ(1U, GetNumQueries(dns, kHelloExampleCom));
+}
+
+TEST_F(ResNsendAsyncTest, TruncatedAnswer) {
+    test::DNSResponder dns;
+    for (const auto& r : kLargeCnameChainRecords) {
+        dns.addMapping(r.host_name, r.type, r.addr);
+    }
+    ASSERT_TRUE(dns.startServer());
+    ASSERT_EQ(0, SetResolvers());
+
+    // The query must be retried over TCP, which the caller does with resolv_res_nsend().
+    const std::vector<uint8_t> query = MakeQuery(kHelloExampleCom);
+    const auto send = MakeResNsendAsync(query);
+    EXPECT_EQ(ResNsendAsync::Status::BLOCKING, Run(*send));
+    EXPECT_EQ(1U, GetNumQueriesForProtocol(dns, IPPROTO_UDP, kHelloExampleCom));
+    EXPECT_EQ(0U, GetNumQueriesForProtocol(dns, IPPROTO_TCP, kHelloExampleCom));
+
+    // The pending request of the query was released, so the next lookup doesn't wait for it.
+    std::vector<uint8_t> buf(MAXPACKET);
+    int anslen = 0;
+    EXPECT_EQ(RESOLV_CACHE_NOTFOUND,
+              resolv_cache_lookup_async(TEST_NETID, query, buf, &anslen, 0, [] {}));
+}
+
 // Note that local host file function, files_getaddrinfo(), of resolv_getaddrinfo()
 // is not tested because it only returns a boolean (success or failure) without any error number.
 